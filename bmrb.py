@@ -48,6 +48,27 @@ were after loops will be moved to before loops.
 * Setting bmrb.DONT_SHOW_COMMENTS to True will supress the printing of
 comments before saveframes.
 
+* Setting bmrb.COLUMNAR_LOOPS to True will store the data of loops that
+are read in one column at a time rather than as lists of rows. (See
+ColumnarData.) This uses much less memory for large loops. Loop.data
+still acts like a list of rows.
+
+* Setting bmrb.LAZY_LOADING to True will only outline the saveframes of
+entries that are read in, and parse the tags and loops of each one the
+first time they are used. This saves most of the parsing when only a few
+saveframes or loops of an entry are needed. Other than parsing
+errors in the tags and loops of a saveframe being raised when it is first
+used, rather than when the entry is read, this should not cause any
+change in behavior. (Requires the C extension.)
+
+* Setting bmrb.CACHE_DIRECTORY to the name of a directory will make
+Entry.from_file() and Entry.from_files() keep a binary copy (see
+Entry.save_binary()) of each local file they parse in it, and load the
+copy rather than parsing the file again as long as the file hasn't
+changed. Copies made with different CONVERT_DATATYPES, ALLOW_V2_ENTRIES
+or parse warning settings are not used. Schemas read from local files
+are kept there too, as snapshots (see Schema.save_snapshot()).
+
 * Setting bmrb.CONVERT_DATATYPES to True will automatically convert
 the data loaded from the file into the corresponding python type as
 determined by loading the standard BMRB schema. This would mean that
@@ -58,6 +79,12 @@ on all objects. Other that converting uppercase "E"s in scientific
 notation floats to lowercase "e"s this should not cause any change in
 the way re-printed NMR-STAR objects are displayed.
 
+To ask the same question of many entries, such as a copy of the BMRB
+archive, open the directory they are in as an Archive. It parses each
+entry once and keeps an index of their loops, so that queries like
+Archive.get_tag("_Atom_chem_shift.Val", where={"Atom_ID": "CA"}) only
+read the loops they need.
+
 Some errors will be detected and exceptions raised, but this does not
 implement a full validator (at least at present).
 
@@ -76,14 +103,24 @@ import os
 import re
 import sys
 import json
+import mmap
+import marshal
+import struct
 import decimal
+import fnmatch
+import hashlib
 import optparse
+import tempfile
 
 from optparse import SUPPRESS_HELP
+from array import array
+from bisect import bisect_left
 from copy import deepcopy
 from csv import reader as csv_reader, writer as csv_writer
 from datetime import date
 from gzip import GzipFile
+from multiprocessing import Pool
+from operator import attrgetter, itemgetter
 
 # Determine if we are running in python3
 PY3 = (sys.version_info[0] == 3)
@@ -94,7 +131,8 @@ PY3 = (sys.version_info[0] == 3)
 if PY3:
     from urllib.request import urlopen
     from urllib.error import HTTPError, URLError
-    from io import StringIO, BytesIO
+    from io import StringIO, BytesIO, TextIOBase
+    from sys import intern
 else:
     from urllib2 import urlopen, HTTPError, URLError
     from cStringIO import StringIO
@@ -139,7 +177,7 @@ def _build_extension():
 # See if we can use the fast tokenizer
 try:
     import cnmrstar
-    if "version" not in dir(cnmrstar) or cnmrstar.version() < "2.2.7":
+    if "version" not in dir(cnmrstar) or cnmrstar.version() < "2.4.9":
         print("Recompiling cnmrstar module due to API changes. You may "
               "experience a segmentation fault immediately following this "
               "message but should have no issues the next time you run your "
@@ -178,9 +216,9 @@ except ImportError:
 #############################################
 
 # Set this to allow import * from bmrb to work sensibly
-__all__ = ['Entry', 'Saveframe', 'Loop', 'Schema', 'diff', 'validate',
-           'enable_nef_defaults', 'enable_nmrstar_defaults', 'sans_parse',
-           'PY3']
+__all__ = ['Entry', 'Saveframe', 'Loop', 'ColumnarData', 'Schema', 'Archive',
+           'diff', 'validate', 'enable_nef_defaults',
+           'enable_nmrstar_defaults', 'sans_parse', 'PY3']
 
 # May be set by calling code
 VERBOSE = False
@@ -191,6 +229,9 @@ WARNINGS_TO_IGNORE = []
 SKIP_EMPTY_LOOPS = False
 DONT_SHOW_COMMENTS = False
 CONVERT_DATATYPES = False
+COLUMNAR_LOOPS = False
+LAZY_LOADING = False
+CACHE_DIRECTORY = None
 
 # WARNING: STR_CONVERSION_DICT cannot contain both booleans and
 # arithmetic types. Attempting to use both will cause an issue since
@@ -203,6 +244,60 @@ _COMMENT_DICTIONARY = {}
 _API_URL = "http://webapi.bmrb.wisc.edu/v1"
 _SCHEMA_URL = 'http://svn.bmrb.wisc.edu/svn/nmr-star-dictionary/bmrb_only_files/adit_input/xlschem_ann.csv'
 _WHITESPACE = " \t\n\v"
+# The nulls that can be kept in an integer column, and their codes
+_NULLS = (None, ".", "?")
+_NULL_CODES = {None: 1, ".": 2, "?": 3}
+# How Loop._get_conversions() says to convert the values of a column.
+#  These match the convert_ defines in the C extension.
+_CONVERT_NONE, _CONVERT_CALL, _CONVERT_STRING = 0, 1, 2
+_CONVERT_INTEGER, _CONVERT_FLOAT, _CONVERT_DATE = 3, 4, 5
+# Added to the others if nulls are an error
+_CONVERT_NULL_ERROR = 8
+# Typecode of arrays of 64 bit integers
+try:
+    _INT_TYPECODE = array("q").typecode
+except ValueError:
+    _INT_TYPECODE = "l"
+# Start of the files that Entry.save_binary() writes and the version of
+#  their format
+_BINARY_MAGIC = b"NMRSTARB"
+_BINARY_VERSION = 1
+# The header of the files: the start and version, the parse settings of
+#  the entry, the modification time (in ns), size and SHA-1 of the file
+#  it was parsed from (if any) and where the saveframe directory is
+_BINARY_HEADER = struct.Struct("<8sIIqq20sQQ")
+# The values that aren't strings are stored as text along with a kind:
+#  how to store each type, and how to turn each kind back into a value
+_BINARY_KINDS = {type(None): (0, lambda x: ""), int: (2, str),
+                 decimal.Decimal: (3, str), date: (4, lambda x: x.isoformat()),
+                 float: (5, repr), bool: (6, str)}
+_BINARY_VALUES = {0: lambda x: None, 2: int, 3: decimal.Decimal,
+                  4: lambda x: _parse_date(x), 5: float,
+                  6: lambda x: x == "True", 7: lambda x: x.decode("utf-8")}
+if not PY3:
+    _BINARY_KINDS[long] = (2, str)
+    _BINARY_KINDS[unicode] = (7, lambda x: x)
+# Start of the files that Schema.save_snapshot() writes and the version of
+#  their format
+_SNAPSHOT_MAGIC = b"NMRSTARS"
+_SNAPSHOT_VERSION = 1
+# The header of snapshots: the start and version, the python and marshal
+#  versions (the schema is marshaled, which depends on them), and the
+#  modification time (in ns), size and SHA-1 of the schema file and the
+#  modification time and size of the data types file it was read with
+_SNAPSHOT_HEADER = struct.Struct("<8sIIIqq20sqq")
+_DATA_TYPES_FILE = os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                                "reference_files", "data_types.csv")
+# Start of the index files that Archive keeps and the version of their
+#  format
+_ARCHIVE_MAGIC = b"NMRSTARA"
+_ARCHIVE_VERSION = 1
+# The header of the index: the start and version, the python and marshal
+#  versions (the index is marshaled) and the parse settings that the
+#  binary copies of the entries were made with
+_ARCHIVE_HEADER = struct.Struct("<8sIIII")
+# How many files Archive.refresh() parses before saving the index
+_ARCHIVE_BATCH = 100
 _VERSION = "2.3"
 
 #############################################
@@ -299,7 +394,7 @@ class _PrinterHandler(_ContentHandler):
         print("%s : %s %s %s" % (tag, val, delim, inloop))
 
 def sans_parse(entry_to_parse, handler=_PrinterHandler(),
-               error_handler=_ErrorHandler()):
+               error_handler=_ErrorHandler(), rows_per_call=1000):
     """ Parses a NMR-STAR file or string in SANS mode and makes a
     callback for every token it encounters. Expects a handler (with the
     callback methods) and an error handler (for error callbacks). To
@@ -317,15 +412,35 @@ def sans_parse(entry_to_parse, handler=_PrinterHandler(),
     * endLoop(self, line)
     * data(self, tag, tagline, val, valline, delim, inloop)
 
+    The handler may also have a loopRows(self, category, columns, rows)
+    method, in which case the values of loops are passed to it as lists
+    of up to rows_per_call rows rather than to data() one at a time.
+    Only that many rows are held in memory at once, and returning True
+    stops the parse like the other callbacks.
+
     The methods the error handler must have:
 
     * fatalError(self, line, msg)
     * error(self, line, msg)
-    * warning(self, line, msg)"""
+    * warning(self, line, msg)
+
+    If the C extension is available the file is read and tokenized a
+    piece at a time, so files that don't fit in memory can be parsed."""
 
     parser = _Parser()
-    parser.sans_parse(_interpret_file(entry_to_parse).read(), handler,
-                      error_handler)
+    if cnmrstar != None:
+        stream = _interpret_stream(entry_to_parse)
+        try:
+            tokenizer = cnmrstar.Tokenizer()
+            tokenizer.load_stream(stream)
+            parser.sans_parse(None, handler, error_handler,
+                              tokenizer=tokenizer, rows_per_call=rows_per_call)
+        finally:
+            if stream is not entry_to_parse:
+                stream.close()
+    else:
+        parser.sans_parse(_interpret_file(entry_to_parse).read(), handler,
+                          error_handler, rows_per_call=rows_per_call)
 
 def clean_value(value):
     """Automatically quotes the value in the appropriate way. Don't
@@ -425,16 +540,61 @@ def clean_value(value):
     # It's good to go
     return value
 
+def clean_values(values, widths=False):
+    """Returns a list of the values each quoted the way clean_value()
+    quotes them. This is quicker than calling clean_value() on each one,
+    so use it on whole rows or columns. If widths is True the lengths of
+    the quoted values are returned instead."""
+
+    # Use the fast code if it is available
+    if cnmrstar != None:
+        return cnmrstar.clean_values(values, STR_CONVERSION_DICT, widths)
+
+    if widths:
+        return [len(clean_value(x)) for x in values]
+    return [clean_value(x) for x in values]
+
 # Internal use only methods
 
+# The types _json_serialize() writes out as str() of them
+_JSON_STRING_TYPES = (date, decimal.Decimal)
+
 def _json_serialize(obj):
     """JSON serializer for objects not serializable by default json code"""
 
     # Serialize datetime.date objects by calling str() on them
-    if isinstance(obj, (date, decimal.Decimal)):
+    if isinstance(obj, _JSON_STRING_TYPES):
         return str(obj)
     raise TypeError("Type not serializable: %s" % type(obj))
 
+def _json_dumps(obj):
+    """ Returns the object in JSON format."""
+
+    return json.dumps(obj, default=_json_serialize)
+
+def _to_json(obj, write=None, binary=False):
+    """ Returns an Entry, Saveframe or Loop in JSON format, or if write is
+    given passes it to write() a piece at a time instead. binary says
+    whether write() takes bytes. The C extension writes the JSON
+    straight from the objects rather than from what get_json() returns,
+    and a bufferful at a time."""
+
+    if cnmrstar is not None:
+        return cnmrstar.to_json(obj, (Saveframe, _OutlinedSaveframe), Loop,
+                                _JSON_STRING_TYPES, _json_dumps, write,
+                                binary)
+
+    text = _json_dumps(obj.get_json(serialize=False))
+    if write is None:
+        return text
+    write(text.encode() if binary else text)
+
+def _parse_date(value):
+    """Returns the datetime.date of a year-month-day string."""
+
+    year, month, day = [int(x) for x in value.split("-")]
+    return date(year, month, day)
+
 def _format_category(value):
     """Adds a '_' to the front of a tag (if not present) and strips out
     anything after a '.'"""
@@ -518,6 +678,310 @@ def _interpret_file(the_file):
 
     return star_buffer
 
+def _interpret_stream(the_file):
+    """Like _interpret_file() but returns an object to read() the raw
+    data from a piece at a time rather than reading it all in. The C
+    tokenizer decompresses gzipped data itself. Close the result when done
+    if it isn't the_file."""
+
+    if hasattr(the_file, 'read'):
+        return the_file
+    elif isinstance(the_file, str) or isinstance(the_file, unicode):
+        if (the_file.startswith("http://") or the_file.startswith("https://") or
+                the_file.startswith("ftp://")):
+            return urlopen(the_file)
+        else:
+            return open(the_file, 'rb')
+    else:
+        raise ValueError("Cannot figure out how to interpret the file"
+                         " you passed.")
+
+def _open_output(the_file, compress=None):
+    """Helper method for write_to() and write_json(). the_file could be a
+    file location or an object with a write() method. Returns the
+    function to write the text to, whether it needs to be passed bytes
+    rather than a string, and a function to call when done writing. If
+    compress is "gzip" the text is gzipped as it is written."""
+
+    if compress not in (None, "gzip"):
+        raise ValueError("Unknown compression '%s'. Use None or 'gzip'." %
+                         compress)
+
+    if hasattr(the_file, 'write'):
+        out_file, opened = the_file, None
+    elif isinstance(the_file, str) or isinstance(the_file, unicode):
+        out_file = opened = open(the_file, 'wb')
+    else:
+        raise ValueError("Cannot figure out how to write to the file"
+                         " you passed.")
+
+    gzip_file = None
+    if compress == "gzip":
+        gzip_file = out_file = GzipFile(fileobj=out_file, mode="wb")
+
+    def finish():
+        """ Flush the compressed data and close what we opened."""
+        if gzip_file is not None:
+            gzip_file.close()
+        if opened is not None:
+            opened.close()
+
+    binary = PY3 and not isinstance(out_file, TextIOBase)
+    return out_file.write, binary, finish
+
+def _is_local_file(file_name):
+    """ Returns True if file_name names a local file, which the C
+    tokenizer can load directly whether or not it is gzipped."""
+
+    if hasattr(file_name, 'read'):
+        return False
+    return not (file_name.startswith("http://") or
+                file_name.startswith("https://") or
+                file_name.startswith("ftp://"))
+
+def _parse_settings():
+    """ Returns the bits of the module settings that change what parsing
+    an entry gives, for the header of binary files."""
+
+    settings = (CONVERT_DATATYPES, ALLOW_V2_ENTRIES,
+                RAISE_PARSE_WARNINGS and
+                "tag-only-loop" not in WARNINGS_TO_IGNORE,
+                RAISE_PARSE_WARNINGS and "empty-loop" not in WARNINGS_TO_IGNORE)
+    return sum(1 << pos for pos, setting in enumerate(settings) if setting)
+
+def _file_stat(file_name):
+    """ Returns the modification time in nanoseconds and the size of a
+    file."""
+
+    stat = os.stat(file_name)
+    mtime = getattr(stat, "st_mtime_ns", None)
+    if mtime is None:
+        mtime = int(stat.st_mtime * 1000000000)
+    return mtime, stat.st_size
+
+def _file_digest(file_name):
+    """ Returns the SHA-1 of the contents of a file."""
+
+    digest = hashlib.sha1()
+    with open(file_name, "rb") as read_file:
+        for chunk in iter(lambda: read_file.read(1048576), b""):
+            digest.update(chunk)
+    return digest.digest()
+
+def _cache_file(file_name, extension=".bmrb"):
+    """ Returns where the binary copy of a file (or the snapshot of a
+    schema file) is kept in CACHE_DIRECTORY."""
+
+    path = os.path.abspath(file_name)
+    if PY3 or isinstance(path, unicode):
+        path = path.encode("utf-8")
+    return os.path.join(CACHE_DIRECTORY,
+                        hashlib.sha1(path).hexdigest() + extension)
+
+def _write_atomically(file_name, parts):
+    """ Writes the parts to a temporary file and then renames it to
+    file_name, so that anything reading (or mapping) the old file never
+    sees it half written."""
+
+    directory = os.path.dirname(os.path.abspath(file_name))
+    handle, temp_name = tempfile.mkstemp(dir=directory, suffix=".tmp")
+    try:
+        with os.fdopen(handle, "wb") as out_file:
+            for part in parts:
+                out_file.write(part)
+        # mkstemp() only lets us read the file
+        umask = os.umask(0)
+        os.umask(umask)
+        os.chmod(temp_name, 0o666 & ~umask)
+        if PY3:
+            os.replace(temp_name, file_name)
+        else:
+            os.rename(temp_name, file_name)
+    except:
+        os.remove(temp_name)
+        raise
+
+def _load_cached(entry_class, file_name):
+    """ Returns the entry from the copy of the file in CACHE_DIRECTORY,
+    or None if there isn't a usable copy."""
+
+    try:
+        mtime, size = _file_stat(file_name)
+        reader = _BinaryReader.open(_cache_file(file_name))
+    except (IOError, OSError, ValueError):
+        return None
+
+    try:
+        if reader.settings != _parse_settings() or reader.size != size:
+            return None
+
+        if reader.mtime != mtime:
+            # The file was touched or copied, but is it the same?
+            if reader.digest != _file_digest(file_name):
+                return None
+            try:
+                reader.set_mtime(_cache_file(file_name), mtime)
+            except (IOError, OSError):
+                pass
+
+        return reader.read_entry(entry_class, LAZY_LOADING,
+                                 "from_file('%s')" % file_name)
+    # The copy is damaged
+    except (ValueError, IndexError):
+        return None
+    finally:
+        # The saveframes of lazily loaded entries are read from it later
+        if not LAZY_LOADING:
+            reader.close()
+
+def _store_cached(entry, file_name, stat):
+    """ Saves a binary copy of an entry in CACHE_DIRECTORY. stat is what
+    _file_stat() returned before the file was parsed. Nothing is saved
+    if the file has changed since then, or if the copy can't be
+    written."""
+
+    try:
+        digest = _file_digest(file_name)
+        if _file_stat(file_name) != stat:
+            return
+        if not os.path.isdir(CACHE_DIRECTORY):
+            os.makedirs(CACHE_DIRECTORY)
+        parts = _BinaryWriter.entry(entry, _parse_settings(), stat, digest)
+        _write_atomically(_cache_file(file_name), parts)
+    # A lazily loaded saveframe might not parse, in which case the error
+    #  is raised when it is used
+    except (IOError, OSError, ValueError):
+        pass
+
+def _decode_strings(text, offsets):
+    """ Returns the strings in a block of UTF-8 text, given the offset of
+    each one and of the end of the last one."""
+
+    if cnmrstar is not None:
+        return cnmrstar.decode_strings(text, offsets)
+    text = bytes(text)
+    if PY3:
+        return [text[offsets[x]:offsets[x + 1]].decode("utf-8") for x in
+                range(0, len(offsets) - 1)]
+    return [text[offsets[x]:offsets[x + 1]] for x in
+            range(0, len(offsets) - 1)]
+
+def _row_hashes(rows):
+    """ Returns an array with a hash of each of the rows. Rows hash the
+    same if clean_values() quotes their values the same way."""
+
+    hashes = array(_INT_TYPECODE)
+    if cnmrstar is not None and hashes.itemsize == 8:
+        if PY3:
+            hashes.frombytes(cnmrstar.row_hashes(rows, STR_CONVERSION_DICT))
+        else:
+            hashes.fromstring(cnmrstar.row_hashes(rows, STR_CONVERSION_DICT))
+    else:
+        hashes.extend(hash(tuple(clean_values(row))) for row in rows)
+    return hashes
+
+def _unmatched_rows(hashes, other_hashes, matched=None):
+    """ Returns the positions of the rows, given their hashes, that have
+    no match among the other rows. If a row appears more times than it
+    does in the other rows the extra copies are unmatched. If matched is
+    given the positions of the rows that were matched up are added to it
+    in pairs."""
+
+    waiting = {}
+    for pos in range(len(other_hashes) - 1, -1, -1):
+        waiting.setdefault(other_hashes[pos], []).append(pos)
+    unmatched = []
+    for pos, row_hash in enumerate(hashes):
+        other_positions = waiting.get(row_hash)
+        if other_positions:
+            other_pos = other_positions.pop()
+            if matched is not None:
+                matched.append((pos, other_pos))
+        else:
+            unmatched.append(pos)
+    return unmatched
+
+def _same_rows(rows, other_rows):
+    """ Returns True if clean_values() quotes each of the rows the same
+    as the other row in its place. Rows with the same hash are checked
+    with this since different rows can hash the same."""
+
+    if cnmrstar is not None:
+        return cnmrstar.same_rows(rows, other_rows, STR_CONVERSION_DICT)
+    if len(rows) != len(other_rows):
+        return False
+    for row, other_row in zip(rows, other_rows):
+        if clean_values(row) != clean_values(other_row):
+            return False
+    return True
+
+def _sort_order(data, ordinals):
+    """ Returns the positions of the rows of the loop data in the order
+    that sorts them by the columns at the ordinals, which come in order
+    of priority. A column is sorted numerically if all of its values can
+    be made into floats and by the values otherwise."""
+
+    if isinstance(data, ColumnarData):
+        columns = [data.column(x) for x in ordinals]
+        if cnmrstar is not None:
+            return cnmrstar.sort_order(columns)
+    elif cnmrstar is not None:
+        return cnmrstar.sort_order(data, ordinals)
+    else:
+        columns = [[row[x] for row in data] for x in ordinals]
+
+    keys = []
+    for values in columns:
+        try:
+            keys.append([float(x) for x in values])
+        except ValueError:
+            keys.append(values)
+    rows = list(zip(*keys))
+    return sorted(range(0, len(rows)), key=rows.__getitem__)
+
+def _read_copy(task):
+    """ Reads what a query of an Archive needs from the binary copy of one
+    entry, only decoding the loops it has to. Runs on the worker
+    processes if there are any. Returns the loops, or if tags are given
+    what get_tag() returns for the rows of them that have the where
+    values."""
+
+    copy_name, stat, positions, tags, where = task
+    with _BinaryReader.open(copy_name) as reader:
+        if (reader.mtime, reader.size) != stat:
+            raise ValueError("The index of the archive is out of date. Call "
+                             "refresh() to update it.")
+
+        results = []
+        for frame, position in positions:
+            loop = reader.read_loop(frame, position, Loop)
+            if tags is None:
+                loop.set_columnar(COLUMNAR_LOOPS)
+                results.append(loop)
+                continue
+
+            if where:
+                data, rows = loop.data, range(0, len(loop.data))
+                for tag, value in where:
+                    rows = data._columns[loop._tag_index(tag)].rows_with(
+                        value, rows)
+                if not rows:
+                    continue
+                loop.data = data._take(rows)
+            results.extend(loop.get_tag(tags))
+    return results
+
+def _rows_from_columns(columns, length):
+    """ Returns the rows of a loop as a list of lists, given what
+    ColumnarData.column_buffers() returns for each column."""
+
+    if cnmrstar is not None and array(_INT_TYPECODE).itemsize == 8:
+        return cnmrstar.rows_from_columns(columns, length)
+    if not columns:
+        return [[] for x in range(0, length)]
+    return [list(row) for row in
+            zip(*[_Column._from_buffers(*x).values() for x in columns])]
+
 def _load_comments(file_to_load=None):
     """ Loads the comments that should be placed in written files. """
 
@@ -543,13 +1007,35 @@ def _load_comments(file_to_load=None):
 def _tag_key(x, schema=None):
     """ Helper function to figure out how to sort the tags."""
     try:
-        return _get_schema(schema).schema_order.index(x)
+        return _get_schema(schema)._position(x)
     except ValueError:
         # Generate an arbitrary sort order for tags that aren't in the
         #  schema but make sure that they always come after tags in the
         #   schema
         return len(_get_schema(schema).schema_order) + hash(x)
 
+# What the indexes compare to see if they need to be rebuilt
+_NAME_AND_PREFIX = attrgetter("name", "tag_prefix")
+_CATEGORY = attrgetter("category")
+_TAG_NAME = itemgetter(0)
+_OBJECT_VERSION = attrgetter("_version")
+
+def _loop_categories(frame):
+    """ Returns the categories of the loops of a saveframe, from its
+    outline if it was loaded lazily and hasn't been parsed yet."""
+
+    if isinstance(frame, _OutlinedSaveframe):
+        return frame._lazy[2]
+    return tuple(map(_CATEGORY, frame.loops))
+
+def _state_without_index(obj):
+    """ Returns the attributes of an Entry, Saveframe or Loop to copy or
+    pickle. The index is left out since it is rebuilt when needed."""
+
+    state = obj.__dict__.copy()
+    state.pop("_index", None)
+    return state
+
 #############################################
 #                Classes                    #
 #############################################
@@ -569,11 +1055,13 @@ class _Parser(object):
         self.ent = entry_to_parse_into
         self.to_process = ""
         self.full_data = ""
+        self.line_breaks = None
         self.index = 0
         self.token = ""
         self.source = "unknown"
         self.delimiter = " "
         self.line_number = 0
+        self.tokenizer = None
 
     def get_line_number(self):
         """ Returns the current line number that is in the process of
@@ -582,16 +1070,22 @@ class _Parser(object):
         if cnmrstar != None:
             return self.line_number
         else:
-            return self.full_data[0:self.index].count("\n")+1
+            # Find where all the lines end the first time we are asked
+            #  so the line number can be looked up rather than counted
+            if self.line_breaks is None:
+                self.line_breaks = array("l", (match.start() for match in
+                                               re.finditer("\n",
+                                                           self.full_data)))
+            return bisect_left(self.line_breaks, self.index) + 1
 
     def get_token(self):
         """ Returns the next token in the parsing process."""
 
         if cnmrstar is not None:
-            self.token, self.line_number, self.delimiter = cnmrstar.get_token_full()
+            self.token, self.line_number, self.delimiter = self.tokenizer.get_token_full()
         else:
             self.real_get_token()
-            self.line_number = 0
+            self.line_number = self.get_line_number()
 
             if self.delimiter == ";":
                 try:
@@ -643,19 +1137,40 @@ class _Parser(object):
         return len(data)
 
 
-    def sans_parse(self, data, handler, error_handler):
+    def sans_parse(self, data, handler, error_handler, tokenizer=None,
+                   rows_per_call=0):
         """ Parses the string provided as data as an NMR-STAR entry
-        and returns the parsed entry. Raises ValueError on exceptions."""
+        and returns the parsed entry. Raises ValueError on exceptions.
+        A cnmrstar.Tokenizer that already has the data loaded may be
+        provided instead of the data. If rows_per_call is positive and
+        the handler has a loopRows() method the values of loops are
+        passed to it that many rows at a time rather than to data()."""
 
         conv_delin = {'\'':10, '"': 11, ';': 12, ' ':14, '$':13}
-
-        # Fix DOS line endings
-        data = data.replace("\r\n", "\n").replace("\r", "\n")
-
-        if cnmrstar != None:
-            cnmrstar.load_string(data)
+        if not hasattr(handler, "loopRows"):
+            rows_per_call = 0
+
+        # The C tokenizer handles DOS line endings itself
+        if tokenizer is not None:
+            self.tokenizer = tokenizer
+        elif cnmrstar != None:
+            self.tokenizer = cnmrstar.Tokenizer()
+            self.tokenizer.load_string(data)
+            self.tokenizer.tokenize()
         else:
+            # Fix DOS line endings
+            data = data.replace("\r\n", "\n").replace("\r", "\n")
             self.full_data = data + "\n"
+            self.line_breaks = None
+
+        # Let the C module run the whole state machine
+        if cnmrstar != None and VERBOSE != "very":
+            try:
+                self.tokenizer.sans_parse(handler, error_handler, Loop,
+                                          rows_per_call)
+            finally:
+                self.tokenizer.reset()
+            return
 
         # Create the NMRSTAR object
         curid = None
@@ -668,7 +1183,7 @@ class _Parser(object):
         self.get_token()
 
         # Make sure this is actually a STAR file
-        if not self.token.startswith("data_"):
+        if self.token is None or not self.token.startswith("data_"):
             error_handler.fatalError(self.line_number,
                                      "Invalid file. NMR-STAR files must start "
                                      "with 'data_'. Did you accidentally select"
@@ -736,6 +1251,7 @@ class _Parser(object):
                     curloop = Loop.from_scratch()
                     curloop.col_lines = []
                     curloop.num_col = 0
+                    rows, row = [], []
                     if handler.startLoop(self.line_number):
                         return
 
@@ -767,6 +1283,11 @@ class _Parser(object):
                             # We are in the data block of a loop
                             while self.token != None:
                                 if self.token == "stop_":
+                                    if rows and handler.loopRows(curloop.category,
+                                                                 list(curloop.columns),
+                                                                 rows):
+                                        return
+                                    rows = []
                                     if self.delimiter != " ":
                                         if error_handler.error(self.line_number,
                                                                "The stop_ keyword may"
@@ -795,6 +1316,10 @@ class _Parser(object):
 
                                     if (self.token in self.reserved and
                                             self.delimiter == " "):
+                                        if rows and handler.loopRows(curloop.category,
+                                                                     list(curloop.columns),
+                                                                     rows):
+                                            return
                                         error_handler.fatalError(self.line_number,
                                                                  "Cannot use keywords "
                                                                  "as data values unless"
@@ -817,18 +1342,32 @@ class _Parser(object):
 
                                     if self.delimiter == "$":
                                         self.token = self.token[1:]
-                                    if curdata == curloop.num_col - 1:
-                                        self.line_number -= 1
+
+                                    # Collect whole rows for loopRows()
+                                    if rows_per_call > 0:
+                                        row.append(self.token)
+                                        if len(row) == curloop.num_col:
+                                            rows.append(row)
+                                            row = []
+                                        if len(rows) >= rows_per_call:
+                                            if handler.loopRows(curloop.category,
+                                                                list(curloop.columns),
+                                                                rows):
+                                                return
+                                            rows = []
 
                                     # Send the tag data and see if we need to quit
-                                    if handler.data((curloop.category + "." +
-                                                     curloop.columns[curdata]),
-                                                    curloop.col_lines[curdata],
-                                                    self.token,
-                                                    self.line_number+1,
-                                                    conv_delin[self.delimiter],
-                                                    True):
-                                        return
+                                    else:
+                                        if curdata == curloop.num_col - 1:
+                                            self.line_number -= 1
+                                        if handler.data((curloop.category + "." +
+                                                         curloop.columns[curdata]),
+                                                        curloop.col_lines[curdata],
+                                                        self.token,
+                                                        self.line_number+1,
+                                                        conv_delin[self.delimiter],
+                                                        True):
+                                            return
                                     curdata = (curdata + 1) % curloop.num_col
                                     seen_data = True
 
@@ -836,6 +1375,9 @@ class _Parser(object):
                                 self.get_token()
 
                     if self.token != "stop_":
+                        if rows and handler.loopRows(curloop.category,
+                                                     list(curloop.columns), rows):
+                            return
                         error_handler.fatalError(self.line_number,
                                                  "Loop improperly terminated at"
                                                  " end of file.")
@@ -845,7 +1387,7 @@ class _Parser(object):
                     if handler.endLoop(self.line_number):
                         return
 
-                    if curdata % curloop.num_col != 0:
+                    if curloop is not None and curdata % curloop.num_col != 0:
                         error_handler.fatalError(self.line_number,
                                                  "Loop count error.")
                         return
@@ -921,6 +1463,8 @@ class _Parser(object):
 
         # Free the memory of the original copy of the data we parsed
         handler.endData(self.line_number, curid)
+        if cnmrstar != None:
+            self.tokenizer.reset()
 
         return
 
@@ -930,23 +1474,67 @@ class _Parser(object):
         values aren't as expected. Useful for manually getting tokens from
         the parser."""
 
+        # Each parse gets its own tokenizer so that parses can run
+        #  concurrently. Tokenizing releases the GIL. The tokenizer does
+        #  the cleanup below itself without copying the data.
+        if cnmrstar != None:
+            self.tokenizer = cnmrstar.Tokenizer()
+            self.tokenizer.load_string(data, True)
+            self.tokenizer.tokenize()
+            return
+
         # Fix DOS line endings
         data = data.replace("\r\n", "\n").replace("\r", "\n")
 
         # Change '\n; data ' started multilines to '\n;\ndata'
         data = re.sub(r'\n;([^\n]+?)\n', r'\n;\n\1\n', data)
 
-        if cnmrstar != None:
-            cnmrstar.load_string(data)
-        else:
-            self.full_data = data + "\n"
+        self.full_data = data + "\n"
+        self.line_breaks = None
 
-    def parse(self, data, source="unknown"):
+    def parse(self, data, source="unknown", tokenizer=None):
         """ Parses the string provided as data as an NMR-STAR entry
-        and returns the parsed entry. Raises ValueError on exceptions."""
+        and returns the parsed entry. Raises ValueError on exceptions.
+        A cnmrstar.Tokenizer that already has the data loaded may be
+        provided instead of the data."""
+
+        # Let the C extension run the whole state machine if we can. It
+        #  builds the same tree and raises the same errors as below.
+        if cnmrstar != None and VERBOSE != "very":
+            options = {"source": source,
+                       "allow_v2": ALLOW_V2_ENTRIES,
+                       "tag_only_loop_error": (RAISE_PARSE_WARNINGS and
+                                               "tag-only-loop" not in
+                                               WARNINGS_TO_IGNORE),
+                       "empty_loop_error": (RAISE_PARSE_WARNINGS and
+                                            "empty-loop" not in
+                                            WARNINGS_TO_IGNORE)}
+            # The saveframes are parsed from the tokenizer as they are
+            #  used, so it has to be kept rather than reset. They are
+            #  parsed with the settings that are in effect now.
+            if LAZY_LOADING:
+                if tokenizer is None:
+                    tokenizer = cnmrstar.Tokenizer()
+                    tokenizer.load_string(data, True)
+                self.tokenizer = tokenizer
+                settings = (COLUMNAR_LOOPS, CONVERT_DATATYPES)
+                self.tokenizer.parse(self.ent, Saveframe, Loop,
+                                     lazy=(tokenizer, dict(options), settings),
+                                     **options)
+            elif tokenizer is not None:
+                self.tokenizer = tokenizer
+                self.tokenizer.parse(self.ent, Saveframe, Loop, **options)
+                self.tokenizer.reset()
+            else:
+                cnmrstar.parse(data, self.ent, Saveframe, Loop, **options)
+            self.source = source
+            return self.ent
 
         # Prepare the data for parsing
-        self.load_data(data)
+        if tokenizer is not None:
+            self.tokenizer = tokenizer
+        else:
+            self.load_data(data)
 
         # Create the NMRSTAR object
         curframe = None
@@ -958,7 +1546,7 @@ class _Parser(object):
         self.get_token()
 
         # Make sure this is actually a STAR file
-        if not self.token.startswith("data_"):
+        if self.token is None or not self.token.startswith("data_"):
             raise ValueError("Invalid file. NMR-STAR files must start with"
                              " 'data_'. Did you accidentally select the wrong"
                              " file?", self.get_line_number())
@@ -1033,6 +1621,16 @@ class _Parser(object):
                             #  to the current saveframe
                             curframe.add_loop(curloop)
 
+                            # The C tokenizer reads the whole data block at
+                            #  once and leaves us at the stop_
+                            if cnmrstar != None:
+                                conversions = curloop._get_conversions()
+                                curdata, stop = self.tokenizer.get_loop_data(
+                                    len(curloop.columns), str(curloop.category),
+                                    conversions)
+                                self.token, self.line_number, self.delimiter = stop
+                                seen_data = len(curdata) > 0
+
                             # We are in the data block of a loop
                             while self.token != None:
                                 if self.token == "stop_":
@@ -1054,8 +1652,15 @@ class _Parser(object):
                                                          self.get_line_number())
                                     else:
                                         if len(curdata) > 0:
-                                            curloop.add_data(curdata,
-                                                             rearrange=True)
+                                            if cnmrstar != None:
+                                                # Already split into rows
+                                                #  and converted
+                                                curloop._set_data(
+                                                    curdata,
+                                                    conversions is not None)
+                                            else:
+                                                curloop.add_data(curdata,
+                                                                 rearrange=True)
                                         curloop = None
                                         curdata = []
 
@@ -1138,10 +1743,11 @@ class _Parser(object):
 
         # Free the memory of the original copy of the data we parsed
         self.full_data = None
+        self.line_breaks = None
 
         # Reset the parser
         if cnmrstar != None:
-            cnmrstar.reset()
+            self.tokenizer.reset()
 
         return self.ent
 
@@ -1306,9 +1912,617 @@ class _Parser(object):
             self.delimiter = '$'
         return
 
+def _array_bytes(values):
+    """ Returns the contents of an array in little endian byte order."""
+
+    if sys.byteorder == "big":
+        values = array(values.typecode, values)
+        values.byteswap()
+    if PY3:
+        return values.tobytes()
+    return values.tostring()
+
+class _BinaryWriter(object):
+    """ Builds one block of the binary files that Entry.save_binary()
+    writes. Each distinct value in the block is stored once, in a table at
+    the start of it, and the rest of the block refers to the values by
+    their position in the table."""
+
+    def __init__(self):
+        self.values = []
+        self.lookup = {}
+        self.parts = []
+
+    @classmethod
+    def entry(cls, entry, settings=0, stat=(-1, -1), digest=b""):
+        """ Returns the parts of the binary file of an entry: the header,
+        a block for each saveframe and the directory of the saveframes,
+        which has what _OutlinedSaveframe needs to outline them."""
+
+        blocks, offsets = [], []
+        position = _BINARY_HEADER.size
+        for frame in entry.frame_list:
+            blocks.append(cls.saveframe(frame))
+            offsets.append(position)
+            position += len(blocks[-1])
+
+        directory = cls()
+        value = directory.value
+        directory.integers(value(entry.entry_id), value(entry.source),
+                           len(entry.frame_list))
+        for frame, offset in zip(entry.frame_list, offsets):
+            directory.integers(value(frame.name), value(frame.tag_prefix),
+                               value(frame.category), value(frame.source))
+            directory.parts.append(struct.pack("<Q", offset))
+            directory.values_of([x[1] for x in frame.tags if str(x[0]).lower()
+                                 in ("sf_category", "_saveframe_category")])
+            directory.values_of([x.category for x in frame.loops])
+        blocks.append(directory.getvalue())
+
+        header = _BINARY_HEADER.pack(_BINARY_MAGIC, _BINARY_VERSION, settings,
+                                     stat[0], stat[1], digest, position,
+                                     len(blocks[-1]))
+        return [header] + blocks
+
+    @classmethod
+    def saveframe(cls, frame):
+        """ Returns the block of a saveframe."""
+
+        block = cls()
+        value = block.value
+        tags = array("I")
+        for tag in frame.tags:
+            tags.extend((value(tag[0]), value(tag[1]),
+                         value(tag[2]) + 1 if len(tag) > 2 else 0))
+        block.integers(value(frame.category), len(frame.tags),
+                       len(frame.loops))
+        block.parts.append(_array_bytes(tags))
+        for loop in frame.loops:
+            block.loop(loop)
+        return block.getvalue()
+
+    def loop(self, loop):
+        """ Adds a loop, with its data stored a column at a time the way
+        ColumnarData stores it. After the category, source, number of rows
+        and column names come the size of the dictionary of each column
+        plus one (or zero for integer columns), the dictionaries, and then
+        the codes, the integers and the nulls of all of the columns."""
+
+        data = loop.data
+        if not isinstance(data, ColumnarData):
+            data = ColumnarData(len(loop.columns), data)
+        elif len(data._columns) != len(loop.columns):
+            raise ValueError("The number of column tags must match "
+                             "width of the data.")
+
+        self.integers(self.value(loop.category), self.value(loop.source),
+                      len(data))
+        self.values_of(loop.columns)
+
+        sizes, dictionaries = array("I"), array("I")
+        codes, ints, nulls = array("i"), array(_INT_TYPECODE), bytearray()
+        for column in data._columns:
+            if column.codes is None:
+                sizes.append(0)
+                ints.extend(column.ints)
+                nulls.extend(column.nulls)
+            else:
+                sizes.append(len(column.dictionary) + 1)
+                dictionaries.extend([self.value(x) for x in
+                                     column.dictionary])
+                codes.extend(column.codes)
+
+        if ints.itemsize != 8:
+            ints = struct.pack("<%dq" % len(ints), *ints)
+        else:
+            ints = _array_bytes(ints)
+        self.parts.extend([_array_bytes(sizes), _array_bytes(dictionaries),
+                           _array_bytes(codes), ints, bytes(nulls)])
+
+    def integers(self, *numbers):
+        """ Adds 32 bit unsigned integers."""
+
+        self.parts.append(struct.pack("<%dI" % len(numbers), *numbers))
+
+    def value(self, value):
+        """ Returns the position of the value in the table, adding it if
+        it isn't there yet."""
+
+        key = _Column._key(value)
+        pos = self.lookup.get(key)
+        if pos is None:
+            pos = self.lookup[key] = len(self.values)
+            self.values.append(value)
+        return pos
+
+    def values_of(self, values):
+        """ Adds the number of values and their positions in the table."""
+
+        self.integers(len(values))
+        self.parts.append(_array_bytes(array("I", [self.value(x) for x in
+                                                   values])))
+
+    def getvalue(self):
+        """ Returns the block. The table of values is the number of
+        values, of bytes of text and of values that aren't strings,
+        followed by the offset of each value in the text, the positions
+        and kinds (see _BINARY_KINDS) of the values that aren't strings,
+        and the UTF-8 text of all of the values."""
+
+        texts, positions, kinds = [], array("I"), bytearray()
+        for pos, value in enumerate(self.values):
+            if type(value) is not str:
+                try:
+                    kind, to_text = _BINARY_KINDS[type(value)]
+                except KeyError:
+                    raise ValueError("Values of type %s can't be saved in "
+                                     "binary files." % type(value).__name__)
+                positions.append(pos)
+                kinds.append(kind)
+                value = to_text(value)
+            texts.append(value)
+
+        if PY3:
+            joined = "".join(texts)
+            text = joined.encode("utf-8")
+            # The lengths are only the same in bytes for ASCII
+            if len(text) != len(joined):
+                texts = [x.encode("utf-8") for x in texts]
+        else:
+            texts = [x.encode("utf-8") if isinstance(x, unicode) else x for
+                     x in texts]
+            text = b"".join(texts)
+
+        offsets, total = array("I", [0]), 0
+        for length in map(len, texts):
+            total += length
+            offsets.append(total)
+
+        return b"".join([struct.pack("<III", len(self.values), len(text),
+                                     len(positions)),
+                         _array_bytes(offsets), _array_bytes(positions),
+                         bytes(kinds), text] + self.parts)
+
+class _BinaryReader(object):
+    """ Reads the binary files that Entry.save_binary() writes. Each
+    saveframe is a block of its own, so when an entry is loaded lazily its
+    saveframes are only read as they are first used. It stands in for the
+    tokenizer of an _OutlinedSaveframe to do that."""
+
+    def __init__(self, data, mapped=None):
+        """ data is the contents of the file, as a memoryview in python3
+        so that slicing it doesn't copy. mapped is the mmap it comes from,
+        if any, for close() to unmap."""
+
+        if (len(data) < _BINARY_HEADER.size or
+                _BINARY_HEADER.unpack_from(data, 0)[0] != _BINARY_MAGIC):
+            raise ValueError("This is not a binary NMR-STAR file.")
+        header = _BINARY_HEADER.unpack_from(data, 0)
+        if header[1] != _BINARY_VERSION:
+            raise ValueError("The binary file is in version %d of the format "
+                             "rather than version %d." %
+                             (header[1], _BINARY_VERSION))
+        if header[6] + header[7] != len(data):
+            raise ValueError("The binary file is the wrong length.")
+
+        (self.settings, self.mtime, self.size, self.digest,
+         self.directory) = header[2:7]
+        self.data = data
+        self.position = 0
+        self.values = []
+        self.block = None
+        self.sources = {}
+        self.mapped = mapped
+
+    def __enter__(self):
+        """Lets readers be used in with statements."""
+
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        """Closes the reader at the end of the with statement."""
+
+        self.close()
+
+    @classmethod
+    def open(cls, the_file):
+        """ Returns a reader for a file location, which is mapped into
+        memory rather than read in, or an object with a read() method.
+        Readers of mapped files should be closed once nothing more will be
+        read, which an entry loaded lazily only knows when it is gone."""
+
+        mapped = None
+        if hasattr(the_file, "read"):
+            data = the_file.read()
+        else:
+            with open(the_file, "rb") as read_file:
+                data = mapped = mmap.mmap(read_file.fileno(), 0,
+                                          access=mmap.ACCESS_READ)
+        if PY3:
+            data = memoryview(data)
+        return cls(data, mapped)
+
+    def close(self):
+        """ Unmaps the file if it was mapped. Nothing read from it refers
+        to the mapping, but a traceback can still hold a slice of it, in
+        which case it is left for the garbage collector to unmap."""
+
+        mapped, self.mapped = self.mapped, None
+        if mapped is None:
+            return
+        if PY3:
+            self.data.release()
+        self.data = None
+        try:
+            mapped.close()
+        except BufferError:
+            pass
+
+    def set_mtime(self, file_name, mtime):
+        """ Changes the modification time in the header of the file."""
+
+        with open(file_name, "r+b") as header_file:
+            header_file.seek(16)
+            header_file.write(struct.pack("<q", mtime))
+        self.mtime = mtime
+
+    def read_entry(self, entry_class, lazy=False, source=None):
+        """ Returns the entry. If lazy is set the saveframes are outlined
+        and read the first time they are used. If source is given it
+        replaces the source the entry was saved with, in the entry and in
+        its saveframes and loops."""
+
+        values = self._block(self.directory)
+        entry_id, entry_source, count = self._integers(3)
+        if source is not None:
+            self.sources = {values[entry_source]: source}
+        entry = entry_class.from_scratch(values[entry_id])
+        entry.source = self._source(values[entry_source])
+
+        outlines = []
+        for x in range(0, count):
+            name, tag_prefix, category, frame_source = self._integers(4)
+            offset = struct.unpack("<Q", self._take(8))[0]
+            frame = Saveframe.from_scratch(values[name], source=self._source(
+                values[frame_source]))
+            frame.tag_prefix = values[tag_prefix]
+            frame.category = values[category]
+            outlines.append((frame, offset, self._values_of(),
+                             self._values_of()))
+
+        for frame, offset, category_tags, loop_categories in outlines:
+            if lazy:
+                # The outline has the values themselves rather than the
+                #  text they were converted from
+                category = frame.category
+                frame._set_outline((self, {}, (COLUMNAR_LOOPS, False)),
+                                   offset, frame.tag_prefix, category_tags,
+                                   loop_categories)
+                frame.category = category
+            else:
+                self.parse_saveframe(frame, offset, Loop)
+        entry.frame_list = [x[0] for x in outlines]
+        return entry
+
+    def parse_saveframe(self, frame, position, loop_class, **options):
+        """ Reads the tags and loops of the saveframe whose block is at
+        position into it. Called like Tokenizer.parse_saveframe() in the C
+        extension."""
+
+        values = self._block(position)
+        category, tag_count, loop_count = self._integers(3)
+        numbers = self._array("I", 3 * tag_count)
+
+        tags = []
+        for pos in range(0, len(numbers), 3):
+            if numbers[pos + 2]:
+                tags.append([values[numbers[pos]], values[numbers[pos + 1]],
+                             values[numbers[pos + 2] - 1]])
+            else:
+                tags.append([values[numbers[pos]], values[numbers[pos + 1]]])
+        frame.tags = tags
+        columnar = options.get("columnar")
+        if columnar is None:
+            columnar = COLUMNAR_LOOPS
+        frame.loops = [self._loop(loop_class, columnar) for x in
+                       range(0, loop_count)]
+        frame.category = values[category]
+
+    def loop_ranges(self):
+        """ Returns where each loop of the entry is, for Archive: the
+        position of the block of its saveframe, the range of bytes it
+        takes up in the block, its category and its columns. Only the
+        tables of values are decoded, not the data of the loops."""
+
+        self._block(self.directory)
+        frames = []
+        for x in range(0, self._integers(3)[2]):
+            self._integers(4)
+            frames.append(struct.unpack("<Q", self._take(8))[0])
+            self._values_of()
+            self._values_of()
+
+        loops = []
+        for frame in frames:
+            values = self._block(frame)
+            tag_count, loop_count = self._integers(3)[1:]
+            self._take(12 * tag_count)
+            for x in range(0, loop_count):
+                start = self.position
+                category, source, length = self._integers(3)
+                columns = self._values_of()
+                sizes = self._array("I", len(columns))
+                int_count = sizes.count(0)
+                self._take(4 * (sum(sizes) - len(sizes) + int_count) +
+                           4 * length * (len(sizes) - int_count) +
+                           9 * length * int_count)
+                loops.append((frame, start, self.position, values[category],
+                              columns))
+        return loops
+
+    def read_loop(self, frame, position, loop_class):
+        """ Returns the loop at position in the block of the saveframe at
+        frame, with its data kept columnar. The table of values of the
+        block is only decoded once for all of its loops."""
+
+        if self.block != frame:
+            self._block(frame)
+        self.position = position
+        return self._loop(loop_class, True)
+
+    def _loop(self, loop_class, columnar=False):
+        """ Reads a loop, into a ColumnarData if columnar is set."""
+
+        values = self.values
+        category, source, length = self._integers(3)
+        loop = loop_class.from_scratch(values[category],
+                                       source=self._source(values[source]))
+        loop.columns = self._values_of()
+
+        sizes = self._array("I", len(loop.columns))
+        int_count = sizes.count(0)
+        dictionaries = [values[x] for x in
+                        self._array("I", sum(sizes) - len(sizes) + int_count)]
+        codes = self._array("i", length * (len(sizes) - int_count))
+        if array(_INT_TYPECODE).itemsize == 8:
+            ints = self._array(_INT_TYPECODE, length * int_count)
+        else:
+            ints = array(_INT_TYPECODE, struct.unpack(
+                "<%dq" % (length * int_count),
+                self._take(8 * length * int_count)))
+        nulls = bytearray(self._take(length * int_count))
+
+        # Split them up into the columns
+        columns, code_start, int_start, dictionary_start = [], 0, 0, 0
+        for size in sizes:
+            if size:
+                dictionary_end = dictionary_start + size - 1
+                columns.append((codes[code_start:code_start + length],
+                                dictionaries[dictionary_start:dictionary_end],
+                                None))
+                code_start += length
+                dictionary_start = dictionary_end
+            else:
+                columns.append((ints[int_start:int_start + length], None,
+                                nulls[int_start:int_start + length]))
+                int_start += length
+
+        if columnar:
+            loop.data = ColumnarData._from_columns(
+                [_Column._from_buffers(*x) for x in columns], length)
+        else:
+            loop.data = _rows_from_columns(columns, length)
+        return loop
+
+    def _block(self, position):
+        """ Reads the table of values at the start of the block at
+        position, and moves on to the rest of the block."""
+
+        self.position = position
+        self.block = position
+        count, length, typed = self._integers(3)
+        offsets = self._array("I", count + 1)
+        positions = self._array("I", typed)
+        kinds = bytearray(self._take(typed))
+
+        values = _decode_strings(self._take(length), offsets)
+        for pos, kind in zip(positions, kinds):
+            try:
+                values[pos] = _BINARY_VALUES[kind](values[pos])
+            except KeyError:
+                raise ValueError("The binary file has a value of an unknown "
+                                 "kind.")
+        self.values = values
+        return values
+
+    def _take(self, length):
+        """ Returns the next length bytes."""
+
+        end = self.position + length
+        if end > len(self.data):
+            raise ValueError("The binary file ends before it should.")
+        data = self.data[self.position:end]
+        self.position = end
+        return data
+
+    def _integers(self, count):
+        """ Returns the next count 32 bit unsigned integers."""
+
+        return struct.unpack("<%dI" % count, self._take(4 * count))
+
+    def _array(self, typecode, count):
+        """ Returns an array of the next count items."""
+
+        values = array(typecode)
+        data = self._take(values.itemsize * count)
+        if PY3:
+            values.frombytes(data)
+        else:
+            values.fromstring(data)
+        if sys.byteorder == "big":
+            values.byteswap()
+        return values
+
+    def _values_of(self):
+        """ Returns the values that _BinaryWriter.values_of() added."""
+
+        values = self.values
+        return [values[x] for x in self._array("I", self._integers(1)[0])]
+
+    def _source(self, source):
+        """ Returns the source to use in place of the saved one."""
+
+        return self.sources.get(source, source)
+
+class _TagCheck(object):
+    """ How Schema.val_type() checks the values of one tag in one
+    saveframe category, worked out once so that whole columns can be
+    checked without looking anything up for each value. The outcome only
+    depends on the value (the line number just goes in the message), so
+    check_column() checks each distinct value once."""
+
+    # The problems a value can have
+    _NULL, _LENGTH, _MATCH, _CASE = range(0, 4)
+
+    __slots__ = ("tag", "in_schema", "error", "null_allowed", "length",
+                 "match", "valtype", "bmrb_type", "pattern",
+                 "capitalized_tag")
+
+    def __init__(self, schema, tag, category):
+        self.tag = tag
+        self.error = None
+        full_tag = schema.schema.get(tag.lower())
+        self.in_schema = full_tag is not None
+        if not self.in_schema:
+            return
+
+        self.valtype = full_tag["Data Type"]
+        self.bmrb_type = full_tag["BMRB data type"]
+        self.null_allowed = full_tag["Nullable"]
+        self.capitalized_tag = full_tag["Tag"]
+        allowed_category = full_tag["SFCategory"]
+        if category != None and category != allowed_category:
+            self.error = ("The tag '%s' in category '%s' should be in "
+                          "category '%s'." % (self.capitalized_tag, category,
+                                              allowed_category))
+
+        self.length = None
+        if "CHAR" in self.valtype:
+            self.length = int(self.valtype[self.valtype.index("(") + 1:
+                                           self.valtype.index(")")])
+
+        # A missing type is only a KeyError once a value needs matching
+        self.pattern = schema.data_types.get(self.bmrb_type)
+        self.match = None
+        if self.pattern is not None:
+            self.match = re.compile(self.pattern).match
+
+    def problem(self, value):
+        """ Returns None if the value is valid, and otherwise which
+        problem it has and the value as it appears in the message."""
+
+        # We will skip type checks for None's
+        was_none = value is None
+
+        # Allow manual specification of conversions for booleans, Nones, etc.
+        if value in STR_CONVERSION_DICT:
+            if any(isinstance(value, type(x)) for x in STR_CONVERSION_DICT):
+                value = STR_CONVERSION_DICT[value]
+
+        # Value should always be string
+        if not isinstance(value, str):
+            value = str(value)
+
+        if value == ".":
+            if not self.null_allowed:
+                return self._NULL, value
+            return None
+
+        if self.length is not None and len(value) > self.length:
+            return self._LENGTH, value
+
+        # Check that the value matches the regular expression for the type
+        if not was_none:
+            if self.match is None:
+                raise KeyError(self.bmrb_type)
+            if not self.match(value):
+                return self._MATCH, value
+
+        # Check the tag capitalization
+        if self.tag != self.capitalized_tag:
+            return self._CASE, value
+        return None
+
+    def message(self, problem, linenum):
+        """ Returns the error message for a problem() on the line."""
+
+        kind, value = problem
+        if kind == self._NULL:
+            return ("Value cannot be NULL but is: '%s':'%s' on line '%s'." %
+                    (self.capitalized_tag, value, linenum))
+        if kind == self._LENGTH:
+            return ("Length of '%d' is too long for %s: '%s':'%s' on line "
+                    "'%s'." % (len(value), self.valtype, self.capitalized_tag,
+                               value, linenum))
+        if kind == self._MATCH:
+            return ("Value does not match specification: '%s':'%s' on line "
+                    "'%s'.\n     Type specified: %s\n     Regular expression "
+                    "for type: '%s'" % (self.capitalized_tag, value, linenum,
+                                        self.bmrb_type, self.pattern))
+        return ("The tag '%s' is improperly capitalized but otherwise valid."
+                " Should be '%s'." % (self.tag, self.capitalized_tag))
+
+    def check(self, value, linenum):
+        """ Returns the errors val_type() finds with the value."""
+
+        if not self.in_schema:
+            return ["Tag '%s' not found in schema. Line '%s'." %
+                    (self.tag, linenum)]
+        if self.error is not None:
+            return [self.error]
+        problem = self.problem(value)
+        if problem is None:
+            return []
+        return [self.message(problem, linenum)]
+
+    def check_column(self, values, linenum):
+        """ Returns (row, error) for each of the values that val_type()
+        finds an error with. linenum(row) returns the line number of a
+        row for the message."""
+
+        if not self.in_schema or self.error is not None:
+            return [(row, self.check(value, linenum(row))[0]) for
+                    row, value in enumerate(values)]
+
+        # The type is part of the key so that 1, 1.0 and True are apart
+        try:
+            distinct = set(zip(map(type, values), values))
+        except TypeError:
+            distinct = None
+        if distinct is not None:
+            problems = dict((key, self.problem(key[1])) for key in distinct)
+            if not any(problems.values()):
+                return []
+            return [(row, self.message(problems[(type(value), value)],
+                                       linenum(row)))
+                    for row, value in enumerate(values)
+                    if problems[(type(value), value)] is not None]
+
+        errors = []
+        for row, value in enumerate(values):
+            problem = self.problem(value)
+            if problem is not None:
+                errors.append((row, self.message(problem, linenum(row))))
+        return errors
+
 class Schema(object):
     """A BMRB schema. Used to validate STAR files."""
 
+    # The _TagChecks that val_type() has made, by tag and category
+    _checks = None
+    # The positions of the tags and categories, built by _position()
+    _positions = None
+
     def __init__(self, schema_file=None):
         """Initialize a BMRB schema. With no arguments the most
         up-to-date schema will be fetched from the BMRB FTP site.
@@ -1327,6 +2541,16 @@ class Schema(object):
             schema_file = _SCHEMA_URL
         self.schema_file = schema_file
 
+        # Use the snapshot of a local file if it is up to date
+        stat = None
+        if CACHE_DIRECTORY is not None and _is_local_file(schema_file):
+            if self._load_cached(schema_file):
+                return
+            try:
+                stat = _file_stat(schema_file)
+            except (IOError, OSError):
+                pass
+
         # Get the schema from the internet, wrap in StringIO and pass that
         #  to the csv reader
         schem_stream = _interpret_file(schema_file)
@@ -1349,6 +2573,7 @@ class Schema(object):
         # Determine the primary key field
         tag_field = self.headers.index("Tag")
         nullable = self.headers.index("Nullable")
+        categories = set()
 
         for line in csv_reader_instance:
 
@@ -1361,29 +2586,176 @@ class Schema(object):
             else:
                 line[nullable] = True
 
-            self.schema[line[tag_field].lower()] = dict(zip(self.headers, line))
+            self.schema[intern(line[tag_field].lower())] = dict(zip(self.headers,
+                                                                    line))
 
             self.schema_order.append(line[tag_field])
             formatted = _format_category(line[tag_field])
-            if formatted not in self.category_order:
+            if formatted not in categories:
+                categories.add(formatted)
                 self.category_order.append(formatted)
 
         # Read in the data types
-        types_file = os.path.join(os.path.dirname(os.path.realpath(__file__)),
-                                  "reference_files/data_types.csv")
-
-        with open(types_file, "rt") as types_file:
+        with open(_DATA_TYPES_FILE, "rt") as types_file:
             csv_reader_instance = csv_reader(types_file)
 
             for item in csv_reader_instance:
                 self.data_types[item[0]] = item[1]
 
+        if stat is not None:
+            self._store_cached(schema_file, stat)
+
     def __repr__(self):
         """Return how we can be initialized."""
 
         return "bmrb.Schema(schema_file='%s') version %s" % (self.schema_file,
                                                              self.version)
 
+    @classmethod
+    def load_snapshot(cls, the_file):
+        """Load a schema that save_snapshot() saved. the_file can be a
+        file location or an object with a read() method. Raises
+        ValueError if it isn't a snapshot or was saved by a different
+        version of python."""
+
+        if hasattr(the_file, "read"):
+            data = the_file.read()
+        else:
+            with open(the_file, "rb") as snapshot:
+                data = snapshot.read()
+
+        schema = cls.__new__(cls)
+        schema._snapshot_header(data)
+        schema._set_snapshot(data)
+        return schema
+
+    def save_snapshot(self, the_file):
+        """Save the schema, with its data types, in a compact form that
+        load_snapshot() reads back in one go. This is much quicker than
+        reading the schema file, but the snapshot can only be loaded by
+        the same version of python. the_file can be a file location or
+        an object with a write() method."""
+
+        parts = self._snapshot()
+        if hasattr(the_file, "write"):
+            for part in parts:
+                the_file.write(part)
+        else:
+            _write_atomically(the_file, parts)
+
+    def _snapshot(self, stat=(0, 0), digest=b"\0" * 20):
+        """ Returns the header and body of a snapshot of the schema. stat
+        and digest are the _file_stat() and _file_digest() of the schema
+        file, if the snapshot is to be used in its place."""
+
+        types_stat = _file_stat(_DATA_TYPES_FILE)
+        header = _SNAPSHOT_HEADER.pack(
+            _SNAPSHOT_MAGIC, _SNAPSHOT_VERSION,
+            sys.version_info[0] * 1000 + sys.version_info[1], marshal.version,
+            stat[0], stat[1], digest, types_stat[0], types_stat[1])
+
+        # Marshal stores an object it has already stored as a reference, so
+        #  use one copy of each distinct value. Most of the values of the
+        #  tags are the same few words.
+        distinct = {}
+        schema = dict((tag, dict((distinct.setdefault((type(key), key), key),
+                                  distinct.setdefault((type(value), value),
+                                                      value))
+                                 for key, value in fields.items()))
+                      for tag, fields in self.schema.items())
+        return [header, marshal.dumps((str(self.schema_file), self.version,
+                                       self.headers, schema,
+                                       self.schema_order, self.category_order,
+                                       self.data_types))]
+
+    @staticmethod
+    def _snapshot_header(data):
+        """ Returns the values in the header of a snapshot, raising
+        ValueError if it isn't one this python can load."""
+
+        if (len(data) < _SNAPSHOT_HEADER.size or
+                data[:len(_SNAPSHOT_MAGIC)] != _SNAPSHOT_MAGIC):
+            raise ValueError("The file is not a schema snapshot.")
+        header = _SNAPSHOT_HEADER.unpack_from(data)
+        if header[1:4] != (_SNAPSHOT_VERSION,
+                           sys.version_info[0] * 1000 + sys.version_info[1],
+                           marshal.version):
+            raise ValueError("The schema snapshot was saved by a different "
+                             "version of python or of this module.")
+        return header
+
+    def _set_snapshot(self, data):
+        """ Sets the schema to the one in a snapshot."""
+
+        try:
+            (self.schema_file, self.version, self.headers, self.schema,
+             self.schema_order, self.category_order,
+             self.data_types) = marshal.loads(data[_SNAPSHOT_HEADER.size:])
+        except (EOFError, TypeError, ValueError):
+            raise ValueError("The schema snapshot is damaged.")
+
+    def _load_cached(self, schema_file):
+        """ Sets the schema to the snapshot of the file in
+        CACHE_DIRECTORY. Returns False if there isn't an up to date one."""
+
+        try:
+            mtime, size = _file_stat(schema_file)
+            types_stat = _file_stat(_DATA_TYPES_FILE)
+            with open(_cache_file(schema_file, ".schema"), "rb") as snapshot:
+                data = snapshot.read()
+            header = self._snapshot_header(data)
+        except (IOError, OSError, ValueError):
+            return False
+        if header[5] != size or header[7:] != types_stat:
+            return False
+        # The file was touched or copied, but is it the same?
+        if header[4] != mtime and header[6] != _file_digest(schema_file):
+            return False
+
+        try:
+            self._set_snapshot(data)
+        except ValueError:
+            return False
+        self.schema_file = schema_file
+        return True
+
+    def _store_cached(self, schema_file, stat):
+        """ Saves a snapshot of the schema in CACHE_DIRECTORY. stat is
+        what _file_stat() returned before the file was read. Nothing is
+        saved if the file has changed since then, or if the snapshot
+        can't be written."""
+
+        try:
+            digest = _file_digest(schema_file)
+            if _file_stat(schema_file) != stat:
+                return
+            if not os.path.isdir(CACHE_DIRECTORY):
+                os.makedirs(CACHE_DIRECTORY)
+            _write_atomically(_cache_file(schema_file, ".schema"),
+                              self._snapshot(stat, digest))
+        except (IOError, OSError, ValueError):
+            pass
+
+    def _position(self, name, category=False):
+        """ Returns the position of the tag in schema_order, or of the
+        category in category_order, as their index() method would but
+        without searching them. Raises ValueError if it isn't there."""
+
+        order = self.category_order if category else self.schema_order
+        if self._positions is None:
+            self._positions = {}
+        positions = self._positions.get(category)
+        if (positions is None or positions[0] is not order or
+                positions[1] != len(order)):
+            lookup = {}
+            for pos, item in enumerate(order):
+                lookup.setdefault(item, pos)
+            positions = self._positions[category] = (order, len(order), lookup)
+        try:
+            return positions[2][name]
+        except KeyError:
+            raise ValueError("'%s' is not in the schema." % name)
+
     def __str__(self):
         """Print the schema that we are adhering to."""
 
@@ -1599,8 +2971,7 @@ class Schema(object):
 
         if "DATETIME year to day" in valtype:
             try:
-                year, month, day = [int(x) for x in value.split("-")]
-                return date(year, month, day)
+                return _parse_date(value)
             except:
                 raise ValueError("Could not parse the file because a value "
                                  "that should be a DATETIME is not. Please "
@@ -1610,75 +2981,74 @@ class Schema(object):
         # We don't know the data type, so just keep it a string
         return value
 
-    def val_type(self, tag, value, category=None, linenum=None):
-        """ Validates that a tag matches the type it should have
-        according to this schema."""
+    def get_conversion(self, tag):
+        """ Returns how convert_tag() converts the values of a tag, as
+        one of the _CONVERT_ constants. _CONVERT_CALL means to call
+        convert_tag() itself. Used to work this out once for a whole
+        column."""
 
         if tag.lower() not in self.schema:
-            return ["Tag '%s' not found in schema. Line '%s'." %
-                    (tag, linenum)]
-
-        # We will skip type checks for None's
-        was_none = value is None
+            if VERBOSE or (RAISE_PARSE_WARNINGS and
+                           "tag-not-in-schema" not in WARNINGS_TO_IGNORE):
+                return _CONVERT_CALL
+            return _CONVERT_NONE
 
-        # Allow manual specification of conversions for booleans, Nones, etc.
-        if value in STR_CONVERSION_DICT:
-            if any(isinstance(value, type(x)) for x in STR_CONVERSION_DICT):
-                value = STR_CONVERSION_DICT[value]
-
-        # Value should always be string
-        if not isinstance(value, str):
-            value = str(value)
-
-        # Make local copies of the fields we care about
         full_tag = self.schema[tag.lower()]
-        bmrb_type = full_tag["BMRB data type"]
         valtype = full_tag["Data Type"]
-        null_allowed = full_tag["Nullable"]
-        allowed_category = full_tag["SFCategory"]
-        capitalized_tag = full_tag["Tag"]
-
-        if category != None:
-            if category != allowed_category:
-                return ["The tag '%s' in category '%s' should be in category "
-                        "'%s'." % (capitalized_tag, category, allowed_category)]
 
-        if value == ".":
-            if not null_allowed:
-                return ["Value cannot be NULL but is: '%s':'%s' on line '%s'."
-                        % (capitalized_tag, value, linenum)]
-            return []
-
-        if "CHAR" in valtype:
-            length = int(valtype[valtype.index("(")+1:valtype.index(")")])
-            if len(str(value)) > length:
-                return ["Length of '%d' is too long for %s: "
-                        "'%s':'%s' on line '%s'." %
-                        (len(value), valtype, capitalized_tag, value, linenum)]
+        if "CHAR" in valtype or "VARCHAR" in valtype or "TEXT" in valtype:
+            kind = _CONVERT_STRING
+        elif "INTEGER" in valtype:
+            kind = _CONVERT_INTEGER
+        elif "FLOAT" in valtype:
+            kind = _CONVERT_FLOAT
+        elif "DATETIME year to day" in valtype:
+            kind = _CONVERT_DATE
+        else:
+            kind = _CONVERT_STRING
+
+        if (not full_tag["Nullable"] and RAISE_PARSE_WARNINGS and
+                "invalid-null-value" not in WARNINGS_TO_IGNORE):
+            kind += _CONVERT_NULL_ERROR
+        return kind
+
+    def _tag_check(self, tag, category=None):
+        """ Returns the _TagCheck for values of the tag in the category,
+        making it the first time. They are thrown away if the schema or
+        its data types are replaced."""
+
+        if (self._checks is None or self._checks[0] is not self.schema or
+                self._checks[1] is not self.data_types):
+            self._checks = (self.schema, self.data_types, {})
+        checks = self._checks[2]
+        try:
+            return checks[(tag, category)]
+        except KeyError:
+            check = checks[(tag, category)] = _TagCheck(self, tag, category)
+            return check
 
-        # Check that the value matches the regular expression for the type
-        if not was_none and not re.match(self.data_types[bmrb_type], str(value)):
-            return ["Value does not match specification: '%s':'%s' on line '%s'"
-                    ".\n     Type specified: %s\n     Regular expression for "
-                    "type: '%s'" % (capitalized_tag, value, linenum, bmrb_type,
-                              self.data_types[bmrb_type])]
+    def val_type(self, tag, value, category=None, linenum=None):
+        """ Validates that a tag matches the type it should have
+        according to this schema."""
 
-        # Check the tag capitalization
-        if tag != capitalized_tag:
-            return ["The tag '%s' is improperly capitalized but otherwise "
-                    "valid. Should be '%s'." % (tag, capitalized_tag)]
-        return []
+        return self._tag_check(tag, category).check(value, linenum)
 
 class Entry(object):
     """An OO representation of a BMRB entry. You can initialize this
     object several ways; (e.g. from a file, from the official database,
     from scratch) see the classmethods."""
 
+    # Built by _get_index() when first needed
+    _index = None
+    # Bumped by the methods that add, remove or move saveframes
+    _version = 0
+
     def __delitem__(self, item):
         """Remove the indicated saveframe."""
 
         if isinstance(item, Saveframe):
             del self.frame_list[self.frame_list.index(item)]
+            self._version += 1
             return
         else:
             self.__delitem__(self.__getitem__(item))
@@ -1702,6 +3072,11 @@ class Entry(object):
         except TypeError:
             return self.get_saveframe_by_name(item)
 
+    def __getstate__(self):
+        """Leave the index out of copies and pickles."""
+
+        return _state_without_index(self)
+
     def __init__(self, **kargs):
         """Don't use this directly, use from_file, from_scratch,
         from_string, or from_database to construct."""
@@ -1729,8 +3104,31 @@ class Entry(object):
             star_buffer = StringIO(kargs['the_string'])
             self.source = "from_string()"
         elif 'file_name' in kargs:
-            star_buffer = _interpret_file(kargs['file_name'])
             self.source = "from_file('%s')" % kargs['file_name']
+
+            if cnmrstar != None:
+                tokenizer = cnmrstar.Tokenizer()
+                stream = None
+
+                # The C tokenizer can map local files into memory (or
+                #  decompress them) rather than reading them in. URLs
+                #  and file objects are tokenized a piece at a time.
+                if _is_local_file(kargs['file_name']):
+                    tokenizer.load(kargs['file_name'], True)
+                else:
+                    stream = _interpret_stream(kargs['file_name'])
+                    tokenizer.load_stream(stream, True)
+
+                try:
+                    parser = _Parser(entry_to_parse_into=self)
+                    parser.parse(None, source=self.source, tokenizer=tokenizer)
+                finally:
+                    if (stream is not None and
+                            stream is not kargs['file_name']):
+                        stream.close()
+                return
+
+            star_buffer = _interpret_file(kargs['file_name'])
         elif 'entry_num' in kargs:
             self.source = "from_database(%s)" % kargs['entry_num']
 
@@ -1780,6 +3178,7 @@ class Entry(object):
 
         # It is a saveframe
         if isinstance(item, Saveframe):
+            self._version += 1
             # Add by ordinal
             try:
                 self.frame_list[key] = item
@@ -1806,6 +3205,53 @@ class Entry(object):
                       "\n".join([str(frame) for frame in self.frame_list]))
         return ret_string
 
+    def write_to(self, the_file, compress=None):
+        """Writes the entry in STAR format to the_file, which can be a
+        file location or an object with a write() method, such as an
+        open file or a socket's makefile(). The text is written a
+        saveframe (or with the C extension a bufferful) at a time rather
+        than being built up in memory first. Set compress to "gzip" to
+        gzip it as it is written."""
+
+        write, binary, finish = _open_output(the_file, compress)
+        try:
+            header = "data_%s\n\n" % self.entry_id
+            write(header.encode() if binary else header)
+            for pos, frame in enumerate(self.frame_list):
+                if pos > 0:
+                    write(b"\n" if binary else "\n")
+                frame._format(write, binary)
+        finally:
+            finish()
+
+    def write_json(self, the_file, compress=None):
+        """Writes the entry in JSON format, as get_json() returns it, to
+        the_file. With the C extension the JSON is written a bufferful at
+        a time rather than being built up in memory first. See write_to()
+        for the arguments."""
+
+        write, binary, finish = _open_output(the_file, compress)
+        try:
+            _to_json(self, write, binary)
+        finally:
+            finish()
+
+    def save_binary(self, the_file):
+        """Saves the entry in a binary format that load_binary() can load
+        much faster than the entry can be parsed. the_file can be a file
+        location or an object with a write() method. Each saveframe is
+        stored separately, with the distinct values in it stored once and
+        its loops stored a column at a time. This will raise ValueError
+        if a value is of a type other than those that CONVERT_DATATYPES
+        converts to."""
+
+        parts = _BinaryWriter.entry(self)
+        if hasattr(the_file, 'write'):
+            for part in parts:
+                the_file.write(part)
+        else:
+            _write_atomically(the_file, parts)
+
     @classmethod
     def from_database(cls, entry_num):
         """Create an entry corresponding to the most up to date entry on
@@ -1853,12 +3299,7 @@ class Entry(object):
                                                    linenum="SF %s" %
                                                    each_saveframe.name)
                     for loop in each_saveframe:
-                        for row in loop.data:
-                            for pos in range(0, len(row)):
-                                catgry = loop.category + "." + loop.columns[pos]
-                                linenum = "Loop %s" % loop.category
-                                row[pos] = schem.convert_tag(catgry, row[pos],
-                                                             linenum=linenum)
+                        loop._set_data(loop.data)
 
             return ent
         # The entry doesn't exist
@@ -1875,9 +3316,74 @@ class Entry(object):
     def from_file(cls, the_file):
         """Create an entry by loading in a file. If the_file starts with
         http://, https://, or ftp:// then we will use those protocols to
-        attempt to open the file."""
+        attempt to open the file. If CACHE_DIRECTORY is set local files
+        are loaded from the binary copy there if they haven't changed
+        since it was saved, and the copy is saved if they have."""
+
+        if CACHE_DIRECTORY is None or not _is_local_file(the_file):
+            return cls(file_name=the_file)
+
+        ent = _load_cached(cls, the_file)
+        if ent is None:
+            try:
+                stat = _file_stat(the_file)
+            except (IOError, OSError):
+                stat = None
+            ent = cls(file_name=the_file)
+            if stat is not None:
+                _store_cached(ent, the_file, stat)
+        return ent
+
+    @classmethod
+    def from_files(cls, file_names, workers=None):
+        """Create a list of entries by loading in a list of files. If the
+        C extension is available the files are read and tokenized on a
+        pool of worker threads without holding the GIL. By default one
+        worker per CPU is used; specify workers to change that. Gzipped
+        files are decompressed by the workers too. URLs and file objects
+        are loaded as from_file() would load them, as are the files that
+        have a binary copy in CACHE_DIRECTORY if it is set."""
+
+        file_names = list(file_names)
+        if cnmrstar is None:
+            return [cls.from_file(x) for x in file_names]
+
+        cached, stats = {}, {}
+        if CACHE_DIRECTORY is not None:
+            for file_name in file_names:
+                if not _is_local_file(file_name):
+                    continue
+                cached[file_name] = _load_cached(cls, file_name)
+                if cached[file_name] is None:
+                    try:
+                        stats[file_name] = _file_stat(file_name)
+                    except (IOError, OSError):
+                        pass
+
+        # Read and tokenize the plain files in parallel
+        plain = [x for x in file_names if _is_local_file(x) and
+                 cached.get(x) is None]
+        tokenizers = iter(cnmrstar.parse_many(plain, workers or 0))
+
+        # Building the objects needs the GIL so is done one at a time
+        results = []
+        for file_name in file_names:
+            if not _is_local_file(file_name):
+                results.append(cls.from_file(file_name))
+                continue
+            if cached.get(file_name) is not None:
+                results.append(cached[file_name])
+                continue
 
-        return cls(file_name=the_file)
+            ent = cls.from_scratch(None)
+            ent.source = "from_file('%s')" % file_name
+            parser = _Parser(entry_to_parse_into=ent)
+            parser.parse(None, source=ent.source, tokenizer=next(tokenizers))
+            if file_name in stats:
+                _store_cached(ent, file_name, stats[file_name])
+            results.append(ent)
+
+        return results
 
     @classmethod
     def from_json(cls, json_dict):
@@ -1885,11 +3391,18 @@ class Entry(object):
 
         # If they provided a string, try to load it using JSON
         if not isinstance(json_dict, dict):
-            try:
-                json_dict = json.loads(json_dict)
-            except (TypeError, ValueError):
-                raise ValueError("The JSON you provided was neither a Python "
-                                 "dictionary nor a JSON string.")
+            # The C extension builds it straight from the text
+            if cnmrstar is not None and isinstance(json_dict, str):
+                json_dict = cnmrstar.from_json(json_dict, Entry, Entry,
+                                               Saveframe, Loop)
+                if isinstance(json_dict, Entry):
+                    return json_dict
+            else:
+                try:
+                    json_dict = json.loads(json_dict)
+                except (TypeError, ValueError):
+                    raise ValueError("The JSON you provided was neither a "
+                                     "Python dictionary nor a JSON string.")
 
         # Make sure it has the correct keys
         if "saveframes" not in json_dict:
@@ -1931,6 +3444,80 @@ class Entry(object):
 
         return cls(entry_id=entry_id)
 
+    @classmethod
+    def load_binary(cls, the_file):
+        """Load an entry that save_binary() saved. the_file can be a file
+        location, which is mapped into memory rather than read in, or an
+        object with a read() method. If LAZY_LOADING is set each
+        saveframe is only read the first time it is used."""
+
+        reader = _BinaryReader.open(the_file)
+        if LAZY_LOADING:
+            return reader.read_entry(cls, True)
+        with reader:
+            return reader.read_entry(cls)
+
+    def _get_index(self, check=False):
+        """ Returns dictionaries of the positions of the saveframes by
+        name, of the saveframes with tags or loops in each lower case
+        category, and of the saveframes with loops in each lower case
+        category. If the entry has changed since they were last used, or
+        if check is set, they are checked against the saveframes and
+        rebuilt if any were added, removed, moved or renamed or their
+        loops were recategorized. Saveframes that were loaded lazily
+        aren't parsed to do this."""
+
+        index = self._index
+        if index is not None and not check and index[0] == self._version:
+            return index[3]
+
+        frames = self.frame_list
+        key = (list(map(_NAME_AND_PREFIX, frames)),
+               list(map(_loop_categories, frames)))
+        if index is None or index[2] != key:
+            frames_by_name, frames_by_category, with_loops = {}, {}, {}
+            for position, frame_key in enumerate(zip(*key)):
+                (name, tag_prefix), loop_categories = frame_key
+                frames_by_name[name] = position
+                categories = [x.lower() for x in loop_categories
+                              if x is not None]
+                for category in categories:
+                    in_category = with_loops.setdefault(category, [])
+                    if not in_category or in_category[-1] != position:
+                        in_category.append(position)
+                if tag_prefix is not None:
+                    categories.insert(0, tag_prefix.lower())
+                for category in categories:
+                    in_category = frames_by_category.setdefault(category, [])
+                    if not in_category or in_category[-1] != position:
+                        in_category.append(position)
+            index = [None, None, key,
+                     (frames_by_name, frames_by_category, with_loops)]
+            self._index = index
+        index[0] = self._version
+        index[1] = list(map(_OBJECT_VERSION, frames))
+        return index[3]
+
+    def _frames_in(self, category, part):
+        """ Returns the saveframes with tags or loops (part 1) or with
+        loops (part 2) in the lower case category. Saveframes given new
+        loops or tag prefixes through their own methods bump their own
+        versions rather than the entry's, and loops can be added to or
+        recategorized in their loop lists directly, so the versions and
+        loop categories are compared too. The index is also checked again
+        if it has no saveframes in the category, since tag prefixes can
+        be changed directly."""
+
+        frames = self.frame_list
+        index = self._get_index()
+        if (self._index[1] != list(map(_OBJECT_VERSION, frames)) or
+                self._index[2][1] != list(map(_loop_categories, frames))):
+            index = self._get_index(True)
+        positions = index[part].get(category)
+        if positions is None:
+            positions = self._get_index(True)[part].get(category, [])
+        return [frames[x] for x in positions]
+
     def add_saveframe(self, frame):
         """Add a saveframe to the entry."""
 
@@ -1939,6 +3526,7 @@ class Entry(object):
                              "using this method.")
 
         self.frame_list.append(frame)
+        self._version += 1
 
     def compare(self, other):
         """Returns the differences between two entries as a list.
@@ -1962,16 +3550,17 @@ class Entry(object):
                 diffs.append("The number of saveframes in the entries are not"
                              " equal: '%d' vs '%d'." %
                              (len(self.frame_list), len(other.frame_list)))
-            for frame in self.frame_dict():
-                if other.frame_dict().get(frame, None) is None:
+            frames = self.frame_dict()
+            other_frames = other.frame_dict()
+            for frame in frames:
+                if other_frames.get(frame, None) is None:
                     diffs.append("No saveframe with name '%s' in other entry." %
-                                 self.frame_dict()[frame].name)
+                                 frames[frame].name)
                 else:
-                    comp = self.frame_dict()[frame].compare(
-                        other.frame_dict()[frame])
+                    comp = frames[frame].compare(other_frames[frame])
                     if len(comp) > 0:
                         diffs.append("Saveframes do not match: '%s'." %
-                                     self.frame_dict()[frame].name)
+                                     frames[frame].name)
                         diffs.extend(comp)
 
         except AttributeError as err:
@@ -1989,6 +3578,9 @@ class Entry(object):
         False a dictionary representation of the entry that is
         serializeable is returned."""
 
+        if serialize:
+            return _to_json(self)
+
         frames = [x.get_json(serialize=False) for x in self.frame_list]
 
         # Store the "bmrb_id" as well to prevent old code from breaking
@@ -1998,10 +3590,7 @@ class Entry(object):
             "saveframes": frames
         }
 
-        if serialize:
-            return json.dumps(entry_dict, default=_json_serialize)
-        else:
-            return entry_dict
+        return entry_dict
 
     def get_loops_by_category(self, value):
         """Allows fetching loops by category."""
@@ -2009,20 +3598,21 @@ class Entry(object):
         value = _format_category(value).lower()
 
         results = []
-        for frame in self.frame_list:
-            for one_loop in frame.loops:
-                if one_loop.category.lower() == value:
-                    results.append(one_loop)
+        for frame in self._frames_in(value, 2):
+            results.extend(frame._loops_in(value))
         return results
 
     def get_saveframe_by_name(self, frame):
         """Allows fetching a saveframe by name."""
 
-        frames = self.frame_dict()
-        if frame in frames:
-            return frames[frame]
-        else:
+        # The saveframe might have been renamed without the entry knowing
+        frames = self.frame_list
+        position = self._get_index()[0].get(frame)
+        if position is None or frames[position].name != frame:
+            position = self._get_index(True)[0].get(frame)
+        if position is None:
             raise KeyError("No saveframe with name '%s'" % frame)
+        return frames[position]
 
     def get_saveframes_by_category(self, value):
         """Allows fetching saveframes by category."""
@@ -2035,6 +3625,8 @@ class Entry(object):
         ret_frames = []
 
         for frame in self.frame_list:
+            if frame._outlined_without(tag_name, value):
+                continue
             results = frame.get_tag(tag_name)
             if results != [] and results[0] == value:
                 ret_frames.append(frame)
@@ -2051,8 +3643,14 @@ class Entry(object):
             raise ValueError("You must provide the tag category to call this"
                              " method at the entry level.")
 
+        # Only the saveframes with tags or loops in the category can match
+        if ALLOW_V2_ENTRIES:
+            frames = self.frame_list
+        else:
+            frames = self._frames_in(_format_category(str(tag)).lower(), 1)
+
         results = []
-        for frame in self.frame_list:
+        for frame in frames:
             results.extend(frame.get_tag(tag, whole_tag=whole_tag))
 
         return results
@@ -2077,13 +3675,15 @@ class Entry(object):
         to the assigned ID."""
 
         # The saveframe/loop order
-        ordering = _get_schema(schema).category_order
+        my_schema = _get_schema(schema)
+        ordering = my_schema.category_order
         # Use these to sort saveframes and loops
         def sf_key(x):
             """ Helper function to sort the saveframes."""
 
             try:
-                return (ordering.index(x.tag_prefix), x.get_tag("ID"))
+                return (my_schema._position(x.tag_prefix, True),
+                        x.get_tag("ID"))
             except ValueError:
                 # Generate an arbitrary sort order for saveframes that aren't
                 #  in the schema but make sure that they always come after
@@ -2094,7 +3694,7 @@ class Entry(object):
             """ Helper function to sort the loops."""
 
             try:
-                return ordering.index(x.category)
+                return my_schema._position(x.category, True)
             except ValueError:
                 # Generate an arbitrary sort order for loops that aren't in the
                 #  schema but make sure that they always come after loops in the
@@ -2114,7 +3714,9 @@ class Entry(object):
                 except ValueError:
                     pass
             each_frame.loops.sort(key=loop_key)
+            each_frame._version += 1
         self.frame_list.sort(key=sf_key)
+        self._version += 1
 
     def nef_string(self):
         """ Returns a string representation of the entry in NEF. """
@@ -2165,6 +3767,7 @@ class Entry(object):
         # Update the saveframe
         change_frame['Sf_framecode'] = new_name
         change_frame.name = new_name
+        change_frame._version += 1
 
         # What the new references should look like
         old_reference = "$" + original_name
@@ -2258,12 +3861,19 @@ class Entry(object):
 class Saveframe(object):
     """A saveframe. Use the classmethod from_scratch to create one."""
 
+    # Built by _get_index() when first needed
+    _index = None
+    # Bumped by the methods that change the tags, loops, name or tag
+    #  prefix
+    _version = 0
+
     def __delitem__(self, item):
         """Remove the indicated tag or loop."""
 
         # If they specify the specific loop to delete, go ahead and delete it
         if isinstance(item, Loop):
             del self.loops[self.loops.index(item)]
+            self._version += 1
             return
 
         # See if the result of get(item) is a loop. If so, delete it
@@ -2298,10 +3908,15 @@ class Saveframe(object):
             if results != []:
                 return results
             else:
-                try:
-                    return self.loop_dict()[item.lower()]
-                except KeyError:
+                loops = self._loops_in(item.lower())
+                if not loops:
                     raise KeyError("No tag or loop matching '%s'" % item)
+                return loops[-1]
+
+    def __getstate__(self):
+        """Leave the index out of copies and pickles."""
+
+        return _state_without_index(self)
 
     def __len__(self):
         """Return the number of loops in this saveframe."""
@@ -2452,11 +4067,18 @@ class Saveframe(object):
 
         # If they provided a string, try to load it using JSON
         if not isinstance(json_dict, dict):
-            try:
-                json_dict = json.loads(json_dict)
-            except (TypeError, ValueError):
-                raise ValueError("The JSON you provided was neither a Python "
-                                 "dictionary nor a JSON string.")
+            # The C extension builds it straight from the text
+            if cnmrstar is not None and isinstance(json_dict, str):
+                json_dict = cnmrstar.from_json(json_dict, Saveframe, Entry,
+                                               Saveframe, Loop)
+                if isinstance(json_dict, Saveframe):
+                    return json_dict
+            else:
+                try:
+                    json_dict = json.loads(json_dict)
+                except (TypeError, ValueError):
+                    raise ValueError("The JSON you provided was neither a "
+                                     "Python dictionary nor a JSON string.")
 
         # Make sure it has the correct keys
         for check in ["name", "tag_prefix", "tags", "loops"]:
@@ -2505,6 +4127,7 @@ class Saveframe(object):
 
         # It's a loop
         if isinstance(item, Loop):
+            self._version += 1
             try:
                 integer = int(str(key))
                 self.loops[integer] = item
@@ -2524,6 +4147,13 @@ class Saveframe(object):
     def __str__(self):
         """Returns the saveframe in STAR format as a string."""
 
+        return self._format()
+
+    def _format(self, write=None, binary=False):
+        """Returns the saveframe in STAR format, or if write is given
+        passes it to write() a piece at a time instead. binary says
+        whether write() takes bytes."""
+
         if ALLOW_V2_ENTRIES:
             if self.tag_prefix is None:
                 width = max([len(x[0]) for x in self.tags])
@@ -2537,7 +4167,11 @@ class Saveframe(object):
             try:
                 width = max([len(self.tag_prefix+"."+x[0]) for x in self.tags])
             except ValueError:
-                return "\nsave_%s\n\nsave_\n" % self.name
+                ret_string = "\nsave_%s\n\nsave_\n" % self.name
+                if write is None:
+                    return ret_string
+                write(ret_string.encode() if binary else ret_string)
+                return
 
         ret_string = ""
 
@@ -2548,6 +4182,15 @@ class Saveframe(object):
 
         # Print the saveframe
         ret_string += "save_%s\n" % self.name
+
+        # The C extension writes the tags and loops straight into one
+        #  string, or through a buffer to write()
+        if cnmrstar != None:
+            return cnmrstar.format_saveframe(self, ret_string, width, Loop,
+                                             STR_CONVERSION_DICT,
+                                             SKIP_EMPTY_LOOPS,
+                                             ALLOW_V2_ENTRIES, write, binary)
+
         pstring = "   %%-%ds  %%s\n" % width
         mstring = "   %%-%ds\n;\n%%s;\n" % width
 
@@ -2573,13 +4216,149 @@ class Saveframe(object):
 
         # Close the saveframe
         ret_string += "save_\n"
-        return ret_string
+        if write is None:
+            return ret_string
+        write(ret_string.encode() if binary else ret_string)
+
+    def write_to(self, the_file, compress=None):
+        """Writes the saveframe in STAR format to the_file. See
+        Entry.write_to() for the arguments."""
+
+        write, binary, finish = _open_output(the_file, compress)
+        try:
+            self._format(write, binary)
+        finally:
+            finish()
+
+    def write_json(self, the_file, compress=None):
+        """Writes the saveframe in JSON format to the_file. See
+        Entry.write_json() for the arguments."""
+
+        write, binary, finish = _open_output(the_file, compress)
+        try:
+            _to_json(self, write, binary)
+        finally:
+            finish()
+
+    def _get_index(self, check_tags=False, check_loops=False):
+        """ Returns dictionaries of the positions of the tags by lower case
+        name and of the loops by lower case category. If anything has
+        changed since they were last used, or if check_tags or
+        check_loops is set, the tag names or loop categories are compared
+        with the ones they were built from and rebuilt if a tag or loop
+        was added, removed, moved or renamed."""
+
+        index = self._index
+        if index is None:
+            index = self._index = [None, None, {}, None, {}]
+        elif index[0] != self._version:
+            check_tags = check_loops = True
+        elif not (check_tags or check_loops):
+            return index[2], index[4]
+
+        if check_tags or index[1] is None:
+            names = list(map(_TAG_NAME, self.tags))
+            if names != index[1]:
+                index[1], index[2] = names, {}
+                for position, name in enumerate(names):
+                    index[2].setdefault(name.lower(), []).append(position)
+        if check_loops or index[3] is None:
+            categories = list(map(_CATEGORY, self.loops))
+            if categories != index[3]:
+                index[3], index[4] = categories, {}
+                for position, category in enumerate(categories):
+                    if category is not None:
+                        index[4].setdefault(category.lower(),
+                                            []).append(position)
+        index[0] = self._version
+        return index[2], index[4]
+
+    def _tags_named(self, name, check=True):
+        """ Returns the tags with the lower case name. Tags can be renamed
+        by changing their lists in place, which the index can't see, so
+        it is checked again if the tags it has were renamed, or if it has
+        none and check is set."""
+
+        tags = self.tags
+        positions = self._get_index()[0].get(name)
+        if positions is None:
+            if not check:
+                return []
+            positions = self._get_index(check_tags=True)[0].get(name, [])
+        try:
+            found = [tags[x] for x in positions]
+            for tag in found:
+                if tag[0].lower() != name:
+                    raise IndexError
+        except IndexError:
+            found = [tags[x] for x in
+                     self._get_index(check_tags=True)[0].get(name, [])]
+        return found
+
+    def _loops_in(self, category):
+        """ Returns the loops in the lower case category. Loops can be
+        added, replaced or recategorized by changing the loop list or the
+        loops in place, which the index can't see, so the categories it
+        was built from are compared with the loops first."""
+
+        loops = self.loops
+        positions = self._get_index()[1]
+        if self._index[3] != list(map(_CATEGORY, loops)):
+            positions = self._get_index(check_loops=True)[1]
+        return [loops[x] for x in positions.get(category, [])]
+
+    def _set_outline(self, lazy, position, tag_prefix, category_tags,
+                     loop_categories):
+        """ Called by the C parser when the entry is loaded lazily, in
+        place of adding the tags and loops. This makes the saveframe an
+        _OutlinedSaveframe until they are first used. lazy is the
+        tokenizer the saveframe is parsed from along with the options and
+        module settings to parse it with, and position is where its tokens
+        start."""
+
+        self._version += 1
+        del self.tags, self.loops
+        self.tag_prefix = tag_prefix
+        if category_tags:
+            self.category = category_tags[0]
+        self._lazy = (lazy, position, tuple(loop_categories), category_tags)
+        self.__class__ = _OutlinedSaveframe
+
+    def _outlined_without(self, tag_name, value):
+        """ Returns True if the saveframe hasn't been parsed yet and its
+        outline shows that the first value get_tag() returns for the tag
+        can't be value."""
+
+        return False
+
+    def _append(self, tag=None, loop=None):
+        """ Appends a tag or loop. If the index was up to date it is
+        updated to match rather than being rebuilt next time."""
+
+        index = self._index
+        current = index is not None and index[0] == self._version
+        self._version += 1
+
+        if tag is not None:
+            self.tags.append(tag)
+            if current:
+                index[1].append(tag[0])
+                index[2].setdefault(tag[0].lower(),
+                                    []).append(len(self.tags) - 1)
+        if loop is not None:
+            self.loops.append(loop)
+            if current:
+                index[3].append(loop.category)
+                if loop.category is not None:
+                    index[4].setdefault(loop.category.lower(),
+                                        []).append(len(self.loops) - 1)
+        if current:
+            index[0] = self._version
 
     def add_loop(self, loop_to_add):
         """Add a loop to the saveframe loops."""
 
-        if (loop_to_add.category in self.loop_dict() or
-                str(loop_to_add.category).lower() in self.loop_dict()):
+        if self._loops_in(str(loop_to_add.category).lower()):
             if loop_to_add.category is None:
                 raise ValueError("You cannot have two loops with the same "
                                  "category in one saveframe. You are getting "
@@ -2590,13 +4369,25 @@ class Saveframe(object):
                                  "category in one saveframe. Category: '%s'." %
                                  loop_to_add.category)
 
-        self.loops.append(loop_to_add)
+        self._append(loop=loop_to_add)
 
     def add_tag(self, name, value, linenum=None, update=False):
         """Add a tag to the tag list. Does a bit of validation and
         parsing. Set update to true to update a tag if it exists rather
         than raise an exception."""
 
+        self._add_tag(name, value, linenum, CONVERT_DATATYPES, update, True)
+
+    def _add_tag(self, name, value, linenum, convert, update=False,
+                 check=False):
+        """ Does the work of add_tag(), converting the datatype if convert
+        is set. Called by the C parser with the CONVERT_DATATYPES it was
+        given, which is None for the current one. The parser's saveframes
+        are new, so unless check is set the index isn't checked for tags
+        renamed in place when looking for duplicates."""
+
+        if convert is None:
+            convert = CONVERT_DATATYPES
         if "." in name:
             if name[0] != ".":
                 prefix = _format_category(name)
@@ -2612,12 +4403,12 @@ class Saveframe(object):
                 name = name[1:]
 
         # No duplicate tags
-        if self.get_tag(name) != []:
+        if self._get_tag(name, False, check) != []:
             if not update:
                 raise ValueError("There is already a tag with the name '%s'." %
                                  name)
             else:
-                self.get_tag(name, whole_tag=True)[0][1] = value
+                self._get_tag(name, True, check)[0][1] = value
                 return
 
         if "." in name:
@@ -2626,7 +4417,7 @@ class Saveframe(object):
             raise ValueError("Tag names can not contain spaces.")
 
         # See if we need to convert the datatype
-        if CONVERT_DATATYPES:
+        if convert:
             new_tag = [name, _get_schema().convert_tag(
                 self.tag_prefix + "." + name, value, linenum=linenum)]
         else:
@@ -2644,7 +4435,7 @@ class Saveframe(object):
         if VERBOSE:
             print("Adding tag: '%s' with value '%s'" % (name, value))
 
-        self.tags.append(new_tag)
+        self._append(tag=new_tag)
 
     def add_tags(self, tag_list, update=False):
         """Adds multiple tags to the list. Input should be a list of
@@ -2678,10 +4469,6 @@ class Saveframe(object):
             else:
                 return ['String was not exactly equal to saveframe.']
 
-        # We need to do this in case of an extra "\n" on the end of one tag
-        if str(other) == str(self):
-            return []
-
         # Do STAR comparison
         try:
             if str(self.name) != str(other.name):
@@ -2744,6 +4531,10 @@ class Saveframe(object):
         except AttributeError as err:
             diffs.append("\tAn exception occured while comparing: '%s'." % err)
 
+        # We need to do this in case of an extra "\n" on the end of one tag
+        if diffs and str(other) == str(self):
+            return []
+
         return diffs
 
     def delete_tag(self, tag):
@@ -2754,6 +4545,7 @@ class Saveframe(object):
         for position, each_tag in enumerate(self.tags):
             # If the tag is a match, remove it
             if each_tag[0].lower() == tag:
+                self._version += 1
                 return self.tags.pop(position)
 
         raise KeyError("There is no tag with name '%s' to remove." % tag)
@@ -2787,6 +4579,9 @@ class Saveframe(object):
         False a dictionary representation of the saveframe that is
         serializeable is returned."""
 
+        if serialize:
+            return _to_json(self)
+
         saveframe_data = {
             "name": self.name,
             "category": self.category,
@@ -2795,18 +4590,15 @@ class Saveframe(object):
             "loops": [x.get_json(serialize=False) for x in self.loops]
         }
 
-        if serialize:
-            return json.dumps(saveframe_data, default=_json_serialize)
-        else:
-            return saveframe_data
+        return saveframe_data
 
     def get_loop_by_category(self, name):
         """Return a loop based on the loop name (category)."""
 
         name = _format_category(name).lower()
-        for each_loop in self.loops:
-            if str(each_loop.category).lower() == name:
-                return each_loop
+        loops = self._loops_in(name)
+        if loops:
+            return loops[0]
         raise KeyError("No loop with category '%s'." % name)
 
     def get_tag(self, query, whole_tag=False):
@@ -2814,6 +4606,12 @@ class Saveframe(object):
         whole_tag=True and the [tag_name, tag_value] pair will be
         returned."""
 
+        return self._get_tag(query, whole_tag, True)
+
+    def _get_tag(self, query, whole_tag, check):
+        """ Does the work of get_tag(). The index is only checked for tags
+        renamed in place if check is set."""
+
         results = []
 
         # Make sure this is the correct saveframe if they specify a tag
@@ -2824,23 +4622,25 @@ class Saveframe(object):
             tag_prefix = self.tag_prefix
 
         # Check the loops
-        for each_loop in self.loops:
-            if ((each_loop.category is not None and tag_prefix is not None and
-                 each_loop.category.lower() == tag_prefix.lower()) or
-                    ALLOW_V2_ENTRIES):
-                results.extend(each_loop.get_tag(query, whole_tag=whole_tag))
+        if ALLOW_V2_ENTRIES:
+            matching_loops = self.loops
+        elif tag_prefix is not None:
+            matching_loops = self._loops_in(tag_prefix.lower())
+        else:
+            matching_loops = []
+        for each_loop in matching_loops:
+            results.extend(each_loop.get_tag(query, whole_tag=whole_tag))
 
         # Check our tags
         query = _format_tag(query).lower()
         if (ALLOW_V2_ENTRIES or
-                (tag_prefix is not None and
+                (tag_prefix is not None and self.tag_prefix is not None and
                  tag_prefix.lower() == self.tag_prefix.lower())):
-            for tag in self.tags:
-                if query == tag[0].lower():
-                    if whole_tag:
-                        results.append(tag)
-                    else:
-                        results.append(tag[1])
+            for tag in self._tags_named(query, check):
+                if whole_tag:
+                    results.append(tag)
+                else:
+                    results.append(tag[1])
 
         return results
 
@@ -2862,6 +4662,7 @@ class Saveframe(object):
         """Set the tag prefix for this saveframe."""
 
         self.tag_prefix = _format_category(tag_prefix)
+        self._version += 1
 
     def sort_tags(self, schema=None):
         """ Sort the tags so they are in the same order as a BMRB
@@ -2871,6 +4672,7 @@ class Saveframe(object):
         mod_key = lambda x: _tag_key(self.tag_prefix + "." + x[0],
                                      schema=schema)
         self.tags.sort(key=mod_key)
+        self._version += 1
 
     def tag_iterator(self):
         """Returns an iterator for saveframe tags."""
@@ -2926,9 +4728,483 @@ class Saveframe(object):
 
         return errors
 
+class _OutlinedSaveframe(Saveframe):
+    """ A saveframe that was loaded lazily and hasn't been parsed yet. It
+    only has the tag prefix, the values of the tags that set its category
+    and the categories of its loops. The tags and loops are parsed the
+    first time they are used, which makes it a plain Saveframe. (This is
+    a separate class so that Saveframe doesn't need a __getattr__(),
+    which would slow down the lookup of every attribute.)"""
+
+    def __getattr__(self, name):
+        """Parses the tags and loops when they are first used."""
+
+        if name in ("tags", "loops"):
+            self._parse_outlined()
+            return getattr(self, name)
+        raise AttributeError("'Saveframe' object has no attribute '%s'" %
+                             name)
+
+    def __reduce_ex__(self, protocol):
+        """Parses the saveframe before it is copied or pickled."""
+
+        self._parse_outlined()
+        return self.__reduce_ex__(protocol)
+
+    def __setattr__(self, name, value):
+        """Parses the saveframe before its tags or loops are replaced so
+        that the outlined ones aren't parsed into it afterwards."""
+
+        if name in ("tags", "loops"):
+            self._parse_outlined()
+        object.__setattr__(self, name, value)
+
+    def _parse_outlined(self):
+        """ Parses the tags and loops, with the settings that were in
+        effect when the entry was loaded. If that fails the saveframe is
+        left outlined so that the error is raised again the next time it
+        is used."""
+
+        lazy = self.__dict__.pop("_lazy")
+        (tokenizer, options, settings), category = lazy[0], self.category
+
+        self.__class__ = Saveframe
+        self.tags, self.loops, self.category = [], [], "unset"
+        try:
+            tokenizer.parse_saveframe(self, lazy[1], Loop,
+                                      columnar=settings[0],
+                                      convert=settings[1], **options)
+        except:
+            self._version += 1
+            del self.tags, self.loops
+            self.category, self._index, self._lazy = category, None, lazy
+            self.__class__ = _OutlinedSaveframe
+            raise
+
+    def _outlined_without(self, tag_name, value):
+        """ Only the tags that set the category are outlined, so this is
+        only ever True for Sf_category."""
+
+        # Converted values might not match the ones in the outline
+        if (ALLOW_V2_ENTRIES or self._lazy[0][2][1] or
+                self.tag_prefix is None or
+                str(tag_name).lower() != "sf_category"):
+            return False
+
+        # A loop in the saveframe's own category could have the tag too
+        for category in self._lazy[2]:
+            if str(category).lower() == self.tag_prefix.lower():
+                return False
+        return value not in self._lazy[3]
+
+class _Column(object):
+    """One column of a ColumnarData. While every value is an int (or one
+    of the nulls None, "." and "?") the values are kept in an array of
+    machine integers, with a byte in nulls for each row that is nonzero
+    if the row holds a null instead. Otherwise each distinct value is
+    kept once in dictionary and codes has the position in dictionary of
+    the value of each row."""
+
+    def __init__(self, values=()):
+        self.ints = array(_INT_TYPECODE)
+        self.nulls = bytearray()
+        self.codes = None
+        self.dictionary = None
+        self.lookup = None
+        self.extend(values)
+
+        # The lookup is only needed to add values, so don't keep it
+        #  around for columns that are read in and never changed
+        self.lookup = None
+
+    @classmethod
+    def _from_buffers(cls, values, dictionary, nulls):
+        """ Returns a column made from what ColumnarData.column_buffers()
+        returns, without copying them."""
+
+        column = cls.__new__(cls)
+        column.lookup = None
+        if dictionary is None:
+            column.ints, column.nulls = values, nulls
+            column.codes = column.dictionary = None
+        else:
+            column.ints = column.nulls = None
+            column.codes, column.dictionary = values, dictionary
+        return column
+
+    def __len__(self):
+        if self.codes is None:
+            return len(self.ints)
+        return len(self.codes)
+
+    def __getitem__(self, row):
+        if self.codes is None:
+            null = self.nulls[row]
+            if null:
+                return _NULLS[null - 1]
+            return self.ints[row]
+        return self.dictionary[self.codes[row]]
+
+    def __setitem__(self, row, value):
+        if self.codes is None:
+            try:
+                null = self._null_code(value)
+                self.ints[row] = 0 if null else value
+                self.nulls[row] = null
+                return
+            except (TypeError, OverflowError):
+                self._use_dictionary()
+        self.codes[row] = self._code(value)
+
+    def __delitem__(self, row):
+        if self.codes is None:
+            del self.ints[row]
+            del self.nulls[row]
+        else:
+            del self.codes[row]
+
+    @staticmethod
+    def _null_code(value):
+        """ Returns the code of the null or 0 for an int. Raises
+        TypeError for anything else."""
+
+        if type(value) is int:
+            return 0
+        null = _NULL_CODES.get(value)
+        if null is None:
+            raise TypeError("Not an integer.")
+        return null
+
+    @staticmethod
+    def _key(value):
+        """ Returns what to look the value up in the dictionary by. Equal
+        values of different types (or Decimals with different precisions)
+        must be kept apart."""
+
+        if type(value) is str:
+            return value
+        return type(value), repr(value)
+
+    def _code(self, value):
+        """ Returns the position of the value in the dictionary, adding
+        it if it isn't there yet."""
+
+        if self.lookup is None:
+            self.lookup = {}
+            for code, known in enumerate(self.dictionary):
+                self.lookup[self._key(known)] = code
+
+        key = self._key(value)
+        code = self.lookup.get(key)
+        if code is None:
+            code = self.lookup[key] = len(self.dictionary)
+            self.dictionary.append(value)
+        return code
+
+    def _use_dictionary(self):
+        """ Switches from an integer column to a dictionary encoded one."""
+
+        values = self.values()
+        self.ints = self.nulls = None
+        self.codes = array("i")
+        self.dictionary = []
+        self.lookup = {}
+        self.extend(values)
+
+    def append(self, value):
+        """ Adds a value to the end of the column."""
+
+        self.insert(len(self), value)
+
+    def extend(self, values):
+        """ Adds the values to the end of the column."""
+
+        values = iter(values)
+        if self.codes is None:
+            for value in values:
+                try:
+                    null = self._null_code(value)
+                    self.ints.append(0 if null else value)
+                    self.nulls.append(null)
+                except (TypeError, OverflowError):
+                    self._use_dictionary()
+                    self.codes.append(self._code(value))
+                    break
+        if self.codes is not None:
+            code = self._code
+            self.codes.extend(array("i", [code(x) for x in values]))
+
+    def insert(self, row, value):
+        """ Inserts a value before the row."""
+
+        if self.codes is None:
+            try:
+                null = self._null_code(value)
+                self.ints.insert(row, 0 if null else value)
+                self.nulls.insert(row, null)
+                return
+            except (TypeError, OverflowError):
+                self._use_dictionary()
+        self.codes.insert(row, self._code(value))
+
+    def take(self, rows):
+        """ Returns a new column with the values of the rows, in the order
+        given. The dictionary is shared rather than rebuilt."""
+
+        if self.codes is None:
+            ints, nulls = self.ints, self.nulls
+            return _Column._from_buffers(
+                array(_INT_TYPECODE, [ints[x] for x in rows]), None,
+                bytearray([nulls[x] for x in rows]))
+        codes = self.codes
+        return _Column._from_buffers(array("i", [codes[x] for x in rows]),
+                                     self.dictionary, None)
+
+    def rows_with(self, value, rows):
+        """ Returns those of the rows (positions) that hold value. Each
+        distinct value is compared only once."""
+
+        if self.codes is None:
+            values = self.values()
+            return [x for x in rows if values[x] == value]
+        wanted = set(code for code, known in enumerate(self.dictionary) if
+                     known == value)
+        if not wanted:
+            return []
+        codes = self.codes
+        return [x for x in rows if codes[x] in wanted]
+
+    def values(self):
+        """ Returns a list of the values in the column."""
+
+        if self.codes is None:
+            return [_NULLS[null - 1] if null else value for value, null in
+                    zip(self.ints, self.nulls)]
+        dictionary = self.dictionary
+        return [dictionary[x] for x in self.codes]
+
+class _ColumnarRow(list):
+    """A row of a ColumnarData. It is a list of the values the row had
+    when it was fetched, and values set in it are set in the data too.
+    It refers to the row by position, so don't hold on to it while
+    inserting or deleting rows."""
+
+    __slots__ = ("_data", "_row")
+
+    def __init__(self, data, row, values):
+        list.__init__(self, values)
+        self._data = data
+        self._row = row
+
+    def __setitem__(self, column, value):
+        list.__setitem__(self, column, value)
+        if isinstance(column, slice):
+            self._data[self._row] = self
+        else:
+            self._data._columns[column][self._row] = value
+            self._data._hashes = None
+
+    def __reduce__(self):
+        return list, (list(self),)
+
+    def __copy__(self):
+        return list(self)
+
+    def __deepcopy__(self, memo):
+        return deepcopy(list(self), memo)
+
+class ColumnarData(object):
+    """The data of a loop kept one column at a time. Integer columns are
+    stored in arrays and other columns keep each distinct value only
+    once, which takes a fraction of the memory of a list of lists for
+    large loops. It acts like the list of rows that Loop.data usually
+    is. Setting a value in one of the rows it returns sets it in the
+    data: see _ColumnarRow.
+
+    Use Loop.set_columnar() or set COLUMNAR_LOOPS to use it. Get at the
+    columns directly with column() or column_buffers()."""
+
+    # The row hashes that Loop.compare() uses, kept until the data changes
+    _hashes = None
+
+    def __init__(self, width, rows=()):
+        """Stores the rows, each of which must have width values."""
+
+        if not isinstance(rows, (list, ColumnarData)):
+            rows = list(rows)
+        for row in rows:
+            if len(row) != width:
+                raise ValueError("The number of column tags must match "
+                                 "width of the data.")
+        self._columns = [_Column(row[pos] for row in rows) for
+                         pos in range(0, width)]
+        self._length = len(rows)
+        self._pending = []
+
+    @classmethod
+    def _from_columns(cls, columns, length):
+        """ Returns the data made up of the _Columns, which must each have
+        length values."""
+
+        data = cls.__new__(cls)
+        data._columns = columns
+        data._length = length
+        data._pending = []
+        return data
+
+    def __len__(self):
+        return self._length
+
+    def __iter__(self):
+        if not self._columns:
+            rows = ((),) * self._length
+        else:
+            rows = zip(*[column.values() for column in self._columns])
+        for pos, row in enumerate(rows):
+            yield _ColumnarRow(self, pos, row)
+
+    def _row_index(self, index):
+        """ Returns the position of the row, like a list would."""
+
+        if not hasattr(index, "__index__"):
+            raise TypeError("Row indices must be integers, not %s." %
+                            type(index).__name__)
+        index = index.__index__()
+        if index < 0:
+            index += self._length
+        if index < 0 or index >= self._length:
+            raise IndexError("Row index out of range.")
+        return index
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return [self[x] for x in range(*index.indices(self._length))]
+        index = self._row_index(index)
+        return _ColumnarRow(self, index,
+                            [column[index] for column in self._columns])
+
+    def __setitem__(self, index, row):
+        index = self._row_index(index)
+        self._check_width(row)
+        self._hashes = None
+        for column, value in zip(self._columns, row):
+            column[index] = value
+
+    def __delitem__(self, index):
+        self._hashes = None
+        if isinstance(index, slice):
+            removed = len(range(*index.indices(self._length)))
+        else:
+            index = self._row_index(index)
+            removed = 1
+        for column in self._columns:
+            del column[index]
+        self._length -= removed
+
+    def __eq__(self, other):
+        try:
+            if len(self) != len(other):
+                return False
+        except TypeError:
+            return False
+        return all(x == y for x, y in zip(self, other))
+
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+    __hash__ = None
+
+    def __repr__(self):
+        return repr(self.to_list())
+
+    def _check_width(self, row):
+        if len(row) != len(self._columns):
+            raise ValueError("The list must have the same number of "
+                             "elements as the number of columns!")
+
+    def append(self, row):
+        """Adds a row to the end."""
+
+        self.insert(self._length, row)
+
+    def extend(self, rows):
+        """Adds the rows to the end."""
+
+        for row in rows:
+            self.append(row)
+
+    def insert(self, index, row):
+        """Inserts a row before index."""
+
+        self._check_width(row)
+        self._hashes = None
+        index = max(0, min(self._length, index + self._length
+                           if index < 0 else index))
+        for column, value in zip(self._columns, row):
+            column.insert(index, value)
+        self._length += 1
+
+    def pop(self, index=-1):
+        """Removes the row and returns it as a list."""
+
+        row = list(self[index])
+        del self[index]
+        return row
+
+    def add_value(self, column, value):
+        """Adds one value at a time to a new row at the end. The row is
+        added once it has a value for every column."""
+
+        if len(self._pending) != column:
+            raise ValueError("You cannot add data out of column order.")
+        self._pending.append(value)
+        if len(self._pending) == len(self._columns):
+            self.append(self._pending)
+            self._pending = []
+
+    def column(self, column):
+        """Returns a list of the values in the column at position
+        column."""
+
+        return self._columns[column].values()
+
+    def column_buffers(self, column):
+        """Returns (values, dictionary, nulls) for the column at position
+        column, for use with memoryview() or numpy.frombuffer(). For a
+        column of integers values is an array of 64 bit integers,
+        dictionary is None, and nulls is a bytearray with 1, 2 or 3 for
+        the rows that are None, "." or "?". For other columns values is
+        an array of 32 bit positions in the dictionary list of distinct
+        values, and nulls is None. Loop.compare() remembers hashes of the
+        rows until they are changed through this class, so don't change
+        the buffers themselves."""
+
+        stored = self._columns[column]
+        if stored.codes is None:
+            return stored.ints, None, stored.nulls
+        return stored.codes, stored.dictionary, None
+
+    def _take(self, rows):
+        """ Returns new data with the rows at the positions given, in that
+        order."""
+
+        return ColumnarData._from_columns(
+            [column.take(rows) for column in self._columns], len(rows))
+
+    def to_list(self):
+        """Returns the data as a list of lists."""
+
+        return _rows_from_columns([self.column_buffers(x) for x in
+                                   range(0, len(self._columns))], self._length)
+
 class Loop(object):
     """A BMRB loop object."""
 
+    # Built by _get_index() when first needed
+    _index = None
+    # Bumped by the methods that change the columns
+    _version = 0
+
     def __eq__(self, other):
         """Returns True if this loop is equal to another loop, False if
         it is different."""
@@ -2950,6 +5226,11 @@ class Loop(object):
                 item = list(item)
             return self.get_tag(tags=item)
 
+    def __getstate__(self):
+        """Leave the index out of copies and pickles."""
+
+        return _state_without_index(self)
+
     def __init__(self, **kargs):
         """Use the classmethods to initialize."""
 
@@ -3093,6 +5374,11 @@ class Loop(object):
     def __str__(self):
         """Returns the loop in STAR format as a string."""
 
+        # The C extension does everything below in one pass
+        if cnmrstar != None:
+            return cnmrstar.format_loop(self, STR_CONVERSION_DICT,
+                                        SKIP_EMPTY_LOOPS, ALLOW_V2_ENTRIES)
+
         # Check if there is any data in this loop
         if len(self.data) == 0:
             # They do not want us to print empty loops
@@ -3147,7 +5433,7 @@ class Loop(object):
             working_data = []
             # Put quotes as needed on the data
             for datum in self.data:
-                working_data.append([clean_value(x) for x in datum])
+                working_data.append(clean_values(datum))
 
             # The nightmare below creates a list of the maximum length of
             #  elements in each column in the self.data matrix. Don't try to
@@ -3192,11 +5478,18 @@ class Loop(object):
 
         # If they provided a string, try to load it using JSON
         if not isinstance(json_dict, dict):
-            try:
-                json_dict = json.loads(json_dict)
-            except (TypeError, ValueError):
-                raise ValueError("The JSON you provided was neither a Python "
-                                 "dictionary nor a JSON string.")
+            # The C extension builds it straight from the text
+            if cnmrstar is not None and isinstance(json_dict, str):
+                json_dict = cnmrstar.from_json(json_dict, Loop, Entry,
+                                               Saveframe, Loop)
+                if isinstance(json_dict, Loop):
+                    return json_dict
+            else:
+                try:
+                    json_dict = json.loads(json_dict)
+                except (TypeError, ValueError):
+                    raise ValueError("The JSON you provided was neither a "
+                                     "Python dictionary nor a JSON string.")
 
         # Make sure it has the correct keys
         for check in ['tags', 'category', 'data']:
@@ -3242,16 +5535,58 @@ class Loop(object):
         return cls(tag_prefix=tag_prefix, all_tags=all_tags,
                    schema=schema, source="from_template()")
 
+    def _get_index(self, check=False):
+        """ Returns a dictionary of the lower case column names to their
+        positions. If the columns were changed since it was last used, or
+        if check is set, it is checked against them and rebuilt if they
+        are different."""
+
+        index = self._index
+        if index is not None and index[0] == self._version and not check:
+            return index[2]
+
+        if index is None or index[1] != self.columns:
+            positions = {}
+            for pos, column in enumerate(self.columns):
+                positions.setdefault(column.lower(), pos)
+            index = self._index = [None, list(self.columns), positions]
+        index[0] = self._version
+        return index[2]
+
+    def _append_column(self, name):
+        """ Appends a column, updating the index to match if it was up to
+        date (see Saveframe._append())."""
+
+        index = self._index
+        current = index is not None and index[0] == self._version
+        self._version += 1
+
+        self.columns.append(name)
+        if current:
+            index[0] = self._version
+            index[1].append(name)
+            index[2].setdefault(name.lower(), len(self.columns) - 1)
+
     def _tag_index(self, tag_name):
         """ Helper method to do a case-insensitive check for the presence
         of a given tag in this loop. Returns the index of the tag if found
         and None if not found."""
 
+        return self._column_position(_format_tag(str(tag_name)).lower())
+
+    def _column_position(self, name):
+        """ Returns the position of the column with the lower case name, or
+        None. The columns can be changed without the loop knowing, so the
+        index is checked again if the column isn't where it says or it
+        doesn't have one with the name."""
+
+        position = self._get_index().get(name)
         try:
-            lc_col = [x.lower() for x in self.columns]
-            return lc_col.index(_format_tag(str(tag_name)).lower())
-        except ValueError:
-            return None
+            if position is not None and self.columns[position].lower() == name:
+                return position
+        except IndexError:
+            pass
+        return self._get_index(True).get(name)
 
     def add_column(self, name, ignore_duplicates=False):
         """Add a column to the column list. Does a bit of validation
@@ -3298,7 +5633,11 @@ class Loop(object):
             raise ValueError("There cannot be more than one '.' in a tag name.")
         if " " in name:
             raise ValueError("Column names can not contain spaces.")
-        self.columns.append(name)
+        self._append_column(name)
+
+        # Columnar data has a fixed number of columns
+        if isinstance(self.data, ColumnarData) and len(self.data) == 0:
+            self.data = ColumnarData(len(self.columns))
 
     def add_data(self, the_list, rearrange=False):
         """Add a list to the data field. Items in list can be any type,
@@ -3326,18 +5665,90 @@ class Loop(object):
                              self.category +
                              " does not match the number of columns!")
 
+        self._set_data(processed_data)
+
+    def _set_data(self, rows, converted=False, columnar=None, convert=None):
+        """ Replaces the data with the provided rows, which must already
+        be the width of the loop. Converts the datatypes if convert is
+        set unless the C parser already did, and makes the data columnar
+        if columnar is set. Either one that is None means the current
+        CONVERT_DATATYPES or COLUMNAR_LOOPS."""
+
         # Auto convert datatypes if option set
-        if CONVERT_DATATYPES:
-            tschem = _get_schema()
-            for row in processed_data:
-                for column, datum in enumerate(row):
-                    row[column] = tschem.convert_tag(self.category + "." +
-                                                     self.columns[column],
-                                                     datum,
-                                                     linenum="Loop %s" %
-                                                     self.category)
-
-        self.data = processed_data
+        conversions = None if converted else self._get_conversions(convert)
+        if conversions is not None:
+            kinds, convert = conversions
+            casts = {_CONVERT_INTEGER: int, _CONVERT_FLOAT: decimal.Decimal,
+                     _CONVERT_DATE: _parse_date}
+            linenum = "Loop %s" % self.category
+
+            # Work out what to do with each column once
+            columns = []
+            for column, kind in enumerate(kinds):
+                if kind != _CONVERT_NONE:
+                    plain = kind & ~_CONVERT_NULL_ERROR
+                    columns.append((column, plain, kind & _CONVERT_NULL_ERROR,
+                                    casts.get(plain)))
+
+            for row in rows:
+                for column, kind, null_error, cast in columns:
+                    value = row[column]
+                    if kind == _CONVERT_CALL:
+                        row[column] = convert(column, value, linenum)
+                    elif value == "." or value == "?":
+                        if null_error:
+                            convert(column, value, linenum)
+                        row[column] = None
+                    elif cast is not None:
+                        # convert_tag() raises the error if this fails
+                        try:
+                            row[column] = cast(value)
+                        except Exception:
+                            row[column] = convert(column, value, linenum)
+
+        if columnar is None:
+            columnar = COLUMNAR_LOOPS
+        if columnar:
+            rows = ColumnarData(len(self.columns), rows)
+        self.data = rows
+
+    def _get_conversions(self, convert=None):
+        """ Returns None if convert isn't set, or CONVERT_DATATYPES when
+        it is None. Otherwise returns how to convert the values of each
+        column, as a list of the _CONVERT_ constants, and the function to
+        call as convert(column, value, line number) to convert a value
+        the slow way and raise any errors."""
+
+        if convert is None:
+            convert = CONVERT_DATATYPES
+        if not convert:
+            return None
+
+        schema = _get_schema()
+        tags = [self.category + "." + x for x in self.columns]
+
+        def convert(column, value, linenum):
+            """ Converts the value the way the schema says to."""
+            return schema.convert_tag(tags[column], value, linenum=linenum)
+
+        return [schema.get_conversion(x) for x in tags], convert
+
+    def _replace_rows(self, rows):
+        """ Replaces the data with the provided rows, keeping it columnar
+        if it was."""
+
+        if isinstance(self.data, ColumnarData):
+            rows = ColumnarData(len(self.columns), rows)
+        self.data = rows
+
+    def _take_rows(self, positions):
+        """ Returns new data with the rows at the positions given, in that
+        order, keeping it columnar if it was."""
+
+        data = self.data
+        if isinstance(data, ColumnarData):
+            return data._take(positions)
+        return [data[x] for x in positions]
 
     def add_data_by_column(self, column_id, value):
         """Add data to the loop one element at a time, based on column.
@@ -3356,6 +5767,9 @@ class Loop(object):
             raise ValueError("The column tag '%s' to which you are attempting "
                              "to add data does not yet exist. Create the "
                              "columns before adding data." % column_id)
+        if isinstance(self.data, ColumnarData):
+            self.data.add_value(pos, value)
+            return
         if len(self.data) == 0:
             self.data.append([])
         if len(self.data[-1]) == len(self.columns):
@@ -3368,12 +5782,14 @@ class Loop(object):
         """Erases all data in this loop. Does not erase the data columns
         or loop category."""
 
-        self.data = []
+        self._replace_rows([])
 
     def compare(self, other):
         """Returns the differences between two loops as a list. Order of
         loops being compared does not make a difference on the specific
-        errors detected."""
+        errors detected. The order of the rows doesn't matter either, and
+        the rows that one loop has and the other doesn't are listed by
+        their row numbers (starting from 1)."""
 
         diffs = []
 
@@ -3387,10 +5803,6 @@ class Loop(object):
             else:
                 return ['String was not exactly equal to loop.']
 
-        # We need to do this in case of an extra "\n" on the end of one tag
-        if str(other) == str(self):
-            return []
-
         # Do STAR comparison
         try:
             # Check category of loops
@@ -3406,16 +5818,46 @@ class Loop(object):
 
             # No point checking if data is the same if the columns aren't
             else:
-                # Only sort the data if it is not already equal
-                if self.data != other.data:
-
-                    # Check data of loops
-                    self_data = sorted(deepcopy(self.data))
-                    other_data = sorted(deepcopy(other.data))
-
-                    if self_data != other_data:
-                        diffs.append("\t\tLoop data does not match for loop "
-                                     "with category '%s'." % self.category)
+                # Compare hashes of the rows rather than sorted copies, and
+                #  then the rows the hashes matched up
+                self_data, other_data = self.data, other.data
+                if isinstance(self_data, ColumnarData):
+                    self_data = self_data.to_list()
+                if isinstance(other_data, ColumnarData):
+                    other_data = other_data.to_list()
+                self_hashes = self._row_hashes()
+                other_hashes = other._row_hashes()
+                only_self, only_other = [], []
+                if self_hashes == other_hashes:
+                    same = _same_rows(self_data, other_data)
+                else:
+                    matched = []
+                    only_self = _unmatched_rows(self_hashes, other_hashes,
+                                                matched)
+                    only_other = _unmatched_rows(other_hashes, self_hashes)
+                    same = _same_rows([self_data[x[0]] for x in matched],
+                                      [other_data[x[1]] for x in matched])
+
+                # Different rows hashed the same, so match up the quoted
+                #  rows themselves
+                if not same:
+                    self_hashes = [tuple(clean_values(x)) for x in self_data]
+                    other_hashes = [tuple(clean_values(x))
+                                    for x in other_data]
+                    only_self = _unmatched_rows(self_hashes, other_hashes)
+                    only_other = _unmatched_rows(other_hashes, self_hashes)
+
+                if only_self or only_other:
+                    diffs.append("\t\tLoop data does not match for loop "
+                                 "with category '%s'." % self.category)
+                for pos in only_self:
+                    diffs.append("\t\tRow %d is not in the compared loop: "
+                                 "%s" % (pos + 1, " ".join(
+                                     clean_values(self_data[pos]))))
+                for pos in only_other:
+                    diffs.append("\t\tRow %d of the compared loop is not in "
+                                 "this loop: %s" % (pos + 1, " ".join(
+                                     clean_values(other_data[pos]))))
 
         except AttributeError as err:
             diffs.append("\t\tAn exception occured while comparing: '%s'." %
@@ -3423,6 +5865,20 @@ class Loop(object):
 
         return diffs
 
+    def _row_hashes(self):
+        """ Returns an array with a hash of each row. Those of ColumnarData
+        are kept until it changes. Plain rows can be changed in place
+        without the loop knowing, so they are hashed each time."""
+
+        data = self.data
+        if not isinstance(data, ColumnarData):
+            return _row_hashes(data)
+
+        key = (cnmrstar is not None, list(STR_CONVERSION_DICT.items()))
+        if data._hashes is None or data._hashes[0] != key:
+            data._hashes = (key, _row_hashes(data.to_list()))
+        return data._hashes[1]
+
     def delete_data_by_tag_value(self, tag, value, index_tag=None):
         """Deletes all rows which contain the provided value in the
         provided column. If index_tag is provided, that column is
@@ -3442,14 +5898,22 @@ class Loop(object):
                              tag)
 
         deleted = []
-
-        # Delete all rows in which the user-provided tag matched
-        cur_row = 0
-        while cur_row < len(self.data):
-            if self.data[cur_row][search_column] == value:
-                deleted.append(self.data.pop(cur_row))
-                continue
-            cur_row += 1
+        kept = []
+
+        # Delete all rows in which the user-provided tag matched, keeping
+        #  the others in one pass
+        data = self.data
+        columnar = isinstance(data, ColumnarData)
+        for pos, row in enumerate(data):
+            if row[search_column] == value:
+                deleted.append(list(row) if columnar else row)
+            else:
+                kept.append(pos)
+        if deleted:
+            if columnar:
+                self.data = self._take_rows(kept)
+            else:
+                data[:] = self._take_rows(kept)
 
         # Re-number if they so desire
         if index_tag is not None:
@@ -3482,9 +5946,15 @@ class Loop(object):
             valid_tags.append(tag)
             result.add_column(tag)
 
-        # Add the data for the tags to the new loop
-        for row in self.get_data_by_tag(valid_tags):
-            result.add_data(row)
+        # Copy the data for the tags to the new loop in one pass
+        positions = [self._tag_index(x) for x in valid_tags]
+        if isinstance(self.data, ColumnarData):
+            everything = range(0, len(self.data))
+            result.data = ColumnarData._from_columns(
+                [self.data._columns[x].take(everything) for x in positions],
+                len(self.data))
+        else:
+            result.data = [[row[x] for x in positions] for row in self.data]
 
         # Assign the category of the new loop
         if result.category is None:
@@ -3547,16 +6017,20 @@ class Loop(object):
         False a dictionary representation of the loop that is
         serializeable is returned."""
 
+        if serialize:
+            return _to_json(self)
+
+        data = self.data
+        if isinstance(data, ColumnarData):
+            data = data.to_list()
+
         loop_dict = {
             "category": self.category,
             "tags": self.columns,
-            "data": self.data
+            "data": data
         }
 
-        if serialize:
-            return json.dumps(loop_dict, default=_json_serialize)
-        else:
-            return loop_dict
+        return loop_dict
 
     def get_tag(self, tags=None, whole_tag=False):
         """Provided a tag name (or a list of tag names), or ordinals
@@ -3570,34 +6044,23 @@ class Loop(object):
         if not isinstance(tags, list):
             tags = [tags]
 
-        # Make a copy of the tags to fetch - don't modify the
-        # list that was passed
-        lower_tags = deepcopy(tags)
-
         # Strip the category if they provide it (also validate
         #  it during the process)
-        for pos, item in enumerate([str(x) for x in lower_tags]):
+        lower_tags = []
+        for item in [str(x) for x in tags]:
             if ("." in item and
                     _format_category(item).lower() != self.category.lower()):
                 raise ValueError("Cannot fetch data with column '%s' because "
                                  "the category does not match the category of "
                                  "this loop '%s'." % (item, self.category))
-            lower_tags[pos] = _format_tag(item).lower()
-
-        # Make a lower case copy of the columns
-        columns_lower = [x.lower() for x in self.columns]
-
-        # Map column name to column position in list
-        column_mapping = dict(zip(reversed(columns_lower),
-                                  reversed(range(len(columns_lower)))))
+            lower_tags.append(_format_tag(item).lower())
 
         # Make sure their fields are actually present in the entry
         column_ids = []
         for query in lower_tags:
-            if str(query) in column_mapping:
-                column_ids.append(column_mapping[query])
-            elif isinstance(query, int):
-                column_ids.append(query)
+            position = self._column_position(query)
+            if position is not None:
+                column_ids.append(position)
             else:
                 if ALLOW_V2_ENTRIES:
                     return []
@@ -3606,6 +6069,17 @@ class Loop(object):
                                      " or ID: '%s' in loop '%s'." %
                                      (query, str(self.category)))
 
+        # Columnar data can hand over whole columns at once
+        if isinstance(self.data, ColumnarData):
+            values = [self.data.column(x) for x in column_ids]
+            if whole_tag:
+                return [[self.category + "." + self.columns[col_id], value]
+                        for col_id, column in zip(column_ids, values)
+                        for value in column]
+            if len(lower_tags) == 1:
+                return values[0]
+            return [list(row) for row in zip(*values)]
+
         # Use a list comprehension to pull the correct tags out of the rows
         if whole_tag:
             return [[self.category + "." + self.columns[col_id], row[col_id]]
@@ -3691,6 +6165,17 @@ class Loop(object):
 
         self.category = _format_category(category)
 
+    def set_columnar(self, columnar=True):
+        """ Keep the data one column at a time in a ColumnarData, which
+        takes much less memory for large loops, or with columnar=False
+        go back to a list of lists. Loops that are read in start out
+        columnar if COLUMNAR_LOOPS is set."""
+
+        if columnar and not isinstance(self.data, ColumnarData):
+            self.data = ColumnarData(len(self.columns), self.data)
+        elif not columnar and isinstance(self.data, ColumnarData):
+            self.data = self.data.to_list()
+
     def sort_tags(self, schema=None):
         """ Rearranges the columns and data in the loop to match the order
         from the schema. Uses the BMRB schema unless one is provided."""
@@ -3705,8 +6190,9 @@ class Loop(object):
         if sorted_order == current_order:
             return
         else:
-            self.data = self.get_tag(sorted_order)
+            self._replace_rows(self.get_tag(sorted_order))
             self.columns = [_format_tag(x) for x in sorted_order]
+            self._version += 1
 
     def sort_rows(self, tags, key=None):
         """ Sort the data in the rows by their values for a given column
@@ -3761,23 +6247,16 @@ class Loop(object):
 
             sort_ordinals.append(renumber_column)
 
-        # Do the sort(s)
-        for column in sort_ordinals:
-            # Going through each column, first attempt to sort as integer.
-            #  Then fallback to string sort.
-            try:
-                if key is None:
-                    tmp_data = sorted(self.data,
-                                      key=lambda x, pos=column: float(x[pos]))
-                else:
-                    tmp_data = sorted(self.data, key=key)
-            except ValueError:
-                if key is None:
-                    tmp_data = sorted(self.data,
-                                      key=lambda x, pos=column: x[pos])
-                else:
-                    tmp_data = sorted(self.data, key=key)
-            self.data = tmp_data
+        if not sort_ordinals:
+            return
+        if key is not None:
+            self._replace_rows(sorted(self.data, key=key))
+            return
+
+        # Sort once by all of the columns, the last one first. Each column
+        #  is sorted numerically if it can be and as strings otherwise.
+        sort_ordinals.reverse()
+        self.data = self._take_rows(_sort_order(self.data, sort_ordinals))
 
     def validate(self, validate_schema=True, schema=None,
                  validate_star=True, category=None):
@@ -3797,14 +6276,35 @@ class Loop(object):
             # Get the default schema if we are not passed a schema
             my_schema = _get_schema(schema)
 
+            # Check a column at a time if the rows are all the right width.
+            #  The errors are put back in the order of the values.
+            num_cols = len(self.columns)
+            columnar = isinstance(self.data, ColumnarData)
+            if columnar or all(len(row) == num_cols for row in self.data):
+                found = []
+                for pos, column in enumerate(self.columns):
+                    check = my_schema._tag_check(self.category + "." + column,
+                                                 category)
+                    if columnar:
+                        values = self.data.column(pos)
+                    else:
+                        values = [row[pos] for row in self.data]
+                    linenum = lambda rownum, pos=pos: (
+                        str(rownum) + " column " + str(pos) + " of loop")
+                    found.extend((rownum, pos, error) for rownum, error in
+                                 check.check_column(values, linenum))
+                found.sort(key=lambda x: x[:2])
+                errors.extend(x[2] for x in found)
+
             # Check the data
-            for rownum, row in enumerate(self.data):
-                for pos, datum in enumerate(row):
-                    lineno = str(rownum) + " column " + str(pos) + " of loop"
-                    errors.extend(my_schema.val_type(self.category + "." +
-                                                     self.columns[pos], datum,
-                                                     category=category,
-                                                     linenum=lineno))
+            else:
+                for rownum, row in enumerate(self.data):
+                    for pos, datum in enumerate(row):
+                        lineno = str(rownum) + " column " + str(pos) + " of loop"
+                        errors.extend(my_schema.val_type(self.category + "." +
+                                                         self.columns[pos], datum,
+                                                         category=category,
+                                                         linenum=lineno))
 
         if validate_star:
             # Check for wrong data size
@@ -3818,6 +6318,273 @@ class Loop(object):
 
         return errors
 
+class Archive(object):
+    """A directory of entries, such as a copy of the BMRB archive, that
+    can be queried without parsing every entry each time. Each entry is
+    parsed once and a binary copy of it (see Entry.save_binary()) is
+    kept in the index directory, along with an index of where each loop
+    of each entry is in the copies. A query looks up the loops of the
+    category it is about in the index and only decodes those. refresh()
+    brings the index up to date, parsing only the files that were added
+    or changed since it was last run."""
+
+    def __init__(self, directory, index_directory=None, pattern="bmr*.str*",
+                 workers=None):
+        """Opens the archive of the entries in directory (and in the
+        directories in it) whose file names match pattern, and brings
+        its index up to date. The index is kept in index_directory,
+        which is the .bmrb_index directory of the archive unless one is
+        given. workers is passed to Entry.from_files() to parse the
+        files that aren't indexed yet."""
+
+        if not os.path.isdir(directory):
+            raise IOError("The archive directory '%s' does not exist." %
+                          directory)
+        self.directory = directory
+        if index_directory is None:
+            index_directory = os.path.join(directory, ".bmrb_index")
+        self.index_directory = index_directory
+        self.pattern = pattern
+
+        # The modification time and size of each file, and the entry ID
+        #  and loops (see _BinaryReader.loop_ranges()) of its entry or
+        #  the error parsing it, by its location in the archive
+        self._records = {}
+        self._settings = None
+        self._index = None
+        self._load_index()
+        self.refresh(workers)
+
+    def __repr__(self):
+        """Returns a description of the archive."""
+
+        return "<bmrb.Archive '%s'>" % self.directory
+
+    def _copy_name(self, name):
+        """ Returns where the binary copy of a file is kept."""
+
+        if PY3 or isinstance(name, unicode):
+            name = name.encode("utf-8")
+        return os.path.join(self.index_directory,
+                            hashlib.sha1(name).hexdigest() + ".bmrb")
+
+    def _load_index(self):
+        """ Reads the index that was saved last time, if there is one this
+        python can read."""
+
+        try:
+            with open(os.path.join(self.index_directory, "index"),
+                      "rb") as index_file:
+                data = index_file.read()
+        except (IOError, OSError):
+            return
+        if (len(data) < _ARCHIVE_HEADER.size or
+                data[:len(_ARCHIVE_MAGIC)] != _ARCHIVE_MAGIC):
+            return
+        header = _ARCHIVE_HEADER.unpack_from(data)
+        if header[1:4] != (_ARCHIVE_VERSION,
+                           sys.version_info[0] * 1000 + sys.version_info[1],
+                           marshal.version):
+            return
+        try:
+            self._records = marshal.loads(data[_ARCHIVE_HEADER.size:])
+        except (EOFError, TypeError, ValueError):
+            return
+        self._settings = header[4]
+
+    def _save_index(self):
+        """ Saves the index for next time."""
+
+        if not os.path.isdir(self.index_directory):
+            os.makedirs(self.index_directory)
+        header = _ARCHIVE_HEADER.pack(
+            _ARCHIVE_MAGIC, _ARCHIVE_VERSION,
+            sys.version_info[0] * 1000 + sys.version_info[1], marshal.version,
+            self._settings)
+        _write_atomically(os.path.join(self.index_directory, "index"),
+                          [header, marshal.dumps(self._records)])
+
+    def _store(self, name, stat, entry):
+        """ Saves the binary copy of an entry and indexes its loops."""
+
+        data = b"".join(_BinaryWriter.entry(entry, self._settings, stat))
+        if not os.path.isdir(self.index_directory):
+            os.makedirs(self.index_directory)
+        _write_atomically(self._copy_name(name), [data])
+        reader = _BinaryReader(memoryview(data) if PY3 else data)
+        self._records[name] = (stat[0], stat[1], entry.entry_id,
+                               reader.loop_ranges(), None)
+
+    def _get_index(self):
+        """ Returns the loops of each category (in lowercase) along with
+        the locations of their files, in order of location."""
+
+        if self._index is None:
+            index = {}
+            for name in sorted(self._records):
+                for loop in self._records[name][3] or ():
+                    index.setdefault(str(loop[3]).lower(), []).append(
+                        (name, loop))
+            self._index = index
+        return self._index
+
+    def _query(self, category, tags, where, workers):
+        """ Returns the entry ID and what _read_copy() returns for each
+        entry with loops of the category that have the tags (and the tags
+        in where), leaving out those that it returns nothing for."""
+
+        wanted = set(_format_tag(x).lower() for x in
+                     (tags or []) + [tag for tag, value in where])
+        plan = []
+        for name, loop in self._get_index().get(category.lower(), []):
+            if not wanted.issubset(str(x).lower() for x in loop[4]):
+                continue
+            if not plan or plan[-1][0] != name:
+                plan.append((name, []))
+            plan[-1][1].append(loop[:2])
+
+        tasks = [(self._copy_name(name), tuple(self._records[name][:2]),
+                  positions, tags, where) for name, positions in plan]
+        if workers is None or workers < 2 or len(tasks) < 2:
+            results = [_read_copy(x) for x in tasks]
+        else:
+            pool = Pool(min(workers, len(tasks)))
+            try:
+                results = pool.map(_read_copy, tasks,
+                                   max(1, len(tasks) // (workers * 4)))
+            finally:
+                pool.terminate()
+                pool.join()
+
+        return [(self._records[name][2], result) for (name, positions), result
+                in zip(plan, results) if result]
+
+    def get_errors(self):
+        """Returns a dictionary of the locations of the files that couldn't
+        be parsed and why. They are tried again once they change."""
+
+        return dict((os.path.join(self.directory, name), record[4]) for
+                    name, record in self._records.items() if
+                    record[4] is not None)
+
+    def get_files(self, name):
+        """Returns the locations of the files of the entries that have a
+        loop of the category name, or if name is a tag (with the
+        category), a loop with that tag. Only the index is used."""
+
+        name = str(name)
+        category = _format_category(name)
+        tag = _format_tag(name).lower() if "." in name else None
+
+        locations = []
+        for file_name, loop in self._get_index().get(category.lower(), []):
+            if tag is not None and tag not in [str(x).lower() for x in
+                                               loop[4]]:
+                continue
+            location = os.path.join(self.directory, file_name)
+            if not locations or locations[-1] != location:
+                locations.append(location)
+        return locations
+
+    def get_loops_by_category(self, category, workers=None):
+        """Returns the loops of the category in each entry that has any,
+        as a list of the entry ID and a list of its loops of the category,
+        in order of the location of the file. Only those loops are
+        decoded. Set workers to read the entries on that many processes
+        at once."""
+
+        return self._query(_format_category(str(category)), None, [],
+                           workers)
+
+    def get_tag(self, tags, where=None, workers=None):
+        """Returns the values of a tag (or list of tags in one category)
+        in each entry that has it, as a list of the entry ID and what
+        Loop.get_tag() returns for the rows of its loops of the category,
+        in order of the location of the file. The tags must include the
+        category. Set where to a dictionary of tags and values to only
+        include the rows with those values, such as {"Atom_ID": "CA"}.
+        Entries without any matching rows are left out. Only the loops of
+        the category that have all of the tags are decoded. Set workers to
+        read the entries on that many processes at once."""
+
+        if not isinstance(tags, list):
+            tags = [tags]
+        tags = [str(x) for x in tags]
+        where = [(str(tag), value) for tag, value in (where or {}).items()]
+        if not tags or "." not in tags[0]:
+            raise ValueError("The tags must include their category.")
+
+        category = _format_category(tags[0])
+        for tag in tags + [x[0] for x in where]:
+            if "." in tag and _format_category(tag).lower() != category.lower():
+                raise ValueError("The tags must all be in the same category "
+                                 "but '%s' isn't in '%s'." % (tag, category))
+        return self._query(category, tags, where, workers)
+
+    def refresh(self, workers=None):
+        """Brings the index up to date with the files in the archive. The
+        files that were added or changed since the index was last brought
+        up to date are parsed, and those that were removed are dropped
+        from it. The index is saved as it goes. Files that can't be parsed
+        are left out of queries: see get_errors(). workers is passed to
+        Entry.from_files(). Returns the locations of the files that were
+        parsed."""
+
+        # Copies made with other settings give different values
+        if self._settings != _parse_settings():
+            self._records, self._settings = {}, _parse_settings()
+
+        index_directory = os.path.abspath(self.index_directory)
+        stats = {}
+        for root, directories, files in os.walk(self.directory):
+            directories[:] = [x for x in directories if os.path.abspath(
+                os.path.join(root, x)) != index_directory]
+            for file_name in fnmatch.filter(files, self.pattern):
+                location = os.path.join(root, file_name)
+                try:
+                    stats[os.path.relpath(location, self.directory)] = \
+                        _file_stat(location)
+                except (IOError, OSError):
+                    pass
+
+        removed = [x for x in self._records if x not in stats]
+        for name in removed:
+            if self._records.pop(name)[3] is not None:
+                try:
+                    os.remove(self._copy_name(name))
+                except (IOError, OSError):
+                    pass
+        changed = sorted(x for x in stats if x not in self._records or
+                         tuple(self._records[x][:2]) != stats[x] or
+                         (self._records[x][3] is not None and
+                          not os.path.exists(self._copy_name(x))))
+        if removed or changed:
+            self._index = None
+
+        for start in range(0, len(changed), _ARCHIVE_BATCH):
+            batch = changed[start:start + _ARCHIVE_BATCH]
+            locations = [os.path.join(self.directory, x) for x in batch]
+            try:
+                entries = Entry.from_files(locations, workers)
+            except (IOError, OSError, ValueError):
+                # Find out which of them was the problem
+                entries = [None] * len(batch)
+
+            for name, location, entry in zip(batch, locations, entries):
+                stat = stats[name]
+                try:
+                    if entry is None:
+                        entry = Entry.from_file(location)
+                    self._store(name, stat, entry)
+                except (IOError, OSError, ValueError) as err:
+                    self._records[name] = (stat[0], stat[1], None, None,
+                                           str(err))
+            self._save_index()
+
+        if removed and not changed:
+            self._save_index()
+        return [os.path.join(self.directory, x) for x in changed]
+
 def called_directly():
     """ Figure out what to do if we were called on the command line
     rather than imported as a module."""
@@ -0,0 +1,62 @@
+#!/usr/bin/env python
+
+""" Measures how many bytes per second the C tokenizer can get through.
+Run with "make benchmark" after building the module. Pass a file name
+to benchmark a file other than the sample entry."""
+
+from __future__ import print_function
+
+import os
+import sys
+import time
+
+our_path = os.path.dirname(os.path.realpath(__file__))
+sys.path.insert(0, os.path.join(our_path, ".."))
+import cnmrstar
+
+def tokenize(data):
+    """ Tokenize the data and throw the tokens away. """
+
+    tokenizer = cnmrstar.Tokenizer()
+    tokenizer.load_string(data)
+    tokenizer.tokenize()
+    tokenizer.reset()
+
+def bytes_per_second(data, repeat=5, min_time=1):
+    """ Returns the best tokenizer throughput seen over the runs. """
+
+    best = None
+    for x in range(0, repeat):
+        runs = 0
+        start = time.time()
+        while time.time() - start < min_time / float(repeat):
+            tokenize(data)
+            runs += 1
+        elapsed = (time.time() - start) / runs
+        if best is None or elapsed < best:
+            best = elapsed
+    return len(data) / best
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        file_name = sys.argv[1]
+    else:
+        file_name = os.path.join(our_path, "..", "unit_tests", "sample_files",
+                                 "bmr15000_3.str")
+    star_data = open(file_name, "r").read()
+    print("Tokenizing %s (%d bytes)" % (os.path.basename(file_name),
+                                        len(star_data)))
+
+    # Compare the scanners this machine supports
+    if "scanner" in dir(cnmrstar):
+        available = cnmrstar.scanners()
+        original = cnmrstar.scanner()
+    else:
+        available = original = [None]
+    for scanner in available:
+        if scanner is not None:
+            cnmrstar.scanner(scanner)
+        rate = bytes_per_second(star_data)
+        print("%-8s %8.1f MB/s" % (scanner or "default", rate / 1000000.0))
+    if original != [None]:
+        cnmrstar.scanner(original)
@@ -1,21 +1,38 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
 
 // Version number. Only need to update when
 // API changes.
-#define module_version "2.2.7"
+#define module_version "2.4.9"
 
 // Use for returning errors
 #define err_size 500
 // Use as a special pointer value
 #define done_parsing  (void *)1
-// Check if a bit is set
-#define CHECK_BIT(var,pos) ((var) & (1<<(pos)))
+// How much gzipped streams are decompressed at a time
+#define inflate_chunk 262144
+// How much STAR text is written out at a time when streaming
+#define write_chunk 65536
+// Smallest block of memory the token arena asks for
+#define arena_block_size 65536
 
 // Check if py3
 #if PY_MAJOR_VERSION >= 3
 #define PyString_FromString PyUnicode_FromString
 #define PyString_FromFormat PyUnicode_FromFormat
+#define PyString_FromStringAndSize PyUnicode_FromStringAndSize
 #endif
 
 struct module_state {
@@ -30,37 +47,252 @@ static struct module_state _state;
 #endif
 
 // Our whitespace chars
-char whitespace[4] = " \n\t\v";
+static const bool whitespace[256] = {[' '] = true, ['\n'] = true,
+                                     ['\t'] = true, ['\v'] = true,
+                                     ['\r'] = true};
+
+// A token that has already been found by tokenize_all()
+typedef struct {
+    long offset;
+    long line_no;
+    char delineator;
+} cached_token;
+
+// Tokens found ahead of time so they can be handed out without
+//  doing any more scanning
+typedef struct {
+    cached_token * tokens;
+    long count;
+    long capacity;
+    long position;
+    char * text;
+    long text_length;
+    long text_capacity;
+} token_cache;
+
+// A block of the memory that holds token text which had to be rewritten
+//  rather than pointed to where it is in the data
+typedef struct arena_block {
+    struct arena_block * previous;
+    long used;
+    long capacity;
+    char text[];
+} arena_block;
+
+// Extra state for data that arrives a piece at a time rather than all
+//  at once. Only the data that hasn't been tokenized yet is kept.
+typedef struct {
+    // Object to read() more data from, or NULL if it is fed to us
+    PyObject * source;
+    long chunk_size;
+    // Do what prepare_data() does as the data arrives
+    bool normalize;
+    // No more data is coming
+    bool finished;
+    // The data so far ends with a "\n" that normalizing hasn't used up
+    bool line_open;
+    // Data held back until we see what follows it
+    char * pending;
+    long pending_length;
+    long pending_capacity;
+    // Size of full_data
+    long capacity;
+    // Bytes and line breaks dropped from the front of full_data
+    long discarded;
+    long lines_discarded;
+    // Don't look for the end of an unfinished token again until there is
+    //  this much data after its start
+    long retry_length;
+    // Text of the previous batch of cached tokens. The last token handed
+    //  out may still be in use.
+    char * retired_text;
+    // Gzipped streams are decompressed into inflated as they arrive. The
+    //  first bytes are kept in head until we know if they are.
+    bool checked_gzip;
+    char head[2];
+    long head_length;
+    z_stream * inflater;
+    char * inflated;
+    // A gzip member just ended or there is nothing more to decompress
+    bool member_ended;
+    bool gzip_done;
+    // The compressed data given to the inflater ends at in_end. It is
+    //  decompressed an inflate_chunk at a time so the tokenizer can keep
+    //  up; compressed keeps the piece read from the source alive until
+    //  then. needs_input is set once all of it has been decompressed.
+    const unsigned char * in_end;
+    PyObject * compressed;
+    bool input_final;
+    bool needs_input;
+    bool output_left;
+} stream_state;
 
 // A parser struct to keep track of state
 typedef struct {
     char * source;
     char * full_data;
+    // The current token is token_length bytes starting at token. It
+    //  points into full_data unless it had to be rewritten, in which
+    //  case it is in the arena.
     char * token;
+    long token_length;
     long index;
     long length;
     long line_no;
     char last_delineator;
+    // Errors are recorded here so that the tokenizer never needs to
+    //  touch the Python API (and therefore can run without the GIL)
+    PyObject * error_type;
+    char error[err_size];
+    // Set with the error when the data ran out in the middle of a token
+    bool out_of_data;
+    token_cache cache;
+    // Set if full_data is a read-only memory mapped file rather than
+    //  malloc()ed memory
+    size_t mapped_length;
+    // Set if full_data is borrowed from this python string
+    PyObject * data_owner;
+    // Set if the data is being streamed in
+    stream_state * stream;
+    // Rewritten token text. Released when the parser is reset.
+    arena_block * arena;
+    // Offsets of the line breaks in full_data so line numbers can be
+    //  looked up rather than counted. Found the first time one is needed.
+    long * line_breaks;
+    long line_break_count;
 } parser_data;
 
 // Initialize the parser
-parser_data parser = {NULL, NULL, done_parsing, 0, 0, 0, ' '};
+parser_data parser = {NULL, NULL, done_parsing, 0, 0, 0, 0, ' '};
 
-void reset_parser(parser_data * parser){
+/* Throws away the line break offsets once full_data changes. */
+void forget_line_breaks(parser_data * parser){
+    free(parser->line_breaks);
+    parser->line_breaks = NULL;
+    parser->line_break_count = 0;
+}
 
-    if (parser->full_data != NULL){
+/* Releases the loaded data however it was loaded. Needs the GIL if the
+   data was borrowed from a python string. */
+void release_data(parser_data * parser){
+    forget_line_breaks(parser);
+    if (parser->mapped_length != 0){
+        munmap(parser->full_data, parser->mapped_length);
+    } else if (parser->data_owner != NULL){
+        Py_DECREF(parser->data_owner);
+    } else {
         free(parser->full_data);
-        parser->full_data = NULL;
     }
-    if (parser->token != done_parsing){
-        free(parser->token);
+    parser->full_data = NULL;
+    parser->mapped_length = 0;
+    parser->data_owner = NULL;
+}
+
+/* Frees the stream state, if any. Needs the GIL. */
+void release_stream(parser_data * parser){
+    stream_state * stream = parser->stream;
+    if (stream == NULL){
+        return;
+    }
+    Py_XDECREF(stream->source);
+    Py_XDECREF(stream->compressed);
+    if (stream->inflater != NULL){
+        inflateEnd(stream->inflater);
+        free(stream->inflater);
+    }
+    free(stream->inflated);
+    free(stream->pending);
+    free(stream->retired_text);
+    free(stream);
+    parser->stream = NULL;
+}
+
+/* Returns size bytes of memory from the parser's arena, or NULL if out
+   of memory. It stays valid until the arena is rewound or released. */
+char * arena_alloc(parser_data * parser, long size){
+    arena_block * block = parser->arena;
+
+    if ((block == NULL) || (block->capacity - block->used < size)){
+        long capacity = (size > arena_block_size) ? size : arena_block_size;
+        block = malloc(sizeof(arena_block) + capacity);
+        if (block == NULL){
+            return NULL;
+        }
+        block->previous = parser->arena;
+        block->used = 0;
+        block->capacity = capacity;
+        parser->arena = block;
+    }
+
+    char * memory = block->text + block->used;
+    block->used += size;
+    return memory;
+}
+
+/* Frees the given arena block and all of the ones before it. */
+void free_arena_blocks(arena_block * block){
+    while (block != NULL){
+        arena_block * previous = block->previous;
+        free(block);
+        block = previous;
+    }
+}
+
+/* Makes all of the arena available again. The newest block is kept to
+   be reused. */
+void arena_rewind(parser_data * parser){
+    if (parser->arena != NULL){
+        free_arena_blocks(parser->arena->previous);
+        parser->arena->previous = NULL;
+        parser->arena->used = 0;
+    }
+}
+
+/* Frees all of the arena. */
+void arena_release(parser_data * parser){
+    free_arena_blocks(parser->arena);
+    parser->arena = NULL;
+}
+
+void reset_parser(parser_data * parser){
+
+    release_data(parser);
+    release_stream(parser);
+    arena_release(parser);
+    if (parser->cache.tokens != NULL){
+        free(parser->cache.tokens);
+        free(parser->cache.text);
     }
+    memset(&parser->cache, 0, sizeof(token_cache));
     parser->source = NULL;
     parser->token = NULL;
+    parser->token_length = 0;
     parser->index = 0;
     parser->length = 0;
     parser->line_no = 0;
     parser->last_delineator = ' ';
+    parser->error_type = NULL;
+    parser->error[0] = '\0';
+    parser->out_of_data = false;
+}
+
+/* Record an error. Raise it later with raise_parser_error(). */
+void set_error(parser_data * parser, PyObject * error_type, char * message){
+    parser->error_type = error_type;
+    snprintf(parser->error, err_size, "%s", message);
+}
+
+/* Raise the recorded error as a Python exception. Needs the GIL. An
+   exception that is already set (from reading a stream) is left alone. */
+void raise_parser_error(parser_data * parser){
+    if (PyErr_Occurred()){
+        return;
+    }
+    if (parser->error_type == NULL){
+        PyErr_SetString(PyExc_ValueError, "Unknown error.");
+    } else {
+        PyErr_SetString(parser->error_type, parser->error);
+    }
 }
 
 static PyObject *
@@ -72,233 +304,498 @@ PARSE_reset(PyObject *self)
     return Py_None;
 }
 
-/* Return the index of the first match of needle in haystack, or -1 */
-long get_index(char * haystack, char * needle, long start_pos){
 
-    haystack += sizeof(char) * start_pos;
-    char * start = strstr(haystack, needle);
+/* Maps a file into memory read-only. An anonymous page is mapped after
+   it so the data is always followed by a null byte without having to
+   copy it. Returns false if the file couldn't be mapped. */
+bool map_file(int fd, size_t size, parser_data * parser){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t total = ((size + page - 1) / page + 1) * page;
 
-    // Return the end if string not found
-    if (!start){
-        return -1;
+    char * region = mmap(NULL, total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED){
+        return false;
+    }
+    if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+        munmap(region, total);
+        return false;
     }
+    madvise(region, size, MADV_SEQUENTIAL);
 
-    // Calculate the length into start is the new word
-    long diff = start - haystack;
-    return diff;
+    parser->full_data = region;
+    parser->mapped_length = total;
+    parser->length = size;
+    return true;
 }
 
-/* From: http://stackoverflow.com/questions/779875/what-is-the-function-to-replace-string-in-c#answer-779960 */
-// You must free the result if result is non-NULL.
-char *str_replace(char *orig, char *rep, char *with) {
-    char *result; // the return string
-    char *ins;    // the next insert point
-    char *tmp;    // varies
-    int len_rep;  // length of rep (the string to remove)
-    int len_with; // length of with (the string to replace rep with)
-    int len_front; // distance between rep and end of last rep
-    int count;    // number of replacements
-
-    // sanity checks and initialization
-    if (!orig || !rep)
-        return NULL;
-    len_rep = strlen(rep);
-    if (len_rep == 0)
-        return NULL; // empty rep causes infinite loop during count
-    if (!with)
-        with = "";
-    len_with = strlen(with);
-
-    // count the number of replacements needed
-    ins = orig;
-    for (count = 0; (tmp = strstr(ins, rep)); ++count) {
-        ins = tmp + len_rep;
+/* Reads everything left in a file into memory. Used for anything that
+   can't be mapped, such as pipes. Returns false on error. */
+bool read_file(int fd, size_t size_hint, parser_data * parser){
+    size_t capacity = size_hint + 1;
+    size_t length = 0;
+    char * string = malloc(capacity + 1);
+
+    while (string != NULL){
+        if (length == capacity){
+            char * resized = realloc(string, capacity * 2 + 1);
+            if (resized == NULL){
+                break;
+            }
+            string = resized;
+            capacity *= 2;
+        }
+        ssize_t got = read(fd, string + length, capacity - length);
+        if (got < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            set_error(parser, PyExc_IOError, "Short read of file.");
+            free(string);
+            return false;
+        }
+        if (got == 0){
+            // Zero terminate
+            string[length] = '\0';
+            parser->full_data = string;
+            parser->length = length;
+            return true;
+        }
+        length += got;
     }
 
-    tmp = result = malloc(strlen(orig) + (len_with - len_rep) * count + 1);
+    free(string);
+    set_error(parser, PyExc_MemoryError, "Out of memory.");
+    return false;
+}
 
-    if (!result)
-        return NULL;
+/* Returns true if the data starts like a gzip file. */
+static inline bool is_gzipped(const char * data, long length){
+    return (length >= 2) && ((unsigned char)data[0] == 0x1f) && ((unsigned char)data[1] == 0x8b);
+}
 
-    // first time through the loop, all the variable are set correctly
-    // from here on,
-    //    tmp points to the end of the result string
-    //    ins points to the next occurrence of rep in orig
-    //    orig points to the remainder of orig after "end of rep"
-    while (count--) {
-        ins = strstr(orig, rep);
-        len_front = ins - orig;
-        tmp = strncpy(tmp, orig, len_front) + len_front;
-        tmp = strcpy(tmp, with) + len_with;
-        orig += len_front + len_rep; // move to next "end of rep"
+/* Replaces gzipped data loaded into the parser with the decompressed
+   data. Files made of more than one gzip member are joined together and
+   anything after the last member is ignored, as gzip does. Does not need
+   the GIL. Returns false with the error recorded on failure. */
+bool inflate_data(parser_data * parser){
+    const unsigned char * in = (const unsigned char *)parser->full_data;
+    const unsigned char * in_end = in + parser->length;
+
+    // The end of a gzip file has the size of its (last) member modulo
+    //  2^32, which is usually the whole size
+    size_t capacity = 0;
+    if (parser->length >= 18){
+        capacity = in_end[-4] | (in_end[-3] << 8) | (in_end[-2] << 16) | ((size_t)in_end[-1] << 24);
     }
-    strcpy(tmp, orig);
-    return result;
-}
+    if (capacity < (size_t)parser->length){
+        capacity = parser->length * 4 + 64;
+    }
+    size_t length = 0;
+    char * out = malloc(capacity + 1);
+
+    z_stream inflater;
+    memset(&inflater, 0, sizeof(z_stream));
+    if ((out == NULL) || (inflateInit2(&inflater, 16 + MAX_WBITS) != Z_OK)){
+        free(out);
+        set_error(parser, PyExc_MemoryError, "Out of memory.");
+        return false;
+    }
+    inflater.next_in = (unsigned char *)in;
 
-/* Use to look for common unset bits between strings.
-void get_common_bits(void){
-    char one[5] = "data_";
-    char two[5] = "save_";
-    char three[5] = "loop_";
-    char four[5] = "stop_";
-    char five[5] = "globa";
-    char comb[5];
+    while (true){
+        if (length == capacity){
+            char * resized = realloc(out, capacity * 2 + 1);
+            if (resized == NULL){
+                set_error(parser, PyExc_MemoryError, "Out of memory.");
+                break;
+            }
+            out = resized;
+            capacity *= 2;
+        }
 
-    int x;
-    for (x=0; x< 5; x++){
-        comb[x] = (char)(one[x] | two[x] | three[x] | four[x] | five[x]);
-    }
+        // zlib counts in unsigned ints
+        if (inflater.avail_in == 0){
+            inflater.avail_in = (in_end - inflater.next_in > UINT_MAX) ? UINT_MAX : in_end - inflater.next_in;
+        }
+        inflater.next_out = (unsigned char *)out + length;
+        inflater.avail_out = (capacity - length > UINT_MAX) ? UINT_MAX : capacity - length;
 
-    printf("Comb: \n");
-    for (x=0; x< 5; x++){
-        int y;
-        for (y=0; y<7; y++){
-            if (CHECK_BIT(comb[x], y)){
-                printf("%d.%d: 1\n", x, y);
-            } else {
-                printf("%d.%d: 0\n", x, y);
+        int status = inflate(&inflater, Z_NO_FLUSH);
+        length = (char *)inflater.next_out - out;
+
+        if (status == Z_STREAM_END){
+            if (is_gzipped((char *)inflater.next_in, in_end - inflater.next_in)){
+                inflateReset(&inflater);
+                continue;
             }
+            inflateEnd(&inflater);
+            out[length] = '\0';
+            release_data(parser);
+            parser->full_data = out;
+            parser->length = length;
+            return true;
+        }
+        if ((status == Z_BUF_ERROR) && (inflater.next_in == in_end)){
+            set_error(parser, PyExc_IOError, "The gzipped data ended unexpectedly.");
+            break;
+        }
+        if ((status != Z_OK) && (status != Z_BUF_ERROR)){
+            set_error(parser, PyExc_IOError, "Could not decompress the gzipped data.");
+            break;
         }
     }
-    return;
-}*/
 
+    inflateEnd(&inflater);
+    free(out);
+    return false;
+}
 
+/* Loads a file into a parser that has already been reset. Regular files
+   are memory mapped rather than copied and gzipped files are
+   decompressed. Does not need the GIL. */
 void get_file(char *fname, parser_data * parser){
 
-    reset_parser(parser);
-
     // Open the file
-    FILE *f = fopen(fname, "rb");
-    if (!f){
-        PyErr_SetString(PyExc_IOError, "Could not open file.");
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0){
+        set_error(parser, PyExc_IOError, "Could not open file.");
         return;
     }
 
-    // Determine how long it is
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    struct stat info;
+    size_t size_hint = 0;
+    bool regular = false;
+    if (fstat(fd, &info) == 0){
+        regular = S_ISREG(info.st_mode);
+        if (info.st_size > 0){
+            size_hint = info.st_size;
+        }
+    }
 
-    // Allocate space for the file in RAM and load the file
-    char *string = malloc(fsize + 1);
-    if (fread(string, fsize, 1, f) != 1){
-        PyErr_SetString(PyExc_IOError, "Short read of file.");
+    bool loaded = (regular && (size_hint > 0) && map_file(fd, size_hint, parser)) ||
+                  read_file(fd, size_hint, parser);
+    close(fd);
+    if (!loaded){
         return;
     }
 
-    fclose(f);
-    // Zero terminate
-    string[fsize] = 0;
-
-    parser->full_data = string;
-    parser->length = fsize;
+    if (is_gzipped(parser->full_data, parser->length) && (!inflate_data(parser))){
+        return;
+    }
     parser->source = fname;
 }
 
 /* Determines if a character is whitespace */
 bool is_whitespace(char test){
-    int x;
-    for (x=0; x<sizeof(whitespace); x++){
-        if (test == whitespace[x]){
-            return true;
-        }
-    }
-    return false;
+    return whitespace[(unsigned char)test];
 }
 
-/* Returns the index of the next whitespace in the string. */
-long get_next_whitespace(char * string, long start_pos){
+/* The scanning functions below find the bytes the tokenizer cares about.
+   They take the data, where to start and the length of the data, which
+   must be null terminated. A null byte stops every search (as strstr()
+   used to) except for counting newlines.
 
-    long pos = start_pos;
-    while (string[pos] != '\0'){
-        if (is_whitespace(string[pos])){
-            return pos;
+   "\r\n" and a lone "\r" are line breaks just like "\n", so DOS and old
+   Mac files can be tokenized without rewriting them first. */
+
+/* Returns true if there is a line break at pos. The "\r" of "\r\n" isn't
+   one, the "\n" is. */
+static inline bool line_break_at(const char * data, long pos){
+    return (data[pos] == '\n') || ((data[pos] == '\r') && (data[pos + 1] != '\n'));
+}
+
+/* Returns true if a line break starts at pos. update_token() steps over
+   the whole "\r\n" when one ends a token. */
+static inline bool line_break_starts(const char * data, long pos){
+    return (data[pos] == '\n') || (data[pos] == '\r');
+}
+
+/* Returns the index of the next whitespace or null byte. */
+static long find_token_end_scalar(const char * data, long pos, long end){
+    while ((pos < end) && (!whitespace[(unsigned char)data[pos]]) && (data[pos] != '\0')){
+        pos++;
+    }
+    return pos;
+}
+
+/* Returns the index of the next non-whitespace byte and adds the number
+   of newlines skipped over to newlines. */
+static long skip_whitespace_scalar(const char * data, long pos, long end, long * newlines){
+    while ((pos < end) && (whitespace[(unsigned char)data[pos]])){
+        if (line_break_at(data, pos)){
+            (*newlines)++;
         }
         pos++;
     }
     return pos;
 }
 
-/* Scan the index to the next non-whitespace char */
-void pass_whitespace(parser_data * parser){
-    while ((parser->index < parser->length) &&
-            (is_whitespace(parser->full_data[parser->index]))){
+/* Returns the index of the next needle, or -1. */
+static long find_byte_scalar(const char * data, long pos, long end, char needle){
+    while ((pos < end) && (data[pos] != '\0')){
+        if (data[pos] == needle){
+            return pos;
+        }
+        pos++;
+    }
+    return -1;
+}
 
-        // Keep track of skipped newlines
-        if (parser->full_data[parser->index] == '\n'){
-            parser->line_no++;
-            //printf("Skipping in pass_whitespace\n");
+/* Returns the index of the next "\n" or "\r", or -1. */
+static long find_line_end_scalar(const char * data, long pos, long end){
+    while ((pos < end) && (data[pos] != '\0')){
+        if ((data[pos] == '\n') || (data[pos] == '\r')){
+            return pos;
         }
+        pos++;
+    }
+    return -1;
+}
 
-        parser->index++;
+/* Returns the index of the line break of the next "\n;", or -1. Adds
+   the number of line breaks up to and including that one to newlines. */
+static long find_value_end_scalar(const char * data, long pos, long end, long * newlines){
+    while ((pos < end) && (data[pos] != '\0')){
+        if (line_break_at(data, pos)){
+            (*newlines)++;
+            if (data[pos + 1] == ';'){
+                return pos;
+            }
+        }
+        pos++;
     }
+    return -1;
 }
 
-bool check_multiline(parser_data * parser, long length){
-    long x;
-    for (x=parser->index; x <= parser->index+length; x++){
-        if (parser->full_data[x] == '\n'){
-            return true;
+/* Returns the number of line breaks between pos and end. */
+static long count_newlines_scalar(const char * data, long pos, long end){
+    long newlines = 0;
+    for (; pos < end; pos++){
+        if (line_break_at(data, pos)){
+            newlines++;
         }
     }
-    return false;
+    return newlines;
+}
+
+// Use SSE2 and AVX2 where the compiler and CPU can
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_SCANNER
+#define SCAN_SUFFIX sse2
+#define SCAN_TARGET
+#define SCAN_VECTOR __m128i
+#define SCAN_WIDTH 16
+#define SCAN_FULL 0xFFFFu
+#define SCAN_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define SCAN_SET1(c) _mm_set1_epi8(c)
+#define SCAN_EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define SCAN_OR(a, b) _mm_or_si128(a, b)
+#define SCAN_MASK(v) ((uint32_t)_mm_movemask_epi8(v))
+#include "scanner.h"
+
+#if defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define HAVE_AVX2_SCANNER
+#define SCAN_SUFFIX avx2
+#define SCAN_TARGET __attribute__((target("avx2,popcnt")))
+#define SCAN_VECTOR __m256i
+#define SCAN_WIDTH 32
+#define SCAN_FULL 0xFFFFFFFFu
+#define SCAN_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define SCAN_SET1(c) _mm256_set1_epi8(c)
+#define SCAN_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define SCAN_OR(a, b) _mm256_or_si256(a, b)
+#define SCAN_MASK(v) ((uint32_t)_mm256_movemask_epi8(v))
+#include "scanner.h"
+#endif
+#endif
+
+// One set of scanning functions
+typedef struct {
+    const char * name;
+    long (*find_token_end)(const char * data, long pos, long end);
+    long (*skip_whitespace)(const char * data, long pos, long end, long * newlines);
+    long (*find_byte)(const char * data, long pos, long end, char needle);
+    long (*find_line_end)(const char * data, long pos, long end);
+    long (*find_value_end)(const char * data, long pos, long end, long * newlines);
+    long (*count_newlines)(const char * data, long pos, long end);
+} scanner_functions;
+
+static scanner_functions scanners[] = {
+    {"scalar", find_token_end_scalar, skip_whitespace_scalar,
+     find_byte_scalar, find_line_end_scalar, find_value_end_scalar,
+     count_newlines_scalar},
+#ifdef HAVE_SSE2_SCANNER
+    {"sse2", find_token_end_sse2, skip_whitespace_sse2,
+     find_byte_sse2, find_line_end_sse2, find_value_end_sse2,
+     count_newlines_sse2},
+#endif
+#ifdef HAVE_AVX2_SCANNER
+    {"avx2", find_token_end_avx2, skip_whitespace_avx2,
+     find_byte_avx2, find_line_end_avx2, find_value_end_avx2,
+     count_newlines_avx2},
+#endif
+};
+#define num_scanners ((long)(sizeof(scanners) / sizeof(scanner_functions)))
 
+// The scanner in use. Picked by choose_scanner() when the module loads.
+static scanner_functions * scan = &scanners[0];
+
+/* Returns true if this CPU can run the named scanner. */
+bool scanner_supported(const char * name){
+#ifdef HAVE_AVX2_SCANNER
+    if (strcmp(name, "avx2") == 0){
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+#endif
+    return true;
 }
 
-void update_line_number(parser_data * parser, long start_pos, long length){
+/* Use the best scanner this CPU supports. */
+void choose_scanner(void){
     long x;
-    for (x=start_pos; x< start_pos + length; x++){
-        if (parser->full_data[x] == '\n'){
-            parser->line_no++;
-            //printf("Skipping in update_line_number\n");
+    for (x=0; x<num_scanners; x++){
+        if (scanner_supported(scanners[x].name)){
+            scan = &scanners[x];
         }
     }
 }
 
-/* Returns a new token char * */
-char * update_token(parser_data * parser, long length, char delineator){
+/* Returns the index of the next whitespace in the string. */
+long get_next_whitespace(parser_data * parser){
+    return scan->find_token_end(parser->full_data, parser->index, parser->length);
+}
+
+/* Scan the index to the next non-whitespace char */
+void pass_whitespace(parser_data * parser){
+    parser->index = scan->skip_whitespace(parser->full_data, parser->index,
+                                          parser->length, &parser->line_no);
+}
 
-    if (parser->token != done_parsing){
-        free(parser->token);
-    }
+bool check_multiline(parser_data * parser, long length){
+    return scan->count_newlines(parser->full_data, parser->index,
+                                parser->index + length + 1) > 0;
+}
 
-    // Allocate space for the token and copy the data into it
-    parser->token = malloc(length+1);
-    memcpy(parser->token, &parser->full_data[parser->index], length);
-    parser->token[length] = '\0';
+/* Makes the token the next length bytes of the data. newlines is the
+   number of newlines in the token and the character after it, which the
+   caller already knows from scanning. The token is left where it is in
+   the data unless its line breaks need rewriting. Returns NULL if out of
+   memory. */
+char * update_token(parser_data * parser, long length, char delineator, long newlines){
+
+    parser->token = &parser->full_data[parser->index];
+    parser->token_length = length;
+
+    // Only multi-line values can have line breaks in them. Make them all
+    //  "\n".
+    if ((delineator == ';') && (memchr(parser->token, '\r', length) != NULL)){
+        char * data = parser->token;
+        char * text = arena_alloc(parser, length);
+        if (text == NULL){
+            set_error(parser, PyExc_MemoryError, "Out of memory.");
+            parser->token = NULL;
+            return parser->token;
+        }
+
+        long read_pos, write_pos = 0;
+        for (read_pos = 0; read_pos < length; read_pos++){
+            if ((data[read_pos] == '\r') && (read_pos + 1 < length) && (data[read_pos+1] == '\n')){
+                continue;
+            }
+            text[write_pos++] = (data[read_pos] == '\r') ? '\n' : data[read_pos];
+        }
+        parser->token = text;
+        parser->token_length = write_pos;
+    }
 
     // Figure out what to set the last delineator as
-    if (parser->index == 0){
+    if ((parser->index == 0) && ((parser->stream == NULL) || (parser->stream->discarded == 0))){
         parser->last_delineator = ' ';
     } else {
         parser->last_delineator = delineator;
     }
 
     // Check if reference
-    if ((parser->token[0] == '$') && (parser->last_delineator == ' ') && (length >1)) {
+    if ((length > 1) && (parser->token[0] == '$') && (parser->last_delineator == ' ')) {
         parser->last_delineator = '$';
     }
 
     // Update the line number
-    update_line_number(parser, parser->index, length + 1);
+    parser->line_no += newlines;
 
     parser->index += length + 1;
+
+    // Don't leave the "\n" of a "\r\n" that ended the token to be counted again
+    if ((parser->full_data[parser->index - 1] == '\r') && (parser->full_data[parser->index] == '\n')){
+        parser->index++;
+    }
+    return parser->token;
+}
+
+/* Copies the current token into the arena with a null after it so it can
+   be used as a string. Returns NULL if out of memory. */
+char * terminate_token(parser_data * parser){
+    char * text = arena_alloc(parser, parser->token_length + 1);
+    if (text == NULL){
+        set_error(parser, PyExc_MemoryError, "Out of memory.");
+        parser->token = NULL;
+        return parser->token;
+    }
+    memcpy(text, parser->token, parser->token_length);
+    text[parser->token_length] = '\0';
+    parser->token = text;
     return parser->token;
 }
 
 
+/* Finds the offsets of all of the line breaks in the data. Returns
+   false if out of memory. */
+bool find_line_breaks(parser_data * parser){
+    const char * data = parser->full_data;
+    long count = scan->count_newlines(data, 0, parser->length);
+
+    parser->line_breaks = malloc((count + 1) * sizeof(long));
+    if (parser->line_breaks == NULL){
+        return false;
+    }
+
+    long pos, found = 0;
+    for (pos = 0; found < count; pos++){
+        if (line_break_at(data, pos)){
+            parser->line_breaks[found++] = pos;
+        }
+    }
+    parser->line_break_count = count;
+    return true;
+}
+
 // Get the current line number
 long get_line_number(parser_data * parser){
-    long num_lines = 0;
-    long x;
-    for (x = 0; x < parser->index; x++){
-        if (parser->full_data[x] == '\n'){
-            num_lines++;
+    long lines;
+
+    // Count the line breaks before the index with a binary search,
+    //  falling back to counting them if there isn't memory for the offsets
+    if ((parser->line_breaks != NULL) || find_line_breaks(parser)){
+        long low = 0, high = parser->line_break_count;
+        while (low < high){
+            long middle = low + (high - low) / 2;
+            if (parser->line_breaks[middle] < parser->index){
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
         }
+        lines = low + 1;
+    } else {
+        lines = scan->count_newlines(parser->full_data, 0, parser->index) + 1;
     }
-    return num_lines + 1;
+    if (parser->stream != NULL){
+        lines += parser->stream->lines_discarded;
+    }
+    return lines;
 }
 
 /* Gets one token from the file/string. Returns NULL on error and
@@ -310,9 +807,7 @@ char * get_token(parser_data * parser){
     // Reset the delineator
     parser->last_delineator = '?';
 
-    // Set up a tmp str pointer to use for searches
-    char * search;
-    // And an error char array
+    // An error char array
     char err[err_size] = "Unknown error.";
 
     // Nothing left
@@ -325,131 +820,142 @@ char * get_token(parser_data * parser){
 
     // Stop if we are at the end
     if (parser->index >= parser->length){
-        free(parser->token);
         parser->token = done_parsing;
         return parser->token;
     }
 
     // See if this is a comment - if so skip it
     if (parser->full_data[parser->index] == '#'){
-        search = "\n";
-        long length = get_index(parser->full_data, search, parser->index);
+        long end_pos = scan->find_line_end(parser->full_data, parser->index, parser->length);
 
         // Handle the edge case where this is the last line of the file and there is no newline
-        if (length == -1){
-            free(parser->token);
+        if (end_pos == -1){
             parser->token = done_parsing;
             return parser->token;
         }
 
         // Return the comment
-        return update_token(parser, length, '#');
+        return update_token(parser, end_pos - parser->index, '#', line_break_starts(parser->full_data, end_pos));
     }
 
     // See if this is a multiline value
-    if ((parser->length - parser->index > 1) && (parser->full_data[parser->index] == ';') && (parser->full_data[parser->index+1] == '\n')){
-        search = "\n;";
-        long length = get_index(parser->full_data, search, parser->index);
+    if ((parser->length - parser->index > 1) && (parser->full_data[parser->index] == ';') &&
+        ((parser->full_data[parser->index+1] == '\n') || (parser->full_data[parser->index+1] == '\r'))){
+        // Find the closing "\n;" and count the lines on the way, including
+        //  the newline we started with
+        long newlines = 0;
+        long end_pos = scan->find_value_end(parser->full_data, parser->index + 1, parser->length, &newlines);
 
         // Handle the edge case where this is the last line of the file and there is no newline
-        if (length == -1){
+        if (end_pos == -1){
             snprintf(err, sizeof(err), "Invalid file. Semicolon-delineated value was not terminated. Error on line: %ld", get_line_number(parser));
-            PyErr_SetString(PyExc_ValueError, err);
-            free(parser->token);
+            set_error(parser, PyExc_ValueError, err);
+            parser->out_of_data = true;
             parser->token = NULL;
             return parser->token;
         }
 
-        // We started with a newline so make sure to count it
-        parser->line_no++;
-
+        // Skip the ";" and the line break after it
         parser->index += 2;
-        return update_token(parser, length-1, ';');
+        if ((parser->full_data[parser->index-1] == '\r') && (parser->full_data[parser->index] == '\n')){
+            parser->index++;
+        }
+        return update_token(parser, end_pos - parser->index + 1, ';', newlines);
     }
 
     // Handle values quoted with '
     if (parser->full_data[parser->index] == '\''){
-        search = "'";
-        long end_quote = get_index(parser->full_data, search, parser->index + 1);
+        long end_quote = scan->find_byte(parser->full_data, parser->index + 1, parser->length, '\'');
 
         // Handle the case where there is no terminating quote in the file
         if (end_quote == -1){
             snprintf(err, sizeof(err), "Invalid file. Single quoted value was not terminated. Error on line: %ld", get_line_number(parser));
-            PyErr_SetString(PyExc_ValueError, err);
-            free(parser->token);
+            set_error(parser, PyExc_ValueError, err);
+            parser->out_of_data = true;
             parser->token = NULL;
             return parser->token;
         }
 
         // Make sure we don't stop for quotes that are not followed by whitespace
-        while ((parser->index+end_quote+2 < parser->length) && (!is_whitespace(parser->full_data[parser->index+end_quote+2]))){
-            long next_index = get_index(parser->full_data, search, parser->index+end_quote+2);
-            if (next_index == -1){
-                PyErr_SetString(PyExc_ValueError, "Invalid file. Single quoted value was never terminated at end of file.");
-                free(parser->token);
+        while ((end_quote+1 < parser->length) && (!is_whitespace(parser->full_data[end_quote+1]))){
+            end_quote = scan->find_byte(parser->full_data, end_quote+1, parser->length, '\'');
+            if (end_quote == -1){
+                set_error(parser, PyExc_ValueError, "Invalid file. Single quoted value was never terminated at end of file.");
+                parser->out_of_data = true;
                 parser->token = NULL;
                 return parser->token;
             }
-            end_quote += next_index + 1;
         }
 
+        // Whether the value ends here depends on what follows the data
+        if (end_quote + 1 >= parser->length){
+            parser->out_of_data = true;
+        }
+
+        // Work with the length of the value from here on
+        end_quote -= parser->index + 1;
+
         // See if the quote has a newline
         if (check_multiline(parser, end_quote)){
             snprintf(err, sizeof(err), "Invalid file. Single quoted value was not terminated on the same line it began. Error on line: %ld", get_line_number(parser));
-            PyErr_SetString(PyExc_ValueError, err);
-            free(parser->token);
+            set_error(parser, PyExc_ValueError, err);
             parser->token = NULL;
             return parser->token;
         }
 
         // Move the index 1 to skip the '
         parser->index++;
-        return update_token(parser, end_quote, '\'');
+        return update_token(parser, end_quote, '\'', 0);
     }
 
     // Handle values quoted with "
     if (parser->full_data[parser->index] == '\"'){
-        search = "\"";
-        long end_quote = get_index(parser->full_data, search, parser->index + 1);
+        long end_quote = scan->find_byte(parser->full_data, parser->index + 1, parser->length, '\"');
 
         // Handle the case where there is no terminating quote in the file
         if (end_quote == -1){
             snprintf(err, sizeof(err), "Invalid file. Double quoted value was not terminated. Error on line: %ld", get_line_number(parser));
-            PyErr_SetString(PyExc_ValueError, err);
-            free(parser->token);
+            set_error(parser, PyExc_ValueError, err);
+            parser->out_of_data = true;
             parser->token = NULL;
             return parser->token;
         }
 
         // Make sure we don't stop for quotes that are not followed by whitespace
-        while ((parser->index+end_quote+2 < parser->length) && (!is_whitespace(parser->full_data[parser->index+end_quote+2]))){
-            long next_index = get_index(parser->full_data, search, parser->index+end_quote+2);
-            if (next_index == -1){
-                PyErr_SetString(PyExc_ValueError, "Invalid file. Double quoted value was never terminated at end of file.");
-                free(parser->token);
+        while ((end_quote+1 < parser->length) && (!is_whitespace(parser->full_data[end_quote+1]))){
+            end_quote = scan->find_byte(parser->full_data, end_quote+1, parser->length, '\"');
+            if (end_quote == -1){
+                set_error(parser, PyExc_ValueError, "Invalid file. Double quoted value was never terminated at end of file.");
+                parser->out_of_data = true;
                 parser->token = NULL;
                 return parser->token;
             }
-            end_quote += next_index + 1;
         }
 
+        // Whether the value ends here depends on what follows the data
+        if (end_quote + 1 >= parser->length){
+            parser->out_of_data = true;
+        }
+
+        // Work with the length of the value from here on
+        end_quote -= parser->index + 1;
+
         // See if the quote has a newline
         if (check_multiline(parser, end_quote)){
             snprintf(err, sizeof(err), "Invalid file. Double quoted value was not terminated on the same line it began. Error on line: %ld", get_line_number(parser));
-            PyErr_SetString(PyExc_ValueError, err);
-            free(parser->token);
+            set_error(parser, PyExc_ValueError, err);
             parser->token = NULL;
             return parser->token;
         }
 
         // Move the index 1 to skip the "
         parser->index++;
-        return update_token(parser, end_quote, '"');
+        return update_token(parser, end_quote, '"', 0);
     }
 
     // Nothing special. Just get the token
-    long end_pos = get_next_whitespace(parser->full_data, parser->index);
-    return update_token(parser, end_pos - parser->index, ' ');
+    long end_pos = get_next_whitespace(parser);
+    return update_token(parser, end_pos - parser->index, ' ', line_break_starts(parser->full_data, end_pos));
 }
 
 /* IDEA: Implementing the tokenizer following this pattern may
@@ -471,270 +977,5662 @@ function readToken() // note: returns only one token each time
     */
 
 
+/* Normalizes freshly loaded data the same way _Parser.load_data() does:
+   DOS and old Mac line endings become "\n" and multi-line values that
+   start on the same line as their ";" are moved to the next line. Returns
+   false if memory could not be allocated. Does not need the GIL. */
+bool normalize_data(parser_data * parser){
 
+    char * data = parser->full_data;
+    long read_pos, write_pos = 0;
 
-// Implements startswith
-bool starts_with(const char *a, const char *b)
-{
-   if(strncmp(a, b, strlen(b)) == 0) return true;
-   return false;
-}
+    if (data == NULL){
+        return true;
+    }
 
-bool ends_with(const char * str, const char * suffix)
-{
-  int str_len = strlen(str);
-  int suffix_len = strlen(suffix);
+    // Fix line endings in place
+    for (read_pos = 0; read_pos < parser->length; read_pos++){
+        if (data[read_pos] == '\r'){
+            if ((read_pos + 1 < parser->length) && (data[read_pos+1] == '\n')){
+                continue;
+            }
+            data[write_pos++] = '\n';
+        } else {
+            data[write_pos++] = data[read_pos];
+        }
+    }
+    data[write_pos] = '\0';
+    parser->length = write_pos;
+
+    // Count the "\n;value\n" lines. Like re.sub() a match consumes the
+    //  newline that ends it so the following line can't match.
+    long matches = 0;
+    long pos = 0;
+    while (pos + 2 < parser->length){
+        char * found = strstr(data + pos, "\n;");
+        if (found == NULL){
+            break;
+        }
+        long start = found - data;
+        if (data[start + 2] == '\n'){
+            pos = start + 2;
+            continue;
+        }
+        char * line_end = strchr(data + start + 2, '\n');
+        if (line_end == NULL){
+            break;
+        }
+        matches++;
+        pos = (line_end - data) + 1;
+    }
+
+    if (matches == 0){
+        return true;
+    }
+
+    // Rewrite into a larger buffer
+    char * fixed = malloc(parser->length + matches + 1);
+    if (fixed == NULL){
+        return false;
+    }
 
-  return
-    (str_len >= suffix_len) &&
-    (0 == strcmp(str + (str_len-suffix_len), suffix));
+    long copied = 0;
+    write_pos = 0;
+    pos = 0;
+    while (pos + 2 < parser->length){
+        char * found = strstr(data + pos, "\n;");
+        if (found == NULL){
+            break;
+        }
+        long start = found - data;
+        if (data[start + 2] == '\n'){
+            pos = start + 2;
+            continue;
+        }
+        char * line_end = strchr(data + start + 2, '\n');
+        if (line_end == NULL){
+            break;
+        }
+        memcpy(fixed + write_pos, data + copied, start + 2 - copied);
+        write_pos += start + 2 - copied;
+        fixed[write_pos++] = '\n';
+        copied = start + 2;
+        pos = (line_end - data) + 1;
+    }
+    memcpy(fixed + write_pos, data + copied, parser->length - copied);
+    write_pos += parser->length - copied;
+    fixed[write_pos] = '\0';
+
+    free(parser->full_data);
+    forget_line_breaks(parser);
+    parser->full_data = fixed;
+    parser->length = write_pos;
+    return true;
 }
 
-/*
-    Automatically quotes the value in the appropriate way. Don't
-    quote values you send to this method or they will show up in
-    another set of quotes as part of the actual data. E.g.:
+/* Returns true if there is a line starting with ";" followed by more
+   text, which normalize_data() would have to rewrite. The tokenizer deals
+   with the line endings itself. */
+bool needs_normalizing(parser_data * parser){
+    char * data = parser->full_data;
+    char * found = data;
+    char * end = data + parser->length;
+
+    while ((found = memchr(found, ';', end - found)) != NULL){
+        long pos = found - data;
+        if ((pos > 0) && ((data[pos-1] == '\n') || (data[pos-1] == '\r')) &&
+            (pos + 1 < parser->length) && (data[pos+1] != '\n') && (data[pos+1] != '\r')){
+            return true;
+        }
+        found++;
+    }
+    return false;
+}
 
-    clean_value('"e. coli"') returns '\'"e. coli"\''
+/* Gets freshly loaded data ready for the parser, which expects it to
+   look like it has been through normalize_data(). Only copies the data
+   if it actually needs rewriting. Returns false if memory could not be
+   allocated. Needs the GIL if the data was borrowed from python. */
+bool prepare_data(parser_data * parser){
 
-    while
+    if ((parser->full_data == NULL) || (!needs_normalizing(parser))){
+        return true;
+    }
 
-    clean_value("e. coli") returns "'e. coli'"
-*/
-static PyObject * clean_string(PyObject *self, PyObject *args){
-    char * str;
-    char * format;
+    // Mapped and borrowed data are read-only so make our own copy
+    if ((parser->mapped_length != 0) || (parser->data_owner != NULL)){
+        long length = parser->length;
+        char * copy = malloc(length + 1);
+        if (copy == NULL){
+            return false;
+        }
+        memcpy(copy, parser->full_data, length + 1);
+        release_data(parser);
+        parser->full_data = copy;
+        parser->length = length;
+    }
 
-    // Get the string to clean
-    if (!PyArg_ParseTuple(args, "s", &str))
-        return NULL;
+    return normalize_data(parser);
+}
 
-    // Figure out how long the string is
-    long len = strlen(str);
+/* Gets the next token that isn't a comment, with embedded STAR
+   unindented. Returns NULL on error and done_parsing if there are no
+   more tokens. Does not need the GIL. */
+char * next_token(parser_data * my_parser){
+    char * token;
 
-    // Don't allow the empty string
-    if (len == 0){
-        PyErr_SetString(PyExc_ValueError, "Empty strings are not allowed as values. Use a '.' or a '?' if needed.");
-        return NULL;
+    // Text rewritten for the last token isn't needed any more
+    arena_rewind(my_parser);
+    token = get_token(my_parser);
+
+    // Skip comments
+    while (my_parser->last_delineator == '#'){
+        token = get_token(my_parser);
     }
 
-    // If it is a STAR-format multiline comment already, we need to escape it
-    if (strstr(str, "\n;") != NULL){
+    // Pass errors up the chain
+    if (token == NULL || token == done_parsing){
+        return token;
+    }
 
-        // Insert the spaces
-        str = str_replace(str, "\n", "\n   ");
+    // Unwrap embedded STAR if all lines start with three spaces
+    long token_len = my_parser->token_length;
+    if ((my_parser->last_delineator == ';') && (token_len >= 4) && (memcmp(token, "\n   ", 4) == 0)){
+        bool shift_over = true;
 
-        // But always newline terminate it
-        if (!ends_with(str, "\n")){
-            // Must start with newline too
-            if (str[0] != '\n'){
-                format = "\n   %s\n";
-            } else {
-                format = "%s\n";
-            }
-        } else {
-            if (str[0] != '\n'){
-                format = "\n   %s";
-            } else {
-                format = "%s";
+        long c;
+        for (c=0; c<token_len - 4; c++){
+            if (token[c] == '\n'){
+                if (token[c+1] != ' ' || token[c+2] != ' ' || token[c+3] != ' '){
+                    shift_over = false;
+                }
             }
         }
 
-        PyObject* result = PyString_FromFormat(format, str);
-        free(str);
-        return(result);
-    }
+        // Actually shift the text over, leaving off the trailing newline
+        if ((shift_over == true) && (memmem(token, token_len, "\n   ;", 5) != NULL)){
+            char * text = arena_alloc(my_parser, token_len);
+            if (text == NULL){
+                set_error(my_parser, PyExc_MemoryError, "Out of memory.");
+                my_parser->token = NULL;
+                return my_parser->token;
+            }
 
-    // If it's going on it's own line, don't touch it
-    if (strstr(str, "\n") != NULL){
-        // But always newline terminate it
-        if (str[len-1] != '\n'){
-            return PyString_FromFormat("%s\n", str);
-        } else {
-            // Return as is if it already ends with a newline
-            return PyString_FromString(str);
+            long read_pos, write_pos = 0;
+            for (read_pos = 0; read_pos < token_len - 1; read_pos++){
+                text[write_pos++] = token[read_pos];
+                if ((token[read_pos] == '\n') && (read_pos + 4 < token_len) &&
+                    (memcmp(&token[read_pos+1], "   ", 3) == 0)){
+                    read_pos += 3;
+                }
+            }
+            my_parser->token = token = text;
+            my_parser->token_length = write_pos;
         }
     }
 
-    // If it has single and double quotes it will need to go on its
-    //  own line under certain conditions...
-    bool has_single = strstr(str, "'") != NULL;
-    bool has_double = strstr(str, "\"") != NULL;
+    return token;
+}
 
-    bool can_wrap_single = true;
-    bool can_wrap_double = true;
+/* Adds a token to the token cache. Returns false if out of memory. */
+bool cache_token(token_cache * cache, const char * token, long length, long line_no, char delineator){
 
-    if (has_double && has_single){
-        // Determine which quote types are appropriate to use
-        //  (Which depends on if the existing quotes are embedded in text
-        //   or are followed by whitespace)
-        long x;
-        for (x=0; x<len-1; x++){
-            if (is_whitespace(str[x+1])){
-                if (str[x] == '\'')
-                    can_wrap_single = false;
-                if (str[x] == '"')
-                    can_wrap_double = false;
-            }
+    long token_length = length + 1;
+
+    if (cache->count == cache->capacity){
+        long new_capacity = cache->capacity * 2 + 1024;
+        cached_token * resized = realloc(cache->tokens, new_capacity * sizeof(cached_token));
+        if (resized == NULL){
+            return false;
         }
+        cache->tokens = resized;
+        cache->capacity = new_capacity;
+    }
 
-        // Return the string with whatever type of quoting we are allowed
-        if ((!can_wrap_single) && (!can_wrap_double))
-            return PyString_FromFormat("%s\n", str);
-        if (can_wrap_single)
-            return PyString_FromFormat("'%s'", str);
-        if (can_wrap_double)
-            return PyString_FromFormat("\"%s\"", str);
+    if (cache->text_length + token_length > cache->text_capacity){
+        long new_capacity = cache->text_capacity * 2 + token_length + 16384;
+        char * resized = realloc(cache->text, new_capacity);
+        if (resized == NULL){
+            return false;
+        }
+        cache->text = resized;
+        cache->text_capacity = new_capacity;
     }
 
-    // Check for special characters in a tag that would require quoting.
-    //  This tries to be super clever by checking for the quickest things to
-    //   check first. That's why it does the bit comparison on the 3rd bit...
-    //
-    bool needs_wrapping = false;
+    memcpy(cache->text + cache->text_length, token, length);
+    cache->text[cache->text_length + length] = '\0';
+    cache->tokens[cache->count].offset = cache->text_length;
+    cache->tokens[cache->count].line_no = line_no;
+    cache->tokens[cache->count].delineator = delineator;
+    cache->text_length += token_length;
+    cache->count++;
+    return true;
+}
 
-    if (str[0] == '_' || str[0] == '"' || str[0] == '\''){
-        needs_wrapping = true;
+/* Finds all of the tokens in the loaded data and stores them in the
+   token cache. Any error is recorded and raised when the token where it
+   occurred would have been returned. The loaded data is released once it
+   has been tokenized. Does not need the GIL. */
+void tokenize_all(parser_data * my_parser){
+
+    token_cache * cache = &my_parser->cache;
+
+    // Make sure the cache exists even if there is nothing to put in it
+    if (cache->tokens == NULL){
+        cache->tokens = malloc(sizeof(cached_token));
+        cache->capacity = 1;
+        if (cache->tokens == NULL){
+            set_error(my_parser, PyExc_MemoryError, "Out of memory.");
+            return;
+        }
     }
 
-    // If the third bit of the third char is 0 then it might be a reserved
-    //  keyword. (See get_common_bits to see how this was calculated.)
-    else if ((!CHECK_BIT(str[3], 3)) && (starts_with(str, "data_") || starts_with(str, "save_") || starts_with(str, "loop_") || starts_with(str, "stop_") || starts_with(str, "global_"))){
-        needs_wrapping = true;
+    // We couldn't load the data
+    if (my_parser->error_type != NULL){
+        return;
     }
 
-    // If we don't already know we need to wrap it, see if there is whitespace
-    //  or quotes
-    else {
-        long x;
-        for (x=0; x<len; x++){
-            // Check for whitespace chars
-            if (is_whitespace(str[x])){
-                needs_wrapping = true;
-                break;
-            }
-            // The pound sign only needs quotes if it is proceeded by whitespace
-            if (str[x] == '#'){
-                // A quote with whitespace before
-                if ((x==0) || (is_whitespace(str[x-1]))){
-                    needs_wrapping = true;
-                    break;
-                }
+    while (true){
+        char * token = next_token(my_parser);
+        if ((token == NULL) || (token == done_parsing)){
+            break;
+        }
+        if (!cache_token(cache, token, my_parser->token_length, my_parser->line_no, my_parser->last_delineator)){
+            set_error(my_parser, PyExc_MemoryError, "Out of memory.");
+            break;
+        }
+    }
+
+    // No need to hold on to the raw data any more. Data borrowed from
+    //  python is let go of in reset_parser() since that needs the GIL.
+    arena_release(my_parser);
+    if (my_parser->data_owner == NULL){
+        release_data(my_parser);
+    }
+}
+
+/* Does the "\n;value\n" rewriting of normalize_data() to the lines in
+   data[start:end], which only has "\n" line breaks. line_open says
+   whether the first line follows a "\n" that an earlier match hasn't
+   used up, and is updated for the data that follows. Unless final, a
+   line that could match but hasn't ended yet is left alone and *cut is
+   set to where it starts; otherwise *cut is end. If out isn't NULL the
+   rewritten data is written there. Returns the number of matches. */
+long stream_lines(const char * data, long start, long end, bool * line_open,
+                  bool final, long * cut, char * out){
+    long matches = 0;
+    long copied = start;
+    long written = 0;
+    long pos = start;
+    bool open = *line_open;
+
+    *cut = end;
+    while (pos < end){
+        // pos is the start of a line
+        if (open && (data[pos] == ';')){
+            char * line_end = memchr(data + pos, '\n', end - pos);
+            if (line_end == NULL){
+                if (!final){
+                    *cut = pos;
+                }
+                break;
+            }
+            if (line_end - data > pos + 1){
+                if (out != NULL){
+                    memcpy(out + written, data + copied, pos + 1 - copied);
+                    written += pos + 1 - copied;
+                    out[written++] = '\n';
+                    copied = pos + 1;
+                }
+                matches++;
+                pos = (line_end - data) + 1;
+                open = false;
+                continue;
+            }
+        }
+
+        // Skip to the next line that starts with ";"
+        char * found = memmem(data + pos, end - pos, "\n;", 2);
+        if (found == NULL){
+            open = data[end - 1] == '\n';
+            break;
+        }
+        pos = (found - data) + 1;
+        open = true;
+    }
+
+    if (out != NULL){
+        memcpy(out + written, data + copied, end - copied);
+    }
+    *line_open = open;
+    return matches;
+}
+
+/* Makes sure full_data can hold size bytes. */
+bool stream_reserve(parser_data * parser, long size){
+    stream_state * stream = parser->stream;
+    if (size <= stream->capacity){
+        return true;
+    }
+    long capacity = stream->capacity * 2;
+    if (capacity < size){
+        capacity = size;
+    }
+    char * resized = realloc(parser->full_data, capacity);
+    if (resized == NULL){
+        return false;
+    }
+    parser->full_data = resized;
+    stream->capacity = capacity;
+    return true;
+}
+
+/* Adds the next piece of a stream to the data waiting to be tokenized.
+   Data before the parser's position has already been tokenized and is
+   dropped. The end of the data is held back until what follows it
+   arrives if that could change how it is read: a "\r" that might be
+   the start of a "\r\n" and, when normalizing, a line that might need
+   rewriting. Nothing after a null byte is used. Returns false if memory
+   could not be allocated. Does not need the GIL. */
+bool stream_add(parser_data * parser, const char * data, long length, bool final){
+    stream_state * stream = parser->stream;
+
+    const char * null_byte = memchr(data, '\0', length);
+    if (null_byte != NULL){
+        length = null_byte - data;
+        final = true;
+    }
+    if (stream->finished){
+        return true;
+    }
+    stream->finished = final;
+
+    // Drop what has been tokenized
+    forget_line_breaks(parser);
+    if (parser->index > 0){
+        stream->lines_discarded += scan->count_newlines(parser->full_data, 0, parser->index);
+        stream->discarded += parser->index;
+        parser->length -= parser->index;
+        memmove(parser->full_data, parser->full_data + parser->index, parser->length);
+        parser->index = 0;
+    }
+
+    // Make room for the new data. Normalizing adds at most one byte for
+    //  every three.
+    long start = parser->length;
+    long added = stream->pending_length + length;
+    if (!stream_reserve(parser, start + added + added / 2 + 2)){
+        return false;
+    }
+    char * full = parser->full_data;
+    memcpy(full + start, stream->pending, stream->pending_length);
+    memcpy(full + start + stream->pending_length, data, length);
+    long end = start + added;
+    full[end] = '\0';
+    stream->pending_length = 0;
+
+    // Only a "\r" at the very end can be followed by a "\n" we haven't seen
+    long keep = end;
+    if ((!final) && (end > start) && (full[end - 1] == '\r')){
+        keep = end - 1;
+    }
+
+    if (stream->normalize){
+        // Make all of the line breaks "\n"
+        if (memchr(full + start, '\r', keep - start) != NULL){
+            long read_pos, write_pos = start;
+            for (read_pos = start; read_pos < keep; read_pos++){
+                if (full[read_pos] != '\r'){
+                    full[write_pos++] = full[read_pos];
+                } else if (full[read_pos + 1] != '\n'){
+                    full[write_pos++] = '\n';
+                }
+            }
+            if (keep < end){
+                full[write_pos] = '\r';
+            }
+            end -= keep - write_pos;
+            keep = write_pos;
+        }
+
+        // Rewrite "\n;value\n" lines
+        long cut;
+        bool line_open = stream->line_open;
+        long matches = 0;
+        if (keep > start){
+            matches = stream_lines(full, start, keep, &line_open, final, &cut, NULL);
+        } else {
+            cut = keep;
+        }
+        if (matches > 0){
+            char * original = malloc(end - start);
+            if (original == NULL){
+                return false;
+            }
+            memcpy(original, full + start, end - start);
+            line_open = stream->line_open;
+            stream_lines(original, 0, keep - start, &line_open, final, &cut, full + start);
+            memcpy(full + keep + matches, original + (keep - start), end - keep);
+            free(original);
+            cut += start + matches;
+            keep += matches;
+            end += matches;
+        }
+        stream->line_open = line_open;
+        keep = cut;
+    }
+
+    // Hold on to the end for next time
+    long held = end - keep;
+    if (held > stream->pending_capacity){
+        char * resized = realloc(stream->pending, held);
+        if (resized == NULL){
+            return false;
+        }
+        stream->pending = resized;
+        stream->pending_capacity = held;
+    }
+    memcpy(stream->pending, full + keep, held);
+    stream->pending_length = held;
+
+    full[keep] = '\0';
+    parser->length = keep;
+    return true;
+}
+
+/* Decompresses up to inflate_chunk bytes of the gzipped data given to
+   the inflater and adds them to the data, so that a small piece of
+   compressed data doesn't have to be inflated all at once before any of
+   it is tokenized. Sets needs_input once all of it has been
+   decompressed, and finishes the stream then if it was the last of the
+   data. Does not need the GIL. Returns false if memory could not be
+   allocated. */
+bool stream_inflate(parser_data * parser){
+    stream_state * stream = parser->stream;
+    z_stream * inflater = stream->inflater;
+    const unsigned char * in_end = stream->in_end;
+
+    while ((!stream->gzip_done) && (parser->error_type == NULL)){
+        // Another member may follow the one that just ended. Anything
+        //  else after it is ignored, as gzip does.
+        if (stream->member_ended){
+            if (inflater->next_in == in_end){
+                break;
+            }
+            if (*inflater->next_in != 0x1f){
+                stream->gzip_done = true;
+                break;
+            }
+            inflateReset(inflater);
+            stream->member_ended = false;
+        }
+
+        // zlib counts in unsigned ints
+        if (inflater->avail_in == 0){
+            if ((inflater->next_in == in_end) && (!stream->output_left)){
+                break;
+            }
+            inflater->avail_in = (in_end - inflater->next_in > UINT_MAX) ? UINT_MAX : in_end - inflater->next_in;
+        }
+        inflater->next_out = (unsigned char *)stream->inflated;
+        inflater->avail_out = inflate_chunk;
+
+        int status = inflate(inflater, Z_NO_FLUSH);
+        long produced = (char *)inflater->next_out - stream->inflated;
+        stream->output_left = (inflater->avail_out == 0);
+        if ((produced > 0) && (!stream_add(parser, stream->inflated, produced, false))){
+            return false;
+        }
+        if (status == Z_STREAM_END){
+            stream->member_ended = true;
+        } else if (status == Z_BUF_ERROR){
+            break;
+        } else if (status != Z_OK){
+            set_error(parser, PyExc_IOError, "Could not decompress the gzipped data.");
+        }
+        if (produced > 0){
+            return true;
+        }
+    }
+
+    stream->needs_input = true;
+    stream->output_left = false;
+    if (!stream->input_final){
+        return true;
+    }
+    if ((!stream->member_ended) && (!stream->gzip_done) && (parser->error_type == NULL)){
+        set_error(parser, PyExc_IOError, "The gzipped data ended unexpectedly.");
+    }
+    return stream_add(parser, "", 0, true);
+}
+
+/* True if the inflater has more to give before it needs more of the
+   gzipped stream. */
+bool stream_inflating(parser_data * parser){
+    stream_state * stream = parser->stream;
+    return ((stream->inflater != NULL) && (!stream->needs_input) &&
+            (!stream->finished));
+}
+
+/* Adds the next piece of a stream. Gzipped streams are decompressed on
+   the way in, only the first inflate_chunk bytes of it here and the rest
+   with stream_inflate(). Does not need the GIL. Returns false if memory
+   could not be allocated. */
+bool stream_append(parser_data * parser, const char * data, long length, bool final){
+    stream_state * stream = parser->stream;
+
+    // See if the stream is gzipped once we have the first two bytes
+    if (!stream->checked_gzip){
+        if ((stream->head_length + length < 2) && (!final)){
+            memcpy(stream->head + stream->head_length, data, length);
+            stream->head_length += length;
+            return true;
+        }
+        char start[2];
+        long start_length = stream->head_length;
+        memcpy(start, stream->head, start_length);
+        while ((start_length < 2) && (start_length - stream->head_length < length)){
+            start[start_length] = data[start_length - stream->head_length];
+            start_length++;
+        }
+        stream->checked_gzip = true;
+
+        if (is_gzipped(start, start_length)){
+            stream->inflater = calloc(1, sizeof(z_stream));
+            stream->inflated = malloc(inflate_chunk);
+            if ((stream->inflater == NULL) || (stream->inflated == NULL) ||
+                (inflateInit2(stream->inflater, 16 + MAX_WBITS) != Z_OK)){
+                free(stream->inflater);
+                stream->inflater = NULL;
+                return false;
+            }
+        }
+
+        // Add the bytes we held on to first
+        if ((stream->head_length > 0) && (!stream_append(parser, stream->head, stream->head_length, false))){
+            return false;
+        }
+        stream->head_length = 0;
+    }
+
+    // Gzipped data is only decompressed a piece at a time, so the
+    //  caller has to keep it until stream_inflating() says it is used up
+    if (stream->inflater != NULL){
+        stream->inflater->next_in = (unsigned char *)data;
+        stream->inflater->avail_in = 0;
+        stream->in_end = (const unsigned char *)data + length;
+        stream->input_final = final;
+        stream->needs_input = false;
+        return stream_inflate(parser);
+    }
+    return stream_add(parser, data, length, final);
+}
+
+/* Tokenizes as much of the stream data as we can be sure about into
+   the token cache. A token that runs into the end of the data is left
+   for next time unless the stream is finished. Does not need the GIL. */
+void stream_tokenize(parser_data * parser){
+    stream_state * stream = parser->stream;
+    token_cache * cache = &parser->cache;
+
+    // Don't keep scanning the start of a huge value over and over
+    if ((!stream->finished) && (parser->length - parser->index < stream->retry_length)){
+        return;
+    }
+
+    while (parser->error_type == NULL){
+        long index = parser->index;
+        long line_no = parser->line_no;
+        char delineator = parser->last_delineator;
+
+        parser->out_of_data = false;
+        char * token = next_token(parser);
+        if ((!stream->finished) &&
+            ((token == done_parsing) || ((token == NULL) && parser->out_of_data) ||
+             ((token != NULL) && (parser->index >= parser->length)))){
+            // Try again once more data has arrived
+            parser->token = NULL;
+            parser->index = index;
+            parser->line_no = line_no;
+            parser->last_delineator = delineator;
+            parser->error_type = NULL;
+            parser->error[0] = '\0';
+            parser->out_of_data = false;
+            stream->retry_length = 2 * (parser->length - parser->index);
+            return;
+        }
+        if ((token == NULL) || (token == done_parsing)){
+            return;
+        }
+        if (!cache_token(cache, token, parser->token_length, parser->line_no, parser->last_delineator)){
+            set_error(parser, PyExc_MemoryError, "Out of memory.");
+            return;
+        }
+    }
+}
+
+/* Starts a new batch of cached tokens for a stream. The last token
+   handed out is carried over so get_loop_data() can step back to it,
+   and its text is kept where it is until the next batch. */
+bool stream_new_batch(parser_data * parser){
+    stream_state * stream = parser->stream;
+    token_cache * cache = &parser->cache;
+
+    free(stream->retired_text);
+    stream->retired_text = cache->text;
+    cache->text = NULL;
+    cache->text_length = 0;
+    cache->text_capacity = 0;
+
+    long count = cache->count;
+    cache->count = 0;
+    cache->position = 0;
+    if (count > 0){
+        cached_token last = cache->tokens[count - 1];
+        char * text = stream->retired_text + last.offset;
+        if (!cache_token(cache, text, strlen(text), last.line_no, last.delineator)){
+            return false;
+        }
+        cache->position = 1;
+    }
+    return true;
+}
+
+/* Reads from the stream source until there are more tokens, an error
+   or the end of the data. Needs the GIL. Returns false with a python
+   exception set if reading failed. */
+bool stream_refill(parser_data * parser){
+    stream_state * stream = parser->stream;
+    token_cache * cache = &parser->cache;
+
+    if (!stream_new_batch(parser)){
+        PyErr_NoMemory();
+        return false;
+    }
+
+    while ((cache->position == cache->count) && (parser->error_type == NULL) &&
+           (!stream->finished)){
+        // Decompress more of what was read last time before reading more
+        if (stream_inflating(parser)){
+            bool inflated;
+            Py_BEGIN_ALLOW_THREADS
+            inflated = stream_inflate(parser);
+            if (inflated){
+                stream_tokenize(parser);
+            }
+            Py_END_ALLOW_THREADS
+            if (!inflated){
+                PyErr_NoMemory();
+                return false;
+            }
+            continue;
+        }
+        Py_CLEAR(stream->compressed);
+
+        PyObject * chunk = PyObject_CallMethod(stream->source, "read", "l", stream->chunk_size);
+        if (chunk == NULL){
+            return false;
+        }
+        const char * data;
+        Py_ssize_t length;
+        if (!PyArg_Parse(chunk, "s#", &data, &length)){
+            Py_DECREF(chunk);
+            return false;
+        }
+
+        bool appended;
+        Py_BEGIN_ALLOW_THREADS
+        appended = stream_append(parser, data, length, length == 0);
+        if (appended){
+            stream_tokenize(parser);
+        }
+        Py_END_ALLOW_THREADS
+        if (stream_inflating(parser)){
+            stream->compressed = chunk;
+        } else {
+            Py_DECREF(chunk);
+        }
+
+        if (!appended){
+            PyErr_NoMemory();
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Reads the file named in args into the given parser. If the optional
+   second argument is true the data is prepared for the parser. */
+static PyObject *
+load_into(parser_data * my_parser, PyObject *args)
+{
+    char *file;
+    int normalize = 0;
+
+    if (!PyArg_ParseTuple(args, "s|i", &file, &normalize))
+        return NULL;
+
+    reset_parser(my_parser);
+
+    // Read the file. The module level parser is shared by every caller,
+    //  so only let other threads run while a Tokenizer's own parser is
+    //  being loaded.
+    PyThreadState * thread_state = NULL;
+    if (my_parser != &parser){
+        thread_state = PyEval_SaveThread();
+    }
+    get_file(file, my_parser);
+    if (normalize && (my_parser->error_type == NULL) && (!prepare_data(my_parser))){
+        set_error(my_parser, PyExc_MemoryError, "Out of memory.");
+    }
+    if (thread_state != NULL){
+        PyEval_RestoreThread(thread_state);
+    }
+
+    if (my_parser->error_type != NULL){
+        raise_parser_error(my_parser);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Loads the string in args into the given parser. The string is
+   borrowed rather than copied. If the optional second argument is true
+   the data is prepared for the parser. */
+static PyObject *
+load_string_into(parser_data * my_parser, PyObject *args)
+{
+    char *data;
+    int normalize = 0;
+
+    if (!PyArg_ParseTuple(args, "s|i", &data, &normalize))
+        return NULL;
+
+    reset_parser(my_parser);
+
+    // Hold on to the string so its contents stay put
+    my_parser->data_owner = PyTuple_GET_ITEM(args, 0);
+    Py_INCREF(my_parser->data_owner);
+    my_parser->full_data = data;
+    my_parser->length = strlen(data);
+
+    if (normalize && (!prepare_data(my_parser))){
+        return PyErr_NoMemory();
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+PARSE_load(PyObject *self, PyObject *args)
+{
+    return load_into(&parser, args);
+}
+
+static PyObject *
+PARSE_load_string(PyObject *self, PyObject *args)
+{
+    return load_string_into(&parser, args);
+}
+
+/* Helper method from:
+ * http://stackoverflow.com/questions/15515088/how-to-check-if-string-starts-with-certain-string-in-c
+ * */
+bool StartsWith(const char *a, const char *b)
+{
+   if(strncmp(a, b, strlen(b)) == 0) return 1;
+   return 0;
+}
+
+bool fetch_token(parser_data * my_parser, char ** token, long * line_no, char * delineator);
+
+/* Builds the (token, line number, delineator) tuple. */
+static PyObject *
+build_token_tuple(char * token, long line_no, char delineator)
+{
+    if (token == done_parsing){
+        // Return python none if done parsing
+    #if PY_MAJOR_VERSION >= 3
+        return Py_BuildValue("OlC", Py_None, line_no, delineator);
+    }
+    return Py_BuildValue("slC", token, line_no, delineator);
+
+    #else
+        return Py_BuildValue("Olc", Py_None, line_no, delineator);
+    }
+    return Py_BuildValue("slc", token, line_no, delineator);
+    #endif
+}
+
+/* Gets the next non-comment token from the given parser and returns
+   it as a (token, line number, delineator) tuple. */
+static PyObject *
+get_token_full(parser_data * my_parser)
+{
+    char * token;
+    long line_no;
+    char delineator;
+
+    // Pass errors up the chain
+    if (!fetch_token(my_parser, &token, &line_no, &delineator)){
+        raise_parser_error(my_parser);
+        return NULL;
+    }
+
+    return build_token_tuple(token, line_no, delineator);
+}
+
+/* Gets the next token, either from the token cache or by scanning.
+   Returns false on error. *token is set to done_parsing at the end. */
+bool fetch_token(parser_data * my_parser, char ** token, long * line_no, char * delineator){
+    token_cache * cache = &my_parser->cache;
+
+    if (cache->tokens != NULL){
+        // Read more of a stream once we have handed out all we have
+        if ((cache->position == cache->count) && (my_parser->stream != NULL) &&
+            (my_parser->stream->source != NULL) && (!my_parser->stream->finished) &&
+            (my_parser->error_type == NULL)){
+            if (!stream_refill(my_parser)){
+                return false;
+            }
+        }
+        if (cache->position < cache->count){
+            cached_token * cur = &cache->tokens[cache->position++];
+            *token = cache->text + cur->offset;
+            *line_no = cur->line_no;
+            *delineator = cur->delineator;
+            return true;
+        }
+        if (my_parser->error_type != NULL){
+            return false;
+        }
+        *token = done_parsing;
+    } else {
+        *token = next_token(my_parser);
+        if ((*token != NULL) && (*token != done_parsing)){
+            *token = terminate_token(my_parser);
+        }
+        if (*token == NULL){
+            return false;
+        }
+    }
+
+    *line_no = my_parser->line_no;
+    *delineator = my_parser->last_delineator;
+    return true;
+}
+
+/* Returns true if the token is one of the STAR reserved keywords. */
+bool is_reserved(const char * token){
+    return ((strcmp(token, "stop_") == 0) || (strcmp(token, "loop_") == 0) ||
+            (strcmp(token, "save_") == 0) || (strcmp(token, "data_") == 0) ||
+            (strcmp(token, "global_") == 0));
+}
+
+/* Raise a ValueError with the same (message, line number) arguments
+   that _Parser uses. */
+void raise_with_line(PyObject * message, long line_no){
+    if (message == NULL){
+        return;
+    }
+    PyObject * args = Py_BuildValue("(Nl)", message, line_no);
+    if (args != NULL){
+        PyErr_SetObject(PyExc_ValueError, args);
+        Py_DECREF(args);
+    }
+}
+
+/* How the values of a column of a loop are converted as they are read
+   in. These match the _CONVERT_ constants in bmrb.py, which decides how
+   to convert each column with Loop._get_conversions(). */
+#define convert_none 0
+#define convert_call 1
+#define convert_string 2
+#define convert_integer 3
+#define convert_float 4
+#define convert_date 5
+// Added to the others if nulls are an error
+#define convert_null_error 8
+
+/* How to convert each column of a loop being read in. If kinds is NULL
+   the values are left as strings. Values that can't be converted here
+   are passed to convert(column, value, line number) to deal with. */
+typedef struct {
+    long * kinds;
+    PyObject * convert;
+    PyObject * decimal;
+    PyObject * date;
+} type_conversions;
+
+/* Frees what load_type_conversions() set up. */
+void free_type_conversions(type_conversions * types){
+    free(types->kinds);
+    types->kinds = NULL;
+    Py_CLEAR(types->convert);
+    Py_CLEAR(types->decimal);
+    Py_CLEAR(types->date);
+}
+
+/* Looks up an attribute of a module, importing it if needed. */
+PyObject * module_attribute(const char * module_name, const char * name){
+    PyObject * module = PyImport_ImportModule(module_name);
+    if (module == NULL){
+        return NULL;
+    }
+    PyObject * result = PyObject_GetAttrString(module, name);
+    Py_DECREF(module);
+    return result;
+}
+
+/* Sets up the conversions from what Loop._get_conversions() returns:
+   None, or the kind of conversion for each column and the function to
+   call with values this can't convert. Returns false with an exception
+   set on error. */
+bool load_type_conversions(type_conversions * types, PyObject * spec, long num_columns){
+    PyObject * kinds;
+    long x;
+
+    memset(types, 0, sizeof(type_conversions));
+    if (spec == Py_None){
+        return true;
+    }
+    if (!PyArg_ParseTuple(spec, "OO", &kinds, &types->convert)){
+        return false;
+    }
+    Py_INCREF(types->convert);
+    if (PyObject_Length(kinds) != num_columns){
+        if (!PyErr_Occurred()){
+            PyErr_SetString(PyExc_ValueError, "There must be a conversion for each column.");
+        }
+        goto error;
+    }
+
+    types->kinds = malloc((num_columns + 1) * sizeof(long));
+    if (types->kinds == NULL){
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (x=0; x<num_columns; x++){
+        PyObject * item = PySequence_GetItem(kinds, x);
+        types->kinds[x] = (item == NULL) ? -1 : PyLong_AsLong(item);
+        Py_XDECREF(item);
+        if (PyErr_Occurred()){
+            goto error;
+        }
+
+        // Look up the types we need
+        long kind = types->kinds[x] & ~convert_null_error;
+        if ((kind == convert_float) && (types->decimal == NULL)){
+            types->decimal = module_attribute("decimal", "Decimal");
+            if (types->decimal == NULL){
+                goto error;
+            }
+        }
+        if ((kind == convert_date) && (types->date == NULL)){
+            types->date = module_attribute("datetime", "date");
+            if (types->date == NULL){
+                goto error;
+            }
+        }
+    }
+    return true;
+
+error:
+    free_type_conversions(types);
+    return false;
+}
+
+/* Parses a run of at most max_digits decimal digits. Returns the number
+   of characters used, which is 0 if there weren't any digits or too
+   many of them. */
+int parse_digits(const char * text, int max_digits, long long * value){
+    int x;
+    *value = 0;
+    for (x=0; (text[x] >= '0') && (text[x] <= '9'); x++){
+        if (x == max_digits){
+            return 0;
+        }
+        *value = *value * 10 + (text[x] - '0');
+    }
+    return x;
+}
+
+/* Returns the value of an integer that is only digits with an optional
+   sign, or NULL without an exception set if it is anything else. */
+PyObject * quick_integer(const char * token){
+    long long value;
+    bool negative = (token[0] == '-');
+    if ((token[0] == '-') || (token[0] == '+')){
+        token++;
+    }
+    int used = parse_digits(token, 18, &value);
+    if ((used == 0) || (token[used] != '\0')){
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLongLong(negative ? -value : value);
+#else
+    // Python 2 makes a long rather than an int if it must
+    if (value > LONG_MAX){
+        return NULL;
+    }
+    return PyInt_FromLong(negative ? -value : value);
+#endif
+}
+
+/* Returns the date of a year-month-day value that is only digits and
+   dashes, or NULL without an exception set if it is anything else or
+   isn't a valid date. */
+PyObject * quick_date(PyObject * date, const char * token){
+    long long parts[3];
+    int x;
+    for (x=0; x<3; x++){
+        int used = parse_digits(token, 9, &parts[x]);
+        if ((used == 0) || (token[used] != ((x < 2) ? '-' : '\0'))){
+            return NULL;
+        }
+        token += used + 1;
+    }
+    PyObject * result = PyObject_CallFunction(date, "iii", (int)parts[0], (int)parts[1], (int)parts[2]);
+    if (result == NULL){
+        PyErr_Clear();
+    }
+    return result;
+}
+
+/* Returns the token converted the way Schema.convert_tag() in bmrb.py
+   converts values of the column. */
+PyObject * convert_value(type_conversions * types, long column, const char * token, long line_no){
+    if (types->kinds == NULL){
+        return PyString_FromString(token);
+    }
+
+    long kind = types->kinds[column];
+    PyObject * result = NULL;
+
+    if (kind == convert_none){
+        return PyString_FromString(token);
+    }
+
+    // Nulls
+    if ((kind != convert_call) && ((strcmp(token, ".") == 0) || (strcmp(token, "?") == 0))){
+        if (!(kind & convert_null_error)){
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+        kind = convert_call;
+    }
+
+    switch (kind & ~convert_null_error){
+        case convert_string:
+            return PyString_FromString(token);
+        case convert_integer:
+            result = quick_integer(token);
+            break;
+        case convert_date:
+            result = quick_date(types->date, token);
+            break;
+    }
+    if (result != NULL){
+        return result;
+    }
+
+    PyObject * value = PyString_FromString(token);
+    if (value == NULL){
+        return NULL;
+    }
+    if ((kind & ~convert_null_error) == convert_float){
+        result = PyObject_CallFunctionObjArgs(types->decimal, value, NULL);
+        if (result != NULL){
+            Py_DECREF(value);
+            return result;
+        }
+        PyErr_Clear();
+    }
+
+    // Let python deal with anything else, including raising the error
+    return PyObject_CallFunction(types->convert, "lNl", column, value, line_no);
+}
+
+/* Checks a token of the data of a loop, given the number of values
+   before it. Returns 1 if it is the stop_ that ends the loop, 0 if it is
+   a value and -1 with an exception set if it isn't allowed. */
+static int
+check_loop_token(const char * token, long line_no, char delineator,
+                 long num_columns, long values, const char * category)
+{
+    if (strcmp(token, "stop_") == 0){
+        if (delineator != ' '){
+            raise_with_line(PyString_FromString("The stop_ keyword may not be quoted or semicolon-delineated."), line_no);
+            return -1;
+        }
+        if ((num_columns > 0) && (values % num_columns != 0)){
+            PyErr_Format(PyExc_ValueError, "The number of data elements in the loop %s does not match the number of columns!", category);
+            return -1;
+        }
+        return 1;
+    }
+
+    if (num_columns == 0){
+        raise_with_line(PyString_FromString("Data found in loop before loop tags."), line_no);
+        return -1;
+    }
+
+    if ((delineator == ' ') && is_reserved(token)){
+        raise_with_line(PyString_FromFormat("Cannot use keywords as data values unless quoted or semi-colon delineated. Perhaps this is a loop that wasn't properly terminated? Illegal value: %s", token), line_no);
+        return -1;
+    }
+    return 0;
+}
+
+/* Skips over the data values of a loop as read_loop_rows() would read
+   them, making the same checks. Returns the number of values, or -1 on
+   error. */
+static long
+skip_loop_rows(parser_data * my_parser, long num_columns, const char * category,
+               char ** token, long * line_no, char * delineator)
+{
+    long values = 0;
+
+    while ((*token != done_parsing) && (*token != NULL)){
+        int checked = check_loop_token(*token, *line_no, *delineator,
+                                       num_columns, values, category);
+        if (checked < 0){
+            return -1;
+        }
+        if (checked > 0){
+            break;
+        }
+        values++;
+
+        if (!fetch_token(my_parser, token, line_no, delineator)){
+            raise_parser_error(my_parser);
+            return -1;
+        }
+    }
+
+    return values;
+}
+
+/* Reads the data values of a loop, starting with the token passed in,
+   through the stop_ that ends the loop. Returns the values split into
+   rows, converted as types says, and leaves the token that ended the
+   loop in token, line_no and delineator. */
+static PyObject *
+read_loop_rows(parser_data * my_parser, long num_columns, const char * category,
+               type_conversions * types, char ** token, long * line_no, char * delineator)
+{
+    PyObject * rows = PyList_New(0);
+    PyObject * row = NULL;
+    long values = 0;
+    if (rows == NULL){
+        return NULL;
+    }
+
+    while ((*token != done_parsing) && (*token != NULL)){
+
+        int checked = check_loop_token(*token, *line_no, *delineator,
+                                       num_columns, values, category);
+        if (checked < 0){
+            goto error;
+        }
+        // We've reached the end of the loop
+        if (checked > 0){
+            break;
+        }
+
+        // Start a new row
+        if (values % num_columns == 0){
+            row = PyList_New(0);
+            if ((row == NULL) || (PyList_Append(rows, row) != 0)){
+                Py_XDECREF(row);
+                goto error;
+            }
+            Py_DECREF(row);
+        }
+
+        PyObject * value = convert_value(types, values % num_columns, *token, *line_no);
+        if ((value == NULL) || (PyList_Append(row, value) != 0)){
+            Py_XDECREF(value);
+            goto error;
+        }
+        Py_DECREF(value);
+        values++;
+
+        if (!fetch_token(my_parser, token, line_no, delineator)){
+            raise_parser_error(my_parser);
+            goto error;
+        }
+    }
+
+    return rows;
+
+error:
+    Py_DECREF(rows);
+    return NULL;
+}
+
+/* Reads the data values of a loop, starting with the token most
+   recently returned by get_token_full(), through the stop_ that ends
+   the loop. Returns the values split into rows along with the
+   (token, line number, delineator) of the token that ended the loop.
+   The values are converted if given what Loop._get_conversions()
+   returns. */
+static PyObject *
+get_loop_data(parser_data * my_parser, PyObject *args)
+{
+    long num_columns;
+    char * category;
+    char * token;
+    long line_no;
+    char delineator;
+    PyObject * spec = Py_None;
+    type_conversions types;
+
+    if (!PyArg_ParseTuple(args, "ls|O", &num_columns, &category, &spec))
+        return NULL;
+
+    // Start with the token the caller already has
+    token_cache * cache = &my_parser->cache;
+    if ((cache->tokens != NULL) && (cache->position > 0)){
+        cache->position--;
+        if (!fetch_token(my_parser, &token, &line_no, &delineator)){
+            raise_parser_error(my_parser);
+            return NULL;
+        }
+    } else if (cache->tokens == NULL){
+        token = my_parser->token;
+        line_no = my_parser->line_no;
+        delineator = my_parser->last_delineator;
+    } else {
+        token = done_parsing;
+        line_no = my_parser->line_no;
+        delineator = my_parser->last_delineator;
+    }
+
+    if (!load_type_conversions(&types, spec, num_columns)){
+        return NULL;
+    }
+    PyObject * rows = read_loop_rows(my_parser, num_columns, category, &types,
+                                     &token, &line_no, &delineator);
+    free_type_conversions(&types);
+    if (rows == NULL){
+        return NULL;
+    }
+
+    return Py_BuildValue("(NN)", rows, build_token_tuple(token, line_no, delineator));
+}
+
+/* Returns the UTF-8 contents of a python string. */
+const char * string_data(PyObject * string){
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_AsUTF8(string);
+#else
+    return PyString_AsString(string);
+#endif
+}
+
+/* Calls a method and throws away the result. Returns false if the
+   method raised an exception. */
+bool call_method(PyObject * object, char * method, char * format, ...){
+    va_list va;
+    va_start(va, format);
+    PyObject * callable = PyObject_GetAttrString(object, method);
+    PyObject * args = NULL;
+    PyObject * result = NULL;
+    if (callable != NULL){
+        args = Py_VaBuildValue(format, va);
+        if (args != NULL){
+            result = PyObject_Call(callable, args, NULL);
+        }
+    }
+    va_end(va);
+    Py_XDECREF(callable);
+    Py_XDECREF(args);
+    if (result == NULL){
+        return false;
+    }
+    Py_DECREF(result);
+    return true;
+}
+
+// Fetch the next token in parse_entry() or bail out
+#define NEXT_TOKEN() if (!fetch_token(my_parser, &token, &line_no, &delineator)){ \
+                         raise_parser_error(my_parser); \
+                         goto error; \
+                     }
+
+// Raise a ValueError with the current line number in parse_entry()
+#define PARSE_ERROR(message) { raise_with_line(PyString_FromString(message), line_no); \
+                               goto error; }
+
+// How parse_entry() and parse_saveframe() build the tree
+typedef struct {
+    PyObject * saveframe_class;
+    PyObject * loop_class;
+    PyObject * source;
+    int allow_v2;
+    int tag_only_loop_error;
+    int empty_loop_error;
+    // The COLUMNAR_LOOPS and CONVERT_DATATYPES to build with, or None for
+    //  the current ones. Passed along rather than set so that entries
+    //  parsed on other threads meanwhile aren't affected.
+    PyObject * columnar;
+    PyObject * convert;
+} parse_options;
+
+// What the first pass of a lazy parse records about a saveframe rather
+//  than building its tags and loops
+typedef struct {
+    // The first tag with a category, which sets the tag prefix
+    char * prefix_tag;
+    // The values of the tags that set the saveframe category
+    PyObject * category_tags;
+    // The category of each loop, or None
+    PyObject * loop_categories;
+} saveframe_outline;
+
+/* Records what a lazy parse needs to know about a saveframe tag. These
+   are the tags that Saveframe.add_tag() sets the tag prefix and
+   category from. */
+bool outline_tag(saveframe_outline * outline, char * tag, char * value){
+    char * dot = strchr(tag, '.');
+    if ((outline->prefix_tag == NULL) && (dot != NULL)){
+        outline->prefix_tag = tag;
+    }
+
+    const char * name = (dot != NULL) ? dot + 1 : tag;
+    if ((strcasecmp(name, "sf_category") != 0) &&
+        (strcasecmp(name, "_saveframe_category") != 0)){
+        return true;
+    }
+
+    PyObject * item;
+    if (value == done_parsing){
+        Py_INCREF(Py_None);
+        item = Py_None;
+    } else {
+        item = PyString_FromString(value);
+    }
+    if ((item == NULL) || (PyList_Append(outline->category_tags, item) != 0)){
+        Py_XDECREF(item);
+        return false;
+    }
+    Py_DECREF(item);
+    return true;
+}
+
+/* Parses the tags and loops of a saveframe into the frame, starting
+   with the token after its save_NAME and finishing with the save_ that
+   ends it. If outline isn't NULL the frame is left empty and what a
+   lazy parse needs is recorded there instead. Everything is still
+   checked except what the Saveframe and Loop methods check. */
+bool parse_saveframe(parser_data * my_parser, PyObject * frame,
+                     const char * frame_name, parse_options * options,
+                     saveframe_outline * outline){
+    char * token;
+    long line_no;
+    char delineator;
+    PyObject * loop = NULL;
+    PyObject * category = NULL;
+    PyObject * rows = NULL;
+
+    while (true){
+        NEXT_TOKEN();
+        if (token == done_parsing){
+            break;
+        }
+
+        if (strcmp(token, "loop_") == 0){
+            if (delineator != ' '){
+                PARSE_ERROR("The loop_ keyword may not be quoted or semicolon-delineated.");
+            }
+
+            if (outline == NULL){
+                loop = PyObject_CallMethod(options->loop_class, "from_scratch",
+                                           "(OO)", Py_None, options->source);
+                if (loop == NULL){
+                    goto error;
+                }
+            }
+            long num_columns = 0;
+            char * first_column = NULL;
+
+            // We are in a loop
+            while (true){
+                NEXT_TOKEN();
+                if (token == done_parsing){
+                    break;
+                }
+
+                // Add a column
+                if (token[0] == '_'){
+                    if (delineator != ' '){
+                        PARSE_ERROR("Loop tags may not be quoted or semicolon-delineated.");
+                    }
+                    if (outline != NULL){
+                        if ((first_column == NULL) && (strchr(token, '.') != NULL)){
+                            first_column = token;
+                        }
+                        num_columns++;
+                    } else if (!call_method(loop, "add_column", "(s)", token)){
+                        goto error;
+                    }
+                    continue;
+                }
+
+                // Read the data block through the stop_, converting the
+                //  values as we go if asked to, or just check it
+                long values;
+                bool converted = false;
+                if (outline == NULL){
+                    // Now that we have the columns we can add the loop
+                    //  to the current saveframe
+                    if (!call_method(frame, "add_loop", "(O)", loop)){
+                        goto error;
+                    }
+
+                    PyObject * columns = PyObject_GetAttrString(loop, "columns");
+                    PyObject * loop_category = PyObject_GetAttrString(loop, "category");
+                    if (loop_category != NULL){
+                        category = PyObject_Str(loop_category);
+                        Py_DECREF(loop_category);
+                    }
+                    if ((columns == NULL) || (category == NULL)){
+                        Py_XDECREF(columns);
+                        goto error;
+                    }
+                    num_columns = PyObject_Length(columns);
+                    Py_DECREF(columns);
+
+                    const char * category_name = string_data(category);
+                    PyObject * spec = (num_columns < 0) ? NULL :
+                                      PyObject_CallMethod(loop, "_get_conversions",
+                                                          "(O)", options->convert);
+                    converted = (spec != NULL) && (spec != Py_None);
+                    type_conversions types;
+                    if ((spec != NULL) && (category_name != NULL) &&
+                        load_type_conversions(&types, spec, num_columns)){
+                        rows = read_loop_rows(my_parser, num_columns,
+                                              category_name, &types, &token,
+                                              &line_no, &delineator);
+                        free_type_conversions(&types);
+                    }
+                    Py_XDECREF(spec);
+                    if (rows == NULL){
+                        goto error;
+                    }
+                    values = PyList_GET_SIZE(rows);
+                } else {
+                    // Loop.add_column() takes the category from the
+                    //  first column that has one
+                    if (first_column == NULL){
+                        Py_INCREF(Py_None);
+                        category = Py_None;
+                    } else {
+                        category = PyString_FromStringAndSize(first_column,
+                                                              strchr(first_column, '.') - first_column);
+                    }
+                    if ((category == NULL) ||
+                        (PyList_Append(outline->loop_categories, category) != 0)){
+                        goto error;
+                    }
+                    const char * category_name = (category == Py_None) ? "None" :
+                                                 string_data(category);
+                    if (category_name == NULL){
+                        goto error;
+                    }
+                    values = skip_loop_rows(my_parser, num_columns, category_name,
+                                            &token, &line_no, &delineator);
+                    if (values < 0){
+                        goto error;
+                    }
+                }
+                Py_CLEAR(category);
+
+                if (token != done_parsing){
+                    if ((num_columns == 0) && options->tag_only_loop_error){
+                        PARSE_ERROR("Loop with no tags.");
+                    }
+                    if ((values == 0) && options->empty_loop_error){
+                        PARSE_ERROR("Loop with no data.");
+                    }
+                    if ((rows != NULL) && (values > 0) &&
+                        (!call_method(loop, "_set_data", "(OiOO)", rows,
+                                      converted, options->columnar,
+                                      options->convert))){
+                        goto error;
+                    }
+                }
+                Py_CLEAR(rows);
+                break;
+            }
+            Py_CLEAR(loop);
+
+            if ((token == done_parsing) || (strcmp(token, "stop_") != 0)){
+                PARSE_ERROR("Loop improperly terminated at end of file.");
+            }
+        }
+
+        // Close saveframe
+        else if (strcmp(token, "save_") == 0){
+            if ((delineator != ' ') && (delineator != ';')){
+                PARSE_ERROR("The save_ keyword may not be quoted or semicolon-delineated.");
+            }
+            if (!options->allow_v2){
+                bool has_prefix;
+                if (outline != NULL){
+                    has_prefix = outline->prefix_tag != NULL;
+                } else {
+                    PyObject * tag_prefix = PyObject_GetAttrString(frame, "tag_prefix");
+                    if (tag_prefix == NULL){
+                        goto error;
+                    }
+                    Py_DECREF(tag_prefix);
+                    has_prefix = tag_prefix != Py_None;
+                }
+                if (!has_prefix){
+                    PyErr_Format(PyExc_ValueError, "The tag prefix was never set! Either the saveframe had no tags, you tried to read a version 2.1 file without setting ALLOW_V2_ENTRIES to True, or there is something else wrong with your file. Saveframe error occured: '%s'", frame_name);
+                    goto error;
+                }
+            }
+            break;
+        }
+
+        // Invalid content in saveframe
+        else if (token[0] != '_'){
+            raise_with_line(PyString_FromFormat("Invalid token found in saveframe '%s': '%s'", frame_name, token), line_no);
+            goto error;
+        }
+
+        // Add a tag
+        else {
+            if (delineator != ' '){
+                PARSE_ERROR("Saveframe tags may not be quoted or semicolon-delineated.");
+            }
+            char * tag = token;
+
+            // We are in a saveframe and waiting for the saveframe tag
+            NEXT_TOKEN();
+            if (token == done_parsing){
+                if (outline != NULL){
+                    if (!outline_tag(outline, tag, token)){
+                        goto error;
+                    }
+                } else if (!call_method(frame, "_add_tag", "(sOlO)", tag, Py_None,
+                                        line_no, options->convert)){
+                    goto error;
+                }
+                continue;
+            }
+            if ((delineator == ' ') && is_reserved(token)){
+                raise_with_line(PyString_FromFormat("Cannot use keywords as data values unless quoted or semi-colon delineated. Illegal value: %s", token), line_no);
+                goto error;
+            }
+            if (outline != NULL){
+                if (!outline_tag(outline, tag, token)){
+                    goto error;
+                }
+            } else if (!call_method(frame, "_add_tag", "(sslO)", tag, token,
+                                    line_no, options->convert)){
+                goto error;
+            }
+        }
+    }
+
+    if ((token == done_parsing) || (strcmp(token, "save_") != 0)){
+        PARSE_ERROR("Saveframe improperly terminated at end of file.");
+    }
+    return true;
+
+error:
+    Py_XDECREF(loop);
+    Py_XDECREF(category);
+    Py_XDECREF(rows);
+    return false;
+}
+
+/* Gives a saveframe that a lazy parse left empty what it needs to be
+   parsed later: the lazy object, where in the token cache it starts,
+   and what its outline found. */
+bool set_outline(PyObject * frame, PyObject * lazy, long position,
+                 saveframe_outline * outline){
+    PyObject * tag_prefix;
+    if (outline->prefix_tag == NULL){
+        Py_INCREF(Py_None);
+        tag_prefix = Py_None;
+    } else {
+        tag_prefix = PyString_FromStringAndSize(outline->prefix_tag,
+                                                strchr(outline->prefix_tag, '.') - outline->prefix_tag);
+        if (tag_prefix == NULL){
+            return false;
+        }
+    }
+
+    bool result = call_method(frame, "_set_outline", "(OlOOO)", lazy, position,
+                              tag_prefix, outline->category_tags,
+                              outline->loop_categories);
+    Py_DECREF(tag_prefix);
+    return result;
+}
+
+/* Runs the whole data_/save_/loop_/stop_ state machine over the tokens
+   of the given parser and builds the saveframes and loops in the entry.
+   This is a translation of bmrb._Parser.parse() and must raise the same
+   errors. The Saveframe and Loop methods are used to build the tree so
+   that all of their checks still apply. If lazy isn't NULL the
+   saveframes are only outlined, to be parsed with parse_saveframe()
+   when they are first used. */
+bool parse_entry(parser_data * my_parser, PyObject * entry,
+                 parse_options * options, PyObject * lazy){
+    char * token;
+    long line_no;
+    char delineator;
+    PyObject * frame = NULL;
+    char * frame_name = NULL;
+    saveframe_outline outline = {NULL, NULL, NULL};
+
+    // Make sure this is actually a STAR file
+    NEXT_TOKEN();
+    if ((token == done_parsing) || (!StartsWith(token, "data_"))){
+        PARSE_ERROR("Invalid file. NMR-STAR files must start with 'data_'. Did you accidentally select the wrong file?");
+    }
+    if (strlen(token) < 6){
+        PARSE_ERROR("'data_' must be followed by data name. Simply 'data_' is not allowed.");
+    }
+    if (delineator != ' '){
+        PyErr_SetString(PyExc_ValueError, "The data_ keyword may not be quoted or semicolon-delineated.");
+        goto error;
+    }
+
+    // Set the entry_id
+    PyObject * entry_id = PyString_FromString(token + 5);
+    if ((entry_id == NULL) || (PyObject_SetAttrString(entry, "entry_id", entry_id) != 0)){
+        Py_XDECREF(entry_id);
+        goto error;
+    }
+    Py_DECREF(entry_id);
+
+    // We are expecting to get saveframes
+    while (true){
+        NEXT_TOKEN();
+        if (token == done_parsing){
+            break;
+        }
+
+        if (!StartsWith(token, "save_")){
+            raise_with_line(PyString_FromFormat("Only 'save_NAME' is valid in the body of a NMR-STAR file. Found '%s'.", token), line_no);
+            goto error;
+        }
+        if (strlen(token) < 6){
+            PARSE_ERROR("'save_' must be followed by saveframe name. You have a 'save_' tag which is illegal without a specified saveframe name.");
+        }
+        if (delineator != ' '){
+            PARSE_ERROR("The save_ keyword may not be quoted or semicolon-delineated.");
+        }
+
+        // Add the saveframe. Keep our own copy of the name since the
+        //  tokens of a stream don't stick around.
+        free(frame_name);
+        frame_name = strdup(token + 5);
+        if (frame_name == NULL){
+            PyErr_NoMemory();
+            goto error;
+        }
+        frame = PyObject_CallMethod(options->saveframe_class, "from_scratch",
+                                    "(sOO)", frame_name, Py_None, options->source);
+        if ((frame == NULL) || (!call_method(entry, "add_saveframe", "(O)", frame))){
+            goto error;
+        }
+
+        // We are in a saveframe
+        if (lazy == NULL){
+            if (!parse_saveframe(my_parser, frame, frame_name, options, NULL)){
+                goto error;
+            }
+        } else {
+            long position = my_parser->cache.position;
+            outline.prefix_tag = NULL;
+            outline.category_tags = PyList_New(0);
+            outline.loop_categories = PyList_New(0);
+            if ((outline.category_tags == NULL) || (outline.loop_categories == NULL) ||
+                (!parse_saveframe(my_parser, frame, frame_name, options, &outline)) ||
+                (!set_outline(frame, lazy, position, &outline))){
+                goto error;
+            }
+            Py_CLEAR(outline.category_tags);
+            Py_CLEAR(outline.loop_categories);
+        }
+        Py_CLEAR(frame);
+    }
+
+    free(frame_name);
+    return true;
+
+error:
+    Py_XDECREF(frame);
+    Py_XDECREF(outline.category_tags);
+    Py_XDECREF(outline.loop_categories);
+    free(frame_name);
+    return false;
+}
+
+#undef NEXT_TOKEN
+#undef PARSE_ERROR
+
+static char * parse_keywords[] = {"entry", "saveframe_class", "loop_class",
+                                  "source", "allow_v2", "tag_only_loop_error",
+                                  "empty_loop_error", "lazy", "columnar",
+                                  "convert", NULL};
+
+/* Parses the already loaded data of the given parser into an entry. If
+   the caller can keep the parser around and passes an object as lazy,
+   the saveframes are only outlined and each one is given the object
+   (see parse_entry()). Streamed data is always parsed in full since
+   its tokens aren't kept. */
+static PyObject *
+parse_into(parser_data * my_parser, PyObject *args, PyObject *kwds,
+           bool can_defer)
+{
+    PyObject * entry;
+    PyObject * lazy = Py_None;
+    parse_options options = {NULL, NULL, NULL, 0, 0, 0, Py_None, Py_None};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|OiiiOOO", parse_keywords,
+                                     &entry, &options.saveframe_class,
+                                     &options.loop_class, &options.source,
+                                     &options.allow_v2,
+                                     &options.tag_only_loop_error,
+                                     &options.empty_loop_error, &lazy,
+                                     &options.columnar, &options.convert))
+        return NULL;
+
+    // Tokenize everything first so the tokens stay put while we parse
+    if (my_parser->cache.tokens == NULL){
+        Py_BEGIN_ALLOW_THREADS
+        tokenize_all(my_parser);
+        Py_END_ALLOW_THREADS
+    }
+
+    if (options.source == NULL){
+        options.source = PyString_FromString("unknown");
+    } else {
+        Py_INCREF(options.source);
+    }
+    if (options.source == NULL){
+        return NULL;
+    }
+
+    if ((lazy == Py_None) || (!can_defer) || (my_parser->stream != NULL)){
+        lazy = NULL;
+    }
+    bool parsed = parse_entry(my_parser, entry, &options, lazy);
+    Py_DECREF(options.source);
+    if (!parsed){
+        return NULL;
+    }
+
+    Py_INCREF(entry);
+    return entry;
+}
+
+static char * saveframe_keywords[] = {"frame", "position", "loop_class",
+                                      "source", "allow_v2",
+                                      "tag_only_loop_error",
+                                      "empty_loop_error", "columnar",
+                                      "convert", NULL};
+
+/* Parses the tags and loops of a saveframe that a lazy parse_into()
+   left empty, starting from the position it was given. */
+static PyObject *
+parse_saveframe_into(parser_data * my_parser, PyObject *args, PyObject *kwds)
+{
+    PyObject * frame;
+    long position;
+    parse_options options = {NULL, NULL, NULL, 0, 0, 0, Py_None, Py_None};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OlO|OiiiOO", saveframe_keywords,
+                                     &frame, &position, &options.loop_class,
+                                     &options.source, &options.allow_v2,
+                                     &options.tag_only_loop_error,
+                                     &options.empty_loop_error,
+                                     &options.columnar, &options.convert))
+        return NULL;
+
+    token_cache * cache = &my_parser->cache;
+    if ((cache->tokens == NULL) || (my_parser->stream != NULL) ||
+        (position < 0) || (position >= cache->count)){
+        PyErr_SetString(PyExc_ValueError, "The tokens of the saveframe are no longer loaded.");
+        return NULL;
+    }
+
+    PyObject * name = PyObject_GetAttrString(frame, "name");
+    PyObject * name_str = (name == NULL) ? NULL : PyObject_Str(name);
+    Py_XDECREF(name);
+    const char * frame_name = (name_str == NULL) ? NULL : string_data(name_str);
+    if (frame_name == NULL){
+        Py_XDECREF(name_str);
+        return NULL;
+    }
+
+    if (options.source == NULL){
+        options.source = PyString_FromString("unknown");
+    } else {
+        Py_INCREF(options.source);
+    }
+    if (options.source == NULL){
+        Py_DECREF(name_str);
+        return NULL;
+    }
+
+    // Put the position back afterwards in case this was called while
+    //  another saveframe was being parsed
+    long saved_position = cache->position;
+    cache->position = position;
+    bool parsed = parse_saveframe(my_parser, frame, frame_name, &options, NULL);
+    cache->position = saved_position;
+    Py_DECREF(options.source);
+    Py_DECREF(name_str);
+    if (!parsed){
+        return NULL;
+    }
+
+    Py_INCREF(frame);
+    return frame;
+}
+
+/* Calls a method of a sans_parse() handler. Returns 1 if it returned
+   something true, which means parsing should stop, 0 if it didn't and
+   -1 if it raised an exception. */
+int sans_callback(PyObject * handler, char * method, char * format, ...){
+    va_list va;
+    va_start(va, format);
+    PyObject * callable = PyObject_GetAttrString(handler, method);
+    PyObject * args = NULL;
+    PyObject * result = NULL;
+    if (callable != NULL){
+        args = Py_VaBuildValue(format, va);
+        if (args != NULL){
+            result = PyObject_Call(callable, args, NULL);
+        }
+    }
+    va_end(va);
+    Py_XDECREF(callable);
+    Py_XDECREF(args);
+    if (result == NULL){
+        return -1;
+    }
+    int stop = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    return stop;
+}
+
+/* Passes a message to a method of the error handler, taking over the
+   reference to the message. Returns what sans_callback() does. */
+int sans_report(PyObject * error_handler, char * method, long line_no, PyObject * message){
+    if (message == NULL){
+        return -1;
+    }
+    int stop = sans_callback(error_handler, method, "(lO)", line_no, message);
+    Py_DECREF(message);
+    return stop;
+}
+
+/* The number that sans_parse() handlers are given for a delineator. */
+int sans_delineator(char delineator){
+    switch (delineator){
+        case '\'': return 10;
+        case '"': return 11;
+        case ';': return 12;
+        case '$': return 13;
+        default: return 14;
+    }
+}
+
+// The loop that sans_parse_entry() is in the middle of
+typedef struct {
+    PyObject * loop;          // Checks the column names as they are added
+    PyObject * tags;          // The full tag name of each column
+    PyObject * rows;          // Rows waiting to be passed to loopRows()
+    PyObject * row;           // The row being filled in
+    long * column_lines;
+    long num_columns;
+    long column;              // The column of the next value
+} sans_loop;
+
+void sans_clear_loop(sans_loop * loop){
+    Py_CLEAR(loop->loop);
+    Py_CLEAR(loop->tags);
+    Py_CLEAR(loop->rows);
+    Py_CLEAR(loop->row);
+    free(loop->column_lines);
+    loop->column_lines = NULL;
+    loop->num_columns = 0;
+    loop->column = 0;
+}
+
+/* Passes the complete rows of the loop that haven't been passed on yet
+   to loopRows(). Returns what sans_callback() does. */
+int sans_flush_rows(PyObject * handler, sans_loop * loop){
+    if ((loop->rows == NULL) || (PyList_GET_SIZE(loop->rows) == 0)){
+        return 0;
+    }
+
+    int stop = -1;
+    PyObject * category = PyObject_GetAttrString(loop->loop, "category");
+    PyObject * column_names = PyObject_GetAttrString(loop->loop, "columns");
+    PyObject * columns = (column_names == NULL) ? NULL : PySequence_List(column_names);
+    if ((category != NULL) && (columns != NULL)){
+        stop = sans_callback(handler, "loopRows", "(OOO)", category, columns, loop->rows);
+    }
+    Py_XDECREF(category);
+    Py_XDECREF(column_names);
+    Py_XDECREF(columns);
+
+    // The handler has the rows now
+    Py_CLEAR(loop->rows);
+    return stop;
+}
+
+/* Adds a value of the loop to the row being filled in, and the row to
+   the rows waiting to be passed to loopRows() once it is complete. */
+bool sans_add_value(sans_loop * loop, PyObject * value){
+    if (loop->row == NULL){
+        loop->row = PyList_New(loop->num_columns);
+        if (loop->row == NULL){
+            return false;
+        }
+    }
+    Py_INCREF(value);
+    PyList_SET_ITEM(loop->row, loop->column, value);
+    if (loop->column < loop->num_columns - 1){
+        return true;
+    }
+
+    if (loop->rows == NULL){
+        loop->rows = PyList_New(0);
+        if (loop->rows == NULL){
+            return false;
+        }
+    }
+    bool added = (PyList_Append(loop->rows, loop->row) == 0);
+    Py_CLEAR(loop->row);
+    return added;
+}
+
+/* Builds the full tag name of each column of the loop. */
+bool sans_loop_tags(sans_loop * loop){
+    PyObject * category = PyObject_GetAttrString(loop->loop, "category");
+    PyObject * columns = PyObject_GetAttrString(loop->loop, "columns");
+    PyObject * dot = PyString_FromString(".");
+    PyObject * prefix = NULL;
+    bool success = false;
+    long x;
+
+    if ((category != NULL) && (columns != NULL) && (dot != NULL)){
+        prefix = PyNumber_Add(category, dot);
+        loop->tags = PyList_New(loop->num_columns);
+    }
+    if ((prefix != NULL) && (loop->tags != NULL)){
+        for (x=0; x<loop->num_columns; x++){
+            PyObject * column = PySequence_GetItem(columns, x);
+            PyObject * tag = (column == NULL) ? NULL : PyNumber_Add(prefix, column);
+            Py_XDECREF(column);
+            if (tag == NULL){
+                break;
+            }
+            PyList_SET_ITEM(loop->tags, x, tag);
+        }
+        success = (x == loop->num_columns);
+    }
+
+    Py_XDECREF(category);
+    Py_XDECREF(columns);
+    Py_XDECREF(dot);
+    Py_XDECREF(prefix);
+    return success;
+}
+
+// Fetch the next token in sans_parse_entry() or bail out
+#define SANS_NEXT_TOKEN() if (!fetch_token(my_parser, &token, &line_no, &delineator)){ \
+                              raise_parser_error(my_parser); \
+                              goto error; \
+                          }
+
+// Stop if a handler raised an exception or returned something true
+#define SANS_CALL(call) switch (call){ \
+                            case 0: break; \
+                            case -1: goto error; \
+                            default: goto done; \
+                        }
+
+// Tell the error handler about an error (or warning) and stop if it says to
+#define SANS_REPORT(method, message) SANS_CALL(sans_report(error_handler, method, line_no, message))
+
+// Tell the error handler about a fatal error and stop
+#define SANS_FATAL(message) if (sans_report(error_handler, "fatalError", line_no, message) < 0){ \
+                                goto error; \
+                            } \
+                            goto done;
+
+/* The state machine of sans_parse() in bmrb.py. It calls the methods of
+   the handler for each part of the entry and those of the error handler
+   for the problems it finds, exactly as _Parser.sans_parse() does. If
+   rows_per_call is positive the values of loops are passed to the
+   loopRows() method of the handler that many rows at a time rather than
+   to data() one at a time. Returns false if a handler raised an
+   exception. */
+bool sans_parse_entry(parser_data * my_parser, PyObject * handler,
+                      PyObject * error_handler, PyObject * loop_class,
+                      long rows_per_call){
+    char * token;
+    long line_no;
+    char delineator;
+    char * frame_name = NULL;
+    PyObject * data_name = NULL;
+    PyObject * data_method = NULL;
+    PyObject * tag = NULL;
+    PyObject * value = NULL;
+    sans_loop loop = {NULL, NULL, NULL, NULL, NULL, 0, 0};
+    bool success = true;
+
+    // Make sure this is actually a STAR file
+    SANS_NEXT_TOKEN();
+    if ((token == done_parsing) || (!StartsWith(token, "data_"))){
+        SANS_FATAL(PyString_FromString("Invalid file. NMR-STAR files must start with 'data_'. Did you accidentally select the wrong file?"));
+    } else if (strlen(token) < 6){
+        SANS_FATAL(PyString_FromString("'data_' must be followed by data name. Simply 'data_' is not allowed."));
+    }
+    if (delineator != ' '){
+        SANS_REPORT("warning", PyString_FromString("The data_ keyword may not be quoted or semicolon-delineated."));
+    }
+
+    // Start data
+    data_name = PyString_FromString(token + 5);
+    if (data_name == NULL){
+        goto error;
+    }
+    SANS_CALL(sans_callback(handler, "startData", "(lO)", line_no, data_name));
+
+    // We are expecting to get saveframes
+    while (true){
+        SANS_NEXT_TOKEN();
+        if (token == done_parsing){
+            break;
+        }
+
+        if (!StartsWith(token, "save_")){
+            SANS_FATAL(PyString_FromFormat("Only 'save_NAME' is valid in the bodyof a NMR-STAR file. Found '%s'.", token));
+        }
+        if (strlen(token) < 6){
+            SANS_FATAL(PyString_FromString("'save_' must be followed by saveframe name. You have a 'save_' tag which is illegal without a specified saveframe name."));
+        }
+        if (delineator != ' '){
+            SANS_REPORT("error", PyString_FromString("The save_ keyword may not be quoted or semicolon-delineated."));
+        }
+
+        // Keep our own copy of the name since the tokens of a stream
+        //  don't stick around
+        free(frame_name);
+        frame_name = strdup(token + 5);
+        if (frame_name == NULL){
+            PyErr_NoMemory();
+            goto error;
+        }
+        SANS_CALL(sans_callback(handler, "startSaveframe", "(ls)", line_no, frame_name));
+
+        // We are in a saveframe
+        while (true){
+            SANS_NEXT_TOKEN();
+            if (token == done_parsing){
+                break;
+            }
+
+            if (strcmp(token, "loop_") == 0){
+                if (delineator != ' '){
+                    SANS_REPORT("error", PyString_FromString("The loop_ keyword may not be quoted or semicolon-delineated."));
+                }
+
+                sans_clear_loop(&loop);
+                loop.loop = PyObject_CallMethod(loop_class, "from_scratch", NULL);
+                if (loop.loop == NULL){
+                    goto error;
+                }
+                SANS_CALL(sans_callback(handler, "startLoop", "(l)", line_no));
+
+                // Add the columns
+                bool seen_data = false;
+                SANS_NEXT_TOKEN();
+                while ((token != done_parsing) && (token[0] == '_')){
+                    if (delineator != ' '){
+                        SANS_REPORT("error", PyString_FromString("Loop tags may not be quoted or semicolon-delineated."));
+                    }
+                    if (!call_method(loop.loop, "add_column", "(s)", token)){
+                        goto error;
+                    }
+                    long * column_lines = realloc(loop.column_lines, (loop.num_columns + 1) * sizeof(long));
+                    if (column_lines == NULL){
+                        PyErr_NoMemory();
+                        goto error;
+                    }
+                    loop.column_lines = column_lines;
+                    loop.column_lines[loop.num_columns++] = line_no;
+                    SANS_NEXT_TOKEN();
+                }
+
+                // We are in the data block of the loop
+                while (token != done_parsing){
+                    if (strcmp(token, "stop_") == 0){
+                        SANS_CALL(sans_flush_rows(handler, &loop));
+                        if (delineator != ' '){
+                            SANS_REPORT("error", PyString_FromString("The stop_ keyword may not be quoted or semicolon-delineated."));
+                        }
+                        if (loop.num_columns == 0){
+                            SANS_REPORT("warning", PyString_FromString("Loop with no tags."));
+                        }
+                        if (!seen_data){
+                            SANS_REPORT("warning", PyString_FromString("Loop with no data."));
+                        }
+                        break;
+                    }
+
+                    if (loop.num_columns == 0){
+                        SANS_FATAL(PyString_FromString("Data found in loop before loop tags."));
+                    }
+                    if (is_reserved(token) && (delineator == ' ')){
+                        SANS_CALL(sans_flush_rows(handler, &loop));
+                        SANS_FATAL(PyString_FromFormat("Cannot use keywords as data values unless quoted or semi-colon delineated. Perhaps this is a loop that wasn't properly terminated? Illegal value: %s", token));
+                    }
+
+                    value = PyString_FromString((delineator == '$') ? token + 1 : token);
+                    if (value == NULL){
+                        goto error;
+                    }
+                    if (rows_per_call > 0){
+                        if (!sans_add_value(&loop, value)){
+                            goto error;
+                        }
+                        if ((loop.rows != NULL) && (PyList_GET_SIZE(loop.rows) >= rows_per_call)){
+                            SANS_CALL(sans_flush_rows(handler, &loop));
+                        }
+                    } else {
+                        if (data_method == NULL){
+                            data_method = PyObject_GetAttrString(handler, "data");
+                            if (data_method == NULL){
+                                goto error;
+                            }
+                        }
+                        if ((loop.tags == NULL) && (!sans_loop_tags(&loop))){
+                            goto error;
+                        }
+
+                        // The last value of each row is given the line
+                        //  number of the token rather than the one after
+                        PyObject * result = PyObject_CallFunction(
+                            data_method, "(OlOliO)",
+                            PyList_GET_ITEM(loop.tags, loop.column),
+                            loop.column_lines[loop.column], value,
+                            (loop.column == loop.num_columns - 1) ? line_no : line_no + 1,
+                            sans_delineator(delineator), Py_True);
+                        int stop = (result == NULL) ? -1 : PyObject_IsTrue(result);
+                        Py_XDECREF(result);
+                        SANS_CALL(stop);
+                    }
+                    Py_CLEAR(value);
+                    loop.column = (loop.column + 1) % loop.num_columns;
+                    seen_data = true;
+
+                    SANS_NEXT_TOKEN();
+                }
+
+                if ((token == done_parsing) || (strcmp(token, "stop_") != 0)){
+                    SANS_CALL(sans_flush_rows(handler, &loop));
+                    SANS_FATAL(PyString_FromString("Loop improperly terminated at end of file."));
+                }
+
+                // End of a loop
+                SANS_CALL(sans_callback(handler, "endLoop", "(l)", line_no));
+                if ((loop.num_columns > 0) && (loop.column != 0)){
+                    SANS_FATAL(PyString_FromString("Loop count error."));
+                }
+            }
+
+            // Close saveframe
+            else if (strcmp(token, "save_") == 0){
+                if ((delineator != ' ') && (delineator != ';')){
+                    SANS_REPORT("error", PyString_FromString("The save_ keyword may not be quoted or semicolon-delineated."));
+                }
+                SANS_CALL(sans_callback(handler, "endSaveframe", "(ls)", line_no, frame_name));
+                break;
+            }
+
+            // Invalid content in saveframe
+            else if (token[0] != '_'){
+                SANS_FATAL(PyString_FromFormat("Invalid token found in saveframe '%s': '%s'", frame_name, token));
+            }
+
+            // Add a tag
+            else {
+                if (delineator != ' '){
+                    SANS_REPORT("error", PyString_FromString("Saveframe tags may not be quoted or semicolon-delineated."));
+                }
+                Py_XDECREF(tag);
+                tag = PyString_FromString(token);
+                if (tag == NULL){
+                    goto error;
+                }
+                long tag_line = line_no;
+
+                // The value, which is None at the end of the file
+                SANS_NEXT_TOKEN();
+                if (token == done_parsing){
+                    Py_INCREF(Py_None);
+                    value = Py_None;
+                    delineator = ' ';
+                } else {
+                    if (is_reserved(token) && (delineator == ' ')){
+                        SANS_REPORT("error", PyString_FromFormat("Cannot use keywords as data values unless quoted or semi-colon delineated. Illegal value: %s", token));
+                    }
+                    value = PyString_FromString((delineator == '$') ? token + 1 : token);
+                    if (value == NULL){
+                        goto error;
+                    }
+                }
+
+                long value_line = line_no;
+                if ((delineator == '\'') || (delineator == '"') || (delineator == ';')){
+                    value_line++;
+                }
+                if (delineator == ';'){
+                    tag_line--;
+                }
+                SANS_CALL(sans_callback(handler, "data", "(OlOliO)", tag, tag_line + 1,
+                                        value, value_line, sans_delineator(delineator),
+                                        Py_False));
+                Py_CLEAR(value);
+            }
+        }
+
+        if ((token == done_parsing) || (strcmp(token, "save_") != 0)){
+            SANS_REPORT("error", PyString_FromString("Saveframe improperly terminated at end of file."));
+        }
+    }
+
+    // What endData() returns doesn't matter since we are done anyway
+    if (sans_callback(handler, "endData", "(lO)", line_no, data_name) < 0){
+        goto error;
+    }
+    goto done;
+
+error:
+    success = false;
+done:
+    sans_clear_loop(&loop);
+    Py_XDECREF(data_name);
+    Py_XDECREF(data_method);
+    Py_XDECREF(tag);
+    Py_XDECREF(value);
+    free(frame_name);
+    return success;
+}
+
+#undef SANS_NEXT_TOKEN
+#undef SANS_CALL
+#undef SANS_REPORT
+#undef SANS_FATAL
+
+/* Runs sans_parse_entry() on the loaded data. */
+static PyObject *
+sans_parse_into(parser_data * my_parser, PyObject *args)
+{
+    PyObject * handler, * error_handler, * loop_class;
+    long rows_per_call = 0;
+
+    if (!PyArg_ParseTuple(args, "OOO|l", &handler, &error_handler, &loop_class, &rows_per_call))
+        return NULL;
+
+    if (!sans_parse_entry(my_parser, handler, error_handler, loop_class, rows_per_call)){
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Parses a string into an entry without keeping any tokenizer state
+   around afterwards. */
+static PyObject *
+PARSE_parse(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    if (PyTuple_Size(args) < 1){
+        PyErr_SetString(PyExc_TypeError, "Please provide the data to parse.");
+        return NULL;
+    }
+
+    parser_data my_parser = {NULL, NULL, done_parsing, 0, 0, 0, 0, ' '};
+    PyObject * data_args = Py_BuildValue("(Oi)", PyTuple_GET_ITEM(args, 0), 1);
+    PyObject * parse_args = PyTuple_GetSlice(args, 1, PyTuple_Size(args));
+    PyObject * result = NULL;
+    if ((data_args == NULL) || (parse_args == NULL)){
+        goto done;
+    }
+
+    PyObject * loaded = load_string_into(&my_parser, data_args);
+    if (loaded == NULL){
+        goto done;
+    }
+    Py_DECREF(loaded);
+
+    Py_BEGIN_ALLOW_THREADS
+    tokenize_all(&my_parser);
+    Py_END_ALLOW_THREADS
+
+    result = parse_into(&my_parser, parse_args, kwds, false);
+
+done:
+    Py_XDECREF(data_args);
+    Py_XDECREF(parse_args);
+    reset_parser(&my_parser);
+    return result;
+}
+
+static PyObject *
+PARSE_get_token_full(PyObject *self)
+{
+    return get_token_full(&parser);
+}
+
+/* A tokenizer object. Each one owns its own parser state so that
+   multiple files can be tokenized at the same time. */
+typedef struct {
+    PyObject_HEAD
+    parser_data parser;
+} Tokenizer;
+
+static PyTypeObject TokenizerType;
+
+static PyObject *
+Tokenizer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Tokenizer *self = (Tokenizer *)type->tp_alloc(type, 0);
+    if (self == NULL){
+        return NULL;
+    }
+
+    // tp_alloc zeroes the memory so only the non-zero fields need setting
+    self->parser.token = done_parsing;
+    self->parser.last_delineator = ' ';
+
+    return (PyObject *)self;
+}
+
+static void
+Tokenizer_dealloc(Tokenizer *self)
+{
+    reset_parser(&self->parser);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+Tokenizer_load(Tokenizer *self, PyObject *args)
+{
+    return load_into(&self->parser, args);
+}
+
+static PyObject *
+Tokenizer_load_string(Tokenizer *self, PyObject *args)
+{
+    return load_string_into(&self->parser, args);
+}
+
+static PyObject *
+Tokenizer_get_token_full(Tokenizer *self)
+{
+    return get_token_full(&self->parser);
+}
+
+static PyObject *
+Tokenizer_get_loop_data(Tokenizer *self, PyObject *args)
+{
+    return get_loop_data(&self->parser, args);
+}
+
+static PyObject *
+Tokenizer_parse(Tokenizer *self, PyObject *args, PyObject *kwds)
+{
+    return parse_into(&self->parser, args, kwds, true);
+}
+
+static PyObject *
+Tokenizer_parse_saveframe(Tokenizer *self, PyObject *args, PyObject *kwds)
+{
+    return parse_saveframe_into(&self->parser, args, kwds);
+}
+
+static PyObject *
+Tokenizer_sans_parse(Tokenizer *self, PyObject *args)
+{
+    return sans_parse_into(&self->parser, args);
+}
+
+static PyObject *
+Tokenizer_tokenize(Tokenizer *self)
+{
+    // Nothing to do if we already did it
+    if (self->parser.cache.tokens != NULL){
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    tokenize_all(&self->parser);
+    Py_END_ALLOW_THREADS
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+Tokenizer_load_stream(Tokenizer *self, PyObject *args)
+{
+    PyObject * source = Py_None;
+    int normalize = 0;
+    long chunk_size = 1048576;
+
+    if (!PyArg_ParseTuple(args, "|Oil", &source, &normalize, &chunk_size))
+        return NULL;
+
+    if (chunk_size < 1){
+        PyErr_SetString(PyExc_ValueError, "The chunk size must be positive.");
+        return NULL;
+    }
+    if ((source != Py_None) && (!PyObject_HasAttrString(source, "read"))){
+        PyErr_SetString(PyExc_ValueError, "The source must have a read() method.");
+        return NULL;
+    }
+
+    parser_data * my_parser = &self->parser;
+    reset_parser(my_parser);
+
+    stream_state * stream = calloc(1, sizeof(stream_state));
+    my_parser->full_data = malloc(1);
+    my_parser->cache.tokens = malloc(sizeof(cached_token));
+    if ((stream == NULL) || (my_parser->full_data == NULL) || (my_parser->cache.tokens == NULL)){
+        free(stream);
+        return PyErr_NoMemory();
+    }
+    my_parser->full_data[0] = '\0';
+    my_parser->cache.capacity = 1;
+    my_parser->stream = stream;
+
+    stream->capacity = 1;
+    stream->chunk_size = chunk_size;
+    stream->normalize = normalize;
+    if (source != Py_None){
+        Py_INCREF(source);
+        stream->source = source;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+Tokenizer_feed(Tokenizer *self, PyObject *args)
+{
+    const char * data;
+    Py_ssize_t length;
+    int final = 0;
+
+    if (!PyArg_ParseTuple(args, "s#|i", &data, &length, &final))
+        return NULL;
+
+    parser_data * my_parser = &self->parser;
+    if ((my_parser->stream == NULL) || (my_parser->stream->source != NULL)){
+        PyErr_SetString(PyExc_ValueError, "Call load_stream() without a source before feeding data.");
+        return NULL;
+    }
+
+    // The tokens from last time have all been handed out
+    token_cache * cache = &my_parser->cache;
+    cache->count = 0;
+    cache->position = 0;
+    cache->text_length = 0;
+
+    // Tokenize gzipped data as it is decompressed rather than holding
+    //  all of it at once
+    bool appended;
+    Py_BEGIN_ALLOW_THREADS
+    appended = stream_append(my_parser, data, length, final);
+    while (appended){
+        stream_tokenize(my_parser);
+        if (!stream_inflating(my_parser)){
+            break;
+        }
+        appended = stream_inflate(my_parser);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!appended){
+        return PyErr_NoMemory();
+    }
+
+    // Hand out the tokens before an error first
+    if ((my_parser->error_type != NULL) && (cache->count == 0)){
+        raise_parser_error(my_parser);
+        return NULL;
+    }
+
+    PyObject * tokens = PyList_New(cache->count);
+    if (tokens == NULL){
+        return NULL;
+    }
+    long x;
+    for (x=0; x<cache->count; x++){
+        cached_token * cur = &cache->tokens[x];
+        PyObject * item = build_token_tuple(cache->text + cur->offset, cur->line_no, cur->delineator);
+        if (item == NULL){
+            Py_DECREF(tokens);
+            return NULL;
+        }
+        PyList_SET_ITEM(tokens, x, item);
+    }
+    cache->position = cache->count;
+
+    return tokens;
+}
+
+static PyObject *
+Tokenizer_buffer_size(Tokenizer *self)
+{
+    parser_data * my_parser = &self->parser;
+    if (my_parser->stream != NULL){
+        return PyLong_FromLong(my_parser->stream->capacity);
+    }
+    return PyLong_FromLong(my_parser->length);
+}
+
+static PyObject *
+Tokenizer_reset(Tokenizer *self)
+{
+    reset_parser(&self->parser);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+// The work shared between the parse_many() worker threads
+typedef struct {
+    char ** file_names;
+    parser_data ** parsers;
+    long count;
+    long next;
+    pthread_mutex_t lock;
+} parse_job;
+
+/* Worker thread for parse_many(). Runs without the GIL. */
+void * parse_worker(void * arg){
+    parse_job * job = (parse_job *)arg;
+
+    while (true){
+        pthread_mutex_lock(&job->lock);
+        long cur = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (cur >= job->count){
+            break;
+        }
+
+        parser_data * my_parser = job->parsers[cur];
+        get_file(job->file_names[cur], my_parser);
+        if ((my_parser->error_type == NULL) && (!prepare_data(my_parser))){
+            set_error(my_parser, PyExc_MemoryError, "Out of memory.");
+        }
+        tokenize_all(my_parser);
+    }
+
+    return NULL;
+}
+
+static PyObject *
+PARSE_parse_many(PyObject *self, PyObject *args)
+{
+    PyObject * paths;
+    int workers = 0;
+
+    if (!PyArg_ParseTuple(args, "O|i", &paths, &workers))
+        return NULL;
+
+    PyObject * path_list = PySequence_Fast(paths, "Please provide a list of file names.");
+    if (path_list == NULL){
+        return NULL;
+    }
+    long count = PySequence_Fast_GET_SIZE(path_list);
+
+    PyObject * result = PyList_New(count);
+    parse_job job;
+    job.file_names = malloc(sizeof(char *) * (count + 1));
+    job.parsers = malloc(sizeof(parser_data *) * (count + 1));
+    job.count = count;
+    job.next = 0;
+    if ((result == NULL) || (job.file_names == NULL) || (job.parsers == NULL)){
+        free(job.file_names);
+        free(job.parsers);
+        Py_XDECREF(result);
+        Py_DECREF(path_list);
+        return PyErr_NoMemory();
+    }
+
+    // Create a tokenizer for each file while we still have the GIL
+    long x;
+    for (x=0; x<count; x++){
+        PyObject * item = PySequence_Fast_GET_ITEM(path_list, x);
+    #if PY_MAJOR_VERSION >= 3
+        job.file_names[x] = (char *)PyUnicode_AsUTF8(item);
+    #else
+        job.file_names[x] = PyString_AsString(item);
+    #endif
+        Tokenizer * tokenizer = (Tokenizer *)Tokenizer_new(&TokenizerType, NULL, NULL);
+        if ((job.file_names[x] == NULL) || (tokenizer == NULL)){
+            Py_XDECREF(tokenizer);
+            free(job.file_names);
+            free(job.parsers);
+            Py_DECREF(result);
+            Py_DECREF(path_list);
+            return NULL;
+        }
+        job.parsers[x] = &tokenizer->parser;
+        reset_parser(job.parsers[x]);
+        PyList_SET_ITEM(result, x, (PyObject *)tokenizer);
+    }
+
+    if (workers <= 0){
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers > count){
+        workers = count;
+    }
+    if (workers < 1){
+        workers = 1;
+    }
+
+    // Read and tokenize the files without the GIL
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_t * threads = malloc(sizeof(pthread_t) * workers);
+    int started = 0;
+    if (threads != NULL){
+        for (started=0; started<workers; started++){
+            if (pthread_create(&threads[started], NULL, parse_worker, &job) != 0){
+                break;
+            }
+        }
+    }
+    // Do the work here if we couldn't start any threads
+    if (started == 0){
+        parse_worker(&job);
+    }
+    int y;
+    for (y=0; y<started; y++){
+        pthread_join(threads[y], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    Py_END_ALLOW_THREADS
+
+    free(job.file_names);
+    free(job.parsers);
+    Py_DECREF(path_list);
+    return result;
+}
+
+static PyMethodDef Tokenizer_methods[] = {
+    {"load",  (PyCFunction)Tokenizer_load, METH_VARARGS,
+     "Load a file in preparation to tokenize. Pass True as the second "
+     "argument to prepare it for the parser as well."},
+
+    {"load_string",  (PyCFunction)Tokenizer_load_string, METH_VARARGS,
+     "Load a string in preparation to tokenize. Pass True as the second "
+     "argument to prepare it for the parser as well."},
+
+    {"load_stream",  (PyCFunction)Tokenizer_load_stream, METH_VARARGS,
+     "Prepare to tokenize data that arrives a piece at a time. Data is "
+     "read from the read() method of the optional source as it is needed, "
+     "or else passed to feed(). Pass True as the second argument to "
+     "prepare it for the parser as well."},
+
+    {"feed",  (PyCFunction)Tokenizer_feed, METH_VARARGS,
+     "Add the next piece of a stream started with load_stream(). Returns "
+     "the tokens that are now complete. Pass True as the second argument "
+     "with the last piece. An error is raised once the tokens before it "
+     "have been returned."},
+
+    {"get_token_full",  (PyCFunction)Tokenizer_get_token_full, METH_NOARGS,
+     "Get one token from the file as well as the line number and delineator."},
+
+    {"get_loop_data",  (PyCFunction)Tokenizer_get_loop_data, METH_VARARGS,
+     "Read the values of a loop through the terminating stop_ and return "
+     "them as rows. Call after get_token_full() returns the first value."},
+
+    {"parse",  (PyCFunction)Tokenizer_parse, METH_VARARGS | METH_KEYWORDS,
+     "Parse the loaded data into the provided entry using the provided "
+     "Saveframe and Loop classes. Pass an object as lazy to only outline "
+     "the saveframes; each one is given it, the position its tokens start "
+     "at, its tag prefix, the values of its category tags and the "
+     "categories of its loops with _set_outline()."},
+
+    {"parse_saveframe",  (PyCFunction)Tokenizer_parse_saveframe, METH_VARARGS | METH_KEYWORDS,
+     "Parse the tags and loops of a saveframe outlined by a lazy parse() "
+     "into it, using the provided Loop class."},
+
+    {"sans_parse",  (PyCFunction)Tokenizer_sans_parse, METH_VARARGS,
+     "Run sans_parse() on the loaded data with the provided handlers and "
+     "Loop class, passing loop values to loopRows() rows_per_call rows at "
+     "a time if it is positive."},
+
+    {"tokenize",  (PyCFunction)Tokenizer_tokenize, METH_NOARGS,
+     "Tokenize all of the loaded data at once without holding the GIL."},
+
+    {"buffer_size",  (PyCFunction)Tokenizer_buffer_size, METH_NOARGS,
+     "Return the size of the buffer holding the loaded data. For streams "
+     "this is the largest it has grown to."},
+
+    {"reset",  (PyCFunction)Tokenizer_reset, METH_NOARGS,
+     "Reset the tokenizer state."},
+
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyTypeObject TokenizerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "cnmrstar.Tokenizer",                      /* tp_name */
+    sizeof(Tokenizer),                         /* tp_basicsize */
+    0,                                         /* tp_itemsize */
+    (destructor)Tokenizer_dealloc,             /* tp_dealloc */
+    0,                                         /* tp_print */
+    0,                                         /* tp_getattr */
+    0,                                         /* tp_setattr */
+    0,                                         /* tp_compare */
+    0,                                         /* tp_repr */
+    0,                                         /* tp_as_number */
+    0,                                         /* tp_as_sequence */
+    0,                                         /* tp_as_mapping */
+    0,                                         /* tp_hash */
+    0,                                         /* tp_call */
+    0,                                         /* tp_str */
+    0,                                         /* tp_getattro */
+    0,                                         /* tp_setattro */
+    0,                                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                        /* tp_flags */
+    "A NMR-STAR tokenizer with its own state.", /* tp_doc */
+    0,                                         /* tp_traverse */
+    0,                                         /* tp_clear */
+    0,                                         /* tp_richcompare */
+    0,                                         /* tp_weaklistoffset */
+    0,                                         /* tp_iter */
+    0,                                         /* tp_iternext */
+    Tokenizer_methods,                         /* tp_methods */
+    0,                                         /* tp_members */
+    0,                                         /* tp_getset */
+    0,                                         /* tp_base */
+    0,                                         /* tp_dict */
+    0,                                         /* tp_descr_get */
+    0,                                         /* tp_descr_set */
+    0,                                         /* tp_dictoffset */
+    0,                                         /* tp_init */
+    0,                                         /* tp_alloc */
+    Tokenizer_new,                             /* tp_new */
+};
+
+/* Text being written out in STAR format. */
+typedef struct {
+    char * text;
+    long length;
+    long capacity;
+    // If set, the text is passed to this a piece at a time rather than
+    //  all being kept. binary says whether to pass bytes or strings.
+    PyObject * sink;
+    bool binary;
+} star_writer;
+
+// STR_CONVERSION_DICT from bmrb.py and the types of its keys
+typedef struct {
+    PyObject * conversions;
+    PyObject * key_types;
+} value_conversions;
+
+/* Passes the text written so far to the sink. Returns false with a
+   python exception set on error. */
+bool writer_flush(star_writer * out){
+    if ((out->sink == NULL) || (out->length == 0)){
+        return true;
+    }
+#if PY_MAJOR_VERSION >= 3
+    PyObject * text = out->binary ? PyBytes_FromStringAndSize(out->text, out->length) :
+                                    PyUnicode_DecodeUTF8(out->text, out->length, NULL);
+#else
+    PyObject * text = PyString_FromStringAndSize(out->text, out->length);
+#endif
+    if (text == NULL){
+        return false;
+    }
+    PyObject * result = PyObject_CallFunctionObjArgs(out->sink, text, NULL);
+    Py_DECREF(text);
+    if (result == NULL){
+        return false;
+    }
+    Py_DECREF(result);
+    out->length = 0;
+    return true;
+}
+
+/* Makes room for size more bytes, first passing what has been written
+   to the sink if there is one and the buffer is full. Nothing is ever
+   reserved part way through a character so the text passed on is
+   always whole. Returns false with a python exception set on error. */
+bool writer_reserve(star_writer * out, long size){
+    if ((out->sink != NULL) && (out->length + size > write_chunk) && (!writer_flush(out))){
+        return false;
+    }
+    if (out->length + size <= out->capacity){
+        return true;
+    }
+    long capacity = out->capacity * 2;
+    if (capacity < out->length + size){
+        capacity = out->length + size;
+    }
+    char * resized = realloc(out->text, capacity);
+    if (resized == NULL){
+        PyErr_NoMemory();
+        return false;
+    }
+    out->text = resized;
+    out->capacity = capacity;
+    return true;
+}
+
+/* Adds text that there is already room for. */
+static inline void writer_put(star_writer * out, const char * text, long length){
+    memcpy(out->text + out->length, text, length);
+    out->length += length;
+}
+
+/* Adds count spaces that there is already room for. */
+static inline void writer_pad(star_writer * out, long count){
+    if (count > 0){
+        memset(out->text + out->length, ' ', count);
+        out->length += count;
+    }
+}
+
+/* Adds the text, making room for it first. */
+bool writer_add(star_writer * out, const char * text, long length){
+    if (!writer_reserve(out, length)){
+        return false;
+    }
+    writer_put(out, text, length);
+    return true;
+}
+
+/* Turns the written text into a python string. */
+PyObject * writer_result(star_writer * out){
+#if PY_MAJOR_VERSION >= 3
+    PyObject * result = PyUnicode_DecodeUTF8(out->text, out->length, NULL);
+#else
+    PyObject * result = PyString_FromStringAndSize(out->text, out->length);
+#endif
+    free(out->text);
+    return result;
+}
+
+/* Returns the number of characters python counts in the UTF-8 text.
+   Python 2 strings are counted in bytes. */
+long text_width(const char * text, long length){
+#if PY_MAJOR_VERSION >= 3
+    long x, width = 0;
+    for (x=0; x<length; x++){
+        if ((text[x] & 0xC0) != 0x80){
+            width++;
+        }
+    }
+    return width;
+#else
+    return length;
+#endif
+}
+
+/* Gets the UTF-8 contents of a python string without copying them.
+   Returns false without an exception set if it isn't a string or
+   can't be encoded. */
+bool string_contents(PyObject * string, const char ** text, Py_ssize_t * length, bool * ascii){
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(string)){
+        return false;
+    }
+    *text = PyUnicode_AsUTF8AndSize(string, length);
+    if (*text == NULL){
+        PyErr_Clear();
+        return false;
+    }
+    *ascii = PyUnicode_IS_ASCII(string);
+#else
+    if (!PyString_Check(string)){
+        return false;
+    }
+    PyString_AsStringAndSize(string, (char **)text, length);
+    *ascii = true;
+#endif
+    return true;
+}
+
+/* Adds a python string to the writer. Returns its width in characters,
+   or -1 with an exception set if it isn't a string. */
+long write_string(star_writer * out, PyObject * string){
+    const char * text;
+    Py_ssize_t length;
+    bool ascii;
+
+    if (!string_contents(string, &text, &length, &ascii)){
+        if (!PyErr_Occurred()){
+            PyErr_SetString(PyExc_TypeError, "Only strings can be written out.");
+        }
+        return -1;
+    }
+    if (!writer_add(out, text, length)){
+        return -1;
+    }
+    return ascii ? length : text_width(text, length);
+}
+
+/* What clean_into() needs to know about a value to decide how to quote
+   it, found in one pass over it. */
+typedef struct {
+    long newlines;
+    bool semicolon_line;
+    bool whitespace;
+    bool single;
+    bool double_;
+    bool single_before_space;
+    bool double_before_space;
+} value_class;
+
+void classify_value(value_class * cls, const char * str, long len){
+    long x;
+    memset(cls, 0, sizeof(value_class));
+    for (x=0; x<len; x++){
+        switch (str[x]){
+            case '\n':
+                cls->newlines++;
+                if ((x+1 < len) && (str[x+1] == ';')){
+                    cls->semicolon_line = true;
+                }
+                break;
+            case '\'':
+                cls->single = true;
+                if ((x+1 < len) && is_whitespace(str[x+1])){
+                    cls->single_before_space = true;
+                }
+                continue;
+            case '"':
+                cls->double_ = true;
+                if ((x+1 < len) && is_whitespace(str[x+1])){
+                    cls->double_before_space = true;
+                }
+                continue;
+        }
+        if (is_whitespace(str[x])){
+            cls->whitespace = true;
+        }
+    }
+}
+
+/* Quotes the value the same way clean_value() in bmrb.py does and adds
+   it to the writer. The value can't be empty or have null bytes in it.
+   Returns false if out of memory. */
+bool clean_into(star_writer * out, const char * str, long len){
+    value_class cls;
+    classify_value(&cls, str, len);
+
+    // If it is a STAR-format multiline comment already, indent it
+    if (cls.semicolon_line){
+        long x;
+        if (!writer_reserve(out, len + cls.newlines * 3 + 5)){
+            return false;
+        }
+
+        // Must start with a newline and always end with one
+        if (str[0] != '\n'){
+            writer_put(out, "\n   ", 4);
+        }
+        for (x=0; x<len; x++){
+            out->text[out->length++] = str[x];
+            if (str[x] == '\n'){
+                writer_put(out, "   ", 3);
+            }
+        }
+        writer_put(out, "\n", 1);
+        return true;
+    }
+
+    if (!writer_reserve(out, len + 2)){
+        return false;
+    }
+
+    // If it's going on it's own line, don't touch it
+    if (cls.newlines > 0){
+        writer_put(out, str, len);
+        if (str[len-1] != '\n'){
+            writer_put(out, "\n", 1);
+        }
+        return true;
+    }
+
+    // With both kinds of quotes in it use whichever kind isn't followed
+    //  by whitespace inside the value, or put it on its own line
+    if (cls.double_ && cls.single){
+        if (cls.single_before_space && cls.double_before_space){
+            writer_put(out, str, len);
+            writer_put(out, "\n", 1);
+        } else {
+            char quote = cls.single_before_space ? '"' : '\'';
+            writer_put(out, &quote, 1);
+            writer_put(out, str, len);
+            writer_put(out, &quote, 1);
+        }
+        return true;
+    }
+
+    // Quote values that start like a tag, keyword, quoted value or
+    //  comment or that have whitespace in them
+    bool needs_wrapping = cls.whitespace || (str[0] == '_') || (str[0] == '"') || (str[0] == '\'') || (str[0] == '#') ||
+                          ((len >= 5) && ((memcmp(str, "data_", 5) == 0) || (memcmp(str, "save_", 5) == 0) ||
+                                          (memcmp(str, "loop_", 5) == 0) || (memcmp(str, "stop_", 5) == 0))) ||
+                          ((len >= 7) && (memcmp(str, "global_", 7) == 0));
+
+    if (needs_wrapping){
+        // If there is a single quote wrap in double quotes
+        char quote = cls.single ? '"' : '\'';
+        writer_put(out, &quote, 1);
+        writer_put(out, str, len);
+        writer_put(out, &quote, 1);
+    } else {
+        writer_put(out, str, len);
+    }
+    return true;
+}
+
+/*
+    Automatically quotes the value in the appropriate way. Don't
+    quote values you send to this method or they will show up in
+    another set of quotes as part of the actual data. E.g.:
+
+    clean_value('"e. coli"') returns '\'"e. coli"\''
+
+    while
+
+    clean_value("e. coli") returns "'e. coli'"
+*/
+static PyObject * clean_string(PyObject *self, PyObject *args){
+    char * str;
+    star_writer out = {NULL, 0, 0};
+
+    // Get the string to clean
+    if (!PyArg_ParseTuple(args, "s", &str))
+        return NULL;
+
+    // Don't allow the empty string
+    if (str[0] == '\0'){
+        PyErr_SetString(PyExc_ValueError, "Empty strings are not allowed as values. Use a '.' or a '?' if needed.");
+        return NULL;
+    }
+
+    if (!clean_into(&out, str, strlen(str))){
+        free(out.text);
+        return NULL;
+    }
+    return writer_result(&out);
+}
+
+/* Does what clean_value() in bmrb.py does after the conversions with a
+   value that clean_into() can't take. Returns a new reference. */
+PyObject * clean_object(PyObject * value){
+    PyObject * args = PyTuple_Pack(1, value);
+    if (args == NULL){
+        return NULL;
+    }
+    PyObject * result = clean_string(NULL, args);
+    Py_DECREF(args);
+
+    // Try again with it as a string
+    if ((result == NULL) && (PyErr_ExceptionMatches(PyExc_ValueError) ||
+                             PyErr_ExceptionMatches(PyExc_TypeError))){
+        PyErr_Clear();
+        PyObject * string = PyObject_Str(value);
+        if (string == NULL){
+            return NULL;
+        }
+        args = PyTuple_Pack(1, string);
+        Py_DECREF(string);
+        if (args == NULL){
+            return NULL;
+        }
+        result = clean_string(NULL, args);
+        Py_DECREF(args);
+    }
+    return result;
+}
+
+/* Sets up the conversions, finding the types of the keys. Returns false
+   with an exception set on error. */
+bool load_conversions(value_conversions * conv, PyObject * conversions){
+    conv->conversions = conversions;
+    conv->key_types = NULL;
+
+    PyObject * types = PyList_New(0);
+    PyObject * keys = PyObject_GetIter(conversions);
+    PyObject * key;
+    if ((types == NULL) || (keys == NULL)){
+        Py_XDECREF(types);
+        Py_XDECREF(keys);
+        return false;
+    }
+    while ((key = PyIter_Next(keys)) != NULL){
+        int added = PyList_Append(types, (PyObject *)Py_TYPE(key));
+        Py_DECREF(key);
+        if (added != 0){
+            break;
+        }
+    }
+    Py_DECREF(keys);
+    if (PyErr_Occurred()){
+        Py_DECREF(types);
+        return false;
+    }
+    conv->key_types = types;
+    return true;
+}
+
+/* Quotes the value the way clean_value() in bmrb.py does and adds it to
+   the writer. Returns its width in characters, or -1 on error. */
+long write_value(star_writer * out, PyObject * value, value_conversions * conv){
+    PyObject * converted = NULL;
+
+    // Allow manual specification of conversions for booleans, Nones, etc.
+    int found = PySequence_Contains(conv->conversions, value);
+    if (found < 0){
+        return -1;
+    }
+    if (found){
+        Py_ssize_t x;
+        for (x=0; x<PyList_GET_SIZE(conv->key_types); x++){
+            int matches = PyObject_IsInstance(value, PyList_GET_ITEM(conv->key_types, x));
+            if (matches < 0){
+                return -1;
+            }
+            if (matches){
+                converted = PyObject_GetItem(conv->conversions, value);
+                if (converted == NULL){
+                    return -1;
+                }
+                value = converted;
+                break;
+            }
+        }
+    }
+
+    const char * text;
+    Py_ssize_t length;
+    bool ascii;
+    long width;
+
+    // Most values are strings that can be quoted straight into the writer
+    if (string_contents(value, &text, &length, &ascii) && (length > 0) &&
+        (memchr(text, '\0', length) == NULL)){
+        long start = out->length;
+        if (!clean_into(out, text, length)){
+            width = -1;
+        } else if (ascii){
+            width = out->length - start;
+        } else {
+            width = text_width(out->text + start, out->length - start);
+        }
+    } else {
+        PyObject * cleaned = clean_object(value);
+        width = (cleaned == NULL) ? -1 : write_string(out, cleaned);
+        Py_XDECREF(cleaned);
+    }
+
+    Py_XDECREF(converted);
+    return width;
+}
+
+/* Returns prefix + "." the way python works it out. */
+PyObject * with_dot(PyObject * prefix){
+    PyObject * dot = PyString_FromString(".");
+    if (dot == NULL){
+        return NULL;
+    }
+    PyObject * result = PyNumber_Add(prefix, dot);
+    Py_DECREF(dot);
+    return result;
+}
+
+/* Raises a ValueError with the message formatted with str() of the
+   object. */
+void raise_about(const char * format, PyObject * object){
+    PyObject * string = PyObject_Str(object);
+    if (string != NULL){
+        const char * text = string_data(string);
+        if (text != NULL){
+            PyErr_Format(PyExc_ValueError, format, text);
+        }
+        Py_DECREF(string);
+    }
+}
+
+/* Writes out the rows of a loop with the columns padded to the widest
+   value in them, keeping all of the quoted values to write the rows into
+   space reserved for all of them at once. */
+bool write_rows(star_writer * out, PyObject ** rows, Py_ssize_t num_rows,
+                Py_ssize_t num_columns, value_conversions * conv){
+    long * offsets = malloc((num_rows * num_columns + 1) * sizeof(long));
+    long * widths = malloc((num_rows * num_columns + 1) * sizeof(long));
+    long * column_widths = calloc(num_columns, sizeof(long));
+    star_writer values = {NULL, 0, 0};
+    Py_ssize_t row, column;
+    long cell = 0;
+    bool success = false;
+
+    if ((offsets == NULL) || (widths == NULL) || (column_widths == NULL)){
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    // Quote all of the values, keeping track of the widest in each column
+    for (row=0; row<num_rows; row++){
+        PyObject ** items = PySequence_Fast_ITEMS(rows[row]);
+        for (column=0; column<num_columns; column++, cell++){
+            offsets[cell] = values.length;
+            widths[cell] = write_value(&values, items[column], conv);
+            if (widths[cell] < 0){
+                goto done;
+            }
+            if (widths[cell] + 3 > column_widths[column]){
+                column_widths[column] = widths[cell] + 3;
+            }
+        }
+    }
+    offsets[cell] = values.length;
+
+    // Work out exactly how much space the rows need. Values with
+    //  newlines in them go on their own lines between semicolons.
+    long size = num_rows * 7;
+    for (cell=0; cell<num_rows*num_columns; cell++){
+        long length = offsets[cell + 1] - offsets[cell];
+        long width = widths[cell];
+        if (memchr(values.text + offsets[cell], '\n', length) != NULL){
+            length += 5;
+            width += 5;
+        }
+        column = cell % num_columns;
+        size += length + ((column_widths[column] > width) ? column_widths[column] - width : 0);
+    }
+    if (!writer_reserve(out, size)){
+        goto done;
+    }
+
+    // Write the data, with the columns sized appropriately
+    for (cell=0, row=0; row<num_rows; row++){
+        writer_put(out, "     ", 5);
+        for (column=0; column<num_columns; column++, cell++){
+            const char * value = values.text + offsets[cell];
+            long length = offsets[cell + 1] - offsets[cell];
+            long width = widths[cell];
+            if (memchr(value, '\n', length) != NULL){
+                writer_put(out, "\n;\n", 3);
+                writer_put(out, value, length);
+                writer_put(out, ";\n", 2);
+                width += 5;
+            } else {
+                writer_put(out, value, length);
+            }
+            writer_pad(out, column_widths[column] - width);
+        }
+        writer_put(out, " \n", 2);
+    }
+    success = true;
+
+done:
+    free(offsets);
+    free(widths);
+    free(column_widths);
+    free(values.text);
+    return success;
+}
+
+/* Does what write_rows() does without keeping the quoted values. They
+   are quoted once to find the widths of the columns and again as they
+   are written, so only a bufferful of the loop is held at a time. */
+bool stream_rows(star_writer * out, PyObject ** rows, Py_ssize_t num_rows,
+                 Py_ssize_t num_columns, value_conversions * conv){
+    long * column_widths = calloc(num_columns, sizeof(long));
+    star_writer value = {NULL, 0, 0};
+    Py_ssize_t row, column;
+    bool success = false;
+
+    if (column_widths == NULL){
+        PyErr_NoMemory();
+        return false;
+    }
+
+    for (row=0; row<num_rows; row++){
+        PyObject ** items = PySequence_Fast_ITEMS(rows[row]);
+        for (column=0; column<num_columns; column++){
+            value.length = 0;
+            long width = write_value(&value, items[column], conv);
+            if (width < 0){
+                goto done;
+            }
+            if (width + 3 > column_widths[column]){
+                column_widths[column] = width + 3;
+            }
+        }
+    }
+
+    for (row=0; row<num_rows; row++){
+        PyObject ** items = PySequence_Fast_ITEMS(rows[row]);
+        if (!writer_add(out, "     ", 5)){
+            goto done;
+        }
+        for (column=0; column<num_columns; column++){
+            value.length = 0;
+            long width = write_value(&value, items[column], conv);
+            if ((width < 0) || (!writer_reserve(out, value.length + column_widths[column] + 5))){
+                goto done;
+            }
+            if (memchr(value.text, '\n', value.length) != NULL){
+                writer_put(out, "\n;\n", 3);
+                writer_put(out, value.text, value.length);
+                writer_put(out, ";\n", 2);
+                width += 5;
+            } else {
+                writer_put(out, value.text, value.length);
+            }
+            writer_pad(out, column_widths[column] - width);
+        }
+        if (!writer_add(out, " \n", 2)){
+            goto done;
+        }
+    }
+    success = true;
+
+done:
+    free(column_widths);
+    free(value.text);
+    return success;
+}
+
+/* Writes the loop out the way Loop.__str__() in bmrb.py does. Returns
+   false with an exception set on error. */
+bool write_loop(star_writer * out, PyObject * loop, value_conversions * conv,
+                bool skip_empty, bool allow_v2){
+    PyObject * category = PyObject_GetAttrString(loop, "category");
+    PyObject * columns = NULL, * data = NULL, * prefix = NULL;
+    PyObject ** rows = NULL;
+    Py_ssize_t num_rows = 0, num_columns = 0, row, column;
+    bool success = false;
+
+    if (category == NULL){
+        goto done;
+    }
+    columns = PyObject_GetAttrString(loop, "columns");
+    PyObject * loop_data = (columns == NULL) ? NULL : PyObject_GetAttrString(loop, "data");
+    if (loop_data == NULL){
+        goto done;
+    }
+    data = PySequence_Fast(loop_data, "The loop data must be a list.");
+    Py_DECREF(loop_data);
+    if (data == NULL){
+        goto done;
+    }
+    num_rows = PySequence_Fast_GET_SIZE(data);
+    num_columns = PyObject_Length(columns);
+    if (num_columns < 0){
+        goto done;
+    }
+
+    // Check if there is any data in this loop
+    if (num_rows == 0){
+        // They do not want us to print empty loops
+        if (skip_empty){
+            success = true;
+            goto done;
+        }
+        // If we have no columns than write the empty loop
+        if (num_columns == 0){
+            success = writer_add(out, "\n   loop_\n\n   stop_\n", 20);
+            goto done;
+        }
+    }
+
+    if (num_columns == 0){
+        raise_about("Impossible to print data if there are no associated tags. Loop: '%s'.", category);
+        goto done;
+    }
+
+    // Make sure the data is the same width as the column tags
+    rows = calloc(num_rows + 1, sizeof(PyObject *));
+    if (rows == NULL){
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (row=0; row<num_rows; row++){
+        rows[row] = PySequence_Fast(PySequence_Fast_GET_ITEM(data, row), "Each row of a loop must be a list.");
+        if (rows[row] == NULL){
+            goto done;
+        }
+        if (PySequence_Fast_GET_SIZE(rows[row]) != num_columns){
+            raise_about("The number of column tags must matchwidth of the data. Loop: '%s'.", category);
+            goto done;
+        }
+    }
+
+    if ((category == Py_None) && (!allow_v2)){
+        PyErr_SetString(PyExc_ValueError, "The category was never set for this loop. Either add a column with the category intact, specify it when generating the loop, or set it using set_category.");
+        goto done;
+    }
+
+    // Write the column tags
+    if (!writer_add(out, "\n   loop_\n", 10)){
+        goto done;
+    }
+    if (category != Py_None){
+        prefix = with_dot(category);
+        if (prefix == NULL){
+            goto done;
+        }
+    }
+    for (column=0; column<num_columns; column++){
+        PyObject * name = PySequence_GetItem(columns, column);
+        PyObject * tag = NULL;
+        if (name != NULL){
+            tag = (prefix == NULL) ? PyObject_Str(name) : PyNumber_Add(prefix, name);
+            Py_DECREF(name);
+        }
+        if ((tag == NULL) || (!writer_add(out, "      ", 6)) ||
+            (write_string(out, tag) < 0) || (!writer_add(out, "\n", 1))){
+            Py_XDECREF(tag);
+            goto done;
+        }
+        Py_DECREF(tag);
+    }
+    if (!writer_add(out, "\n", 1)){
+        goto done;
+    }
+
+    // Write the data and close the loop
+    if (out->sink == NULL){
+        success = write_rows(out, rows, num_rows, num_columns, conv);
+    } else {
+        success = stream_rows(out, rows, num_rows, num_columns, conv);
+    }
+    success = success && writer_add(out, "   stop_\n", 9);
+
+done:
+    if (rows != NULL){
+        for (row=0; row<num_rows; row++){
+            Py_XDECREF(rows[row]);
+        }
+        free(rows);
+    }
+    Py_XDECREF(prefix);
+    Py_XDECREF(data);
+    Py_XDECREF(columns);
+    Py_XDECREF(category);
+    return success;
+}
+
+/* Does what clean_value() in bmrb.py does to each of the values, with
+   the conversions worked out once rather than for every value. Returns
+   a list of the quoted values or, if widths is set, of their lengths. */
+static PyObject *
+PARSE_clean_values(PyObject *self, PyObject *args)
+{
+    PyObject * values, * conversions, * items, * result;
+    int widths = 0;
+    value_conversions conv;
+    star_writer out = {NULL, 0, 0};
+    Py_ssize_t x;
+
+    if (!PyArg_ParseTuple(args, "OO|i", &values, &conversions, &widths))
+        return NULL;
+
+    items = PySequence_Fast(values, "The values must be a list or other sequence.");
+    if (items == NULL){
+        return NULL;
+    }
+    if (!load_conversions(&conv, conversions)){
+        Py_DECREF(items);
+        return NULL;
+    }
+    result = PyList_New(PySequence_Fast_GET_SIZE(items));
+
+    for (x=0; (result != NULL) && (x<PySequence_Fast_GET_SIZE(items)); x++){
+        out.length = 0;
+        long width = write_value(&out, PySequence_Fast_GET_ITEM(items, x), &conv);
+        PyObject * item = NULL;
+        if (width >= 0){
+#if PY_MAJOR_VERSION >= 3
+            item = widths ? PyLong_FromLong(width) : PyUnicode_DecodeUTF8(out.text, out.length, NULL);
+#else
+            item = widths ? PyInt_FromLong(width) : PyString_FromStringAndSize(out.text, out.length);
+#endif
+        }
+        if (item == NULL){
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, x, item);
+    }
+
+    free(out.text);
+    Py_DECREF(conv.key_types);
+    Py_DECREF(items);
+    return result;
+}
+
+/* A 64 bit FNV-1a hash of the bytes, mixed at the end so that similar
+   text doesn't give similar hashes. */
+static uint64_t hash_bytes(const char * text, long length){
+    uint64_t hash = 14695981039346656037ULL;
+    long x;
+    for (x=0; x<length; x++){
+        hash = (hash ^ (unsigned char)text[x]) * 1099511628211ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/* Writes the values of the row into out as clean_values() in bmrb.py
+   quotes them, kept apart by nulls, which quoted values never have.
+   Returns false with a python exception set if that failed. */
+static bool write_row(star_writer * out, PyObject * row, value_conversions * conv){
+    PyObject * items = PySequence_Fast(row, "Each row must be a list or other sequence.");
+    if (items == NULL){
+        return false;
+    }
+
+    Py_ssize_t x;
+    out->length = 0;
+    for (x=0; x<PySequence_Fast_GET_SIZE(items); x++){
+        if ((write_value(out, PySequence_Fast_GET_ITEM(items, x), conv) < 0) ||
+            (!writer_add(out, "", 1))){
+            break;
+        }
+    }
+    Py_DECREF(items);
+    return !PyErr_Occurred();
+}
+
+/* Returns a 64 bit hash of each row as bytes to load into an array. The
+   values are hashed as clean_values() in bmrb.py quotes them, so two
+   rows hash the same if they are written out the same. */
+static PyObject *
+PARSE_row_hashes(PyObject *self, PyObject *args)
+{
+    PyObject * rows, * conversions, * iterator, * row, * result = NULL;
+    value_conversions conv;
+    star_writer out = {NULL, 0, 0};
+    star_writer hashes = {NULL, 0, 0};
+
+    if (!PyArg_ParseTuple(args, "OO", &rows, &conversions))
+        return NULL;
+
+    iterator = PyObject_GetIter(rows);
+    if (iterator == NULL){
+        return NULL;
+    }
+    if (!load_conversions(&conv, conversions)){
+        Py_DECREF(iterator);
+        return NULL;
+    }
+
+    while ((row = PyIter_Next(iterator)) != NULL){
+        bool written = write_row(&out, row, &conv);
+        Py_DECREF(row);
+        if (!written){
+            break;
+        }
+
+        uint64_t hash = hash_bytes(out.text, out.length);
+        if (!writer_add(&hashes, (char *)&hash, sizeof(hash))){
+            break;
+        }
+    }
+
+    if (!PyErr_Occurred()){
+        result = PyBytes_FromStringAndSize(hashes.text, hashes.length);
+    }
+    free(out.text);
+    free(hashes.text);
+    Py_DECREF(conv.key_types);
+    Py_DECREF(iterator);
+    return result;
+}
+
+/* Returns True if each row of the first list is written out the same as
+   the row in its place in the second list by clean_values() in bmrb.py.
+   Used to rule out hash collisions once row_hashes() match. */
+static PyObject *
+PARSE_same_rows(PyObject *self, PyObject *args)
+{
+    PyObject * rows, * other_rows, * conversions, * row_items, * other_items;
+    PyObject * result = NULL;
+    value_conversions conv;
+    star_writer out = {NULL, 0, 0};
+    star_writer other_out = {NULL, 0, 0};
+
+    if (!PyArg_ParseTuple(args, "OOO", &rows, &other_rows, &conversions))
+        return NULL;
+
+    row_items = PySequence_Fast(rows, "The rows must be a list or other sequence.");
+    if (row_items == NULL){
+        return NULL;
+    }
+    other_items = PySequence_Fast(other_rows, "The rows must be a list or other sequence.");
+    if (other_items == NULL){
+        Py_DECREF(row_items);
+        return NULL;
+    }
+    if (!load_conversions(&conv, conversions)){
+        Py_DECREF(row_items);
+        Py_DECREF(other_items);
+        return NULL;
+    }
+
+    bool same = (PySequence_Fast_GET_SIZE(row_items) == PySequence_Fast_GET_SIZE(other_items));
+    Py_ssize_t x;
+    for (x=0; same && (x<PySequence_Fast_GET_SIZE(row_items)); x++){
+        if ((!write_row(&out, PySequence_Fast_GET_ITEM(row_items, x), &conv)) ||
+            (!write_row(&other_out, PySequence_Fast_GET_ITEM(other_items, x), &conv))){
+            break;
+        }
+        same = ((out.length == other_out.length) &&
+                (memcmp(out.text, other_out.text, out.length) == 0));
+    }
+
+    if (!PyErr_Occurred()){
+        result = PyBool_FromLong(same);
+    }
+    free(out.text);
+    free(other_out.text);
+    Py_DECREF(conv.key_types);
+    Py_DECREF(row_items);
+    Py_DECREF(other_items);
+    return result;
+}
+
+/* A column to sort the rows by: the value of each row, and the values as
+   numbers if they all can be made into floats. */
+typedef struct {
+    PyObject * items;
+    double * numbers;
+} sort_column;
+
+/* Reads plain ASCII numbers like "-12.5e3" without making a float
+   object. Returns false for anything else, which float() then decides
+   on. */
+static bool sort_plain_number(PyObject * value, double * number){
+    const char * text;
+    Py_ssize_t length, x;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_CheckExact(value) || !PyUnicode_IS_ASCII(value)){
+        return false;
+    }
+    text = (const char *)PyUnicode_DATA(value);
+    length = PyUnicode_GET_LENGTH(value);
+#else
+    if (!PyString_CheckExact(value)){
+        return false;
+    }
+    text = PyString_AS_STRING(value);
+    length = PyString_GET_SIZE(value);
+#endif
+    if ((length == 0) || (length > 64)){
+        return false;
+    }
+    for (x=0; x<length; x++){
+        char c = text[x];
+        if (((c < '0') || (c > '9')) && (c != '.') && (c != '-') &&
+            (c != '+') && (c != 'e') && (c != 'E')){
+            return false;
+        }
+    }
+
+    char * end;
+    *number = PyOS_string_to_double(text, &end, NULL);
+    if (*number == -1.0 && PyErr_Occurred()){
+        PyErr_Clear();
+        return false;
+    }
+    return end == text + length;
+}
+
+/* Works out the numbers of the column. Returns false on an error other
+   than a value that isn't a number, which leaves numbers NULL. */
+static bool sort_numbers(sort_column * column){
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(column->items), x;
+    PyObject ** values = PySequence_Fast_ITEMS(column->items);
+
+    column->numbers = malloc(sizeof(double) * (length > 0 ? length : 1));
+    if (column->numbers == NULL){
+        PyErr_NoMemory();
+        return false;
+    }
+    for (x=0; x<length; x++){
+        if (PyFloat_CheckExact(values[x])){
+            column->numbers[x] = PyFloat_AS_DOUBLE(values[x]);
+            continue;
+        }
+        if (sort_plain_number(values[x], &column->numbers[x])){
+            continue;
+        }
+        PyObject * number = PyNumber_Float(values[x]);
+        if (number == NULL){
+            free(column->numbers);
+            column->numbers = NULL;
+            if (PyErr_ExceptionMatches(PyExc_ValueError)){
+                PyErr_Clear();
+                return true;
+            }
+            return false;
+        }
+        column->numbers[x] = PyFloat_AS_DOUBLE(number);
+        Py_DECREF(number);
+    }
+    return true;
+}
+
+/* Gives a column of strings that aren't numbers the rank of each value
+   among the distinct values as its numbers, so that only the distinct
+   values are compared as strings. Other columns are left alone. */
+static bool sort_ranks(sort_column * column){
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(column->items), x;
+    PyObject ** values = PySequence_Fast_ITEMS(column->items);
+    PyObject * ranks = NULL, * distinct = NULL;
+    bool success = false;
+
+    for (x=0; x<length; x++){
+#if PY_MAJOR_VERSION >= 3
+        if (!PyUnicode_CheckExact(values[x])){
+#else
+        if (!PyString_CheckExact(values[x])){
+#endif
+            return true;
+        }
+    }
+
+    ranks = PyDict_New();
+    distinct = PyList_New(0);
+    if ((ranks == NULL) || (distinct == NULL)){
+        goto done;
+    }
+    for (x=0; x<length; x++){
+        int known = PyDict_Contains(ranks, values[x]);
+        if ((known < 0) || ((known == 0) && ((PyDict_SetItem(ranks, values[x], Py_None) < 0) ||
+                                             (PyList_Append(distinct, values[x]) < 0)))){
+            goto done;
+        }
+    }
+    if (PyList_Sort(distinct) < 0){
+        goto done;
+    }
+    for (x=0; x<PyList_GET_SIZE(distinct); x++){
+        PyObject * rank = PyLong_FromSsize_t(x);
+        if ((rank == NULL) || (PyDict_SetItem(ranks, PyList_GET_ITEM(distinct, x), rank) < 0)){
+            Py_XDECREF(rank);
+            goto done;
+        }
+        Py_DECREF(rank);
+    }
+
+    column->numbers = malloc(sizeof(double) * (length > 0 ? length : 1));
+    if (column->numbers == NULL){
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (x=0; x<length; x++){
+        column->numbers[x] = (double)PyLong_AsSsize_t(PyDict_GetItem(ranks, values[x]));
+    }
+    success = true;
+
+done:
+    Py_XDECREF(ranks);
+    Py_XDECREF(distinct);
+    return success;
+}
+
+/* Returns 1 if row b comes before row a, 0 if it doesn't and -1 on an
+   error comparing them. */
+static int sort_before(sort_column * columns, Py_ssize_t num_columns,
+                       Py_ssize_t a, Py_ssize_t b){
+    Py_ssize_t x;
+    for (x=0; x<num_columns; x++){
+        if (columns[x].numbers != NULL){
+            double first = columns[x].numbers[a], second = columns[x].numbers[b];
+            if (second < first){
+                return 1;
+            }
+            if (first < second){
+                return 0;
+            }
+            continue;
+        }
+        PyObject * first = PySequence_Fast_GET_ITEM(columns[x].items, a);
+        PyObject * second = PySequence_Fast_GET_ITEM(columns[x].items, b);
+        int less = PyObject_RichCompareBool(second, first, Py_LT);
+        if (less != 0){
+            return less;
+        }
+        less = PyObject_RichCompareBool(first, second, Py_LT);
+        if (less != 0){
+            return (less < 0) ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+/* A stable merge sort of the row positions. Runs of 32 are insertion
+   sorted first, and runs already in order aren't merged, so sorted rows
+   take one pass. */
+static bool sort_positions(sort_column * columns, Py_ssize_t num_columns,
+                           Py_ssize_t * order, Py_ssize_t length){
+    Py_ssize_t start, width, x, y;
+    int before;
+
+    for (start=0; start<length; start+=32){
+        Py_ssize_t end = (start + 32 < length) ? start + 32 : length;
+        for (x=start + 1; x<end; x++){
+            Py_ssize_t moving = order[x];
+            for (y=x; y>start; y--){
+                before = sort_before(columns, num_columns, order[y - 1], moving);
+                if (before < 0){
+                    return false;
+                }
+                if (!before){
+                    break;
+                }
+                order[y] = order[y - 1];
+            }
+            order[y] = moving;
+        }
+    }
+    if (length <= 32){
+        return true;
+    }
+
+    Py_ssize_t * merged = malloc(sizeof(Py_ssize_t) * length);
+    if (merged == NULL){
+        PyErr_NoMemory();
+        return false;
+    }
+    for (width=32; width<length; width*=2){
+        for (start=0; start + width<length; start+=width * 2){
+            Py_ssize_t middle = start + width;
+            Py_ssize_t end = (middle + width < length) ? middle + width : length;
+
+            before = sort_before(columns, num_columns, order[middle - 1], order[middle]);
+            if (before < 0){
+                free(merged);
+                return false;
+            }
+            if (!before){
+                continue;
+            }
+
+            Py_ssize_t left = start, right = middle, out = start;
+            while ((left < middle) && (right < end)){
+                before = sort_before(columns, num_columns, order[left], order[right]);
+                if (before < 0){
+                    free(merged);
+                    return false;
+                }
+                merged[out++] = before ? order[right++] : order[left++];
+            }
+            while (left < middle){
+                merged[out++] = order[left++];
+            }
+            while (right < end){
+                merged[out++] = order[right++];
+            }
+            memcpy(order + start, merged + start, sizeof(Py_ssize_t) * (end - start));
+        }
+    }
+    free(merged);
+    return true;
+}
+
+/* Returns a list of the values of the rows at the column position. */
+static PyObject * sort_column_values(PyObject * rows, PyObject * ordinal){
+    Py_ssize_t column = PyNumber_AsSsize_t(ordinal, PyExc_IndexError), x;
+    if ((column == -1) && PyErr_Occurred()){
+        return NULL;
+    }
+    PyObject * values = PyList_New(PySequence_Fast_GET_SIZE(rows));
+    for (x=0; (values != NULL) && (x<PySequence_Fast_GET_SIZE(rows)); x++){
+        PyObject * row = PySequence_Fast_GET_ITEM(rows, x), * value;
+        if (PyList_Check(row) && (column >= 0) && (column < PyList_GET_SIZE(row))){
+            value = PyList_GET_ITEM(row, column);
+            Py_INCREF(value);
+        } else {
+            value = PySequence_GetItem(row, column);
+            if (value == NULL){
+                Py_CLEAR(values);
+                break;
+            }
+        }
+        PyList_SET_ITEM(values, x, value);
+    }
+    return values;
+}
+
+/* Returns the positions of the rows in sorted order. Each column is a
+   list of the value of every row, and they come in order of priority.
+   Given the rows and the positions of the columns in them instead, the
+   columns are taken from the rows. Columns whose values can all be made
+   into floats are sorted as numbers and the others by the values
+   themselves. */
+static PyObject *
+PARSE_sort_order(PyObject *self, PyObject *args)
+{
+    PyObject * given, * ordinals = NULL, * rows = NULL, * items, * result = NULL;
+    sort_column * columns = NULL;
+    Py_ssize_t * order = NULL;
+    Py_ssize_t num_columns = 0, length = 0, x;
+
+    if (!PyArg_ParseTuple(args, "O|O", &given, &ordinals))
+        return NULL;
+
+    if (ordinals == NULL){
+        items = PySequence_Fast(given, "The columns must be a list or other sequence.");
+    } else {
+        rows = PySequence_Fast(given, "The rows must be a list or other sequence.");
+        if (rows == NULL){
+            return NULL;
+        }
+        items = PySequence_Fast(ordinals, "The column positions must be a list or other sequence.");
+    }
+    if (items == NULL){
+        Py_XDECREF(rows);
+        return NULL;
+    }
+    columns = calloc(PySequence_Fast_GET_SIZE(items) + 1, sizeof(sort_column));
+    if (columns == NULL){
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (x=0; x<PySequence_Fast_GET_SIZE(items); x++){
+        if (rows == NULL){
+            columns[x].items = PySequence_Fast(PySequence_Fast_GET_ITEM(items, x),
+                                               "Each column must be a list or other sequence.");
+        } else {
+            columns[x].items = sort_column_values(rows, PySequence_Fast_GET_ITEM(items, x));
+        }
+        if (columns[x].items == NULL){
+            goto done;
+        }
+        num_columns++;
+        if (x == 0){
+            length = PySequence_Fast_GET_SIZE(columns[x].items);
+        } else if (PySequence_Fast_GET_SIZE(columns[x].items) != length){
+            PyErr_SetString(PyExc_ValueError, "The columns must all be the same length.");
+            goto done;
+        }
+        if (!sort_numbers(&columns[x]) ||
+            ((columns[x].numbers == NULL) && !sort_ranks(&columns[x]))){
+            goto done;
+        }
+    }
+
+    order = malloc(sizeof(Py_ssize_t) * (length > 0 ? length : 1));
+    if (order == NULL){
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (x=0; x<length; x++){
+        order[x] = x;
+    }
+    if (!sort_positions(columns, num_columns, order, length)){
+        goto done;
+    }
+
+    result = PyList_New(length);
+    for (x=0; (result != NULL) && (x<length); x++){
+        PyObject * position = PyLong_FromSsize_t(order[x]);
+        if (position == NULL){
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, x, position);
+    }
+
+done:
+    if (columns != NULL){
+        for (x=0; x<num_columns; x++){
+            Py_DECREF(columns[x].items);
+            free(columns[x].numbers);
+        }
+        free(columns);
+    }
+    free(order);
+    Py_DECREF(items);
+    Py_XDECREF(rows);
+    return result;
+}
+
+/* Returns the loop in STAR format. Does what Loop.__str__() in bmrb.py
+   does in one go. */
+static PyObject *
+PARSE_format_loop(PyObject *self, PyObject *args)
+{
+    PyObject * loop, * conversions;
+    int skip_empty = 0, allow_v2 = 0;
+    value_conversions conv;
+    star_writer out = {NULL, 0, 0};
+
+    if (!PyArg_ParseTuple(args, "OO|ii", &loop, &conversions, &skip_empty, &allow_v2))
+        return NULL;
+
+    if (!load_conversions(&conv, conversions)){
+        return NULL;
+    }
+    bool written = write_loop(&out, loop, &conv, skip_empty, allow_v2);
+    Py_DECREF(conv.key_types);
+    if (!written){
+        free(out.text);
+        return NULL;
+    }
+    return writer_result(&out);
+}
+
+/* Returns the saveframe in STAR format. The header (any comment and the
+   save_NAME line) and the width of the widest tag name are worked out
+   by Saveframe.__str__() in bmrb.py. Loops of exactly loop_class are
+   written here rather than by calling str() on them. If a write
+   function is given the text is passed to it a piece at a time instead,
+   as bytes if binary is set, and None is returned. */
+static PyObject *
+PARSE_format_saveframe(PyObject *self, PyObject *args)
+{
+    PyObject * frame, * header, * loop_class, * conversions, * sink = Py_None;
+    Py_ssize_t width;
+    int skip_empty = 0, allow_v2 = 0, binary = 0;
+    PyObject * tag_prefix = NULL, * prefix = NULL, * tags = NULL, * loops = NULL;
+    value_conversions conv;
+    star_writer out = {NULL, 0, 0};
+    bool success = false;
+    Py_ssize_t x;
+
+    if (!PyArg_ParseTuple(args, "OOnOO|iiOi", &frame, &header, &width, &loop_class,
+                          &conversions, &skip_empty, &allow_v2, &sink, &binary))
+        return NULL;
+
+    if (sink != Py_None){
+        out.sink = sink;
+        out.binary = binary;
+    }
+
+    if (!load_conversions(&conv, conversions)){
+        return NULL;
+    }
+    if (write_string(&out, header) < 0){
+        goto done;
+    }
+
+    tag_prefix = PyObject_GetAttrString(frame, "tag_prefix");
+    if (tag_prefix == NULL){
+        goto done;
+    }
+    if (!(allow_v2 && (tag_prefix == Py_None))){
+        prefix = with_dot(tag_prefix);
+        if (prefix == NULL){
+            goto done;
+        }
+    }
+
+    // Write the tags
+    PyObject * frame_tags = PyObject_GetAttrString(frame, "tags");
+    if (frame_tags == NULL){
+        goto done;
+    }
+    tags = PySequence_Fast(frame_tags, "The saveframe tags must be a list.");
+    Py_DECREF(frame_tags);
+    if (tags == NULL){
+        goto done;
+    }
+    for (x=0; x<PySequence_Fast_GET_SIZE(tags); x++){
+        PyObject * tag = PySequence_Fast_GET_ITEM(tags, x);
+        PyObject * value = PySequence_GetItem(tag, 1);
+        if (value == NULL){
+            goto done;
+        }
+
+        // Quote the value first so we know where it goes
+        star_writer cleaned = {NULL, 0, 0};
+        long written = write_value(&cleaned, value, &conv);
+        Py_DECREF(value);
+        PyObject * name = (written < 0) ? NULL : PySequence_GetItem(tag, 0);
+        PyObject * formatted = NULL;
+        if (name != NULL){
+            formatted = (prefix == NULL) ? PyObject_Str(name) : PyNumber_Add(prefix, name);
+            Py_DECREF(name);
+        }
+        long name_width = -1;
+        if ((formatted != NULL) && writer_add(&out, "   ", 3)){
+            name_width = write_string(&out, formatted);
+        }
+        Py_XDECREF(formatted);
+        if ((name_width < 0) || (!writer_reserve(&out, width + cleaned.length + 5))){
+            free(cleaned.text);
+            goto done;
+        }
+        writer_pad(&out, width - name_width);
+        if (memchr(cleaned.text, '\n', cleaned.length) != NULL){
+            writer_put(&out, "\n;\n", 3);
+            writer_put(&out, cleaned.text, cleaned.length);
+            writer_put(&out, ";\n", 2);
+        } else {
+            writer_put(&out, "  ", 2);
+            writer_put(&out, cleaned.text, cleaned.length);
+            writer_put(&out, "\n", 1);
+        }
+        free(cleaned.text);
+    }
+
+    // Write any loops
+    PyObject * frame_loops = PyObject_GetAttrString(frame, "loops");
+    if (frame_loops == NULL){
+        goto done;
+    }
+    loops = PySequence_Fast(frame_loops, "The saveframe loops must be a list.");
+    Py_DECREF(frame_loops);
+    if (loops == NULL){
+        goto done;
+    }
+    for (x=0; x<PySequence_Fast_GET_SIZE(loops); x++){
+        PyObject * loop = PySequence_Fast_GET_ITEM(loops, x);
+        if ((PyObject *)Py_TYPE(loop) == loop_class){
+            if (!write_loop(&out, loop, &conv, skip_empty, allow_v2)){
+                goto done;
+            }
+        } else {
+            PyObject * string = PyObject_Str(loop);
+            long written = (string == NULL) ? -1 : write_string(&out, string);
+            Py_XDECREF(string);
+            if (written < 0){
+                goto done;
+            }
+        }
+    }
+
+    // Close the saveframe
+    success = writer_add(&out, "save_\n", 6) && writer_flush(&out);
+
+done:
+    Py_DECREF(conv.key_types);
+    Py_XDECREF(tag_prefix);
+    Py_XDECREF(prefix);
+    Py_XDECREF(tags);
+    Py_XDECREF(loops);
+    if ((!success) || (out.sink != NULL)){
+        free(out.text);
+        if (success){
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+        return NULL;
+    }
+    return writer_result(&out);
+}
+
+/* The bytes of an object that supports the buffer protocol, such as an
+   array, a bytearray or bytes. */
+typedef struct {
+    const char * data;
+    Py_ssize_t length;
+#if PY_MAJOR_VERSION >= 3
+    Py_buffer view;
+#endif
+} byte_buffer;
+
+static void release_bytes(byte_buffer * buffer){
+#if PY_MAJOR_VERSION >= 3
+    PyBuffer_Release(&buffer->view);
+#endif
+    buffer->data = NULL;
+}
+
+/* Gets the bytes of the object, raising ValueError if there are fewer
+   than length of them. Call release_bytes() when done with them. */
+static bool get_bytes(byte_buffer * buffer, PyObject * object, Py_ssize_t length){
+#if PY_MAJOR_VERSION >= 3
+    if (PyObject_GetBuffer(object, &buffer->view, PyBUF_SIMPLE) != 0){
+        return false;
+    }
+    buffer->data = buffer->view.buf;
+    buffer->length = buffer->view.len;
+#else
+    const void * data;
+    if (PyObject_AsReadBuffer(object, &data, &buffer->length) != 0){
+        return false;
+    }
+    buffer->data = data;
+#endif
+    if (buffer->length < length){
+        release_bytes(buffer);
+        PyErr_SetString(PyExc_ValueError, "The data ends before it should.");
+        return false;
+    }
+    return true;
+}
+
+/* Returns a list of the strings in a block of UTF-8 text, given an array
+   of 32 bit integers with the offset of each string in it followed by
+   the offset of the end of the last one. */
+static PyObject *
+PARSE_decode_strings(PyObject *self, PyObject *args)
+{
+    PyObject * text_object, * offsets_object, * result;
+    byte_buffer text, offsets;
+    uint32_t start, end;
+    Py_ssize_t x, count;
+
+    if (!PyArg_ParseTuple(args, "OO", &text_object, &offsets_object))
+        return NULL;
+
+    if (!get_bytes(&text, text_object, 0)){
+        return NULL;
+    }
+    if (!get_bytes(&offsets, offsets_object, sizeof(uint32_t))){
+        release_bytes(&text);
+        return NULL;
+    }
+
+    count = offsets.length / sizeof(uint32_t) - 1;
+    memcpy(&start, offsets.data, sizeof(uint32_t));
+    result = PyList_New(count);
+
+    for (x=0; (result != NULL) && (x<count); x++){
+        PyObject * item = NULL;
+        memcpy(&end, offsets.data + (x + 1) * sizeof(uint32_t), sizeof(uint32_t));
+        if ((end < start) || (end > text.length)){
+            PyErr_SetString(PyExc_ValueError, "The offsets of the strings are out of order.");
+        } else {
+            item = PyString_FromStringAndSize(text.data + start, end - start);
+        }
+        if (item == NULL){
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, x, item);
+        start = end;
+    }
+
+    release_bytes(&offsets);
+    release_bytes(&text);
+    return result;
+}
+
+/* Fills in the row of a list of lists from the columns. */
+static bool rows_from_columns_row(PyObject * items, Py_ssize_t row, Py_ssize_t width,
+                                  byte_buffer * values, byte_buffer * null_codes,
+                                  PyObject ** dictionaries, PyObject ** nulls){
+    Py_ssize_t column;
+
+    for (column=0; column<width; column++){
+        PyObject * item = NULL;
+        if (dictionaries[column] != NULL){
+            int32_t code;
+            memcpy(&code, values[column].data + row * sizeof(int32_t), sizeof(int32_t));
+            if ((code < 0) || (code >= PyList_GET_SIZE(dictionaries[column]))){
+                PyErr_SetString(PyExc_ValueError, "A column refers to a value its dictionary doesn't have.");
+                return false;
+            }
+            item = PyList_GET_ITEM(dictionaries[column], code);
+            Py_INCREF(item);
+        } else {
+            unsigned char null = null_codes[column].data[row];
+            if (null > 3){
+                PyErr_SetString(PyExc_ValueError, "A column has an unknown null.");
+                return false;
+            } else if (null > 0){
+                item = nulls[null - 1];
+                Py_INCREF(item);
+            } else {
+                int64_t number;
+                memcpy(&number, values[column].data + row * sizeof(int64_t), sizeof(int64_t));
+#if PY_MAJOR_VERSION >= 3
+                item = PyLong_FromLongLong(number);
+#else
+                if ((number >= LONG_MIN) && (number <= LONG_MAX)){
+                    item = PyInt_FromLong((long)number);
+                } else {
+                    item = PyLong_FromLongLong(number);
+                }
+#endif
+                if (item == NULL){
+                    return false;
+                }
+            }
+        }
+        PyList_SET_ITEM(items, column, item);
+    }
+    return true;
+}
+
+/* Returns the rows of a loop as a list of lists, given each of its
+   columns as the (values, dictionary, nulls) that column_buffers() in
+   bmrb.py returns and the number of rows. */
+static PyObject *
+PARSE_rows_from_columns(PyObject *self, PyObject *args)
+{
+    PyObject * columns_object, * columns, * result = NULL;
+    PyObject * nulls[3] = {Py_None, NULL, NULL};
+    byte_buffer * values, * null_codes;
+    PyObject ** dictionaries;
+    Py_ssize_t length, width, loaded = 0, row, column;
+
+    if (!PyArg_ParseTuple(args, "On", &columns_object, &length))
+        return NULL;
+
+    if (length < 0){
+        PyErr_SetString(PyExc_ValueError, "The number of rows can't be negative.");
+        return NULL;
+    }
+    columns = PySequence_Fast(columns_object, "The columns must be a list or other sequence.");
+    if (columns == NULL){
+        return NULL;
+    }
+    width = PySequence_Fast_GET_SIZE(columns);
+
+    values = calloc(width + 1, sizeof(byte_buffer));
+    null_codes = calloc(width + 1, sizeof(byte_buffer));
+    dictionaries = calloc(width + 1, sizeof(PyObject *));
+    if ((values == NULL) || (null_codes == NULL) || (dictionaries == NULL)){
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (; loaded<width; loaded++){
+        PyObject * value_object, * dictionary, * null_object;
+        PyObject * item = PySequence_Fast_GET_ITEM(columns, loaded);
+        if (!PyTuple_Check(item)){
+            PyErr_SetString(PyExc_TypeError, "Each column must be a (values, dictionary, nulls) tuple.");
+            goto done;
+        }
+        if (!PyArg_ParseTuple(item, "OOO", &value_object, &dictionary, &null_object)){
+            goto done;
+        }
+        if (dictionary == Py_None){
+            if (!get_bytes(&values[loaded], value_object, length * sizeof(int64_t))){
+                goto done;
+            }
+            if (!get_bytes(&null_codes[loaded], null_object, length)){
+                release_bytes(&values[loaded]);
+                goto done;
+            }
+        } else {
+            if (!PyList_Check(dictionary)){
+                PyErr_SetString(PyExc_TypeError, "The dictionary of a column must be a list.");
+                goto done;
+            }
+            if (!get_bytes(&values[loaded], value_object, length * sizeof(int32_t))){
+                goto done;
+            }
+            dictionaries[loaded] = dictionary;
+        }
+    }
+
+    nulls[1] = PyString_FromString(".");
+    nulls[2] = PyString_FromString("?");
+    if ((nulls[1] == NULL) || (nulls[2] == NULL)){
+        goto done;
+    }
+
+    result = PyList_New(length);
+    for (row=0; (result != NULL) && (row<length); row++){
+        PyObject * items = PyList_New(width);
+        if (items == NULL){
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, row, items);
+        if (!rows_from_columns_row(items, row, width, values, null_codes,
+                                   dictionaries, nulls)){
+            Py_CLEAR(result);
+        }
+    }
+
+  done:
+    for (column=0; column<loaded; column++){
+        release_bytes(&values[column]);
+        if (dictionaries[column] == NULL){
+            release_bytes(&null_codes[column]);
+        }
+    }
+    free(values);
+    free(null_codes);
+    free(dictionaries);
+    Py_XDECREF(nulls[1]);
+    Py_XDECREF(nulls[2]);
+    Py_DECREF(columns);
+    return result;
+}
+
+// What the from_json() methods in bmrb.py say about text they can't load
+#define json_invalid "The JSON you provided was neither a Python dictionary nor a JSON string."
+
+/* What to_json() needs to write out an entry, saveframe or loop. */
+typedef struct {
+    // Saveframes of exactly these types and loops of exactly loop_class
+    //  are written from their attributes. Any others are written from
+    //  what their get_json() returns.
+    PyObject * frame_types;
+    PyObject * loop_class;
+    // Values of these types are written as str() of them
+    PyObject * string_types;
+    // Returns the JSON of anything else, or raises TypeError
+    PyObject * fallback;
+} json_options;
+
+/* Adds the escape json.dumps() uses for a character that isn't
+   printable ASCII, or is a quote or backslash. There must already be
+   room for twelve bytes. */
+static void json_escape(star_writer * out, uint32_t c){
+    static const char hex[] = "0123456789abcdef";
+    char * text = out->text + out->length;
+
+    switch (c){
+        case '"': memcpy(text, "\\\"", 2); out->length += 2; return;
+        case '\\': memcpy(text, "\\\\", 2); out->length += 2; return;
+        case '\n': memcpy(text, "\\n", 2); out->length += 2; return;
+        case '\r': memcpy(text, "\\r", 2); out->length += 2; return;
+        case '\t': memcpy(text, "\\t", 2); out->length += 2; return;
+        case '\b': memcpy(text, "\\b", 2); out->length += 2; return;
+        case '\f': memcpy(text, "\\f", 2); out->length += 2; return;
+    }
+
+    // Characters outside the basic plane are written as surrogate pairs
+    if (c >= 0x10000){
+        json_escape(out, 0xD800 | ((c - 0x10000) >> 10));
+        c = 0xDC00 | ((c - 0x10000) & 0x3FF);
+        text = out->text + out->length;
+    }
+    text[0] = '\\';
+    text[1] = 'u';
+    text[2] = hex[(c >> 12) & 0xF];
+    text[3] = hex[(c >> 8) & 0xF];
+    text[4] = hex[(c >> 4) & 0xF];
+    text[5] = hex[c & 0xF];
+    out->length += 6;
+}
+
+static inline bool json_plain(uint32_t c){
+    return (c >= ' ') && (c <= '~') && (c != '"') && (c != '\\');
+}
+
+/* Writes a string the way json.dumps() does. Returns 1 if it was
+   written, 0 if it needs to be left to json.dumps() and -1 with an
+   exception set on error. */
+int json_string(star_writer * out, PyObject * string){
+    Py_ssize_t x = 0, length;
+
+#if PY_MAJOR_VERSION >= 3
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(string) != 0){
+        return -1;
+    }
+#endif
+    int kind = PyUnicode_KIND(string);
+    const void * data = PyUnicode_DATA(string);
+    length = PyUnicode_GET_LENGTH(string);
+
+    if (!writer_add(out, "\"", 1)){
+        return -1;
+    }
+    // A bit at a time so that a sink gets whole characters
+    while (x < length){
+        Py_ssize_t end = (length - x > 4096) ? x + 4096 : length;
+        if (!writer_reserve(out, (end - x) * 12)){
+            return -1;
+        }
+        for (; x<end; x++){
+            Py_UCS4 c = PyUnicode_READ(kind, data, x);
+            if (json_plain(c)){
+                out->text[out->length++] = (char)c;
+            } else {
+                json_escape(out, c);
             }
         }
     }
+#else
+    // json.dumps() decodes python 2 strings that aren't ASCII first
+    const unsigned char * data = (const unsigned char *)PyString_AS_STRING(string);
+    length = PyString_GET_SIZE(string);
+    for (x=0; x<length; x++){
+        if (data[x] >= 0x80){
+            return 0;
+        }
+    }
+    if (!writer_reserve(out, length * 6 + 1)){
+        return -1;
+    }
+    writer_put(out, "\"", 1);
+    for (x=0; x<length; x++){
+        if (json_plain(data[x])){
+            out->text[out->length++] = (char)data[x];
+        } else {
+            json_escape(out, data[x]);
+        }
+    }
+#endif
+    return writer_add(out, "\"", 1) ? 1 : -1;
+}
+
+/* Writes the text that a python function returned. */
+bool json_add_result(star_writer * out, PyObject * text){
+    if (text == NULL){
+        return false;
+    }
+    long written = write_string(out, text);
+    Py_DECREF(text);
+    return written >= 0;
+}
+
+bool json_value(star_writer * out, PyObject * value, json_options * options);
+
+/* Writes a list or tuple. */
+bool json_sequence(star_writer * out, PyObject * sequence, json_options * options){
+    Py_ssize_t x;
+    bool success = true;
+
+    if (Py_EnterRecursiveCall(" while encoding JSON")){
+        return false;
+    }
+    success = writer_add(out, "[", 1);
+    for (x=0; success && (x<PySequence_Fast_GET_SIZE(sequence)); x++){
+        success = ((x == 0) || writer_add(out, ", ", 2)) &&
+                  json_value(out, PySequence_Fast_GET_ITEM(sequence, x), options);
+    }
+    Py_LeaveRecursiveCall();
+    return success && writer_add(out, "]", 1);
+}
+
+/* Writes a value the way json.dumps() with _json_serialize() from
+   bmrb.py as the default does. Strings, numbers, None, booleans, lists
+   and tuples are written here. Values of the string types are written
+   as str() of them, and anything else is passed to the fallback. */
+bool json_value(star_writer * out, PyObject * value, json_options * options){
+    if (value == Py_None){
+        return writer_add(out, "null", 4);
+    }
+    if (value == Py_True){
+        return writer_add(out, "true", 4);
+    }
+    if (value == Py_False){
+        return writer_add(out, "false", 5);
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(value)){
+#else
+    if (PyString_Check(value)){
+#endif
+        int written = json_string(out, value);
+        if (written != 0){
+            return written > 0;
+        }
+        return json_add_result(out, PyObject_CallFunctionObjArgs(options->fallback, value, NULL));
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (PyLong_Check(value)){
+        return json_add_result(out, PyLong_Type.tp_repr(value));
+    }
+#else
+    if (PyInt_Check(value) || PyLong_Check(value)){
+        return json_add_result(out, PyObject_Str(value));
+    }
+#endif
+    if (PyFloat_Check(value)){
+        double number = PyFloat_AS_DOUBLE(value);
+        if (Py_IS_NAN(number)){
+            return writer_add(out, "NaN", 3);
+        }
+        if (Py_IS_INFINITY(number)){
+            return (number > 0) ? writer_add(out, "Infinity", 8) :
+                                  writer_add(out, "-Infinity", 9);
+        }
+        return json_add_result(out, PyFloat_Type.tp_repr(value));
+    }
+    if (PyList_Check(value) || PyTuple_Check(value)){
+        return json_sequence(out, value, options);
+    }
+
+    int is_string_type = PyObject_IsInstance(value, options->string_types);
+    if (is_string_type < 0){
+        return false;
+    }
+    if (is_string_type){
+        PyObject * string = PyObject_Str(value);
+        if (string == NULL){
+            return false;
+        }
+        int written = json_string(out, string);
+        Py_DECREF(string);
+        if (written != 0){
+            return written > 0;
+        }
+    }
+    return json_add_result(out, PyObject_CallFunctionObjArgs(options->fallback, value, NULL));
+}
+
+/* Writes the "key": part of an object, after a comma unless it is the
+   first key. */
+static inline bool json_key(star_writer * out, const char * key, bool first){
+    return (first || writer_add(out, ", ", 2)) && writer_add(out, "\"", 1) &&
+           writer_add(out, key, strlen(key)) && writer_add(out, "\": ", 3);
+}
+
+/* Writes the attribute of an object as the value of a key. */
+bool json_attribute(star_writer * out, PyObject * object, const char * key,
+                    char * name, bool first, json_options * options){
+    PyObject * value = PyObject_GetAttrString(object, name);
+    if (value == NULL){
+        return false;
+    }
+    bool success = json_key(out, key, first) && json_value(out, value, options);
+    Py_DECREF(value);
+    return success;
+}
+
+/* Writes what get_json(serialize=False) returns for an object. */
+bool json_of_dict(star_writer * out, PyObject * object, json_options * options){
+    PyObject * dict = PyObject_CallMethod(object, "get_json", "(O)", Py_False);
+    if (dict == NULL){
+        return false;
+    }
+    bool success = json_value(out, dict, options);
+    Py_DECREF(dict);
+    return success;
+}
+
+/* Writes a loop the way Loop.get_json() in bmrb.py does. */
+bool json_loop(star_writer * out, PyObject * loop, json_options * options){
+    PyObject * data = NULL, * rows = NULL;
+    bool success = false;
+
+    if ((!writer_add(out, "{", 1)) ||
+        (!json_attribute(out, loop, "category", "category", true, options)) ||
+        (!json_attribute(out, loop, "tags", "columns", false, options))){
+        return false;
+    }
+
+    // Columnar data is turned into rows in one go
+    data = PyObject_GetAttrString(loop, "data");
+    if (data == NULL){
+        return false;
+    }
+    if ((!PyList_Check(data)) && PyObject_HasAttrString(data, "to_list")){
+        rows = PyObject_CallMethod(data, "to_list", NULL);
+    } else {
+        Py_INCREF(data);
+        rows = data;
+    }
+    success = (rows != NULL) && json_key(out, "data", false) &&
+              json_value(out, rows, options) && writer_add(out, "}", 1);
+    Py_XDECREF(rows);
+    Py_DECREF(data);
+    return success;
+}
+
+/* Writes a saveframe the way Saveframe.get_json() in bmrb.py does. */
+bool json_saveframe(star_writer * out, PyObject * frame, json_options * options){
+    PyObject * tags = NULL, * loops = NULL;
+    bool success = false;
+    Py_ssize_t x;
+
+    if ((!writer_add(out, "{", 1)) ||
+        (!json_attribute(out, frame, "name", "name", true, options)) ||
+        (!json_attribute(out, frame, "category", "category", false, options)) ||
+        (!json_attribute(out, frame, "tag_prefix", "tag_prefix", false, options)) ||
+        (!json_key(out, "tags", false)) || (!writer_add(out, "[", 1))){
+        return false;
+    }
+
+    // Each tag is written as a [name, value] list
+    PyObject * frame_tags = PyObject_GetAttrString(frame, "tags");
+    if (frame_tags == NULL){
+        goto done;
+    }
+    tags = PySequence_Fast(frame_tags, "The saveframe tags must be a list.");
+    Py_DECREF(frame_tags);
+    if (tags == NULL){
+        goto done;
+    }
+    for (x=0; x<PySequence_Fast_GET_SIZE(tags); x++){
+        PyObject * tag = PySequence_Fast_GET_ITEM(tags, x);
+        PyObject * name = PySequence_GetItem(tag, 0);
+        PyObject * value = (name == NULL) ? NULL : PySequence_GetItem(tag, 1);
+        bool written = (value != NULL) &&
+                       writer_add(out, (x == 0) ? "[" : ", [", (x == 0) ? 1 : 3) &&
+                       json_value(out, name, options) && writer_add(out, ", ", 2) &&
+                       json_value(out, value, options) && writer_add(out, "]", 1);
+        Py_XDECREF(name);
+        Py_XDECREF(value);
+        if (!written){
+            goto done;
+        }
+    }
+
+    if ((!writer_add(out, "]", 1)) || (!json_key(out, "loops", false)) ||
+        (!writer_add(out, "[", 1))){
+        goto done;
+    }
+    PyObject * frame_loops = PyObject_GetAttrString(frame, "loops");
+    if (frame_loops == NULL){
+        goto done;
+    }
+    loops = PySequence_Fast(frame_loops, "The saveframe loops must be a list.");
+    Py_DECREF(frame_loops);
+    if (loops == NULL){
+        goto done;
+    }
+    for (x=0; x<PySequence_Fast_GET_SIZE(loops); x++){
+        PyObject * loop = PySequence_Fast_GET_ITEM(loops, x);
+        if ((x > 0) && (!writer_add(out, ", ", 2))){
+            goto done;
+        }
+        if (!(((PyObject *)Py_TYPE(loop) == options->loop_class) ?
+              json_loop(out, loop, options) : json_of_dict(out, loop, options))){
+            goto done;
+        }
+    }
+    success = writer_add(out, "]}", 2);
+
+done:
+    Py_XDECREF(tags);
+    Py_XDECREF(loops);
+    return success;
+}
+
+/* Writes an entry the way Entry.get_json() in bmrb.py does. */
+bool json_entry(star_writer * out, PyObject * entry, json_options * options){
+    PyObject * frames;
+    bool success = false;
+    Py_ssize_t x, y;
+
+    if ((!writer_add(out, "{", 1)) ||
+        (!json_attribute(out, entry, "entry_id", "entry_id", true, options)) ||
+        (!json_attribute(out, entry, "bmrb_id", "entry_id", false, options)) ||
+        (!json_key(out, "saveframes", false)) || (!writer_add(out, "[", 1))){
+        return false;
+    }
 
-    if (needs_wrapping){
-        // If there is a single quote wrap in double quotes
-        if (has_single)
-            return PyString_FromFormat("\"%s\"", str);
-        // Either there is a double quote or no quotes
-        else
-            return PyString_FromFormat("'%s'", str);
+    PyObject * frame_list = PyObject_GetAttrString(entry, "frame_list");
+    if (frame_list == NULL){
+        return false;
+    }
+    frames = PySequence_Fast(frame_list, "The saveframes of an entry must be a list.");
+    Py_DECREF(frame_list);
+    if (frames == NULL){
+        return false;
     }
+    for (x=0; x<PySequence_Fast_GET_SIZE(frames); x++){
+        PyObject * frame = PySequence_Fast_GET_ITEM(frames, x);
+        if ((x > 0) && (!writer_add(out, ", ", 2))){
+            goto done;
+        }
 
-    // If we got here it's good to go as it is
-    return PyString_FromString(str);
-}
+        bool native = false;
+        for (y=0; y<PyTuple_GET_SIZE(options->frame_types); y++){
+            native = native || ((PyObject *)Py_TYPE(frame) == PyTuple_GET_ITEM(options->frame_types, y));
+        }
+        if (!(native ? json_saveframe(out, frame, options) : json_of_dict(out, frame, options))){
+            goto done;
+        }
+    }
+    success = writer_add(out, "]}", 2);
 
+done:
+    Py_DECREF(frames);
+    return success;
+}
 
+/* Returns an entry, saveframe or loop in JSON format. Does what
+   json.dumps() of what its get_json() returns does, without building
+   the dictionaries first. If a write function is given the text is
+   passed to it a piece at a time instead, as bytes if binary is set,
+   and None is returned. */
 static PyObject *
-PARSE_load(PyObject *self, PyObject *args)
+PARSE_to_json(PyObject *self, PyObject *args)
 {
-    char *file;
+    PyObject * object, * sink = Py_None;
+    int binary = 0, is_loop, is_frame = 0;
+    json_options options;
+    star_writer out = {NULL, 0, 0};
+    bool success;
+
+    if (!PyArg_ParseTuple(args, "OO!OOO|Oi", &object, &PyTuple_Type,
+                          &options.frame_types, &options.loop_class,
+                          &options.string_types, &options.fallback, &sink, &binary))
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "s", &file))
+    if (PyTuple_GET_SIZE(options.frame_types) == 0){
+        PyErr_SetString(PyExc_ValueError, "At least one saveframe type is needed.");
         return NULL;
+    }
+    if (sink != Py_None){
+        out.sink = sink;
+        out.binary = binary;
+    }
 
-    // Read the file
-    get_file(file, &parser);
+    // Work out which of the three it is
+    is_loop = PyObject_IsInstance(object, options.loop_class);
+    if (is_loop == 0){
+        is_frame = PyObject_IsInstance(object, PyTuple_GET_ITEM(options.frame_types, 0));
+    }
+    if ((is_loop < 0) || (is_frame < 0)){
+        return NULL;
+    }
+    if (is_loop){
+        success = json_loop(&out, object, &options);
+    } else if (is_frame){
+        success = json_saveframe(&out, object, &options);
+    } else {
+        success = json_entry(&out, object, &options);
+    }
+    success = success && writer_flush(&out);
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if ((!success) || (out.sink != NULL)){
+        free(out.text);
+        if (success){
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+        return NULL;
+    }
+    return writer_result(&out);
 }
 
-static PyObject *
-PARSE_load_string(PyObject *self, PyObject *args)
-{
-    char *data;
+// Short strings are looked up in a table of the ones already decoded so
+//  that the values that repeat all through the loops are only made once
+#define json_memo_size 1024
+#define json_memo_length 16
+
+typedef struct {
+    const char * raw;
+    Py_ssize_t length;
+    PyObject * string;
+} json_memo;
+
+// What the object being decoded will be built into
+#define json_any 0
+#define json_entry_shape 1
+#define json_frame_shape 2
+#define json_loop_shape 3
+#define json_frame_list 4
+#define json_loop_list 5
+
+/* A quick hash of a short string for the memo table. */
+static inline size_t json_memo_slot(const char * text, Py_ssize_t length){
+    uint64_t hash = length, chunk;
+    while (length >= 8){
+        memcpy(&chunk, text, 8);
+        hash = (hash ^ chunk) * 0x9E3779B97F4A7C15ULL;
+        text += 8;
+        length -= 8;
+    }
+    chunk = 0;
+    memcpy(&chunk, text, length);
+    hash = (hash ^ chunk) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 52) & (json_memo_size - 1);
+}
+
+/* JSON text being decoded by from_json(). */
+typedef struct {
+    const char * text;
+    Py_ssize_t pos;
+    Py_ssize_t length;
+    // The unescaped bytes of the string being decoded
+    star_writer scratch;
+    json_memo * memo;
+    PyObject * entry_class;
+    PyObject * saveframe_class;
+    PyObject * loop_class;
+    PyObject * source;
+    // Set until the outermost object has been read, which is only built
+    //  once the rest of the text has been checked
+    bool outermost;
+} json_reader;
+
+/* Raises the error the from_json() methods in bmrb.py raise for text
+   that isn't JSON. */
+static void json_error(void){
+    PyErr_SetString(PyExc_ValueError, json_invalid);
+}
+
+static inline void json_skip_whitespace(json_reader * reader){
+    while ((reader->pos < reader->length) &&
+           ((reader->text[reader->pos] == ' ') || (reader->text[reader->pos] == '\n') ||
+            (reader->text[reader->pos] == '\r') || (reader->text[reader->pos] == '\t'))){
+        reader->pos++;
+    }
+}
+
+/* Reads one of the words JSON has for constants. Raises the error for
+   text that isn't JSON if it isn't there. */
+static inline bool json_word(json_reader * reader, const char * word, long length){
+    if ((reader->length - reader->pos >= length) &&
+        (memcmp(reader->text + reader->pos, word, length) == 0)){
+        reader->pos += length;
+        return true;
+    }
+    json_error();
+    return false;
+}
+
+/* Makes a string from UTF-8, which can hold surrogates. */
+static PyObject * json_make_string(const char * text, Py_ssize_t length){
+#if PY_MAJOR_VERSION >= 3
+    PyObject * string = PyUnicode_DecodeUTF8(text, length, "surrogatepass");
+#else
+    PyObject * string = PyUnicode_DecodeUTF8(text, length, NULL);
+#endif
+    if ((string == NULL) && PyErr_ExceptionMatches(PyExc_UnicodeDecodeError)){
+        PyErr_Clear();
+        json_error();
+    }
+    return string;
+}
+
+/* Reads the four hex digits of a \u escape. Returns -1 if they aren't
+   there. */
+static long json_hex(json_reader * reader){
+    long value = 0, x;
+
+    if (reader->pos + 4 > reader->length){
+        return -1;
+    }
+    for (x=0; x<4; x++){
+        char c = reader->text[reader->pos++];
+        value <<= 4;
+        if ((c >= '0') && (c <= '9')){
+            value |= c - '0';
+        } else if ((c >= 'a') && (c <= 'f')){
+            value |= c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')){
+            value |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+/* Adds a character to the scratch buffer in UTF-8. */
+static bool json_put_character(star_writer * out, long c){
+    char bytes[4];
+    long length;
+
+    if (c < 0x80){
+        bytes[0] = (char)c;
+        length = 1;
+    } else if (c < 0x800){
+        bytes[0] = (char)(0xC0 | (c >> 6));
+        bytes[1] = (char)(0x80 | (c & 0x3F));
+        length = 2;
+    } else if (c < 0x10000){
+        bytes[0] = (char)(0xE0 | (c >> 12));
+        bytes[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (c & 0x3F));
+        length = 3;
+    } else {
+        bytes[0] = (char)(0xF0 | (c >> 18));
+        bytes[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (c & 0x3F));
+        length = 4;
+    }
+    return writer_add(out, bytes, length);
+}
+
+/* Decodes a string, starting after its opening quote. */
+PyObject * json_read_string(json_reader * reader){
+    const char * text = reader->text;
+    Py_ssize_t start = reader->pos, pos = start;
+    bool escaped = false;
+    unsigned char high = 0;
+
+    // Find the end first, and whether there is anything to unescape or
+    //  anything but ASCII
+    while (true){
+        if (pos >= reader->length){
+            json_error();
+            return NULL;
+        }
+        unsigned char c = (unsigned char)text[pos];
+        if (c == '"'){
+            break;
+        }
+        if (c < 0x20){
+            json_error();
+            return NULL;
+        }
+        if (c == '\\'){
+            escaped = true;
+            pos++;
+        }
+        high |= c;
+        pos++;
+    }
+    reader->pos = pos + 1;
+
+    // Short strings that have been seen before are reused
+    Py_ssize_t length = pos - start;
+    json_memo * memo = NULL;
+    if (length <= json_memo_length){
+        memo = &reader->memo[json_memo_slot(text + start, length)];
+        if ((memo->string != NULL) && (memo->length == length) &&
+            (memcmp(memo->raw, text + start, length) == 0)){
+            Py_INCREF(memo->string);
+            return memo->string;
+        }
+    }
+
+    PyObject * string;
+    if (!escaped){
+#if PY_MAJOR_VERSION >= 3
+        if (high < 0x80){
+            string = PyUnicode_New(length, 127);
+            if (string != NULL){
+                memcpy(PyUnicode_DATA(string), text + start, length);
+            }
+        } else {
+            string = json_make_string(text + start, length);
+        }
+#else
+        string = json_make_string(text + start, length);
+#endif
+    } else {
+        star_writer * out = &reader->scratch;
+        out->length = 0;
+        for (pos=start; pos<start + length; pos++){
+            if (text[pos] != '\\'){
+                if (!writer_add(out, text + pos, 1)){
+                    return NULL;
+                }
+                continue;
+            }
+            char single = 0;
+            switch (text[++pos]){
+                case '"': single = '"'; break;
+                case '\\': single = '\\'; break;
+                case '/': single = '/'; break;
+                case 'b': single = '\b'; break;
+                case 'f': single = '\f'; break;
+                case 'n': single = '\n'; break;
+                case 'r': single = '\r'; break;
+                case 't': single = '\t'; break;
+                case 'u': break;
+                default: json_error(); return NULL;
+            }
+            if (single != 0){
+                if (!writer_add(out, &single, 1)){
+                    return NULL;
+                }
+                continue;
+            }
+
+            // A \u escape, which might be the first half of a surrogate pair
+            reader->pos = pos + 1;
+            long c = json_hex(reader);
+            if (c < 0){
+                json_error();
+                return NULL;
+            }
+            if ((c >= 0xD800) && (c <= 0xDBFF) && (reader->pos + 6 <= start + length) &&
+                (text[reader->pos] == '\\') && (text[reader->pos + 1] == 'u')){
+                Py_ssize_t low_start = reader->pos;
+                reader->pos += 2;
+                long low = json_hex(reader);
+                if ((low >= 0xDC00) && (low <= 0xDFFF)){
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                } else {
+                    reader->pos = low_start;
+                }
+            }
+            if (!json_put_character(out, c)){
+                return NULL;
+            }
+            pos = reader->pos - 1;
+        }
+        reader->pos = start + length + 1;
+        string = json_make_string(out->text, out->length);
+    }
+
+    if ((string != NULL) && (memo != NULL)){
+        Py_XDECREF(memo->string);
+        Py_INCREF(string);
+        memo->raw = text + start;
+        memo->length = length;
+        memo->string = string;
+    }
+    return string;
+}
+
+/* Decodes a number the way json.loads() does, or NaN, Infinity or
+   -Infinity. */
+PyObject * json_read_number(json_reader * reader){
+    const char * text = reader->text;
+    Py_ssize_t start = reader->pos, pos = start, end = reader->length;
+    bool is_float = false;
+    char buffer[64];
+
+    if ((pos < end) && (text[pos] == '-')){
+        pos++;
+    }
+    if ((end - pos >= 8) && (strncmp(text + pos, "Infinity", 8) == 0)){
+        reader->pos = pos + 8;
+        return PyFloat_FromDouble((pos > start) ? -Py_HUGE_VAL : Py_HUGE_VAL);
+    }
 
-    if (!PyArg_ParseTuple(args, "s", &data))
+    // The integer part, which can only start with 0 if it is 0
+    if ((pos >= end) || (text[pos] < '0') || (text[pos] > '9')){
+        json_error();
         return NULL;
+    }
+    if (text[pos] == '0'){
+        pos++;
+    } else {
+        while ((pos < end) && (text[pos] >= '0') && (text[pos] <= '9')){
+            pos++;
+        }
+    }
 
-    // Read the string into our object
-    reset_parser(&parser);
+    // The fraction and exponent are only taken if they are complete
+    if ((pos + 1 < end) && (text[pos] == '.') && (text[pos + 1] >= '0') && (text[pos + 1] <= '9')){
+        is_float = true;
+        pos += 2;
+        while ((pos < end) && (text[pos] >= '0') && (text[pos] <= '9')){
+            pos++;
+        }
+    }
+    if ((pos < end) && ((text[pos] == 'e') || (text[pos] == 'E'))){
+        Py_ssize_t exponent = pos + 1;
+        if ((exponent < end) && ((text[exponent] == '+') || (text[exponent] == '-'))){
+            exponent++;
+        }
+        if ((exponent < end) && (text[exponent] >= '0') && (text[exponent] <= '9')){
+            is_float = true;
+            pos = exponent;
+            while ((pos < end) && (text[pos] >= '0') && (text[pos] <= '9')){
+                pos++;
+            }
+        }
+    }
+    reader->pos = pos;
+
+    // Integers that fit in a long long are worked out here
+    Py_ssize_t length = pos - start;
+    if ((!is_float) && (length < 19)){
+        long long value = 0;
+        for (pos=(text[start] == '-') ? start + 1 : start; pos<reader->pos; pos++){
+            value = value * 10 + (text[pos] - '0');
+        }
+        if (text[start] == '-'){
+            value = -value;
+        }
+#if PY_MAJOR_VERSION >= 3
+        return PyLong_FromLongLong(value);
+#else
+        if ((value >= LONG_MIN) && (value <= LONG_MAX)){
+            return PyInt_FromLong((long)value);
+        }
+        return PyLong_FromLongLong(value);
+#endif
+    }
 
-    // Copy the input data to a newly malloc'd location so we don't lose it
-    parser.length = strlen(data);
-    parser.full_data = malloc(parser.length+1);
-    snprintf(parser.full_data, parser.length+1, "%s", data);
+    char * number = (length < (Py_ssize_t)sizeof(buffer)) ? buffer : malloc(length + 1);
+    if (number == NULL){
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(number, text + start, length);
+    number[length] = '\0';
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    PyObject * result;
+    if (is_float){
+        double value = PyOS_string_to_double(number, NULL, NULL);
+        result = ((value == -1.0) && PyErr_Occurred()) ? NULL : PyFloat_FromDouble(value);
+    } else {
+        result = PyLong_FromString(number, NULL, 10);
+    }
+    if (number != buffer){
+        free(number);
+    }
+    return result;
 }
 
-/* Helper method from:
- * http://stackoverflow.com/questions/15515088/how-to-check-if-string-starts-with-certain-string-in-c
- * */
-bool StartsWith(const char *a, const char *b)
-{
-   if(strncmp(a, b, strlen(b)) == 0) return 1;
-   return 0;
+PyObject * json_read_value(json_reader * reader, int shape);
+
+/* Returns the item of a dictionary, checking that it is a list if a
+   list is needed. Returns NULL without an exception set if it isn't
+   there. */
+static PyObject * json_item(PyObject * dict, const char * key, bool list){
+    PyObject * item = PyDict_GetItemString(dict, key);
+    if ((item != NULL) && list && (!PyList_Check(item))){
+        return NULL;
+    }
+    return item;
 }
 
-static PyObject *
-PARSE_get_token_full(PyObject *self)
-{
-    char * token;
-    token = get_token(&parser);
-    parser_data * my_parser = &parser;
+/* Sets the attributes of an object from the items of a dictionary. The
+   names and keys alternate, ending with NULL. */
+static bool json_set_attributes(PyObject * object, PyObject * dict, ...){
+    va_list names;
+    char * name;
+    bool success = true;
+
+    va_start(names, dict);
+    while (success && ((name = va_arg(names, char *)) != NULL)){
+        const char * key = va_arg(names, const char *);
+        success = PyObject_SetAttrString(object, name, PyDict_GetItemString(dict, key)) == 0;
+    }
+    va_end(names);
+    return success;
+}
 
-    // Skip comments
-    while (my_parser->last_delineator == '#'){
-        token = get_token(&parser);
+/* Builds an Entry, Saveframe or Loop from its decoded dictionary the
+   way its from_json() in bmrb.py does. Its saveframes or loops have
+   already been built. If anything is missing the dictionary is passed
+   to from_json() to raise the error about it. */
+PyObject * json_build(json_reader * reader, PyObject * dict, int shape){
+    PyObject * built = NULL;
+
+    if (shape == json_entry_shape){
+        PyObject * entry_id = json_item(dict, "entry_id", false);
+        if (entry_id == NULL){
+            entry_id = json_item(dict, "bmrb_id", false);
+        }
+        if ((entry_id == NULL) || (json_item(dict, "saveframes", true) == NULL)){
+            return PyObject_CallMethod(reader->entry_class, "from_json", "(O)", dict);
+        }
+        built = PyObject_CallMethod(reader->entry_class, "from_scratch", "(O)", entry_id);
+        if ((built != NULL) &&
+            (!json_set_attributes(built, dict, "frame_list", "saveframes", NULL))){
+            Py_CLEAR(built);
+        }
+    } else if (shape == json_frame_shape){
+        if ((json_item(dict, "name", false) == NULL) || (json_item(dict, "tag_prefix", false) == NULL) ||
+            (json_item(dict, "tags", false) == NULL) || (json_item(dict, "loops", true) == NULL)){
+            return PyObject_CallMethod(reader->saveframe_class, "from_json", "(O)", dict);
+        }
+        built = PyObject_CallMethod(reader->saveframe_class, "from_scratch", "(O)",
+                                    PyDict_GetItemString(dict, "name"));
+        if ((built != NULL) &&
+            (!json_set_attributes(built, dict, "tag_prefix", "tag_prefix", NULL))){
+            Py_CLEAR(built);
+        }
+        if (built != NULL){
+            PyObject * category = json_item(dict, "category", false);
+            PyObject * unset = (category != NULL) ? NULL : PyString_FromString("unset");
+            if (((category == NULL) && (unset == NULL)) ||
+                (PyObject_SetAttrString(built, "category", (category != NULL) ? category : unset) != 0) ||
+                (!json_set_attributes(built, dict, "tags", "tags", "loops", "loops", NULL))){
+                Py_CLEAR(built);
+            }
+            Py_XDECREF(unset);
+        }
+    } else {
+        if ((json_item(dict, "tags", false) == NULL) || (json_item(dict, "category", false) == NULL) ||
+            (json_item(dict, "data", false) == NULL)){
+            return PyObject_CallMethod(reader->loop_class, "from_json", "(O)", dict);
+        }
+        built = PyObject_CallMethod(reader->loop_class, "from_scratch", NULL);
+        if ((built != NULL) &&
+            (!json_set_attributes(built, dict, "columns", "tags", "category", "category",
+                                  "data", "data", NULL))){
+            Py_CLEAR(built);
+        }
     }
 
-    // Pass errors up the chain
-    if (token == NULL){
+    if ((built != NULL) && (PyObject_SetAttrString(built, "source", reader->source) != 0)){
+        Py_CLEAR(built);
+    }
+    return built;
+}
+
+/* Decodes an object, starting after its opening brace. */
+PyObject * json_read_object(json_reader * reader, int shape){
+    PyObject * dict = PyDict_New();
+    bool first = true, outermost = reader->outermost;
+
+    reader->outermost = false;
+
+    while (dict != NULL){
+        json_skip_whitespace(reader);
+        if ((reader->pos < reader->length) && (reader->text[reader->pos] == '}') && first){
+            reader->pos++;
+            break;
+        }
+        if ((reader->pos >= reader->length) || (reader->text[reader->pos] != '"')){
+            json_error();
+            Py_CLEAR(dict);
+            break;
+        }
+        reader->pos++;
+        PyObject * key = json_read_string(reader);
+        if (key == NULL){
+            Py_CLEAR(dict);
+            break;
+        }
+        json_skip_whitespace(reader);
+        if ((reader->pos >= reader->length) || (reader->text[reader->pos] != ':')){
+            json_error();
+            Py_DECREF(key);
+            Py_CLEAR(dict);
+            break;
+        }
+        reader->pos++;
+
+        // The saveframes of an entry and the loops of a saveframe are
+        //  built as they are decoded
+        int item_shape = json_any;
+        const char * name = string_data(key);
+        if ((shape == json_entry_shape) && (name != NULL) && (strcmp(name, "saveframes") == 0)){
+            item_shape = json_frame_list;
+        } else if ((shape == json_frame_shape) && (name != NULL) && (strcmp(name, "loops") == 0)){
+            item_shape = json_loop_list;
+        }
+        PyErr_Clear();
+
+        PyObject * value = json_read_value(reader, item_shape);
+        int stored = (value == NULL) ? -1 : PyDict_SetItem(dict, key, value);
+        Py_DECREF(key);
+        Py_XDECREF(value);
+        if (stored != 0){
+            Py_CLEAR(dict);
+            break;
+        }
+
+        json_skip_whitespace(reader);
+        if ((reader->pos < reader->length) && (reader->text[reader->pos] == ',')){
+            reader->pos++;
+            first = false;
+        } else if ((reader->pos < reader->length) && (reader->text[reader->pos] == '}')){
+            reader->pos++;
+            break;
+        } else {
+            json_error();
+            Py_CLEAR(dict);
+        }
+    }
+
+    if ((dict == NULL) || (shape == json_any) || outermost){
+        return dict;
+    }
+    PyObject * built = json_build(reader, dict, shape);
+    Py_DECREF(dict);
+    return built;
+}
+
+/* Decodes an array, starting after its opening bracket. */
+PyObject * json_read_array(json_reader * reader, int shape){
+    PyObject * list = PyList_New(0);
+    int item_shape = json_any;
+
+    if (shape == json_frame_list){
+        item_shape = json_frame_shape;
+    } else if (shape == json_loop_list){
+        item_shape = json_loop_shape;
+    }
+
+    json_skip_whitespace(reader);
+    if ((reader->pos < reader->length) && (reader->text[reader->pos] == ']')){
+        reader->pos++;
+        return list;
+    }
+    while (list != NULL){
+        PyObject * value = json_read_value(reader, item_shape);
+        if ((value == NULL) || (PyList_Append(list, value) != 0)){
+            Py_XDECREF(value);
+            Py_CLEAR(list);
+            break;
+        }
+        Py_DECREF(value);
+
+        json_skip_whitespace(reader);
+        if ((reader->pos < reader->length) && (reader->text[reader->pos] == ',')){
+            reader->pos++;
+        } else if ((reader->pos < reader->length) && (reader->text[reader->pos] == ']')){
+            reader->pos++;
+            break;
+        } else {
+            json_error();
+            Py_CLEAR(list);
+        }
+    }
+    return list;
+}
+
+/* Decodes a value. Objects where an entry, saveframe or loop is
+   expected are built into one, and anything else there is passed to
+   from_json() the way bmrb.py would. */
+PyObject * json_read_value(json_reader * reader, int shape){
+    PyObject * value = NULL;
+    const char * text = reader->text;
+
+    json_skip_whitespace(reader);
+    if (reader->pos >= reader->length){
+        json_error();
         return NULL;
     }
+    switch (text[reader->pos]){
+        case '{':
+            if (Py_EnterRecursiveCall(" while decoding JSON")){
+                return NULL;
+            }
+            reader->pos++;
+            // An object where a list of saveframes or loops should be is
+            //  left for bmrb.py to complain about
+            if ((shape == json_frame_list) || (shape == json_loop_list)){
+                shape = json_any;
+            }
+            value = json_read_object(reader, shape);
+            Py_LeaveRecursiveCall();
+            shape = json_any;
+            break;
+        case '[':
+            if (Py_EnterRecursiveCall(" while decoding JSON")){
+                return NULL;
+            }
+            reader->pos++;
+            value = json_read_array(reader, shape);
+            Py_LeaveRecursiveCall();
+            break;
+        case '"':
+            reader->pos++;
+            value = json_read_string(reader);
+            break;
+        case 'n':
+            value = json_word(reader, "null", 4) ? Py_None : NULL;
+            Py_XINCREF(value);
+            break;
+        case 't':
+            value = json_word(reader, "true", 4) ? Py_True : NULL;
+            Py_XINCREF(value);
+            break;
+        case 'f':
+            value = json_word(reader, "false", 5) ? Py_False : NULL;
+            Py_XINCREF(value);
+            break;
+        case 'N':
+            value = json_word(reader, "NaN", 3) ? PyFloat_FromDouble(Py_NAN) : NULL;
+            break;
+        default:
+            value = json_read_number(reader);
+    }
 
-    // Unwrap embedded STAR if all lines start with three spaces
-    if ((my_parser->last_delineator == ';') && (starts_with(token, "\n   "))){
-        bool shift_over = true;
+    if ((value == NULL) || (shape == json_any) ||
+        (shape == json_frame_list) || (shape == json_loop_list)){
+        return value;
+    }
+    PyObject * cls = (shape == json_entry_shape) ? reader->entry_class :
+                     (shape == json_frame_shape) ? reader->saveframe_class : reader->loop_class;
+    PyObject * built = PyObject_CallMethod(cls, "from_json", "(O)", value);
+    Py_DECREF(value);
+    return built;
+}
 
-        size_t token_len = strlen(token);
-        long c;
-        for (c=0; c<token_len - 4; c++){
-            if (token[c] == '\n'){
-                if (token[c+1] != ' ' || token[c+2] != ' ' || token[c+3] != ' '){
-                    shift_over = false;
-                }
+/* Builds an entry, saveframe or loop from JSON text. What it builds
+   depends on which of the three classes is passed first. Does what the
+   from_json() methods in bmrb.py do with text, without building the
+   dictionaries first. If the text isn't a JSON object what it decodes
+   to is returned instead. */
+static PyObject *
+PARSE_from_json(PyObject *self, PyObject *args)
+{
+    PyObject * text_object, * build, * bytes = NULL, * result = NULL;
+    json_reader reader;
+    const char * text;
+    Py_ssize_t length;
+    bool ascii;
+    int shape = json_entry_shape;
+
+    memset(&reader, 0, sizeof(reader));
+    if (!PyArg_ParseTuple(args, "OOOOO", &text_object, &build, &reader.entry_class,
+                          &reader.saveframe_class, &reader.loop_class))
+        return NULL;
+
+    if (!string_contents(text_object, &text, &length, &ascii)){
+        if (PyErr_Occurred()){
+            return NULL;
+        }
+#if PY_MAJOR_VERSION >= 3
+        // Strings with lone surrogates, which json.loads() allows
+        if (PyUnicode_Check(text_object)){
+            bytes = PyUnicode_AsEncodedString(text_object, "utf-8", "surrogatepass");
+        }
+#else
+        if (PyUnicode_Check(text_object)){
+            bytes = PyUnicode_AsUTF8String(text_object);
+        }
+#endif
+        if (bytes == NULL){
+            if (!PyErr_Occurred()){
+                json_error();
             }
+            return NULL;
         }
+        text = PyBytes_AS_STRING(bytes);
+        length = PyBytes_GET_SIZE(bytes);
+    }
+    if (build == reader.saveframe_class){
+        shape = json_frame_shape;
+    } else if (build == reader.loop_class){
+        shape = json_loop_shape;
+    }
 
-        // Actually shift the text over
-        if ((shift_over == true) && (strstr(token, "\n   ;") != NULL)){
-            // Remove the trailing newline
-            token[token_len-1] = '\0';
-            token = str_replace(token, "\n   ", "\n");
+    reader.text = text;
+    reader.length = length;
+    reader.memo = calloc(json_memo_size, sizeof(json_memo));
+    reader.source = PyString_FromString("from_json()");
+    if ((reader.memo == NULL) || (reader.source == NULL)){
+        if (reader.memo == NULL){
+            PyErr_NoMemory();
         }
+        goto done;
     }
 
-    if (token == done_parsing){
-        // Return python none if done parsing
-        Py_INCREF(Py_None);
+    // Anything but an object is returned as it is for bmrb.py to check
+    json_skip_whitespace(&reader);
+    if ((reader.pos >= reader.length) || (reader.text[reader.pos] != '{')){
+        shape = json_any;
+    }
+    reader.outermost = true;
+    result = json_read_value(&reader, shape);
+    json_skip_whitespace(&reader);
+    if ((result != NULL) && (reader.pos != reader.length)){
+        json_error();
+        Py_CLEAR(result);
+    }
+    if ((result != NULL) && (shape != json_any)){
+        PyObject * built = json_build(&reader, result, shape);
+        Py_DECREF(result);
+        result = built;
+    }
 
-    #if PY_MAJOR_VERSION >= 3
-        return Py_BuildValue("OlC", Py_None, my_parser->line_no, my_parser->last_delineator);
+done:
+    if (reader.memo != NULL){
+        long x;
+        for (x=0; x<json_memo_size; x++){
+            Py_XDECREF(reader.memo[x].string);
+        }
+        free(reader.memo);
+    }
+    free(reader.scratch.text);
+    Py_XDECREF(reader.source);
+    Py_XDECREF(bytes);
+    return result;
+}
+
+/* Returns the names of the scanners this CPU can use. */
+static PyObject *
+PARSE_scanners(PyObject *self)
+{
+    PyObject * names = PyList_New(0);
+    long x;
+    for (x=0; (names != NULL) && (x<num_scanners); x++){
+        if (scanner_supported(scanners[x].name)){
+            PyObject * name = PyString_FromString(scanners[x].name);
+            if ((name == NULL) || (PyList_Append(names, name) != 0)){
+                Py_CLEAR(names);
+            }
+            Py_XDECREF(name);
+        }
     }
-    return Py_BuildValue("slC", token, my_parser->line_no, my_parser->last_delineator);
+    return names;
+}
 
-    #else
-        return Py_BuildValue("Olc", Py_None, my_parser->line_no, my_parser->last_delineator);
+/* Returns the name of the scanner in use. Switches to the named
+   scanner first if a name is given. */
+static PyObject *
+PARSE_scanner(PyObject *self, PyObject *args)
+{
+    char * name = NULL;
+
+    if (!PyArg_ParseTuple(args, "|s", &name))
+        return NULL;
+
+    if (name != NULL){
+        long x;
+        for (x=0; x<num_scanners; x++){
+            if ((strcmp(scanners[x].name, name) == 0) && scanner_supported(name)){
+                break;
+            }
+        }
+        if (x == num_scanners){
+            PyErr_Format(PyExc_ValueError, "The '%s' scanner is not available.", name);
+            return NULL;
+        }
+        scan = &scanners[x];
     }
-    return Py_BuildValue("slc", token, my_parser->line_no, my_parser->last_delineator);
-    #endif
+
+    return PyString_FromString(scan->name);
 }
 
 static PyObject *
@@ -746,12 +6644,67 @@ version(PyObject *self)
 static PyMethodDef cnmrstar_methods[] = {
     {"clean_value",  (PyCFunction)clean_string, METH_VARARGS,
      "Properly quote or encapsulate a value before printing."},
+    {"clean_values",  (PyCFunction)PARSE_clean_values, METH_VARARGS,
+     "Return a list of the values each quoted the way clean_value() in "
+     "bmrb.py does. Pass the values and STR_CONVERSION_DICT, and optionally "
+     "True to get the lengths of the quoted values instead."},
+
+    {"row_hashes",  (PyCFunction)PARSE_row_hashes, METH_VARARGS,
+     "Return a 64 bit hash of each row as bytes. Pass the rows and "
+     "STR_CONVERSION_DICT. Rows hash the same if clean_values() quotes "
+     "their values the same."},
+
+    {"same_rows",  (PyCFunction)PARSE_same_rows, METH_VARARGS,
+     "Return True if each of the rows is quoted by clean_values() the same "
+     "as the other row in its place. Pass the two lists of rows and "
+     "STR_CONVERSION_DICT."},
+
+    {"sort_order",  (PyCFunction)PARSE_sort_order, METH_VARARGS,
+     "Return the positions of the rows in sorted order. Pass a list of "
+     "columns in order of priority, each a list of the value of every row, "
+     "or the rows and a list of the positions of the columns in them. "
+     "Columns are sorted as floats if all their values can be."},
+
+    {"format_loop",  (PyCFunction)PARSE_format_loop, METH_VARARGS,
+     "Return a loop in STAR format. Pass the loop, STR_CONVERSION_DICT "
+     "and optionally SKIP_EMPTY_LOOPS and ALLOW_V2_ENTRIES."},
+
+    {"format_saveframe",  (PyCFunction)PARSE_format_saveframe, METH_VARARGS,
+     "Return a saveframe in STAR format. Pass the saveframe, the text to "
+     "start with, the width of the tag names, the Loop class, "
+     "STR_CONVERSION_DICT and optionally SKIP_EMPTY_LOOPS, "
+     "ALLOW_V2_ENTRIES, a function to write the text to a piece at a time "
+     "and whether to write it as bytes."},
+
+    {"decode_strings",  (PyCFunction)PARSE_decode_strings, METH_VARARGS,
+     "Return a list of the strings in a block of UTF-8 text. Pass the text "
+     "and an array of 32 bit integers with the offset of each string "
+     "followed by the offset of the end of the last one."},
+
+    {"rows_from_columns",  (PyCFunction)PARSE_rows_from_columns, METH_VARARGS,
+     "Return the rows of a loop as a list of lists. Pass a list with the "
+     "(values, dictionary, nulls) of each column, as ColumnarData."
+     "column_buffers() returns them, and the number of rows."},
+
+    {"to_json",  (PyCFunction)PARSE_to_json, METH_VARARGS,
+     "Return an entry, saveframe or loop in JSON format. Pass it, a tuple "
+     "of the saveframe types to write from their attributes, the Loop "
+     "class, a tuple of the types to write as str() of them, a function "
+     "that returns the JSON of anything else and optionally a function to "
+     "write the text to a piece at a time and whether to write it as bytes."},
+
+    {"from_json",  (PyCFunction)PARSE_from_json, METH_VARARGS,
+     "Build an entry, saveframe or loop from JSON text. Pass the text, the "
+     "class to build and the Entry, Saveframe and Loop classes. Text that "
+     "isn't a JSON object is decoded but not built into anything."},
 
     {"load",  (PyCFunction)PARSE_load, METH_VARARGS,
-     "Load a file in preparation to tokenize."},
+     "Load a file in preparation to tokenize. Pass True as the second "
+     "argument to prepare it for the parser as well."},
 
      {"load_string",  (PyCFunction)PARSE_load_string, METH_VARARGS,
-     "Load a string in preparation to tokenize."},
+     "Load a string in preparation to tokenize. Pass True as the second "
+     "argument to prepare it for the parser as well."},
 
      {"get_token_full",  (PyCFunction)PARSE_get_token_full, METH_NOARGS,
      "Get one token from the file as well as the line number and delineator."},
@@ -759,6 +6712,21 @@ static PyMethodDef cnmrstar_methods[] = {
      {"reset",  (PyCFunction)PARSE_reset, METH_NOARGS,
      "Reset the tokenizer state."},
 
+     {"parse_many",  (PyCFunction)PARSE_parse_many, METH_VARARGS,
+     "Read and tokenize a list of files on a pool of threads without "
+     "holding the GIL. Returns one Tokenizer per file."},
+
+     {"parse",  (PyCFunction)PARSE_parse, METH_VARARGS | METH_KEYWORDS,
+     "Parse a string into the provided entry using the provided Saveframe "
+     "and Loop classes."},
+
+     {"scanners",  (PyCFunction)PARSE_scanners, METH_NOARGS,
+     "Returns the names of the byte scanners this CPU supports."},
+
+     {"scanner",  (PyCFunction)PARSE_scanner, METH_VARARGS,
+     "Returns the name of the byte scanner in use. Pass a name from "
+     "scanners() to switch to it."},
+
      {"version",  (PyCFunction)version, METH_NOARGS,
      "Returns the version of the module."},
 
@@ -809,6 +6777,18 @@ initcnmrstar(void)
 
     if (module == NULL)
         INITERROR;
+
+    // Scan with the widest vectors the CPU supports
+    choose_scanner();
+
+    // Add the re-entrant tokenizer type
+    if (PyType_Ready(&TokenizerType) < 0){
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(&TokenizerType);
+    PyModule_AddObject(module, "Tokenizer", (PyObject *)&TokenizerType);
+
     struct module_state *st = GETSTATE(module);
 
     st->error = PyErr_NewException("cnmrstar.Error", NULL, NULL);
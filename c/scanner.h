@@ -0,0 +1,187 @@
+/* Vectorized versions of the byte scanning functions. This file is
+   included by cnmrstarmodule.c once for each instruction set with these
+   macros describing the vector operations:
+
+   SCAN_SUFFIX      Appended to the function names (sse2, avx2, ...)
+   SCAN_TARGET      Function attribute that enables the instruction set
+   SCAN_VECTOR      The vector type
+   SCAN_WIDTH       Number of bytes in a vector
+   SCAN_FULL        Bit mask with one bit set per byte of a vector
+   SCAN_LOAD(p)     Unaligned load of SCAN_WIDTH bytes
+   SCAN_SET1(c)     Vector with every byte set to c
+   SCAN_EQ(a, b)    Byte-wise equality
+   SCAN_OR(a, b)    Bitwise or
+   SCAN_MASK(v)     One bit per byte with the top bit of each byte
+
+   data[end] must be readable, and is null when end is the length of the
+   data. Some of the functions look at the byte after the one they are
+   checking but none of them read past data[end]. Each one finishes off
+   with the scalar version once there are fewer than SCAN_WIDTH bytes
+   left.
+
+   Most tokens and the whitespace between them are only a few bytes long,
+   so the searches that are usually short check the first SCAN_WIDTH
+   bytes one at a time before switching to vectors. */
+
+// Where the one byte at a time part of a search ends
+#define SCAN_PROLOGUE(pos, end) (((end) - (pos) > SCAN_WIDTH) ? (pos) + SCAN_WIDTH : (end))
+
+#define SCAN_PASTE(name, suffix) name ## _ ## suffix
+#define SCAN_EXPAND(name, suffix) SCAN_PASTE(name, suffix)
+#define SCAN_NAME(name) SCAN_EXPAND(name, SCAN_SUFFIX)
+
+/* Bit mask of the bytes that are whitespace. */
+SCAN_TARGET static inline uint32_t SCAN_NAME(whitespace_mask)(SCAN_VECTOR v){
+    return SCAN_MASK(SCAN_OR(SCAN_OR(SCAN_OR(SCAN_EQ(v, SCAN_SET1(' ')),
+                                             SCAN_EQ(v, SCAN_SET1('\n'))),
+                                     SCAN_OR(SCAN_EQ(v, SCAN_SET1('\t')),
+                                             SCAN_EQ(v, SCAN_SET1('\v')))),
+                             SCAN_EQ(v, SCAN_SET1('\r'))));
+}
+
+/* Bit mask of the bytes that end a line, given the vector and the vector
+   one byte further along. A "\r" only counts if it isn't followed by a
+   "\n", so that "\r\n" is one line break. */
+SCAN_TARGET static inline uint32_t SCAN_NAME(line_break_mask)(SCAN_VECTOR v, SCAN_VECTOR next){
+    return SCAN_MASK(SCAN_EQ(v, SCAN_SET1('\n'))) |
+           (SCAN_MASK(SCAN_EQ(v, SCAN_SET1('\r'))) &
+            ~SCAN_MASK(SCAN_EQ(next, SCAN_SET1('\n'))));
+}
+
+SCAN_TARGET static long SCAN_NAME(find_token_end)(const char * data, long pos, long end){
+    long limit = SCAN_PROLOGUE(pos, end);
+    pos = find_token_end_scalar(data, pos, limit);
+    if (pos < limit){
+        return pos;
+    }
+
+    while (pos + SCAN_WIDTH <= end){
+        SCAN_VECTOR v = SCAN_LOAD(data + pos);
+        uint32_t stop = SCAN_NAME(whitespace_mask)(v) |
+                        SCAN_MASK(SCAN_EQ(v, SCAN_SET1('\0')));
+        if (stop){
+            return pos + __builtin_ctz(stop);
+        }
+        pos += SCAN_WIDTH;
+    }
+    return find_token_end_scalar(data, pos, end);
+}
+
+SCAN_TARGET static long SCAN_NAME(skip_whitespace)(const char * data, long pos, long end, long * newlines){
+    long limit = SCAN_PROLOGUE(pos, end);
+    pos = skip_whitespace_scalar(data, pos, limit, newlines);
+    if (pos < limit){
+        return pos;
+    }
+
+    while (pos + SCAN_WIDTH <= end){
+        SCAN_VECTOR v = SCAN_LOAD(data + pos);
+        uint32_t lines = SCAN_NAME(line_break_mask)(v, SCAN_LOAD(data + pos + 1));
+        uint32_t stop = ~SCAN_NAME(whitespace_mask)(v) & SCAN_FULL;
+        if (stop){
+            int offset = __builtin_ctz(stop);
+            *newlines += __builtin_popcount(lines & ((1u << offset) - 1));
+            return pos + offset;
+        }
+        *newlines += __builtin_popcount(lines);
+        pos += SCAN_WIDTH;
+    }
+    return skip_whitespace_scalar(data, pos, end, newlines);
+}
+
+SCAN_TARGET static long SCAN_NAME(find_byte)(const char * data, long pos, long end, char needle){
+    long limit = SCAN_PROLOGUE(pos, end);
+    for (; pos < limit; pos++){
+        if (data[pos] == needle){
+            return pos;
+        }
+        if (data[pos] == '\0'){
+            return -1;
+        }
+    }
+
+    SCAN_VECTOR target = SCAN_SET1(needle);
+    while (pos + SCAN_WIDTH <= end){
+        SCAN_VECTOR v = SCAN_LOAD(data + pos);
+        uint32_t stop = SCAN_MASK(SCAN_OR(SCAN_EQ(v, target),
+                                          SCAN_EQ(v, SCAN_SET1('\0'))));
+        if (stop){
+            pos += __builtin_ctz(stop);
+            return (data[pos] == needle) ? pos : -1;
+        }
+        pos += SCAN_WIDTH;
+    }
+    return find_byte_scalar(data, pos, end, needle);
+}
+
+SCAN_TARGET static long SCAN_NAME(find_line_end)(const char * data, long pos, long end){
+    long limit = SCAN_PROLOGUE(pos, end);
+    for (; pos < limit; pos++){
+        if ((data[pos] == '\n') || (data[pos] == '\r')){
+            return pos;
+        }
+        if (data[pos] == '\0'){
+            return -1;
+        }
+    }
+
+    while (pos + SCAN_WIDTH <= end){
+        SCAN_VECTOR v = SCAN_LOAD(data + pos);
+        uint32_t stop = SCAN_MASK(SCAN_OR(SCAN_OR(SCAN_EQ(v, SCAN_SET1('\n')),
+                                                  SCAN_EQ(v, SCAN_SET1('\r'))),
+                                          SCAN_EQ(v, SCAN_SET1('\0'))));
+        if (stop){
+            pos += __builtin_ctz(stop);
+            return (data[pos] != '\0') ? pos : -1;
+        }
+        pos += SCAN_WIDTH;
+    }
+    return find_line_end_scalar(data, pos, end);
+}
+
+SCAN_TARGET static long SCAN_NAME(find_value_end)(const char * data, long pos, long end, long * newlines){
+    // The second load reaches one byte further, up to data[end] at most
+    while (pos + SCAN_WIDTH <= end){
+        SCAN_VECTOR v = SCAN_LOAD(data + pos);
+        SCAN_VECTOR next = SCAN_LOAD(data + pos + 1);
+        uint32_t lines = SCAN_NAME(line_break_mask)(v, next);
+        uint32_t stop = (lines & SCAN_MASK(SCAN_EQ(next, SCAN_SET1(';')))) |
+                        SCAN_MASK(SCAN_EQ(v, SCAN_SET1('\0')));
+        if (stop){
+            int offset = __builtin_ctz(stop);
+            if (data[pos + offset] == '\0'){
+                return -1;
+            }
+            *newlines += __builtin_popcount(lines & ((2u << offset) - 1));
+            return pos + offset;
+        }
+        *newlines += __builtin_popcount(lines);
+        pos += SCAN_WIDTH;
+    }
+    return find_value_end_scalar(data, pos, end, newlines);
+}
+
+SCAN_TARGET static long SCAN_NAME(count_newlines)(const char * data, long pos, long end){
+    long newlines = 0;
+    while (pos + SCAN_WIDTH <= end){
+        newlines += __builtin_popcount(SCAN_NAME(line_break_mask)(SCAN_LOAD(data + pos),
+                                                                  SCAN_LOAD(data + pos + 1)));
+        pos += SCAN_WIDTH;
+    }
+    return newlines + count_newlines_scalar(data, pos, end);
+}
+
+#undef SCAN_PROLOGUE
+#undef SCAN_PASTE
+#undef SCAN_EXPAND
+#undef SCAN_NAME
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#undef SCAN_VECTOR
+#undef SCAN_WIDTH
+#undef SCAN_FULL
+#undef SCAN_LOAD
+#undef SCAN_SET1
+#undef SCAN_EQ
+#undef SCAN_OR
+#undef SCAN_MASK
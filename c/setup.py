@@ -2,7 +2,10 @@ from distutils.core import setup, Extension
 
 cnmrstar = Extension('cnmrstar',
                     sources = ['cnmrstarmodule.c'],
-                    extra_compile_args=["-funroll-loops", "-O3"])
+                    depends = ['scanner.h'],
+                    libraries = ['z'],
+                    extra_compile_args=["-funroll-loops", "-O3", "-pthread"],
+                    extra_link_args=["-pthread"])
 
 setup (name = 'cNMR-STAR Tools',
        version = '1.0',
@@ -12,6 +12,9 @@ if not os.path.isfile("bmrb.py"):
     sys.path.append("..")
 import bmrb
 
+# Only the saveframes that are used need to be parsed
+bmrb.LAZY_LOADING = True
+
 if len(sys.argv) < 2:
     raise ValueError("You must provide the file to read from as the first argument.")
 
@@ -1,11 +1,19 @@
 #!/usr/bin/env python
+# -*- coding: utf-8 -*-
 
 # Standard imports
 import os
 import sys
+import gzip
+import json
 import random
+import shutil
+import decimal
+import datetime
+import tempfile
 import unittest
 import subprocess
+from io import BytesIO
 from copy import deepcopy as copy
 
 # Determine if we are running in python3
@@ -63,6 +71,18 @@ class TestPyNMRSTAR(unittest.TestCase):
         self.assertEqual(bmrb.clean_value("loop_"), "noloop_")
         bmrb.STR_CONVERSION_DICT = {None:"."}
 
+    def test_clean_values(self):
+        values = ["single quote test", "double quote' test", "loop_", None,
+                  "#comment", "_tag", "simple", "a\n;b", "\nnewline\n",
+                  "it's \"quoted\"", "it's \"quoted\" x", 1, 2.5, True,
+                  "été" if PY3 else "ete", "sémi colon"]
+        cleaned = [bmrb.clean_value(x) for x in values]
+        self.assertEqual(bmrb.clean_values(values), cleaned)
+        self.assertEqual(bmrb.clean_values(tuple(values), widths=True),
+                         [len(x) for x in cleaned])
+        self.assertEqual(bmrb.clean_values([]), [])
+        self.assertRaises(ValueError, bmrb.clean_values, ["a", ""])
+
     def test__format_category(self):
         self.assertEqual(bmrb._format_category("test"), "_test")
         self.assertEqual(bmrb._format_category("_test"), "_test")
@@ -109,6 +129,11 @@ class TestPyNMRSTAR(unittest.TestCase):
         self.assertRaises(ValueError, bmrb.Entry.from_string, 'data_1\nsave_1\n"loop"_\n_tag.tag\ndata_\nstop_\nsave_\n')
         self.assertRaises(ValueError, bmrb.Entry.from_string, "data_1\nsave_1\nloop_\n_tag.tag\ndata_\n;\nstop_\n;\nsave_\n")
 
+        # Check that loop values are split into rows and counted properly
+        self.assertEqual(bmrb.Loop.from_string("loop_ _loop.a _loop.b 1 'loop_' \"3\" 4 stop_").data, [['1', 'loop_'], ['3', '4']])
+        self.assertRaises(ValueError, bmrb.Loop.from_string, "loop_ _loop.a _loop.b 1 2 3 stop_")
+        self.assertRaises(ValueError, bmrb.Loop.from_string, "loop_ _loop.a _loop.b 1 2 3 4 'stop_'")
+
     def test_Schema(self):
         default = bmrb.Schema()
         loaded = bmrb.Schema(bmrb._SCHEMA_URL)
@@ -168,6 +193,45 @@ class TestPyNMRSTAR(unittest.TestCase):
         self.entry.frame_list.pop()
         self.assertEqual(file_entry.compare(self.entry), ["Entry ID does not match between entries: '15000' vs '14999'.", "The number of saveframes in the entries are not equal: '25' vs '24'.", "No saveframe with name 'assigned_chem_shift_list_1' in other entry."])
 
+        # Rows are compared as a multiset and the unmatched ones listed
+        loop = bmrb.Loop.from_string("loop_ _A.b _A.c 1 x 1 x 2 'y z' 3 . stop_")
+        other = bmrb.Loop.from_string("loop_ _A.b _A.c 3 . 2 'y z' 1 x 4 ? stop_")
+        self.assertEqual(loop.compare(copy(loop)), [])
+        self.assertEqual(loop.compare(other), ["\t\tLoop data does not match for loop with category '_A'.",
+                                               "\t\tRow 2 is not in the compared loop: 1 x",
+                                               "\t\tRow 4 of the compared loop is not in this loop: 4 ?"])
+        other.data[3] = ["1", "x"]
+        self.assertEqual(other.compare(loop), [])
+        other.data[0][0] = 3
+        self.assertEqual(other.compare(loop), [])
+
+        # The hashes of columnar data are kept until it is changed
+        for columnar in [loop, other]:
+            columnar.set_columnar()
+            self.assertEqual(columnar.compare(copy(other)), [])
+        other.data[1][1] = "y"
+        self.assertEqual(loop.compare(other)[1:], ["\t\tRow 3 is not in the compared loop: 2 'y z'",
+                                                   "\t\tRow 2 of the compared loop is not in this loop: 2 y"])
+        del other.data[1]
+        other.data.append(["2", "y z"])
+        self.assertEqual(loop.compare(other), [])
+
+        # Rows whose hashes match are still compared themselves
+        row_hashes = bmrb.Loop._row_hashes
+        bmrb.Loop._row_hashes = lambda self: [0] * len(self.data)
+        try:
+            loop = bmrb.Loop.from_string("loop_ _A.b _A.c 1 x 1 x 2 'y z' 3 . stop_")
+            other = bmrb.Loop.from_string("loop_ _A.b _A.c 3 . 2 'y z' 1 x 4 ? stop_")
+            self.assertEqual(loop.compare(other), ["\t\tLoop data does not match for loop with category '_A'.",
+                                                   "\t\tRow 2 is not in the compared loop: 1 x",
+                                                   "\t\tRow 4 of the compared loop is not in this loop: 4 ?"])
+            del other.data[3]
+            self.assertEqual(len(loop.compare(other)), 2)
+            other.data.append(["1", "x"])
+            self.assertEqual(loop.compare(other), [])
+        finally:
+            bmrb.Loop._row_hashes = row_hashes
+
     def test_getmethods(self):
         self.assertEqual(5, len(self.entry.get_loops_by_category("_Vendor")))
         self.assertEqual(5, len(self.entry.get_loops_by_category("vendor")))
@@ -580,6 +644,898 @@ _Entry.multi2
         parser.get_token()
         self.assertEqual((parser.token, parser.delimiter), ("\n;\nsomething\nto shift", ';'))
 
+    def test_interleaved_parsers(self):
+        """ Make sure that two parsers working at the same time don't
+        share tokenizer state. """
+
+        one, two = bmrb._Parser(), bmrb._Parser()
+        one.load_data("data_one save_first _A.b c save_")
+        two.load_data("data_two save_second _D.e f save_")
+
+        self.assertEqual(one.get_token(), "data_one")
+        self.assertEqual(two.get_token(), "data_two")
+        self.assertEqual(one.get_token(), "save_first")
+        self.assertEqual(two.get_token(), "save_second")
+
+        # A nested parse shouldn't disturb the outer one
+        self.assertEqual(bmrb.Entry.from_string(str(file_entry)), file_entry)
+        self.assertEqual(one.get_token(), "_A.b")
+        self.assertEqual(two.get_token(), "_D.e")
+
+    def test_from_files(self):
+        gzipped = os.path.join(our_path, "sample_files", "bmr15000_3.str.gz")
+        entries = bmrb.Entry.from_files([sample_file_location, gzipped,
+                                         sample_file_location], workers=2)
+        self.assertEqual(len(entries), 3)
+        for each_entry in entries:
+            self.assertEqual(str(each_entry), str(file_entry))
+        self.assertEqual(entries[0].source, file_entry.source)
+        self.assertRaises(IOError, bmrb.Entry.from_files,
+                          [os.path.join(our_path, "no_such_file.str")])
+
+    def test_native_parse(self):
+        """ Make sure the C parse engine and the python parser agree. """
+
+        if not bmrb.cnmrstar:
+            return
+
+        tests = [str(file_entry), "", "data_", "data_1 _A.b c",
+                 "data_1 save_a _A.b save_", "data_1 save_a _A.b c",
+                 "data_1 save_a _A.b c loop_ _L.c stop_ save_",
+                 "data_1 save_a _A.b c loop_ _L.c 1 2 stop_ bad save_",
+                 "data_1 save_a _A.b c loop_ _L.c 1 2", "data_1 save_a _A.b loop_"]
+
+        native = bmrb.cnmrstar
+        results = []
+        try:
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                for test in tests:
+                    try:
+                        results.append(str(bmrb.Entry.from_string(test)))
+                    except ValueError as err:
+                        results.append(err.args[0])
+        finally:
+            bmrb.cnmrstar = native
+        self.assertEqual(results[:len(tests)], results[len(tests):])
+
+    def test_sans_parse(self):
+        """ Make sure the C SANS parser and the python one make the same
+        callbacks, with and without batched loop rows. """
+
+        class Recorder(object):
+            """ Records every callback without the line numbers, which
+            the two parsers count differently. """
+
+            def __init__(self, batched):
+                self.events = []
+                if batched:
+                    self.loopRows = self._loop_rows
+            def _record(self, *event):
+                self.events.append(event)
+            def startData(self, line, name):
+                self._record("startData", name)
+            def endData(self, line, name):
+                self._record("endData", name)
+            def startSaveframe(self, line, name):
+                self._record("startSaveframe", name)
+            def endSaveframe(self, line, name):
+                self._record("endSaveframe", name)
+            def startLoop(self, line):
+                self._record("startLoop")
+            def endLoop(self, line):
+                self._record("endLoop")
+            def data(self, tag, tagline, val, valline, delim, inloop):
+                self._record("data", tag, val, delim, inloop)
+            def _loop_rows(self, category, columns, rows):
+                self._record("loopRows", category, columns, rows)
+            def fatalError(self, line, msg):
+                self._record("fatalError", msg)
+            def error(self, line, msg):
+                self._record("error", msg)
+            def warning(self, line, msg):
+                self._record("warning", msg)
+
+        tests = ["data_1 save_a _A.b 'x' _A.c $fr save_",
+                 "data_1 save_a loop_ _A.b _A.c 1 2 3 4 5 6 stop_ save_",
+                 "data_1 save_a loop_ _A.b _A.c 1 2 3 stop_ save_",
+                 "data_1 save_a loop_ _A.b 1 2 3 save_ stop_ save_",
+                 "data_1 save_a loop_ _A.b 1 2 3", "data_1 save_a loop_ stop_ save_",
+                 "data_1 'save_a' _A.b 1 save_", "data_1 save_a _A.b 1 junk save_",
+                 "foo", "data_1 save_a _A.b"]
+
+        native = bmrb.cnmrstar
+        results = []
+        try:
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                for test in tests:
+                    for rows_per_call in [0, 2]:
+                        recorder = Recorder(rows_per_call)
+                        bmrb._Parser().sans_parse(test, recorder, recorder,
+                                                  rows_per_call=rows_per_call)
+                        results.append(recorder.events)
+        finally:
+            bmrb.cnmrstar = native
+        self.assertEqual(results[:len(results) // 2], results[len(results) // 2:])
+
+        # The loop rows come in chunks of at most rows_per_call rows
+        recorder = Recorder(True)
+        bmrb._Parser().sans_parse(tests[1], recorder, recorder, rows_per_call=2)
+        self.assertEqual([event[3] for event in recorder.events if event[0] == "loopRows"],
+                         [[["1", "2"], ["3", "4"]], [["5", "6"]]])
+        self.assertEqual(recorder.events[3][1:3], ("_A", ["b", "c"]))
+
+        # A partial row is dropped before the count error
+        recorder = Recorder(True)
+        bmrb._Parser().sans_parse(tests[2], recorder, recorder, rows_per_call=5)
+        self.assertEqual(recorder.events[3][3], [["1", "2"]])
+        self.assertEqual(recorder.events[-1], ("fatalError", "Loop count error."))
+
+        # Every loop value of a real entry makes it through, in order
+        values = []
+        for rows_per_call in [0, 10]:
+            recorder = Recorder(rows_per_call)
+            bmrb.sans_parse(sample_file_location, recorder, recorder, rows_per_call)
+            loops = []
+            for event in recorder.events:
+                if event[0] == "startLoop":
+                    loops.append([])
+                elif event[0] == "data" and event[4]:
+                    loops[-1].append(event[2])
+                elif event[0] == "loopRows":
+                    self.assertTrue(0 < len(event[3]) <= 10)
+                    loops[-1].extend(value for row in event[3] for value in row)
+            values.append(loops)
+        self.assertEqual(values[0], values[1])
+        self.assertEqual(len(values[0]), sum(len(saveframe.loops) for saveframe in file_entry))
+
+    def test_native_write(self):
+        """ Make sure the C writer and the python one agree. """
+
+        if not bmrb.cnmrstar:
+            return
+
+        frame = bmrb.Saveframe.from_scratch("odd", "_Odd")
+        frame.add_tag("Sf_category", "odd")
+        frame.add_tag("Quotes", "it's \"quoted\"")
+        frame.add_tag("Multi", "one\ntwo")
+        frame.add_tag("Embedded", "\n;\nvalue\n;\n")
+        loop = bmrb.Loop.from_scratch("_Odd_loop")
+        loop.add_column(["ID", "Value", "Unicode"])
+        loop.data = [[1, None, "été" if PY3 else "ete"],
+                     [2, "loop_", "x y"], [3, "a\nb", True]]
+        frame.add_loop(loop)
+        empty = bmrb.Loop.from_scratch("_Empty")
+        empty.add_column("ID")
+        frame.add_loop(empty)
+
+        native = bmrb.cnmrstar
+        results = []
+        try:
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                for defaults in [bmrb.enable_nmrstar_defaults,
+                                 bmrb.enable_nef_defaults]:
+                    defaults()
+                    results.extend([str(file_entry), str(frame), str(loop)])
+                bmrb.enable_nmrstar_defaults()
+                loop.data[0][1] = ""
+                self.assertRaises(ValueError, str, loop)
+                loop.data[0][1] = None
+        finally:
+            bmrb.cnmrstar = native
+            bmrb.enable_nmrstar_defaults()
+        self.assertEqual(results[:6], results[6:])
+
+    def test_write_to(self):
+        """ Writing to a file should give what str() does. """
+
+        native = bmrb.cnmrstar
+        location = tempfile.mktemp()
+        try:
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+
+                text = StringIO()
+                file_entry.write_to(text)
+                self.assertEqual(text.getvalue(), str(file_entry))
+                text = StringIO()
+                file_entry[0].write_to(text)
+                self.assertEqual(text.getvalue(), str(file_entry[0]))
+
+                file_entry.write_to(location)
+                self.assertEqual(bmrb.Entry.from_file(location), file_entry)
+                file_entry.write_to(location, compress="gzip")
+                with open(location, "rb") as gzipped:
+                    self.assertEqual(gzipped.read(2), b"\x1f\x8b")
+                self.assertEqual(bmrb.Entry.from_file(location), file_entry)
+                self.assertRaises(ValueError, file_entry.write_to, location,
+                                  compress="zip")
+        finally:
+            bmrb.cnmrstar = native
+            if os.path.exists(location):
+                os.unlink(location)
+
+    def test_json(self):
+        """ The C JSON code should give what json.dumps() and json.loads()
+        do. """
+
+        native = bmrb.cnmrstar
+        ent = copy(file_entry)
+        ent[0].add_tag("Test_text", u"\u00e9\u65e5 \"quoted\" \\ \n\t\x01")
+        ent[0].loops[0].data[0][1] = decimal.Decimal("1.50")
+        ent[0].loops[0].data[1][1] = datetime.date(2000, 1, 2)
+        ent[0].loops[0].data[2][1] = [1.5, None, True, 2 ** 70]
+        location = tempfile.mktemp()
+        try:
+            results = []
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                text = ent.get_json()
+                self.assertEqual(json.loads(text), json.loads(json.dumps(
+                    ent.get_json(serialize=False), default=str)))
+                results.extend([text, ent[0].get_json(),
+                                ent[0].loops[0].get_json()])
+
+                loaded = bmrb.Entry.from_json(text)
+                self.assertEqual(loaded.source, "from_json()")
+                self.assertEqual(loaded.get_json(), text)
+                self.assertEqual(bmrb.Saveframe.from_json(results[-2]).get_json(),
+                                 results[-2])
+                self.assertEqual(bmrb.Loop.from_json(results[-1]).get_json(),
+                                 results[-1])
+                for bad in ["", "{", '{"entry_id": 1}', "[1]", '{"a": 1} x']:
+                    self.assertRaises(ValueError, bmrb.Entry.from_json, bad)
+
+                output = StringIO()
+                ent.write_json(output)
+                self.assertEqual(output.getvalue(), text)
+                ent.write_json(location, compress="gzip")
+                with gzip.open(location, "rb") as gzipped:
+                    self.assertEqual(gzipped.read().decode(), text)
+        finally:
+            bmrb.cnmrstar = native
+            if os.path.exists(location):
+                os.unlink(location)
+
+        # Python 2 dictionaries don't keep their keys in order
+        if PY3:
+            self.assertEqual(results[:3], results[3:])
+        self.assertEqual([json.loads(x) for x in results[:3]],
+                         [json.loads(x) for x in results[3:]])
+
+    def test_sort_rows(self):
+        """ Sorting by several columns at once should give what sorting
+        by each in turn does. """
+
+        rows = [["3", "b", 2.5], ["10", "a", "."], ["2", "b", 1],
+                ["3", "a", 1], ["-1e1", "C", 1], ["2", "a", 1]]
+
+        def one_at_a_time(columns):
+            result = rows
+            for column in columns:
+                try:
+                    result = sorted(result, key=lambda x: float(x[column]))
+                except ValueError:
+                    result = sorted(result, key=lambda x: x[column])
+            return result
+
+        native = bmrb.cnmrstar
+        try:
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                for columnar in [False, True]:
+                    for columns in [[0], [1], [0, 1], [1, 0]]:
+                        loop = bmrb.Loop.from_scratch("_Test")
+                        loop.add_column(["ID", "Name", "Val"])
+                        loop.data = [list(x) for x in rows]
+                        loop.set_columnar(columnar)
+                        loop.sort_rows(columns)
+                        self.assertEqual(loop.data, one_at_a_time(columns))
+
+                    self.assertEqual(loop.delete_data_by_tag_value("Val", 1),
+                                     [["-1e1", "C", 1], ["2", "a", 1],
+                                      ["2", "b", 1], ["3", "a", 1]])
+                    self.assertEqual(loop.data, [["3", "b", 2.5],
+                                                 ["10", "a", "."]])
+                    self.assertEqual(loop.filter(["Val", "ID"]).data,
+                                     [[2.5, "3"], [".", "10"]])
+                    self.assertEqual(isinstance(loop.data, bmrb.ColumnarData),
+                                     columnar)
+                    if PY3:
+                        self.assertRaises(TypeError, loop.sort_rows, "Val")
+        finally:
+            bmrb.cnmrstar = native
+
+    def test_archive(self):
+        """ Queries of an archive should give what parsing each entry
+        does, and the index should only be updated for changed files. """
+
+        shifts = file_entry.get_loops_by_category("_Atom_chem_shift")[0]
+        expected = [row[0] for row in shifts.get_tag(["Val", "Atom_ID"]) if
+                    row[1] == "CA"]
+
+        directory = tempfile.mkdtemp()
+        native = bmrb.cnmrstar
+        try:
+            os.mkdir(os.path.join(directory, "sub"))
+            shutil.copy(sample_file_location, directory)
+            gzipped = os.path.join(directory, "sub", "bmr15000_3.str.gz")
+
+            for implementation in [native, None]:
+                bmrb.cnmrstar = implementation
+                with open(sample_file_location, "rb") as plain:
+                    out = gzip.open(gzipped, "wb")
+                    out.write(plain.read())
+                    out.close()
+                archive = bmrb.Archive(directory)
+                self.assertEqual(archive.get_errors(), {})
+                self.assertEqual(len(archive.get_files("_Atom_chem_shift.Val")),
+                                 2)
+                self.assertEqual(archive.get_files("_Atom_chem_shift.Nope"), [])
+                for workers in [None, 2]:
+                    self.assertEqual(archive.get_tag(
+                        "_Atom_chem_shift.Val", where={"Atom_ID": "CA"},
+                        workers=workers), [("15000", expected)] * 2)
+                    loops = archive.get_loops_by_category("Atom_chem_shift",
+                                                          workers=workers)
+                    self.assertEqual(loops, [("15000", [shifts])] * 2)
+                self.assertEqual(archive.get_tag(["_Atom_chem_shift.Val"],
+                                                 where={"Atom_ID": "Q"}), [])
+                self.assertRaises(ValueError, archive.get_tag, "Val")
+
+                # Nothing is parsed again until the files change
+                self.assertEqual(bmrb.Archive(directory).refresh(), [])
+                broken = os.path.join(directory, "bmr1_3.str")
+                with open(broken, "w") as broken_file:
+                    broken_file.write("data_1 save_a _A.b 1 junk save_")
+                self.assertEqual(archive.refresh(), [broken])
+                self.assertEqual(list(archive.get_errors()), [broken])
+                os.remove(gzipped)
+                self.assertEqual(archive.refresh(), [])
+                self.assertEqual(len(archive.get_tag("_Atom_chem_shift.Val")),
+                                 1)
+                shutil.rmtree(archive.index_directory)
+                os.remove(broken)
+        finally:
+            bmrb.cnmrstar = native
+            shutil.rmtree(directory)
+
+    def test_columnar(self):
+        """ Columnar loops should act like ones with lists of rows. """
+
+        bmrb.COLUMNAR_LOOPS = True
+        try:
+            columnar = bmrb.Entry.from_file(sample_file_location)
+        finally:
+            bmrb.COLUMNAR_LOOPS = False
+        self.assertIsInstance(columnar[0][0].data, bmrb.ColumnarData)
+        self.assertEqual(str(columnar), str(file_entry))
+        self.assertEqual(columnar.get_json(), file_entry.get_json())
+
+        shifts = columnar.get_loops_by_category("_Atom_chem_shift")[0]
+        rows = copy(file_entry.get_loops_by_category("_Atom_chem_shift")[0])
+        self.assertEqual(shifts.get_tag(["Val", "Atom_ID"]),
+                         rows.get_tag(["Val", "Atom_ID"]))
+        for loop in [shifts, rows]:
+            loop.sort_rows("Val")
+            loop.delete_data_by_tag_value("Atom_ID", "H")
+            loop.renumber_rows("ID")
+            loop.data[1][2] = None
+            loop.add_data(["x"] * len(loop.columns))
+        self.assertEqual(str(shifts), str(rows))
+        self.assertEqual(shifts.data, rows.data)
+        self.assertIsInstance(shifts.data, bmrb.ColumnarData)
+        self.assertEqual(str(shifts.filter(["ID", "Val"])),
+                         str(rows.filter(["ID", "Val"])))
+
+        # Integer columns are kept in arrays with the nulls alongside
+        loop = bmrb.Loop.from_scratch("_Test")
+        loop.add_column(["ID", "Name"])
+        for row in [[1, "a"], [2, None], [3, "."]]:
+            loop.add_data(row)
+        loop.set_columnar()
+        loop.data[1][0] = "?"
+        values, dictionary, nulls = loop.data.column_buffers(0)
+        self.assertEqual(list(values), [1, 0, 3])
+        self.assertEqual(memoryview(values).itemsize, 8)
+        self.assertEqual((dictionary, list(nulls)), (None, [0, 3, 0]))
+        self.assertEqual(loop.get_tag("ID"), [1, "?", 3])
+        values, dictionary, nulls = loop.data.column_buffers(1)
+        self.assertEqual([dictionary[x] for x in values], ["a", None, "."])
+
+        shifts.set_columnar(False)
+        self.assertEqual(shifts.data, rows.data)
+        self.assertIsInstance(shifts.data, list)
+
+    def test_convert_datatypes(self):
+        """ Loop values should be converted to the schema types. """
+
+        schema_file = tempfile.mktemp()
+        with open(schema_file, "w") as schema:
+            schema.write("Tag,Data Type,Nullable,SFCategory\nx,x,x,x\n"
+                         "TBL_BEGIN,,,3.1\n_T.ID,INTEGER,NOT NULL,x\n"
+                         "_T.Val,FLOAT,,x\n_T.Day,DATETIME year to day,,x\n"
+                         "_T.Name,VARCHAR(3),,x\nTBL_END\n")
+        star = ("data_1 save_s _S.Sf_category s loop_ _T.ID _T.Val _T.Day"
+                " _T.Name\n1 1.5 2017-01-02 a\n\n-2 . ? .\n%s stop_ save_\n")
+
+        original = bmrb.cnmrstar
+        bmrb._STANDARD_SCHEMA = bmrb.Schema(schema_file=schema_file)
+        bmrb.CONVERT_DATATYPES = True
+        try:
+            for parser in [original, None]:
+                bmrb.cnmrstar = parser
+                loop = bmrb.Entry.from_string(star % "")[0][0]
+                self.assertEqual(loop.data,
+                                 [[1, decimal.Decimal("1.5"),
+                                   datetime.date(2017, 1, 2), "a"],
+                                  [-2, None, None, None]])
+                self.assertRaises(ValueError, bmrb.Entry.from_string,
+                                  star % "x 1 2017-01-02 b")
+
+            # The C parser knows which line the bad value was on
+            bmrb.cnmrstar = original
+            if original:
+                try:
+                    bmrb.Entry.from_string(star % "3 1 2017-02-30 b")
+                except ValueError as err:
+                    self.assertIn("on line '4'", str(err))
+                else:
+                    self.fail("Invalid date was accepted")
+        finally:
+            bmrb.cnmrstar = original
+            bmrb._STANDARD_SCHEMA = None
+            bmrb.CONVERT_DATATYPES = False
+            os.unlink(schema_file)
+
+    def test_validate_columns(self):
+        """ Checking a loop a column at a time should find the same errors
+        in the same order as checking each value on its own. """
+
+        schema_file = tempfile.mktemp()
+        with open(schema_file, "w") as schema:
+            schema.write("Tag,Data Type,Nullable,SFCategory,BMRB data type\n"
+                         "x,x,x,x,x\nTBL_BEGIN,,,3.1,\n"
+                         "_T.ID,INTEGER,NOT NULL,s,int\n_T.Name,VARCHAR(3),,s,code\n"
+                         "_T.VAL,FLOAT,,s,float\n_Q.Other,TEXT,,q,any\nTBL_END\n")
+        schema = bmrb.Schema(schema_file=schema_file)
+        os.unlink(schema_file)
+
+        loop = bmrb.Loop.from_string("loop_ _T.ID _T.Name _T.Val _T.Extra\n"
+                                     "1 abc 1.5 x\n. abcd 2 x\n1 abc x x\n"
+                                     "2 'a b' . x\nstop_")
+        loop.data[0][0] = 1
+        loop.data[1][2] = True
+        expected = []
+        for rownum, row in enumerate(loop.data):
+            for pos, value in enumerate(row):
+                expected.extend(schema.val_type(
+                    "_T." + loop.columns[pos], value, category="s",
+                    linenum=str(rownum) + " column " + str(pos) + " of loop"))
+        self.assertEqual(loop.validate(schema=schema, category="s"), expected)
+        self.assertEqual(expected[:3], [
+            "The tag '_T.Val' is improperly capitalized but otherwise valid. Should be '_T.VAL'.",
+            "Tag '_T.Extra' not found in schema. Line '0 column 3 of loop'.",
+            "Value cannot be NULL but is: '_T.ID':'.' on line '1 column 0 of loop'."])
+        self.assertIn("Length of '4' is too long for VARCHAR(3): '_T.Name':'abcd' on "
+                      "line '1 column 1 of loop'.", expected)
+        self.assertIn("Value does not match specification: '_T.VAL':'True' on line "
+                      "'1 column 2 of loop'.\n     Type specified: float\n     "
+                      "Regular expression for type: '%s'" % schema.data_types["float"],
+                      expected)
+
+        loop.set_columnar()
+        self.assertEqual(loop.validate(schema=schema, category="s"), expected)
+        self.assertEqual(loop.validate(schema=schema, category="q"),
+                         [error for x in range(4) for error in [
+                             "The tag '_T.ID' in category 'q' should be in category 's'.",
+                             "The tag '_T.Name' in category 'q' should be in category 's'.",
+                             "The tag '_T.VAL' in category 'q' should be in category 's'.",
+                             "Tag '_T.Extra' not found in schema. Line '%d column 3 of loop'." % x]])
+
+        # Ragged rows are checked a value at a time
+        loop = bmrb.Loop.from_string("loop_ _T.ID _T.Name 1 abc stop_")
+        loop.data.append(["."])
+        self.assertEqual(loop.validate(schema=schema), [
+            "Value cannot be NULL but is: '_T.ID':'.' on line '1 column 0 of loop'.",
+            "Loop '_T' data width does not match it's column tag width on row '1'."])
+
+    def test_index(self):
+        """ Lookups should notice changes made behind their back. """
+
+        entry = copy(file_entry)
+        frame = entry.get_saveframe_by_name("entry_information")
+        shifts = entry.get_loops_by_category("_atom_chem_shift")[0]
+        self.assertEqual(entry.get_tag("_Entry.ID"), ["15000"])
+        self.assertEqual(len(shifts.get_tag("Val")), len(shifts.data))
+
+        # Loops appended to the loop lists in a category already indexed
+        vendor = copy(entry.get_loops_by_category("_Vendor")[0])
+        vendor.data = [["Other", ".", ".", "15000", "1"]]
+        frame.loops.append(vendor)
+        self.assertEqual(len(entry.get_loops_by_category("_Vendor")), 6)
+        self.assertIn("Other", entry.get_tag("_Vendor.Name"))
+        pipe = entry.get_saveframe_by_name("NMRPipe")
+        pipe.loops.append(copy(vendor))
+        self.assertEqual(len(entry.get_loops_by_category("_Vendor")), 7)
+        self.assertEqual(pipe.get_tag("_Vendor.Name")[-1], "Other")
+        frame.loops.remove(vendor)
+        del pipe.loops[-1]
+
+        # Saveframes moved, removed and renamed
+        entry.frame_list.remove(frame)
+        self.assertEqual(entry.get_tag("_Entry.ID"), [])
+        self.assertRaises(KeyError, entry.get_saveframe_by_name,
+                          "entry_information")
+        entry.frame_list.insert(0, frame)
+        frame.name = "renamed"
+        self.assertIs(entry["renamed"], frame)
+        self.assertEqual(entry.get_tag("_Entry.ID"), ["15000"])
+
+        # Tags, loops and columns changed directly
+        frame.tags.append(["Extra", "1"])
+        self.assertEqual(entry.get_tag("_Entry.extra"), ["1"])
+        frame.tags = [["ID", "2"]]
+        self.assertEqual(entry.get_tag("_Entry.ID"), ["2"])
+        self.assertEqual(frame.get_tag("Extra"), [])
+        frame.tags[0][0] = "New"
+        self.assertEqual(frame.get_tag("New"), ["2"])
+        self.assertEqual(frame.get_tag("ID"), [])
+        shifts.category = "_Other"
+        self.assertEqual(entry.get_loops_by_category("_Atom_chem_shift"), [])
+        self.assertEqual(entry.get_loops_by_category("other"), [shifts])
+        frame.add_loop(bmrb.Loop.from_scratch("_Other"))
+        self.assertEqual(len(entry.get_loops_by_category("other")), 2)
+        shifts.columns[0] = "New"
+        self.assertEqual(shifts.get_tag("new"), [row[0] for row in shifts.data])
+
+        # The index isn't copied
+        self.assertNotIn("_index", copy(frame).__dict__)
+
+    def test_lazy_loading(self):
+        """ Lazily loaded saveframes should act like parsed ones. """
+
+        bmrb.LAZY_LOADING = True
+        try:
+            entry = bmrb.Entry.from_file(sample_file_location)
+            lazy = lambda: [x.name for x in entry if "_lazy" in x.__dict__]
+            if bmrb.cnmrstar:
+                self.assertEqual(len(lazy()), len(entry))
+
+            # Only the saveframes that are used get parsed
+            shifts = entry.get_loops_by_category("_Atom_chem_shift")
+            self.assertEqual(shifts, file_entry.get_loops_by_category("_Atom_chem_shift"))
+            self.assertEqual(entry.get_tag("_Entry.ID"), ["15000"])
+            self.assertEqual(entry.get_saveframes_by_category("entry_information"),
+                             file_entry.get_saveframes_by_category("entry_information"))
+            if bmrb.cnmrstar:
+                self.assertEqual(len(lazy()), len(entry) - 2)
+                self.assertEqual(entry["assigned_chem_shift_list_1"].category,
+                                 "assigned_chemical_shifts")
+            self.assertEqual(entry, file_entry)
+            self.assertEqual(lazy(), [])
+
+            # Copies of saveframes that haven't been parsed are parsed
+            entry = bmrb.Entry.from_string(str(file_entry))
+            self.assertEqual(copy(entry), file_entry)
+
+            # They are parsed with the settings they were loaded with
+            bmrb.COLUMNAR_LOOPS = True
+            entry = bmrb.Entry.from_string(str(file_entry))
+            bmrb.COLUMNAR_LOOPS = False
+            self.assertIsInstance(entry[0][0].data, bmrb.ColumnarData)
+            entry = bmrb.Entry.from_string(str(file_entry))
+            bmrb.COLUMNAR_LOOPS = True
+            self.assertIsInstance(entry[0][0].data, list)
+            self.assertTrue(bmrb.COLUMNAR_LOOPS)
+            bmrb.COLUMNAR_LOOPS = False
+
+            # Errors in the tags and loops are raised when they are used
+            bad_tags = "data_1 save_a _A.b 1 _A.b 2 save_ save_c _C.d 1 save_"
+            if bmrb.cnmrstar:
+                entry = bmrb.Entry.from_string(bad_tags)
+                self.assertEqual(entry["c"].get_tag("d"), ["1"])
+                for x in range(2):
+                    self.assertRaises(ValueError, entry.get_tag, "_A.b")
+            else:
+                self.assertRaises(ValueError, bmrb.Entry.from_string, bad_tags)
+            self.assertRaises(ValueError, bmrb.Entry.from_string,
+                              "data_1 save_a _A.b 1 loop_ _C.d 1 2 save_")
+        finally:
+            bmrb.LAZY_LOADING = False
+            bmrb.COLUMNAR_LOOPS = False
+
+    def test_binary(self):
+        """ Entries saved in the binary format should load back the same,
+        and unchanged files should be loaded from the cache. """
+
+        temp_dir = tempfile.mkdtemp()
+        binary = os.path.join(temp_dir, "entry.bin")
+        source = os.path.join(temp_dir, "entry.str")
+        try:
+            file_entry.save_binary(binary)
+            self.assertEqual(bmrb.Entry.load_binary(binary), file_entry)
+            with open(binary, "rb") as binary_file:
+                self.assertEqual(str(bmrb.Entry.load_binary(binary_file)),
+                                 str(file_entry))
+            with bmrb._BinaryReader.open(binary) as reader:
+                self.assertEqual(reader.read_entry(bmrb.Entry), file_entry)
+            self.assertEqual(reader.mapped, None)
+
+            # Loaded into columns, or a saveframe at a time
+            bmrb.COLUMNAR_LOOPS = True
+            entry = bmrb.Entry.load_binary(binary)
+            bmrb.COLUMNAR_LOOPS = False
+            self.assertIsInstance(entry[0][0].data, bmrb.ColumnarData)
+            self.assertEqual(entry, file_entry)
+            bmrb.LAZY_LOADING = True
+            entry = bmrb.Entry.load_binary(binary)
+            bmrb.LAZY_LOADING = False
+            self.assertEqual(entry.get_saveframes_by_category("entry_information"),
+                             file_entry.get_saveframes_by_category("entry_information"))
+            self.assertEqual(len([x for x in entry if "_lazy" in x.__dict__]),
+                             len(entry) - 1)
+            self.assertEqual(entry, file_entry)
+
+            # Values keep their types
+            typed = bmrb.Entry.from_string("data_1 save_a _A.b 1 loop_ _C.d "
+                                           "_C.e 1 2 stop_ save_")
+            typed[0].tags[0][1] = decimal.Decimal("1.50")
+            typed[0][0].data = [[x, 7] for x in
+                                [None, 5, 1.5, True, datetime.date(2017, 1, 2),
+                                 u"\u00e9", "."]] + [[".", "?"]]
+            typed.save_binary(binary)
+            loaded = bmrb.Entry.load_binary(binary)
+            self.assertEqual(str(loaded[0].tags[0][1]), "1.50")
+            self.assertEqual(loaded[0][0].data, typed[0][0].data)
+            self.assertEqual([type(x) for x in loaded[0][0].get_tag("d")],
+                             [type(x) for x in typed[0][0].get_tag("d")])
+            typed[0].tags[0][1] = set()
+            self.assertRaises(ValueError, typed.save_binary, binary)
+
+            # The cache is used until the file changes
+            bmrb.CACHE_DIRECTORY = os.path.join(temp_dir, "cache")
+            star = str(file_entry)
+            with open(source, "w") as source_file:
+                source_file.write(star)
+            os.utime(source, (1000000000, 1000000000))
+            self.assertRaises(ValueError, bmrb.Entry.load_binary, source)
+            self.assertEqual(bmrb.Entry.from_file(source), file_entry)
+            cache_file = os.path.join(bmrb.CACHE_DIRECTORY,
+                                      os.listdir(bmrb.CACHE_DIRECTORY)[0])
+            with open(source, "w") as source_file:
+                source_file.write(star.replace("data_15000", "data_15001"))
+            os.utime(source, (1000000000, 1000000000))
+            cached = bmrb.Entry.from_file(source)
+            self.assertEqual(cached, file_entry)
+            self.assertEqual(cached[0].source, "from_file('%s')" % source)
+            os.utime(source, (1000000001, 1000000001))
+            self.assertEqual(bmrb.Entry.from_file(source).entry_id, "15001")
+            os.utime(source, (1000000002, 1000000002))
+            self.assertEqual(bmrb.Entry.from_files([source])[0].entry_id,
+                             "15001")
+
+            # Damaged copies are parsed over
+            with open(cache_file, "wb") as damaged:
+                damaged.write(b"NMRSTARB")
+            self.assertEqual(bmrb.Entry.from_file(source).entry_id, "15001")
+            self.assertEqual(bmrb.Entry.load_binary(cache_file).entry_id,
+                             "15001")
+        finally:
+            bmrb.COLUMNAR_LOOPS = False
+            bmrb.LAZY_LOADING = False
+            bmrb.CACHE_DIRECTORY = None
+            shutil.rmtree(temp_dir)
+
+    def test_schema_snapshot(self):
+        """ Schema snapshots should load back the same, and be used in
+        place of unchanged schema files when caching. """
+
+        temp_dir = tempfile.mkdtemp()
+        schema_file = os.path.join(temp_dir, "schema.csv")
+        snapshot = os.path.join(temp_dir, "schema.snapshot")
+        csv = ("Tag,Data Type,Nullable,SFCategory,BMRB data type\nx,x,x,x,x\n"
+               "TBL_BEGIN,,,3.1,\n_T.ID,INTEGER,NOT NULL,s,int\n"
+               "_T.Name,VARCHAR(3),,s,code\n_Q.Other,TEXT,,q,any\nTBL_END\n")
+        attributes = lambda x: (x.version, x.headers, x.schema, x.schema_order,
+                                x.category_order, x.data_types)
+        try:
+            with open(schema_file, "w") as schema:
+                schema.write(csv)
+            original = bmrb.Schema(schema_file=schema_file)
+            self.assertEqual(original.category_order, ["_T", "_Q"])
+            self.assertEqual(original._position("_Q", True), 1)
+            self.assertEqual(original._position("_Q.Other"), 2)
+            self.assertRaises(ValueError, original._position, "_X")
+            original.schema_order.insert(0, "_Q.Extra")
+            self.assertEqual(original._position("_Q.Other"), 3)
+            del original.schema_order[0]
+
+            original.save_snapshot(snapshot)
+            loaded = bmrb.Schema.load_snapshot(snapshot)
+            self.assertEqual(attributes(loaded), attributes(original))
+            self.assertEqual(loaded.schema_file, schema_file)
+            self.assertEqual(loaded.val_type("_T.ID", "x"), original.val_type("_T.ID", "x"))
+            for tag in loaded.schema:
+                self.assertIs(tag, intern(tag) if not PY3 else sys.intern(tag))
+            with open(snapshot, "rb") as snapshot_file:
+                data = snapshot_file.read()
+            self.assertRaises(ValueError, bmrb.Schema.load_snapshot, schema_file)
+            with open(snapshot, "wb") as snapshot_file:
+                snapshot_file.write(data[:-10])
+            self.assertRaises(ValueError, bmrb.Schema.load_snapshot, snapshot)
+
+            # The snapshot is used until the file changes
+            bmrb.CACHE_DIRECTORY = os.path.join(temp_dir, "cache")
+            os.utime(schema_file, (1000000000, 1000000000))
+            original = bmrb.Schema(schema_file=schema_file)
+            with open(schema_file, "w") as schema:
+                schema.write(csv.replace("3.1", "3.2"))
+            os.utime(schema_file, (1000000000, 1000000000))
+            cached = bmrb.Schema(schema_file=schema_file)
+            self.assertEqual(attributes(cached), attributes(original))
+            self.assertEqual(cached.version, "3.1")
+            os.utime(schema_file, (1000000001, 1000000001))
+            self.assertEqual(bmrb.Schema(schema_file=schema_file).version, "3.2")
+        finally:
+            bmrb.CACHE_DIRECTORY = None
+            shutil.rmtree(temp_dir)
+
+    def test_scanners(self):
+        """ Every byte scanner the CPU supports should tokenize alike. """
+
+        if not bmrb.cnmrstar:
+            return
+
+        original = bmrb.cnmrstar.scanner()
+        bad_value = "data_1 save_a _A.b 'not terminated\n save_"
+        try:
+            for scanner in bmrb.cnmrstar.scanners():
+                self.assertEqual(bmrb.cnmrstar.scanner(scanner), scanner)
+                self.assertEqual(bmrb.Entry.from_string(str(file_entry)),
+                                 file_entry)
+                self.assertRaises(ValueError, bmrb.Entry.from_string,
+                                  bad_value)
+        finally:
+            bmrb.cnmrstar.scanner(original)
+        self.assertRaises(ValueError, bmrb.cnmrstar.scanner, "no_such")
+
+    def test_line_endings(self):
+        """ DOS and old Mac line endings should parse like unix ones. """
+
+        star = str(file_entry)
+        for newline in ["\r\n", "\r"]:
+            self.assertEqual(bmrb.Entry.from_string(star.replace("\n",
+                                                                 newline)),
+                             file_entry)
+        value = bmrb.Entry.from_string("data_1\r\nsave_a\r\n_A.b\r\n;\r\n"
+                                       "one\r\ntwo\r\n;\r\nsave_\r\n")
+        self.assertEqual(value.get_tag("_A.b"), ["one\ntwo\n"])
+
+    def test_error_line_numbers(self):
+        """ Errors deep in a file should report the line they are on. """
+
+        tags = "".join(["_A.t%d x\n" % x for x in range(5000)])
+        star = "data_1\nsave_1\n" + tags + "_A.c loop_\nsave_\n"
+        for line_ending in ["\n", "\r\n"]:
+            try:
+                bmrb.Entry.from_string(star.replace("\n", line_ending))
+                self.fail("Keyword used as a value was not caught.")
+            except ValueError as err:
+                self.assertEqual(err.args[1], 5003)
+
+    def test_rewritten_tokens(self):
+        """ Values whose text has to be rewritten should come out the same
+        whether or not the data was tokenized ahead of time. """
+
+        if not bmrb.cnmrstar:
+            return
+
+        star = "_A.b\r\n;\r\n\r\n   ;\r\n   shifted\r\n;\r\n_A.c\n;\nkept\r\n;\n"
+        expected = [("_A.b", " "), ("\n;\nshifted", ";"), ("_A.c", " "),
+                    ("kept\n", ";"), (None, "?")]
+        for tokenize in [False, True]:
+            tokenizer = bmrb.cnmrstar.Tokenizer()
+            tokenizer.load_string(star)
+            if tokenize:
+                tokenizer.tokenize()
+            tokens = [tokenizer.get_token_full() for x in range(len(expected))]
+            self.assertEqual([(x[0], x[2]) for x in tokens], expected)
+
+    def test_stream(self):
+        """ Data that arrives in pieces should tokenize as if it came all
+        at once, even when tokens span the pieces. """
+
+        gzipped = os.path.join(our_path, "sample_files", "bmr15000_3.str.gz")
+        with open(gzipped, "rb") as gzip_file:
+            self.assertEqual(bmrb.Entry.from_file(gzip_file), file_entry)
+
+        if not bmrb.cnmrstar:
+            return
+
+        star = str(file_entry).replace("\n", "\r\n").encode()
+        whole = bmrb.cnmrstar.Tokenizer()
+        whole.load_string(star.decode(), True)
+        expected = []
+        while True:
+            token = whole.get_token_full()
+            if token[0] is None:
+                break
+            expected.append(token)
+
+        for size in [1, 7, 4096]:
+            tokenizer = bmrb.cnmrstar.Tokenizer()
+            tokenizer.load_stream(None, True)
+            tokens = []
+            for pos in range(0, len(star), size):
+                tokens.extend(tokenizer.feed(star[pos:pos + size]))
+            tokens.extend(tokenizer.feed(b"", True))
+            self.assertEqual(tokens, expected)
+
+        tokenizer = bmrb.cnmrstar.Tokenizer()
+        tokenizer.load_stream()
+        self.assertEqual(tokenizer.feed(b"data_1 'not terminated"), [("data_1", 0, " ")])
+        self.assertRaises(ValueError, tokenizer.feed, b"", True)
+
+    def test_gzip(self):
+        """ Gzipped files, including ones made of several gzip members,
+        should be decompressed as they are loaded. """
+
+        gzipped = os.path.join(our_path, "sample_files", "bmr15000_3.str.gz")
+        with open(gzipped, "rb") as gzip_file:
+            compressed = gzip_file.read()
+
+        temp_dir = tempfile.mkdtemp()
+        doubled = os.path.join(temp_dir, "doubled.str.gz")
+        truncated = os.path.join(temp_dir, "truncated.str.gz")
+        try:
+            with open(doubled, "wb") as doubled_file:
+                doubled_file.write(compressed + compressed)
+            with open(truncated, "wb") as truncated_file:
+                truncated_file.write(compressed[:len(compressed) // 2])
+
+            # The second copy of the entry isn't valid after the first
+            self.assertRaises(ValueError, bmrb.Entry.from_file, doubled)
+            self.assertRaises((IOError, EOFError), bmrb.Entry.from_file,
+                              truncated)
+            with open(doubled, "rb") as doubled_file:
+                self.assertRaises(ValueError, bmrb.Entry.from_file,
+                                  doubled_file)
+        finally:
+            for temp_file in [doubled, truncated]:
+                if os.path.exists(temp_file):
+                    os.remove(temp_file)
+            os.rmdir(temp_dir)
+
+        if not bmrb.cnmrstar:
+            return
+
+        # Data that compresses well is tokenized as it is decompressed
+        #  rather than decompressed all at once
+        value = b"x" * 99 + b" "
+        star = (b"data_1 save_a _A.b 1 loop_ _C.d " + value * 160000 +
+                b"stop_ save_")
+        compressed = BytesIO()
+        gzip_file = gzip.GzipFile(fileobj=compressed, mode="wb")
+        gzip_file.write(star)
+        gzip_file.close()
+        compressed = compressed.getvalue()
+
+        tokenizer = bmrb.cnmrstar.Tokenizer()
+        tokenizer.load_stream(BytesIO(compressed), True)
+        tokens = 0
+        while tokenizer.get_token_full()[0] is not None:
+            tokens += 1
+        self.assertEqual(tokens, 160008)
+        self.assertTrue(tokenizer.buffer_size() < len(star) // 8)
+
+        tokenizer.load_stream(None, True)
+        tokens = tokenizer.feed(compressed, True)
+        self.assertEqual(len(tokens), 160008)
+        self.assertTrue(tokenizer.buffer_size() < len(star) // 8)
+
     # Parse and re-print entries to check for divergences. Only use in-house.
     def test_reparse(self):
 